@@ -0,0 +1,384 @@
+#include "programs.hpp"
+
+#include <stdexcept>
+#include <utility>
+
+#include "vm.hpp"
+
+namespace bench {
+namespace {
+// register roles shared by the loops below.
+constexpr auto BASE  = vm::R4;  // scratch memory for the kernels
+constexpr auto INNER = vm::R5;  // inner loop counter
+constexpr auto OUTER = vm::R6;  // outer loop counter
+
+// the inner loops all count this many trips, the outer ones set the size.
+constexpr auto INNER_TRIPS = tl::u16{1000};
+
+// scratch memory, away from the code and the devices.
+constexpr auto SCRATCH = tl::u16{0x5000};
+constexpr auto TARGET  = tl::u16{0x6000};
+constexpr auto STACK   = tl::u16{0xF000};
+
+// an inner loop of INNER_TRIPS trips around body inside an outer loop of
+// outer trips. The data labels are filled in after the HALT, followed by
+// whatever tail emits.
+template <typename Body, typename Tail>
+auto nested_loops(Assembler &as, tl::u16 outer, Body body, Tail tail) -> void {
+  const auto outer_count = as.label();
+  const auto inner_count = as.label();
+
+  as.ld(OUTER, outer_count);
+  const auto outer_loop = as.here();
+  as.ld(INNER, inner_count);
+  const auto inner_loop = as.here();
+  body();
+  as.emit(add_imm(INNER, INNER, -1));
+  as.br(p, inner_loop);
+  as.emit(add_imm(OUTER, OUTER, -1));
+  as.br(p, outer_loop);
+  as.halt();
+
+  as.bind(outer_count);
+  as.fill(outer);
+  as.bind(inner_count);
+  as.fill(INNER_TRIPS);
+  tail();
+}
+
+// ADD, AND and NOT on registers only.
+auto arithmetic() -> Program {
+  auto as = Assembler();
+  nested_loops(
+    as,
+    4000,
+    [&as] {
+      as.emit(add_imm(vm::R0, vm::R0, 1));
+      as.emit(add(vm::R1, vm::R1, vm::R0));
+      as.emit(and_imm(vm::R2, vm::R1, 15));
+      as.emit(not_(vm::R3, vm::R2));
+      as.emit(add(vm::R3, vm::R3, vm::R1));
+      as.emit(and_(vm::R2, vm::R3, vm::R0));
+    },
+    [] {});
+  return {"arithmetic", Kind::workload, as.image()};
+}
+
+// copies 4096 words with LDR/STR, like a memcpy loop.
+auto memory_copy() -> Program {
+  auto as         = Assembler();
+  const auto from = as.label();
+  const auto to   = as.label();
+  const auto size = as.label();
+
+  const auto outer_count = as.label();
+  as.ld(OUTER, outer_count);
+  const auto outer_loop = as.here();
+  as.ld(vm::R0, from);
+  as.ld(vm::R1, to);
+  as.ld(vm::R2, size);
+  const auto copy = as.here();
+  as.emit(ldr(vm::R3, vm::R0, 0));
+  as.emit(str(vm::R3, vm::R1, 0));
+  as.emit(add_imm(vm::R0, vm::R0, 1));
+  as.emit(add_imm(vm::R1, vm::R1, 1));
+  as.emit(add_imm(vm::R2, vm::R2, -1));
+  as.br(p, copy);
+  as.emit(add_imm(OUTER, OUTER, -1));
+  as.br(p, outer_loop);
+  as.halt();
+
+  as.bind(outer_count);
+  as.fill(tl::u16{1000});
+  as.bind(from);
+  as.fill(SCRATCH);
+  as.bind(to);
+  as.fill(TARGET);
+  as.bind(size);
+  as.fill(tl::u16{4096});
+  return {"memory_copy", Kind::workload, as.image()};
+}
+
+// naive recursive fibonacci, JSR/RET with a stack in memory.
+auto recursion() -> Program {
+  auto as          = Assembler();
+  const auto fib   = as.label();
+  const auto stack = as.label();
+  const auto arg   = as.label();
+  const auto reps  = as.label();
+
+  as.ld(INNER, reps);
+  const auto again = as.here();
+  as.ld(OUTER, stack);
+  as.ld(vm::R0, arg);
+  as.jsr(fib);
+  as.emit(add_imm(INNER, INNER, -1));
+  as.br(p, again);
+  as.halt();
+
+  // R1 = fib(R0), R6 is the stack pointer.
+  const auto recurse = as.label();
+  as.bind(fib);
+  as.emit(add_imm(vm::R2, vm::R0, -2));
+  as.br(zp, recurse);
+  as.emit(add_imm(vm::R1, vm::R0, 0));
+  as.emit(ret());
+  as.bind(recurse);
+  as.emit(add_imm(OUTER, OUTER, -1));  // push R7
+  as.emit(str(vm::R7, OUTER, 0));
+  as.emit(add_imm(OUTER, OUTER, -1));  // push n
+  as.emit(str(vm::R0, OUTER, 0));
+  as.emit(add_imm(vm::R0, vm::R0, -1));
+  as.jsr(fib);
+  as.emit(ldr(vm::R0, OUTER, 0));  // n
+  as.emit(add_imm(OUTER, OUTER, -1));  // push fib(n - 1)
+  as.emit(str(vm::R1, OUTER, 0));
+  as.emit(add_imm(vm::R0, vm::R0, -2));
+  as.jsr(fib);
+  as.emit(ldr(vm::R2, OUTER, 0));  // pop fib(n - 1)
+  as.emit(add_imm(OUTER, OUTER, 1));
+  as.emit(add(vm::R1, vm::R1, vm::R2));
+  as.emit(add_imm(OUTER, OUTER, 1));  // drop n
+  as.emit(ldr(vm::R7, OUTER, 0));  // pop R7
+  as.emit(add_imm(OUTER, OUTER, 1));
+  as.emit(ret());
+
+  as.bind(stack);
+  as.fill(STACK);
+  as.bind(arg);
+  as.fill(tl::u16{20});
+  as.bind(reps);
+  as.fill(tl::u16{40});
+  return {"recursion", Kind::workload, as.image()};
+}
+
+// follows a linked list through LDI, storing through STI on the way.
+auto pointer_chase() -> Program {
+  // node i links to node (389 * i + 1) % 1024, which visits all of them.
+  constexpr auto nodes = 1024;
+  constexpr auto mult  = 389;
+
+  auto as          = Assembler();
+  const auto cur   = as.label();
+  const auto touch = as.label();
+  nested_loops(
+    as,
+    6000,
+    [&] {
+      as.ldi(vm::R0, cur);  // R0 = next of cur
+      as.st(vm::R0, cur);
+      as.sti(INNER, touch);
+    },
+    [&] {
+      as.bind(cur);
+      as.fill(SCRATCH);
+      as.bind(touch);
+      as.fill(TARGET);
+    });
+
+  // the list lives in the image, right at SCRATCH.
+  auto image = as.image();
+  image.resize(SCRATCH - vm::PC_START + nodes);
+  for (auto i = 0; i < nodes; ++i) {
+    image[SCRATCH - vm::PC_START + i] =
+      static_cast<tl::u16>(SCRATCH + (mult * i + 1) % nodes);
+  }
+  return {"pointer_chase", Kind::workload, std::move(image)};
+}
+
+// a PUTS and a line of OUTs, over and over.
+auto trap_output() -> Program {
+  auto as         = Assembler();
+  const auto line = as.label();
+  const auto star = as.label();
+  nested_loops(
+    as,
+    150,
+    [&] {
+      as.lea(vm::R0, line);
+      as.emit(trap(vm::Trap::puts));
+      as.ld(vm::R0, star);
+      as.emit(trap(vm::Trap::out));
+      as.emit(trap(vm::Trap::out));
+    },
+    [&] {
+      as.bind(star);
+      as.fill(tl::u16{'*'});
+      as.bind(line);
+      as.stringz("benchmark output\n");
+    });
+  return {"trap_output", Kind::workload, as.image()};
+}
+
+// KERNEL_COPIES copies of what copy emits in the inner loop.
+template <typename Copy>
+auto kernel(std::string name, Copy copy) -> Program {
+  auto as         = Assembler();
+  const auto word = as.label();
+  const auto ptr  = as.label();
+  const auto sub  = as.label();
+  const auto base = as.label();
+
+  as.ld(BASE, base);
+  nested_loops(
+    as,
+    250,
+    [&] {
+      for (auto i = 0; i < KERNEL_COPIES; ++i) { copy(as, word, ptr, sub); }
+    },
+    [&] {
+      as.bind(base);
+      as.fill(SCRATCH);
+      as.bind(word);
+      as.fill(tl::u16{'.'});
+      as.bind(ptr);
+      as.fill(SCRATCH);
+      as.bind(sub);
+      as.emit(ret());
+    });
+  return {std::move(name), Kind::kernel, as.image()};
+}
+
+auto kernels() -> std::vector<Program> {
+  using vm::R1;
+
+  auto all = std::vector<Program>();
+  all.push_back(kernel("loop", [](auto &...) {}));
+  all.push_back(kernel("add", [](Assembler &as, auto...) {
+    as.emit(add_imm(R1, R1, 1));
+  }));
+  all.push_back(kernel("and", [](Assembler &as, auto...) {
+    as.emit(and_(R1, R1, vm::R0));
+  }));
+  all.push_back(
+    kernel("not", [](Assembler &as, auto...) { as.emit(not_(R1, R1)); }));
+  all.push_back(kernel("br", [](Assembler &as, auto...) {
+    const auto next = as.label();  // taken, to the next word
+    as.br(nzp, next);
+    as.bind(next);
+  }));
+  all.push_back(kernel("ld", [](Assembler &as, Label word, auto...) {
+    as.ld(R1, word);
+  }));
+  all.push_back(kernel("st", [](Assembler &as, Label word, auto...) {
+    as.st(R1, word);
+  }));
+  all.push_back(kernel("ldr", [](Assembler &as, auto...) {
+    as.emit(ldr(R1, BASE, 0));
+  }));
+  all.push_back(kernel("str", [](Assembler &as, auto...) {
+    as.emit(str(R1, BASE, 0));
+  }));
+  all.push_back(kernel("ldi", [](Assembler &as, Label, Label ptr, auto) {
+    as.ldi(R1, ptr);
+  }));
+  all.push_back(kernel("sti", [](Assembler &as, Label, Label ptr, auto) {
+    as.sti(R1, ptr);
+  }));
+  all.push_back(kernel("lea", [](Assembler &as, Label word, auto...) {
+    as.lea(R1, word);
+  }));
+  all.push_back(
+    kernel("jsr_ret", [](Assembler &as, Label, Label, Label sub) {
+      as.jsr(sub);
+    }));
+  all.push_back(kernel("trap_out", [](Assembler &as, Label word, auto...) {
+    as.ld(vm::R0, word);
+    as.emit(trap(vm::Trap::out));
+  }));
+  return all;
+}
+}  // namespace
+
+auto Assembler::label() -> Label {
+  this->labels_.emplace_back();
+  return Label{this->labels_.size() - 1};
+}
+
+auto Assembler::bind(Label label) -> void {
+  this->labels_[label.id] = this->words_.size();
+}
+
+auto Assembler::here() -> Label {
+  const auto label = this->label();
+  this->bind(label);
+  return label;
+}
+
+auto Assembler::fill(Label label) -> void { this->reference(0, label, 0); }
+
+auto Assembler::stringz(std::string_view text) -> void {
+  for (const auto ch : text) { this->emit(static_cast<tl::u16>(ch)); }
+  this->emit(0);
+}
+
+auto Assembler::br(Cond cond, Label target) -> void {
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  this->reference(encode(vm::BR, cond << 9), target, 9);
+}
+
+auto Assembler::ld(int dr, Label target) -> void {
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  this->reference(encode(vm::LD, dr << 9), target, 9);
+}
+
+auto Assembler::st(int sr, Label target) -> void {
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  this->reference(encode(vm::ST, sr << 9), target, 9);
+}
+
+auto Assembler::ldi(int dr, Label target) -> void {
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  this->reference(encode(vm::LDI, dr << 9), target, 9);
+}
+
+auto Assembler::sti(int sr, Label target) -> void {
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  this->reference(encode(vm::STI, sr << 9), target, 9);
+}
+
+auto Assembler::lea(int dr, Label target) -> void {
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  this->reference(encode(vm::LEA, dr << 9), target, 9);
+}
+
+auto Assembler::jsr(Label target) -> void {
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  this->reference(encode(vm::JSR, 1 << 11), target, 11);
+}
+
+auto Assembler::reference(tl::u16 word, Label target, int bits) -> void {
+  this->fixups_.push_back({this->words_.size(), target, bits});
+  this->emit(word);
+}
+
+auto Assembler::image() const -> std::vector<tl::u16> {
+  auto words = this->words_;
+  for (const auto &fixup : this->fixups_) {
+    const auto &bound = this->labels_[fixup.target.id];
+    if (!bound) { throw std::logic_error("unbound label"); }
+
+    const auto address = static_cast<int>(vm::PC_START + *bound);
+    if (fixup.bits == 0) {
+      words[fixup.at] = static_cast<tl::u16>(address);
+      continue;
+    }
+
+    // relative to the incremented PC.
+    const auto offset = address - static_cast<int>(vm::PC_START + fixup.at + 1);
+    const auto limit  = 1 << (fixup.bits - 1);  // NOLINT(hicpp-signed-bitwise)
+    if (offset < -limit || offset >= limit) {
+      throw std::logic_error("offset out of range");
+    }
+    words[fixup.at] |= field(offset, fixup.bits);
+  }
+  return words;
+}
+
+auto programs() -> std::vector<Program> {
+  auto all = std::vector<Program>{
+    arithmetic(), memory_copy(), recursion(), pointer_chase(), trap_output()};
+  for (auto &program : kernels()) { all.push_back(std::move(program)); }
+  return all;
+}
+}  // namespace bench
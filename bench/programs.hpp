@@ -0,0 +1,152 @@
+#pragma once
+/*
+ * Synthetic LC-3 programs for vm_bench.
+ *
+ * The programs are put together in memory with a small assembler instead of
+ * shipping .obj files: the encoders below build single instruction words,
+ * Assembler lays them out from PC_START on and resolves labels.
+ */
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "opcodes.hpp"
+#include "tl/numeric-aliases.hpp"
+
+namespace bench {
+// raw encoders, offsets and immediates are already relative and in range.
+// NOLINTBEGIN(hicpp-signed-bitwise)
+[[nodiscard]] constexpr auto field(int value, int bits) noexcept -> tl::u16 {
+  return static_cast<tl::u16>(value & ((1 << bits) - 1));
+}
+
+[[nodiscard]] constexpr auto encode(vm::Op_Code op, int args) noexcept
+  -> tl::u16 {
+  return static_cast<tl::u16>((op << 12) | args);
+}
+
+[[nodiscard]] constexpr auto add(int dr, int sr1, int sr2) noexcept
+  -> tl::u16 {
+  return encode(vm::ADD, (dr << 9) | (sr1 << 6) | sr2);
+}
+
+[[nodiscard]] constexpr auto add_imm(int dr, int sr1, int imm5) noexcept
+  -> tl::u16 {
+  return encode(vm::ADD, (dr << 9) | (sr1 << 6) | (1 << 5) | field(imm5, 5));
+}
+
+[[nodiscard]] constexpr auto and_(int dr, int sr1, int sr2) noexcept
+  -> tl::u16 {
+  return encode(vm::AND, (dr << 9) | (sr1 << 6) | sr2);
+}
+
+[[nodiscard]] constexpr auto and_imm(int dr, int sr1, int imm5) noexcept
+  -> tl::u16 {
+  return encode(vm::AND, (dr << 9) | (sr1 << 6) | (1 << 5) | field(imm5, 5));
+}
+
+[[nodiscard]] constexpr auto not_(int dr, int sr) noexcept -> tl::u16 {
+  return encode(vm::NOT, (dr << 9) | (sr << 6) | 0x3F);
+}
+
+[[nodiscard]] constexpr auto ldr(int dr, int base, int offset6) noexcept
+  -> tl::u16 {
+  return encode(vm::LDR, (dr << 9) | (base << 6) | field(offset6, 6));
+}
+
+[[nodiscard]] constexpr auto str(int sr, int base, int offset6) noexcept
+  -> tl::u16 {
+  return encode(vm::STR, (sr << 9) | (base << 6) | field(offset6, 6));
+}
+
+[[nodiscard]] constexpr auto jmp(int base) noexcept -> tl::u16 {
+  return encode(vm::JMP, base << 6);
+}
+
+[[nodiscard]] constexpr auto ret() noexcept -> tl::u16 { return jmp(vm::R7); }
+
+[[nodiscard]] constexpr auto trap(int vector) noexcept -> tl::u16 {
+  return encode(vm::TRAP, field(vector, 8));
+}
+
+// BR condition bits, in the dr field.
+enum Cond {
+  p   = vm::POS,
+  z   = vm::ZRO,
+  n   = vm::NEG,
+  zp  = z | p,
+  nz  = n | z,
+  np  = n | p,
+  nzp = n | z | p,
+};
+// NOLINTEND(hicpp-signed-bitwise)
+
+// a position in the program, bound with Assembler::bind().
+struct Label {
+  tl::usize id;
+};
+
+/*
+ * Lays instructions and data out from PC_START on. Instructions that reach
+ * memory PC-relative (BR, LD, ST, LDI, STI, LEA, JSR) take a Label, which
+ * may be bound before or after them; image() fills in the offsets.
+ */
+class Assembler {
+ public:
+  [[nodiscard]] auto label() -> Label;
+  auto bind(Label label) -> void;
+  // a label bound right here.
+  [[nodiscard]] auto here() -> Label;
+
+  auto emit(tl::u16 word) -> void { this->words_.push_back(word); }
+  auto fill(tl::u16 value) -> void { this->emit(value); }
+  auto fill(Label label) -> void;  // the address of label
+  auto stringz(std::string_view text) -> void;
+
+  auto br(Cond cond, Label target) -> void;
+  auto ld(int dr, Label target) -> void;
+  auto st(int sr, Label target) -> void;
+  auto ldi(int dr, Label target) -> void;
+  auto sti(int sr, Label target) -> void;
+  auto lea(int dr, Label target) -> void;
+  auto jsr(Label target) -> void;
+  auto halt() -> void { this->emit(trap(vm::Trap::halt)); }
+
+  // the words to load at PC_START. Throws std::logic_error for unbound
+  // labels and offsets out of range.
+  [[nodiscard]] auto image() const -> std::vector<tl::u16>;
+
+ private:
+  struct Fixup {
+    tl::usize at;  // index in words_
+    Label target;
+    int bits;  // 0 for an absolute address (fill)
+  };
+
+  auto reference(tl::u16 word, Label target, int bits) -> void;
+
+  std::vector<tl::u16> words_;
+  std::vector<std::optional<tl::usize>> labels_;  // index in words_
+  std::vector<Fixup> fixups_;
+};
+
+enum class Kind {
+  workload,  // a small program with a realistic mix
+  kernel,    // one instruction (or pair) over and over, see KERNEL_COPIES
+};
+
+// a kernel repeats its instructions this many times per loop trip. The loop
+// is the same for every kernel, the "loop" kernel is just the loop: what a
+// kernel takes on top of it is what its instructions cost.
+static constexpr auto KERNEL_COPIES = 16;
+
+struct Program {
+  std::string name;
+  Kind kind;
+  std::vector<tl::u16> image;  // loaded at PC_START
+};
+
+// every workload, then every kernel, the "loop" kernel first.
+[[nodiscard]] auto programs() -> std::vector<Program>;
+}  // namespace bench
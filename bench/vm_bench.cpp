@@ -0,0 +1,400 @@
+/*
+ * vm_bench: runs the synthetic programs of programs.hpp through
+ * Virtual_Machine and reports how fast each engine gets through them.
+ *
+ * Every program runs warmup + reps times per engine, in a fresh vm each time
+ * so stores from the last rep don't carry over (and the jit compiles again).
+ * Only run() is timed. The warmup runs are thrown away, the rest give the
+ * min, median, mean and standard deviation; instructions per second and
+ * ns per instruction are from the median.
+ *
+ * The cost of an op code comes from its kernel: the kernel's median minus
+ * the median of the "loop" kernel, over the instructions it ran on top of it.
+ *
+ * "threaded" runs without superinstructions or loop idioms (see
+ * Virtual_Machine::set_fusion()), so its kernels time dispatch and not a host
+ * memcpy. "fused" is the threaded engine as vm runs it, on the workloads only.
+ *
+ * Before the timed runs every program runs once more, untimed, for its
+ * instruction count and a digest of its output, registers and memory. The
+ * engines have to agree on both, vm_bench fails otherwise.
+ *
+ * usage: vm_bench [--engine=switch|threaded|fused|jit] [--reps=N]
+ *                 [--warmup=N] [--filter=TEXT] [--no-count] [--trace=FILE]
+ *                 [--json]
+ * --no-count times the runs with the instruction counter compiled out of the
+ * run loop (see Features).
+ * --trace=FILE times the runs with a trace going to FILE (each run starts it
+ * over), up to when the writer has it all on disk.
+ * --json prints the results as JSON instead of tables, to compare builds.
+ */
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "fmt/format.h"
+#include "headless.hpp"
+#include "programs.hpp"
+#include "tl/numeric-aliases.hpp"
+#include "vm.hpp"
+
+namespace {
+constexpr auto usage =
+  "usage: vm_bench [options]\n"
+  "options:\n"
+  "  --engine=switch|threaded|fused|jit\n"
+  "                                only this engine (default: all of them)\n"
+  "  --reps=N                      timed runs per program (default: 5)\n"
+  "  --warmup=N                    untimed runs before those (default: 1)\n"
+  "  --filter=TEXT                 only programs with TEXT in their name\n"
+  "  --no-count                    time runs without the instruction counter\n"
+  "  --trace=FILE                  time runs with a trace written to FILE\n"
+  "  --json                        print JSON instead of tables\n";
+
+struct Engine_Name {
+  vm::Engine engine;
+  const char *name;
+  bool fusion{false};  // superinstructions and loop idioms, workloads only
+};
+
+constexpr auto engines = std::array{
+  Engine_Name{vm::Engine::switch_loop, "switch"},
+  Engine_Name{vm::Engine::threaded, "threaded"},
+  Engine_Name{vm::Engine::threaded, "fused", true},
+  Engine_Name{vm::Engine::jit, "jit"},
+};
+
+struct Options {
+  std::vector<Engine_Name> engines{begin(::engines), end(::engines)};
+  tl::u32 reps{5};
+  tl::u32 warmup{1};
+  std::string_view filter;
+  bool count{true};
+  std::string trace;
+  bool json{false};
+};
+
+// over the timed runs of a program, in ns.
+struct Summary {
+  double min{};
+  double median{};
+  double mean{};
+  double stddev{};
+};
+
+// what an untimed run of a program left behind, the same on every engine.
+struct Check {
+  tl::u64 instructions{};
+  tl::u64 digest{};  // of the output, the registers and memory
+};
+
+struct Result {
+  const Engine_Name *engine;
+  const bench::Program *program;
+  tl::u64 instructions;
+  tl::u64 digest;  // see Check
+  Summary ns;
+
+  [[nodiscard]] auto ns_per_instruction() const -> double {
+    return this->ns.median / static_cast<double>(this->instructions);
+  }
+  [[nodiscard]] auto mips() const -> double {
+    return 1e3 / this->ns_per_instruction();
+  }
+};
+
+// an op code's kernel against the "loop" kernel, see the top.
+struct Op_Cost {
+  const Engine_Name *engine;
+  const bench::Program *kernel;
+  double ns;  // per instruction
+};
+
+[[nodiscard]] auto parse_number(std::string_view text, tl::u32 &value) -> bool {
+  const auto *end      = text.data() + text.size();
+  const auto [ptr, ec] = std::from_chars(text.data(), end, value);
+  return ec == std::errc() && ptr == end;
+}
+
+[[nodiscard]] auto parse_option(std::string_view option, Options &options)
+  -> bool {
+  const auto value = option.substr(option.find('=') + 1);
+  if (option.starts_with("--engine=")) {
+    const auto *found = std::ranges::find(
+      engines, value, [](const auto &engine) { return engine.name; });
+    if (found == end(engines)) { return false; }
+    options.engines = {*found};
+  } else if (option.starts_with("--reps=")) {
+    return parse_number(value, options.reps) && options.reps > 0;
+  } else if (option.starts_with("--warmup=")) {
+    return parse_number(value, options.warmup);
+  } else if (option.starts_with("--filter=")) {
+    options.filter = value;
+  } else if (option == "--no-count") {
+    options.count = false;
+  } else if (option.starts_with("--trace=")) {
+    options.trace = value;
+    return !options.trace.empty();
+  } else if (option == "--json") {
+    options.json = true;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+[[nodiscard]] auto summarize(std::vector<double> samples) -> Summary {
+  if (samples.empty()) { return {}; }
+  std::ranges::sort(samples);
+  const auto count = static_cast<double>(samples.size());
+  const auto half  = samples.size() / 2;
+
+  auto summary   = Summary{};
+  summary.min    = samples.front();
+  summary.median = samples.size() % 2 ? samples[half]
+                                      : (samples[half - 1] + samples[half]) / 2;
+  summary.mean = std::accumulate(begin(samples), end(samples), 0.0) / count;
+
+  auto squares = 0.0;
+  for (const auto sample : samples) {
+    squares += (sample - summary.mean) * (sample - summary.mean);
+  }
+  summary.stddev = std::sqrt(squares / count);
+  return summary;
+}
+
+auto prepare(vm::Virtual_Machine &vm,
+             const bench::Program &program,
+             const Engine_Name &engine) -> void {
+  vm.set_engine(engine.engine);
+  vm.set_fusion(engine.fusion);
+  vm.load_image(vm::PC_START, program.image);
+}
+
+// one untimed, counted run in a fresh vm, with its output captured.
+[[nodiscard]] auto check_run(const bench::Program &program,
+                             const Engine_Name &engine) -> Check {
+  auto vm = vm::Virtual_Machine();
+  prepare(vm, program, engine);
+  vm.output().capture();
+  vm.run();
+
+  auto state           = vm.output().captured();
+  const auto registers = vm.registers();
+  const auto memory    = vm.memory();
+  state.append(reinterpret_cast<const char *>(registers.data()),
+               sizeof(registers));
+  state.append(reinterpret_cast<const char *>(memory.data()),
+               memory.size_bytes());
+  return {vm.instructions(), vm::digest(state)};
+}
+
+// one run in a fresh vm, in ns.
+[[nodiscard]] auto time_run(const bench::Program &program,
+                            const Engine_Name &engine,
+                            bool count,
+                            const std::string &trace) -> double {
+  // main() made sure trace can be written.
+  auto tracer = trace.empty() ? nullptr : vm::Trace_Writer::open(trace);
+
+  auto vm = vm::Virtual_Machine();
+  prepare(vm, program, engine);
+  vm.set_features({.count = count, .trace = tracer != nullptr});
+  vm.set_tracer(tracer.get());
+  vm.output().set_fd(-1);
+
+  const auto start = std::chrono::steady_clock::now();
+  vm.run();
+  if (tracer) { static_cast<void>(tracer->close()); }
+  const auto time = std::chrono::steady_clock::now() - start;
+
+  return std::chrono::duration<double, std::nano>(time).count();
+}
+
+[[nodiscard]] auto measure(const Options &options,
+                           const Engine_Name &engine,
+                           const bench::Program &program) -> Result {
+  const auto check = check_run(program, engine);
+
+  for (auto i = tl::u32{0}; i < options.warmup; ++i) {
+    static_cast<void>(
+      time_run(program, engine, options.count, options.trace));
+  }
+
+  auto samples = std::vector<double>();
+  for (auto i = tl::u32{0}; i < options.reps; ++i) {
+    samples.push_back(time_run(program, engine, options.count, options.trace));
+  }
+  return {&engine,
+          &program,
+          check.instructions,
+          check.digest,
+          summarize(std::move(samples))};
+}
+
+// false if some engine ran a program differently from the first one that ran
+// it, says which on stderr.
+[[nodiscard]] auto engines_agree(const std::vector<Result> &results) -> bool {
+  auto agree = true;
+  for (const auto &result : results) {
+    const auto first =
+      std::ranges::find(results, result.program, &Result::program);
+    if (result.instructions == first->instructions &&
+        result.digest == first->digest) {
+      continue;
+    }
+    fmt::print(stderr,
+               "{}: {} ran {} instructions, digest {:016x}, but {} ran {}, "
+               "digest {:016x}\n",
+               result.program->name,
+               result.engine->name,
+               result.instructions,
+               result.digest,
+               first->engine->name,
+               first->instructions,
+               first->digest);
+    agree = false;
+  }
+  return agree;
+}
+
+[[nodiscard]] auto op_costs(const std::vector<Result> &results)
+  -> std::vector<Op_Cost> {
+  auto costs = std::vector<Op_Cost>();
+  for (const auto &loop : results) {
+    if (loop.program->name != "loop") { continue; }
+    for (const auto &result : results) {
+      if (result.engine != loop.engine ||
+          result.program->kind != bench::Kind::kernel ||
+          result.instructions <= loop.instructions) {
+        continue;
+      }
+      const auto extra =
+        static_cast<double>(result.instructions - loop.instructions);
+      costs.push_back({result.engine,
+                       result.program,
+                       (result.ns.median - loop.ns.median) / extra});
+    }
+  }
+  return costs;
+}
+
+auto print_tables(const std::vector<Result> &results,
+                  const std::vector<Op_Cost> &costs) -> void {
+  fmt::print("{:<9} {:<14} {:>11} {:>10} {:>8} {:>9} {:>7}\n",
+             "engine",
+             "program",
+             "instrs",
+             "median ms",
+             "MIPS",
+             "ns/instr",
+             "stddev");
+  for (const auto &result : results) {
+    fmt::print("{:<9} {:<14} {:>11} {:>10.2f} {:>8.1f} {:>9.3f} {:>6.1f}%\n",
+               result.engine->name,
+               result.program->name,
+               result.instructions,
+               result.ns.median / 1e6,
+               result.mips(),
+               result.ns_per_instruction(),
+               100 * result.ns.stddev / result.ns.mean);
+  }
+
+  if (costs.empty()) { return; }
+  fmt::print("\nper op code, on top of the loop kernel:\n");
+  fmt::print("{:<9} {:<14} {:>9}\n", "engine", "kernel", "ns/instr");
+  for (const auto &cost : costs) {
+    fmt::print("{:<9} {:<14} {:>9.3f}\n",
+               cost.engine->name,
+               cost.kernel->name,
+               cost.ns);
+  }
+}
+
+auto print_json(const Options &options,
+                const std::vector<Result> &results,
+                const std::vector<Op_Cost> &costs) -> void {
+  fmt::print("{{\n  \"reps\": {},\n  \"warmup\": {},\n  \"results\": [",
+             options.reps,
+             options.warmup);
+  auto separator = "\n";
+  for (const auto &result : results) {
+    fmt::print(
+      "{}    {{\"engine\": \"{}\", \"program\": \"{}\", \"kind\": \"{}\", "
+      "\"instructions\": {}, \"digest\": \"{:016x}\", \"min_ns\": {:.0f}, "
+      "\"median_ns\": {:.0f}, \"mean_ns\": {:.0f}, \"stddev_ns\": {:.0f}, "
+      "\"mips\": {:.2f}, \"ns_per_instruction\": {:.4f}}}",
+      separator,
+      result.engine->name,
+      result.program->name,
+      result.program->kind == bench::Kind::kernel ? "kernel" : "workload",
+      result.instructions,
+      result.digest,
+      result.ns.min,
+      result.ns.median,
+      result.ns.mean,
+      result.ns.stddev,
+      result.mips(),
+      result.ns_per_instruction());
+    separator = ",\n";
+  }
+
+  fmt::print("\n  ],\n  \"op_costs\": [");
+  separator = "\n";
+  for (const auto &cost : costs) {
+    fmt::print("{}    {{\"engine\": \"{}\", \"kernel\": \"{}\", "
+               "\"ns_per_instruction\": {:.4f}}}",
+               separator,
+               cost.engine->name,
+               cost.kernel->name,
+               cost.ns);
+    separator = ",\n";
+  }
+  fmt::print("\n  ]\n}}\n");
+}
+}  // namespace
+
+auto main(int argc, const char *argv[]) -> int {
+  auto options = Options();
+  for (auto i = 1; i < argc; ++i) {
+    const auto arg = std::string_view(argv[i]);
+    if (!parse_option(arg, options)) {
+      fmt::print(stderr, "Unknown option: {}\n{}", arg, usage);
+      return -1;
+    }
+  }
+  if (!options.trace.empty() && !vm::Trace_Writer::open(options.trace)) {
+    fmt::print(stderr, "cannot write trace: {}\n", options.trace);
+    return -1;
+  }
+
+  const auto programs = bench::programs();
+  auto results        = std::vector<Result>();
+  for (const auto &engine : options.engines) {
+    for (const auto &program : programs) {
+      // fused kernels would time the superinstructions, not dispatch.
+      if (engine.fusion && program.kind == bench::Kind::kernel) { continue; }
+      // the op code costs need the loop kernel, whatever the filter says.
+      if (program.name.find(options.filter) == std::string::npos &&
+          program.name != "loop") {
+        continue;
+      }
+      results.push_back(measure(options, engine, program));
+    }
+  }
+
+  const auto costs = op_costs(results);
+  if (options.json) {
+    print_json(options, results, costs);
+  } else {
+    print_tables(results, costs);
+  }
+  return engines_agree(results) ? 0 : -1;
+}
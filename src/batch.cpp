@@ -0,0 +1,354 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+
+#include "fmt/format.h"
+#include "fmt/ranges.h"  // fmt::join
+#include "headless.hpp"
+#include "input.hpp"
+#include "lockstep.hpp"
+#include "snapshot.hpp"
+
+namespace vm {
+namespace {
+using Clock = std::chrono::steady_clock;
+
+struct File_Closer {
+  auto operator()(std::FILE *file) const noexcept -> void {
+    std::fclose(file);  // NOLINT
+  }
+};
+using File = std::unique_ptr<std::FILE, File_Closer>;
+
+[[nodiscard]] auto open_file(const std::string &path, const char *mode)
+  -> File {
+#ifdef _WIN32
+  std::FILE *file = nullptr;
+  fopen_s(&file, path.c_str(), mode);
+  return File(file);
+#else
+  return File(std::fopen(path.c_str(), mode));
+#endif
+}
+
+[[nodiscard]] auto descriptor(std::FILE *file) noexcept -> int {
+#ifdef _WIN32
+  return _fileno(file);
+#else
+  return fileno(file);
+#endif
+}
+
+[[nodiscard]] auto to_status(Exit_Reason reason) noexcept -> Job_Status {
+  switch (reason) {
+    case Exit_Reason::halted:
+      return Job_Status::halted;
+    case Exit_Reason::bad_opcode:
+      return Job_Status::bad_opcode;
+    case Exit_Reason::end_of_input:
+      return Job_Status::end_of_input;
+    case Exit_Reason::waiting_for_input:
+    case Exit_Reason::out_of_budget:
+      break;  // run_for() only
+  }
+  return Job_Status::error;
+}
+
+[[nodiscard]] auto status_name(Job_Status status) noexcept -> const char * {
+  switch (status) {
+    case Job_Status::halted:
+      return "halted";
+    case Job_Status::bad_opcode:
+      return "bad-opcode";
+    case Job_Status::end_of_input:
+      return "end-of-input";
+    case Job_Status::load_failed:
+      return "load-failed";
+    case Job_Status::io_failed:
+      return "io-failed";
+    case Job_Status::error:
+      return "error";
+  }
+  return "error";
+}
+
+constexpr auto STATUSES = 6;
+
+// the snapshot of every job that has one, nullptr for the jobs without.
+using Job_Snapshots = std::map<std::string, std::unique_ptr<Snapshot>>;
+
+// the memory of image lists that several jobs (without a snapshot) start
+// from, loaded once. nullptr if they failed to load.
+using Job_Images =
+  std::map<std::vector<std::string>, std::shared_ptr<const Memory_Image>>;
+
+[[nodiscard]] auto shared_images(const std::vector<Batch_Job> &jobs)
+  -> Job_Images {
+  auto uses = std::map<std::vector<std::string>, tl::usize>();
+  for (const auto &job : jobs) {
+    if (job.snapshot.empty()) { ++uses[job.images]; }
+  }
+
+  auto images = Job_Images();
+  for (const auto &[files, count] : uses) {
+    if (count < 2) { continue; }
+    auto loader = std::make_unique<Virtual_Machine>();
+    const auto loaded = std::ranges::all_of(files, [&loader](const auto &file) {
+      return loader->read_file(file.c_str());
+    });
+    images[files] =
+      loaded ? Memory_Image::create(std::as_bytes(loader->memory())) : nullptr;
+  }
+  return images;
+}
+
+[[nodiscard]] auto run_job(const Batch_Job &job,
+                           const Job_Snapshots &snapshots,
+                           const Job_Images &images,
+                           const std::function<void(Virtual_Machine &)> &setup)
+  -> Job_Result {
+  auto result = Job_Result{};
+
+  const auto *snapshot =
+    job.snapshot.empty() ? nullptr : snapshots.at(job.snapshot).get();
+  const auto shared =
+    job.snapshot.empty() ? images.find(job.images) : end(images);
+  if ((!job.snapshot.empty() && !snapshot) ||
+      (shared != end(images) && !shared->second)) {
+    result.status = Job_Status::load_failed;
+    return result;
+  }
+
+  auto bytes = std::string();
+  if (!job.input.empty() && !read_whole_file(job.input, bytes)) {
+    result.status = Job_Status::io_failed;
+    return result;
+  }
+
+  // declared before the vm, so the vm flushes into it before it is closed.
+  auto output = File();
+  if (!job.output.empty()) {
+    output = open_file(job.output, "wb");
+    if (!output) {
+      result.status = Job_Status::io_failed;
+      return result;
+    }
+  }
+
+  // on the heap, a vm is too big for comfort on a worker's stack.
+  auto vm = std::make_unique<Virtual_Machine>();
+  setup(*vm);
+  vm->output().set_fd(output ? descriptor(output.get()) : -1);
+  if (snapshot) { vm->restore(*snapshot); }
+  if (shared != end(images)) {
+    vm->load_image(*shared->second);
+  } else {
+    for (const auto &image : job.images) {
+      if (!vm->read_file(image.c_str())) {
+        result.status = Job_Status::load_failed;
+        return result;
+      }
+    }
+  }
+
+  auto input = Scripted_Input(std::move(bytes));
+  vm->set_input(&input);
+  vm->set_stop_on_eof(true);
+  vm->set_instruction_clock(true);
+
+  result.status       = to_status(vm->run());
+  result.output_bytes = vm->output().total_bytes();
+  return result;
+}
+
+// jobs that start from the same image, side by side, see lockstep.hpp.
+auto run_lanes(const std::vector<Batch_Job> &jobs,
+               const std::vector<tl::usize> &lanes,
+               const Memory_Image &image,
+               const std::function<void(Virtual_Machine &)> &setup,
+               std::vector<Job_Result> &results) -> void {
+  // open until every lane is done.
+  auto outputs  = std::vector<File>();
+  auto lane_job = std::vector<tl::usize>();
+  auto group    = std::vector<Lockstep_Job>();
+  for (const auto i : lanes) {
+    const auto &job = jobs[i];
+    auto lane       = Lockstep_Job();
+    if (!job.input.empty() && !read_whole_file(job.input, lane.input)) {
+      results[i].status = Job_Status::io_failed;
+      continue;
+    }
+    if (!job.output.empty()) {
+      auto output = open_file(job.output, "wb");
+      if (!output) {
+        results[i].status = Job_Status::io_failed;
+        continue;
+      }
+      lane.output_fd = descriptor(output.get());
+      outputs.push_back(std::move(output));
+    }
+    lane_job.push_back(i);
+    group.push_back(std::move(lane));
+  }
+
+  const auto lane_results = run_lockstep(image, std::move(group), setup);
+  for (auto lane = tl::usize{0}; lane < lane_job.size(); ++lane) {
+    auto &result        = results[lane_job[lane]];
+    result.status       = to_status(lane_results[lane].exit);
+    result.output_bytes = lane_results[lane].output_bytes;
+    result.time         = lane_results[lane].time;
+  }
+}
+}  // namespace
+
+auto read_manifest(const char *path) -> std::optional<std::vector<Batch_Job>> {
+  auto in = std::ifstream(path);
+  if (!in) {
+    fmt::print(stderr, "cannot open manifest: {}\n", path);
+    return std::nullopt;
+  }
+
+  auto jobs        = std::vector<Batch_Job>();
+  auto line        = std::string();
+  auto line_number = 0;
+  while (std::getline(in, line)) {
+    ++line_number;
+    auto words = std::istringstream(line);
+    auto word  = std::string();
+    auto job   = Batch_Job();
+    while (words >> word) {
+      if (word.starts_with('#') && job.images.empty()) { break; }
+      if (word == "<" || word == ">" || word == "@") {
+        auto &target = word == "<"   ? job.input
+                       : word == ">" ? job.output
+                                     : job.snapshot;
+        if (!(words >> target)) {
+          fmt::print(stderr, "{}:{}: missing file after {}\n", path,
+                     line_number, word);
+          return std::nullopt;
+        }
+        continue;
+      }
+      job.images.push_back(word);
+    }
+
+    if (!job.images.empty() || !job.snapshot.empty()) {
+      jobs.push_back(std::move(job));
+    } else if (!job.input.empty() || !job.output.empty()) {
+      fmt::print(stderr, "{}:{}: job without images\n", path, line_number);
+      return std::nullopt;
+    }
+  }
+  return jobs;
+}
+
+auto run_batch(const std::vector<Batch_Job> &jobs,
+               Work_Stealing_Pool &pool,
+               const std::function<void(Virtual_Machine &)> &setup,
+               unsigned lanes) -> std::vector<Job_Result> {
+  auto results = std::vector<Job_Result>(jobs.size());
+
+  // opened up front, the jobs only ever read them.
+  auto snapshots = Job_Snapshots();
+  for (const auto &job : jobs) {
+    if (!job.snapshot.empty() && !snapshots.contains(job.snapshot)) {
+      snapshots[job.snapshot] = Snapshot::open(job.snapshot);
+    }
+  }
+  const auto images = shared_images(jobs);
+
+  // a task per job, or per group of up to lanes jobs that start from the
+  // same images.
+  auto tasks  = std::vector<std::vector<tl::usize>>();
+  auto groups = std::map<std::vector<std::string>, std::vector<tl::usize>>();
+  for (auto i = tl::usize{0}; i < jobs.size(); ++i) {
+    const auto &job   = jobs[i];
+    const auto shared = images.find(job.images);
+    if (lanes < 2 || !job.snapshot.empty() || shared == end(images) ||
+        !shared->second) {
+      tasks.push_back({i});
+      continue;
+    }
+    auto &group = groups[job.images];
+    group.push_back(i);
+    if (group.size() == std::min(lanes, unsigned{LOCKSTEP_LANES})) {
+      tasks.push_back(std::move(group));
+      group.clear();
+    }
+  }
+  for (auto &[files, group] : groups) {
+    if (!group.empty()) { tasks.push_back(std::move(group)); }
+  }
+
+  pool.run(tasks.size(), [&](tl::usize t) {
+    const auto &task = tasks[t];
+    if (task.size() > 1) {
+      try {
+        run_lanes(
+          jobs, task, *images.at(jobs[task[0]].images), setup, results);
+      } catch (...) {
+        for (const auto i : task) { results[i].status = Job_Status::error; }
+      }
+      return;
+    }
+
+    const auto i     = task[0];
+    const auto start = Clock::now();
+    try {
+      results[i] = run_job(jobs[i], snapshots, images, setup);
+    } catch (...) {
+      results[i].status = Job_Status::error;
+    }
+    results[i].time =
+      std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                            start);
+  });
+
+  return results;
+}
+
+auto write_report(std::FILE *out,
+                  const std::vector<Batch_Job> &jobs,
+                  const std::vector<Job_Result> &results,
+                  unsigned workers,
+                  std::chrono::microseconds wall_time) -> void {
+  auto counts = std::array<tl::usize, STATUSES>();
+
+  fmt::print(out, "# job\tstatus\ttime_us\toutput_bytes\timages\n");
+  for (auto i = tl::usize{0}; i < jobs.size(); ++i) {
+    const auto &result = results[i];
+    const auto &job    = jobs[i];
+    ++counts[static_cast<tl::usize>(result.status)];
+    fmt::print(out,
+               "{}\t{}\t{}\t{}\t{}{}{}\n",
+               i,
+               status_name(result.status),
+               result.time.count(),
+               result.output_bytes,
+               job.snapshot.empty() ? "" : "@ " + job.snapshot,
+               job.snapshot.empty() || job.images.empty() ? "" : " ",
+               fmt::join(job.images, " "));
+  }
+
+  const auto seconds = static_cast<double>(wall_time.count()) / 1e6;
+  fmt::print(out,
+             "# {} jobs on {} workers in {:.3f} s ({:.1f} jobs/s):",
+             jobs.size(),
+             workers,
+             seconds,
+             seconds > 0 ? static_cast<double>(jobs.size()) / seconds : 0.0);
+  for (auto s = 0; s < STATUSES; ++s) {
+    if (counts[static_cast<tl::usize>(s)] == 0) { continue; }
+    fmt::print(out,
+               " {} {}",
+               counts[static_cast<tl::usize>(s)],
+               status_name(static_cast<Job_Status>(s)));
+  }
+  fmt::print(out, "\n");
+}
+}  // namespace vm
@@ -0,0 +1,79 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "tl/numeric-aliases.hpp"
+#include "vm.hpp"
+#include "work_pool.hpp"
+
+namespace vm {
+/*
+ * Batch mode: many independent, non interactive runs in one process.
+ *
+ * A manifest has one job per line: the image files to load, then optionally
+ * "< file" with the job's input and "> file" for its output. "@ file" starts
+ * the job from a snapshot (see snapshot.hpp) instead, with the images loaded
+ * on top of it if there are any. Empty lines and lines starting with '#' are
+ * skipped, paths are relative to the current directory:
+ *
+ *   images/hello.obj > out/hello.txt
+ *   lib.obj grader.obj < tests/1.txt > out/1.txt
+ *   @ booted.snap < tests/2.txt > out/2.txt
+ *
+ * Every snapshot is read once and shared by all the jobs that start from it,
+ * and so are the images that more than one job loads the same way: their
+ * vms share the pages they don't write to, see memory.hpp.
+ *
+ * Every job gets its own Virtual_Machine and runs like a headless run (see
+ * headless.hpp), except its output goes straight to its file. It ends when
+ * it halts, hits a bad op code or reads past the end of its input. Nothing
+ * touches the terminal, so jobs run side by side on a pool.
+ */
+struct Batch_Job {
+  std::vector<std::string> images;
+  std::string snapshot;  // empty: the job starts from the images alone
+  std::string input;   // empty: the job has no input
+  std::string output;  // empty: the output is only counted
+};
+
+enum class Job_Status {
+  halted,
+  bad_opcode,
+  end_of_input,
+  load_failed,  // an image or the snapshot couldn't be loaded
+  io_failed,    // the input or output file couldn't be opened
+  error,        // anything else, e.g. out of memory
+};
+
+struct Job_Result {
+  Job_Status status{Job_Status::error};
+  std::chrono::microseconds time{};
+  tl::u64 output_bytes{};
+};
+
+// nullopt if the manifest can't be read or has a bad line, says why on
+// stderr.
+[[nodiscard]] auto read_manifest(const char *path)
+  -> std::optional<std::vector<Batch_Job>>;
+
+// runs every job on the pool. setup() configures each vm (engine...) before
+// its images are loaded, it is called from the worker threads. With lanes
+// above 1, jobs that load the same images (and no snapshot) run up to lanes
+// at a time in lockstep, see lockstep.hpp.
+[[nodiscard]] auto run_batch(
+  const std::vector<Batch_Job> &jobs,
+  Work_Stealing_Pool &pool,
+  const std::function<void(Virtual_Machine &)> &setup,
+  unsigned lanes = 1) -> std::vector<Job_Result>;
+
+// one tab separated line per job, then a summary line.
+auto write_report(std::FILE *out,
+                  const std::vector<Batch_Job> &jobs,
+                  const std::vector<Job_Result> &results,
+                  unsigned workers,
+                  std::chrono::microseconds wall_time) -> void;
+}  // namespace vm
@@ -0,0 +1,190 @@
+#include "decoder.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <initializer_list>
+
+#include "opcodes.hpp"
+#include "utils.hpp"
+
+namespace vm {
+[[nodiscard]] auto decode(tl::u16 instruction) noexcept -> Decoded_Instruction {
+  // NOLINTBEGIN(hicpp-signed-bitwise)
+  const auto field = [instruction](int shift, tl::u16 mask) {
+    return static_cast<tl::u8>((instruction >> shift) & mask);
+  };
+
+  auto decoded = Decoded_Instruction{};
+  decoded.op   = field(12, 0xF);
+  decoded.dr   = field(9, Mask::Three_Bits);
+  decoded.sr1  = field(6, Mask::Three_Bits);
+  decoded.sr2  = field(0, Mask::Three_Bits);
+
+  switch (decoded.op) {
+    case Op_Code::BR:
+    case Op_Code::LD:
+    case Op_Code::ST:
+    case Op_Code::LDI:
+    case Op_Code::STI:
+    case Op_Code::LEA:
+      decoded.imm = sign_extend(instruction & Mask::Nine_Bits, 9);
+      break;
+    case Op_Code::ADD:
+    case Op_Code::AND:
+      decoded.imm_mode = (instruction >> 5) & 1;
+      decoded.imm      = sign_extend(instruction & Mask::Five_Bits, 5);
+      break;
+    case Op_Code::LDR:
+    case Op_Code::STR:
+      decoded.imm = sign_extend(instruction & Mask::Six_Bits, 6);
+      break;
+    case Op_Code::JSR:
+      decoded.imm_mode = (instruction >> 11) & 1;
+      decoded.imm      = sign_extend(instruction & 0x7FF, 11);
+      break;
+    case Op_Code::TRAP:
+      decoded.imm = instruction & Mask::Eight_Bits;
+      break;
+    default:
+      break;
+  }
+  // NOLINTEND(hicpp-signed-bitwise)
+
+  return decoded;
+}
+
+auto fuse(tl::u16 first, tl::u16 second, tl::u16 third) noexcept
+  -> Decoded_Instruction {
+  auto head       = decode(first);
+  const auto next = decode(second);
+  // ADD Rx, Rx, #k
+  const auto adds_to = [&next](tl::u8 reg) {
+    return next.op == Op_Code::ADD && next.imm_mode && next.dr == reg &&
+           next.sr1 == reg;
+  };
+
+  switch (head.op) {
+    case Op_Code::AND:
+      if (head.imm_mode && head.imm == 0 && adds_to(head.dr)) {
+        head.op  = FUSED_CONST;
+        head.imm = next.imm;
+      }
+      break;
+    case Op_Code::ADD:
+      if (head.imm_mode && next.op == Op_Code::BR) {
+        head.op  = FUSED_ADD_BR;
+        head.aux = static_cast<tl::u8>(head.imm);
+        head.sr2 = next.dr;
+        head.imm = next.imm;
+      }
+      break;
+    case Op_Code::LDR: {
+      // the ADD can't change the address the STR writes to.
+      const auto last = decode(third);
+      if (head.dr != head.sr1 && adds_to(head.dr) &&
+          last.op == Op_Code::STR && last.dr == head.dr &&
+          last.sr1 == head.sr1 && last.imm == head.imm) {
+        head.op  = FUSED_RMW;
+        head.aux = static_cast<tl::u8>(next.imm);
+      }
+      break;
+    }
+    case Op_Code::LEA:
+      if (next.op == Op_Code::TRAP && next.imm == Trap::puts) {
+        head.op = FUSED_LEA_PUTS;
+      }
+      break;
+    default:
+      break;
+  }
+  return head;
+}
+
+auto loop_idiom(std::span<const tl::u16, LOOP_LENGTH> words) noexcept
+  -> Loop_Idiom {
+  auto body = std::array<Decoded_Instruction, LOOP_LENGTH>{};
+  std::ranges::transform(words, body.begin(), decode);
+
+  // ADD reg, reg, #k
+  const auto steps = [](const Decoded_Instruction &instr, tl::u8 reg,
+                        tl::u16 k) {
+    return instr.op == Op_Code::ADD && instr.imm_mode && instr.dr == reg &&
+           instr.sr1 == reg && instr.imm == k;
+  };
+  // BR nzp to the first word, as the instruction at
+  const auto closes = [&body](tl::usize at, tl::u8 nzp) {
+    return body.at(at).op == Op_Code::BR && body.at(at).dr == nzp &&
+           body.at(at).imm == static_cast<tl::u16>(-(at + 1));
+  };
+  const auto distinct = [](std::initializer_list<tl::u8> regs) {
+    auto seen = 0U;
+    for (const auto reg : regs) { seen |= 1U << reg; }
+    return static_cast<tl::usize>(std::popcount(seen)) == regs.size();
+  };
+  constexpr auto up   = tl::u16{1};
+  constexpr auto down = tl::u16{0xFFFF};
+
+  const auto &head = body[0];
+  auto loop        = Loop_Idiom{};
+  switch (head.op) {
+    case Op_Code::LDR: {
+      loop.value         = head.dr;
+      loop.source        = head.sr1;
+      loop.source_offset = head.imm;
+      const auto &store  = body[1];
+      if (store.op == Op_Code::STR && store.dr == loop.value) {
+        loop.dest        = store.sr1;
+        loop.dest_offset = store.imm;
+        loop.counter     = body[4].dr;
+        const auto pointers =
+          (steps(body[2], loop.source, up) && steps(body[3], loop.dest, up)) ||
+          (steps(body[2], loop.dest, up) && steps(body[3], loop.source, up));
+        if (pointers && steps(body[4], loop.counter, down) &&
+            closes(5, Condition_Flag::POS) &&
+            distinct({loop.value, loop.source, loop.dest, loop.counter})) {
+          loop.kind   = Loop_Kind::copy;
+          loop.length = 6;
+        }
+        break;
+      }
+      const auto &out = body[1];
+      if (out.op != Op_Code::BR || out.dr != Condition_Flag::ZRO ||
+          !steps(body[2], loop.source, up) ||
+          !distinct({loop.value, loop.source})) {
+        break;
+      }
+      loop.exit    = static_cast<tl::u16>(out.imm + 2);
+      loop.counter = body[3].dr;
+      constexpr auto any = Condition_Flag::NEG | Condition_Flag::ZRO |
+                           Condition_Flag::POS;  // NOLINT(hicpp-signed-bitwise)
+      if (closes(3, any)) {
+        loop.kind    = Loop_Kind::scan;
+        loop.length  = 4;
+        loop.counter = NO_REGISTER;
+      } else if (steps(body[3], loop.counter, up) && closes(4, any) &&
+                 distinct({loop.value, loop.source, loop.counter})) {
+        loop.kind   = Loop_Kind::scan;
+        loop.length = 5;
+      }
+      break;
+    }
+    case Op_Code::STR:
+      loop.value       = head.dr;
+      loop.dest        = head.sr1;
+      loop.dest_offset = head.imm;
+      loop.counter     = body[2].dr;
+      if (steps(body[1], loop.dest, up) &&
+          steps(body[2], loop.counter, down) &&
+          closes(3, Condition_Flag::POS) &&
+          distinct({loop.value, loop.dest, loop.counter})) {
+        loop.kind   = Loop_Kind::fill;
+        loop.length = 4;
+      }
+      break;
+    default:
+      break;
+  }
+  return loop;
+}
+}  // namespace vm
@@ -0,0 +1,122 @@
+#pragma once
+#include <array>
+#include <span>
+
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+// marks a cache entry that has not been decoded yet (or was invalidated by a
+// write to its address). Op codes only use 4 bits, so it is the first value
+// after them, which lets the threaded engine give it a slot in its table.
+static constexpr tl::u8 UNDECODED = 16;
+
+// superinstructions: one cache entry for a short sequence that LC-3 code
+// repeats a lot, so the threaded engine runs it with a single dispatch, see
+// fuse(). They come after UNDECODED, everything else decodes them again.
+enum Fused_Op : tl::u8 {
+  FUSED_CONST = UNDECODED + 1,  // AND Rx, Ry, #0; ADD Rx, Rx, #k
+  FUSED_ADD_BR,                 // ADD Rx, Ry, #k; BR
+  FUSED_RMW,                    // LDR Rx, Rb, #o; ADD Rx, Rx, #k; STR the same
+  FUSED_LEA_PUTS,               // LEA Rx, label; TRAP x22
+  FUSED_LOOP,                   // a whole loop, see loop_idiom()
+};
+static constexpr tl::u8 FUSED_END = FUSED_LOOP + 1;
+
+// how many instructions a fused entry covers, at most. FUSED_LOOP entries
+// are longer, but they look at their loop again every time they run.
+static constexpr auto FUSED_LENGTH = 3;
+
+/*
+ * An instruction with all of its fields already extracted.
+ *
+ * run() keeps one of these for every memory location, so the bit fiddling is
+ * done once per address instead of every time the instruction executes.
+ *
+ * Field usage per op code:
+ *  BR              dr = nzp, imm = sext(PCoffset9)
+ *  ADD, AND        dr, sr1, sr2 / imm = sext(imm5), imm_mode = bit 5
+ *  LD, ST, LDI,
+ *  STI, LEA        dr (SR for the stores), imm = sext(PCoffset9)
+ *  LDR, STR        dr (SR for STR), sr1 = BaseR, imm = sext(offset6)
+ *  NOT             dr, sr1
+ *  JMP             sr1 = BaseR
+ *  JSR             imm_mode = bit 11, imm = sext(PCoffset11), sr1 = BaseR
+ *  TRAP            imm = trapvect8
+ *
+ * and for the fused ones (aux is the k of their ADD, sign extended to 8 bits):
+ *  FUSED_CONST     dr, imm = k
+ *  FUSED_ADD_BR    dr, sr1, aux, sr2 = nzp, imm = sext(PCoffset9)
+ *  FUSED_RMW       dr, sr1 = BaseR, imm = sext(offset6), aux
+ *  FUSED_LEA_PUTS  the LEA
+ *  FUSED_LOOP      the first instruction of the loop
+ */
+struct Decoded_Instruction {
+  tl::u16 imm{};
+  tl::u8 op{UNDECODED};
+  tl::u8 dr{};
+  tl::u8 sr1{};
+  tl::u8 sr2{};
+  bool imm_mode{};
+  tl::u8 aux{};  // fits in the padding
+};
+static_assert(sizeof(Decoded_Instruction) == 8);
+
+[[nodiscard]] auto decode(tl::u16 instruction) noexcept -> Decoded_Instruction;
+// the mnemonic of every op code, what decode() leaves in op.
+static constexpr auto OP_NAMES = std::array{"BR",
+                                            "ADD",
+                                            "LD",
+                                            "ST",
+                                            "JSR",
+                                            "AND",
+                                            "LDR",
+                                            "STR",
+                                            "RTI",
+                                            "NOT",
+                                            "LDI",
+                                            "STI",
+                                            "JMP",
+                                            "RES",
+                                            "LEA",
+                                            "TRAP"};
+// first decoded, or a fused entry if it starts one of the sequences with the
+// words after it.
+[[nodiscard]] auto fuse(tl::u16 first, tl::u16 second, tl::u16 third) noexcept
+  -> Decoded_Instruction;
+
+// loops the threaded engine runs as a host copy, fill or search, with the
+// counter as the last ADD before the branch back:
+enum class Loop_Kind : tl::u8 {
+  none,
+  // LDR Rv, Rs, #o; STR Rv, Rd, #o; ADD Rs, Rs, #1; ADD Rd, Rd, #1 (or the
+  // other way around); ADD Rc, Rc, #-1; BRp back
+  copy,
+  // STR Rv, Rd, #o; ADD Rd, Rd, #1; ADD Rc, Rc, #-1; BRp back
+  fill,
+  // LDR Rv, Rs, #o; BRz out; ADD Rs, Rs, #1; ADD Rc, Rc, #1 (optional);
+  // BRnzp back
+  scan,
+};
+
+// words in the longest of them.
+static constexpr auto LOOP_LENGTH = 6;
+
+// the counter of a scan without one.
+static constexpr tl::u8 NO_REGISTER = 0xFF;
+
+struct Loop_Idiom {
+  Loop_Kind kind{Loop_Kind::none};
+  tl::u8 length{};   // instructions per iteration
+  tl::u8 value{};    // Rv
+  tl::u8 source{};   // Rs, copy and scan
+  tl::u8 dest{};     // Rd, copy and fill
+  tl::u8 counter{};  // Rc
+  tl::u16 source_offset{};
+  tl::u16 dest_offset{};
+  tl::u16 exit{};  // scan: where BRz goes, relative to the first word
+};
+
+// the loop that starts with the first of words, if it is one of them.
+[[nodiscard]] auto loop_idiom(
+  std::span<const tl::u16, LOOP_LENGTH> words) noexcept -> Loop_Idiom;
+}  // namespace vm
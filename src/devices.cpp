@@ -0,0 +1,116 @@
+#include "devices.hpp"
+
+#include "instructions.hpp"
+#include "opcodes.hpp"
+#include "vm.hpp"
+
+namespace vm {
+auto Keyboard::read(tl::u16 addr) -> tl::u16 {
+  if (addr == Mapped_Reg::key_data_reg) {
+    this->status_ &= ~DEVICE_READY;
+    return this->data_;
+  }
+  if (addr != Mapped_Reg::key_status_reg) { return 0; }
+
+  const auto interrupts = this->status_ & INTERRUPT_ENABLE;
+  if (interrupts && (this->status_ & DEVICE_READY)) { return this->status_; }
+
+  // the guest is polling the keyboard, show it what it printed so far.
+  auto &vm = this->vm_;
+  vm.output_.flush();
+  if (vm.key_ready()) {
+    this->status_ = static_cast<tl::u16>(interrupts | DEVICE_READY);
+    this->data_   = static_cast<tl::u16>(vm.get_key());
+    ++vm.effects_;
+  } else {
+    this->status_ = static_cast<tl::u16>(interrupts);
+    vm.wait_if_idle();
+  }
+  return this->status_;
+}
+
+auto Keyboard::write(tl::u16 addr, tl::u16 value) -> void {
+  if (addr == Mapped_Reg::key_status_reg) {
+    // only the interrupt enable bit can be written.
+    this->status_ = static_cast<tl::u16>((this->status_ & DEVICE_READY) |
+                                         (value & INTERRUPT_ENABLE));
+    this->vm_.update_events();
+  } else if (addr == Mapped_Reg::key_data_reg) {
+    this->data_ = value;
+  }
+}
+
+auto Keyboard::latch() -> bool {
+  if (this->status_ & DEVICE_READY) { return true; }
+  auto &vm = this->vm_;
+  if (!vm.key_ready()) { return false; }
+  this->status_ |= DEVICE_READY;
+  this->data_ = static_cast<tl::u16>(vm.get_key());
+  ++vm.effects_;
+  // the end of the input may have stopped the run.
+  return vm.running_;
+}
+
+auto Display::read(tl::u16 addr) -> tl::u16 {
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  return addr == Mapped_Reg::display_status_reg ? (1 << 15) : 0;
+}
+
+auto Display::write(tl::u16 addr, tl::u16 value) -> void {
+  if (addr != Mapped_Reg::display_data_reg) { return; }
+
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  this->output_.put(static_cast<char>(value & 0xFF));
+  this->output_.maybe_flush();
+}
+
+auto Timer::read(tl::u16 addr) -> tl::u16 {
+  if (addr == Mapped_Reg::timer_interval_reg) { return this->interval_; }
+  if (addr != Mapped_Reg::timer_status_reg) { return 0; }
+
+  const auto enabled = this->interrupts_ ? INTERRUPT_ENABLE : tl::u16{0};
+  return static_cast<tl::u16>(enabled | (this->tick() ? DEVICE_READY : 0));
+}
+
+auto Timer::write(tl::u16 addr, tl::u16 value) -> void {
+  if (addr == Mapped_Reg::timer_status_reg) {
+    this->interrupts_ = (value & INTERRUPT_ENABLE) != 0;
+    this->vm_.update_events();
+    return;
+  }
+  if (addr != Mapped_Reg::timer_interval_reg) { return; }
+  this->interval_ = value;
+  this->next_     = this->now() + value;
+}
+
+auto Timer::tick() -> bool {
+  if (this->interval_ == 0) { return false; }
+  const auto now = this->now();
+  if (now < this->next_) { return false; }
+  this->next_ = now + this->interval_;
+  return true;
+}
+
+auto Timer::due() -> bool {
+  if (!this->instructions_ && this->polls_-- != 0) { return false; }
+  this->polls_ = CLOCK_POLLS;
+  return this->tick();
+}
+
+auto Timer::now() const -> tl::u64 {
+  if (this->instructions_) { return *this->instructions_ / INSTRUCTIONS_PER_MS; }
+  return static_cast<tl::u64>(
+    std::chrono::duration_cast<std::chrono::milliseconds>(
+      Clock::now().time_since_epoch())
+      .count());
+}
+
+auto Machine_Control::read(tl::u16 /*addr*/) -> tl::u16 {
+  // the clock runs as long as anything can read this.
+  return DEVICE_READY;
+}
+
+auto Machine_Control::write(tl::u16 /*addr*/, tl::u16 value) -> void {
+  if (!(value & DEVICE_READY)) { this->vm_.stop(Exit_Reason::halted); }
+}
+}  // namespace vm
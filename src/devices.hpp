@@ -0,0 +1,131 @@
+#pragma once
+#include <chrono>
+
+#include "output.hpp"
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+class Lockstep_Group;
+class Virtual_Machine;
+
+/*
+ * A memory mapped device, see Virtual_Machine::attach().
+ *
+ * Loads and stores to the addresses a device is attached to go to read() and
+ * write() instead of memory. Device registers don't have to behave like
+ * memory: reading one can have side effects, writing one can be ignored.
+ */
+class Device {
+ public:
+  Device()                                   = default;
+  virtual ~Device()                          = default;
+  Device(const Device &)                     = delete;
+  auto operator=(const Device &) -> Device & = delete;
+
+  [[nodiscard]] virtual auto read(tl::u16 addr) -> tl::u16 = 0;
+  virtual auto write(tl::u16 addr, tl::u16 value) -> void   = 0;
+};
+
+// bits of the status registers (KBSR, TMR): the device is ready, and it
+// interrupts the guest when it is, see Virtual_Machine::poll_events().
+static constexpr auto DEVICE_READY     = tl::u16{1} << 15;
+static constexpr auto INTERRUPT_ENABLE = tl::u16{1} << 14;
+
+// KBSR and KBDR. Reading KBSR checks for a key and, if there is one, moves it
+// into KBDR right away. With interrupts enabled a key waits in KBDR until the
+// guest reads it, polls don't replace it.
+class Keyboard final : public Device {
+ public:
+  explicit Keyboard(Virtual_Machine &vm)
+    : vm_(vm) {}
+
+  [[nodiscard]] auto read(tl::u16 addr) -> tl::u16 override;
+  auto write(tl::u16 addr, tl::u16 value) -> void override;
+
+ private:
+  // true if a key is in KBDR, fetching one if there is none yet.
+  [[nodiscard]] auto latch() -> bool;
+
+  Virtual_Machine &vm_;
+  tl::u16 status_{0};  // DEVICE_READY and INTERRUPT_ENABLE
+  tl::u16 data_{0};
+
+  friend class Virtual_Machine;  // for interrupts and snapshots
+  friend class Lockstep_Group;   // for lanes that leave a group, or come back
+};
+
+// DSR and DDR. The console is always ready, characters written to DDR go to
+// the output buffer.
+class Display final : public Device {
+ public:
+  explicit Display(Output_Buffer &output)
+    : output_(output) {}
+
+  [[nodiscard]] auto read(tl::u16 addr) -> tl::u16 override;
+  auto write(tl::u16 addr, tl::u16 value) -> void override;
+
+ private:
+  Output_Buffer &output_;
+};
+
+// how long a millisecond is for a timer on the instruction clock.
+static constexpr auto INSTRUCTIONS_PER_MS = tl::u64{1000};
+
+// TMR and TMI. Writing a number of milliseconds to TMI starts the timer (0
+// stops it), reading TMR has bit 15 set once per elapsed interval. With
+// INTERRUPT_ENABLE set in TMR the timer interrupts the guest once per
+// interval instead.
+class Timer final : public Device {
+  using Clock = std::chrono::steady_clock;
+
+ public:
+  explicit Timer(Virtual_Machine &vm)
+    : vm_(vm) {}
+
+  [[nodiscard]] auto read(tl::u16 addr) -> tl::u16 override;
+  auto write(tl::u16 addr, tl::u16 value) -> void override;
+
+  // counts milliseconds from *instructions (INSTRUCTIONS_PER_MS) instead of
+  // the wall clock, nullptr goes back to the wall clock.
+  auto use_instruction_clock(const tl::u64 *instructions) noexcept -> void {
+    this->instructions_ = instructions;
+  }
+  [[nodiscard]] auto on_instruction_clock() const noexcept -> bool {
+    return this->instructions_ != nullptr;
+  }
+
+ private:
+  [[nodiscard]] auto now() const -> tl::u64;  // ms
+  // true once per elapsed interval.
+  [[nodiscard]] auto tick() -> bool;
+  // tick() between basic blocks, which reads the wall clock only every
+  // CLOCK_POLLS calls: that costs more than a short block.
+  [[nodiscard]] auto due() -> bool;
+
+  static constexpr auto CLOCK_POLLS = tl::u16{256};
+
+  Virtual_Machine &vm_;
+  const tl::u64 *instructions_{nullptr};
+  tl::u16 interval_{0};  // ms
+  tl::u64 next_{0};      // ms
+  tl::u16 polls_{0};     // until due() reads the clock
+  bool interrupts_{false};
+
+  friend class Virtual_Machine;  // like the keyboard
+  friend class Lockstep_Group;
+};
+
+// MCR. Bit 15 reads as set while the machine runs, clearing it halts the vm
+// the way HALT does: that is how an OS's HALT routine stops.
+class Machine_Control final : public Device {
+ public:
+  explicit Machine_Control(Virtual_Machine &vm)
+    : vm_(vm) {}
+
+  [[nodiscard]] auto read(tl::u16 addr) -> tl::u16 override;
+  auto write(tl::u16 addr, tl::u16 value) -> void override;
+
+ private:
+  Virtual_Machine &vm_;
+};
+}  // namespace vm
@@ -0,0 +1,53 @@
+#include <memory>
+
+#include "instructions.hpp"
+#include "jit.hpp"
+#include "vm.hpp"
+
+namespace vm {
+// Tiered engine: basic blocks are interpreted until they get hot, then run
+// as native code compiled by the Jit.
+auto Virtual_Machine::run_jit() -> void {
+  if (!Jit::supported()) {
+    this->diagnose("jit not supported here, using threaded.");
+    this->run_threaded();
+    return;
+  }
+
+  // compiled blocks can't tell the profiler or the trace about every
+  // instruction, or stop a loop at the end of a budget.
+  if (this->active_.profile || this->active_.trace || this->active_.budget) {
+    this->run_threaded();
+    return;
+  }
+
+  if (!this->jit_) { this->jit_ = std::make_unique<Jit>(this->jit_threshold_); }
+  with_features(this->active_, [this]<Features F>() { this->jit_loop<F>(); });
+}
+
+template <Features F>
+auto Virtual_Machine::jit_loop() -> void {
+  auto &jit = *this->jit_;
+
+  // every PC we get here with starts a basic block, interrupts come in
+  // between them.
+  for (; this->running_; this->end_block()) {
+    const auto pc = this->register_[Register::PC];
+    if (const auto block = jit.lookup(pc)) {
+      this->sync_flags();
+      block(this, this->register_.data(), this->memory_.data());
+      continue;
+    }
+
+    if (jit.hot(pc) && jit.compile(*this, pc)) { continue; }
+
+    // cold block, interpret it.
+    auto instr = this->fetch<F>();
+    this->execute(instr);
+    while (this->running_ && !ends_basic_block(instr.op)) {
+      instr = this->fetch<F>();
+      this->execute(instr);
+    }
+  }
+}
+}  // namespace vm
@@ -0,0 +1,64 @@
+#include <memory>
+
+#include "instructions.hpp"
+#include "native.hpp"
+#include "vm.hpp"
+
+namespace vm {
+// Ahead of time engine: the blocks lc3_recompile translated run natively,
+// everything else is interpreted a basic block at a time, like cold code in
+// the jit engine.
+auto Virtual_Machine::run_native() -> void {
+  const auto *program = native_program();
+  if (!program) {
+    this->diagnose("no native program built in, using threaded.");
+    this->run_threaded();
+    return;
+  }
+
+  // translated blocks can't tell the profiler or the trace about every
+  // instruction, or stop a loop at the end of a budget.
+  if (this->active_.profile || this->active_.trace || this->active_.budget) {
+    this->run_threaded();
+    return;
+  }
+
+  if (!this->native_) {
+    this->native_ =
+      std::make_unique<Native_Code>(*program, this->memory_.span());
+  }
+  with_features(this->active_,
+                [this]<Features F>() { this->native_loop<F>(); });
+}
+
+template <Features F>
+auto Virtual_Machine::native_loop() -> void {
+  auto &code = *this->native_;
+  // blocks always count, into a counter nobody reads if the run doesn't.
+  auto uncounted = tl::u64{0};
+  auto frame     = Native_Frame{this->register_.data(),
+                                this->memory_.data(),
+                                &this->io_pages_,
+                                F.count ? &this->instructions_ : &uncounted,
+                                this};
+
+  // every PC we get here with starts a basic block, interrupts come in
+  // between them.
+  for (; this->running_; this->end_block()) {
+    const auto pc = this->register_[Register::PC];
+    if (const auto block = code.lookup(pc)) {
+      this->sync_flags();
+      frame.stopped                 = false;
+      this->register_[Register::PC] = block(frame);
+      continue;
+    }
+
+    auto instr = this->fetch<F>();
+    this->execute(instr);
+    while (this->running_ && !ends_basic_block(instr.op)) {
+      instr = this->fetch<F>();
+      this->execute(instr);
+    }
+  }
+}
+}  // namespace vm
@@ -0,0 +1,16 @@
+#include "instructions.hpp"
+#include "vm.hpp"
+
+namespace vm {
+// The reference engine: a single switch on the op code for every instruction.
+auto Virtual_Machine::run_switch() -> void {
+  with_features(this->active_, [this]<Features F>() {
+    while (this->running_) {
+      const auto instr = this->fetch<F>();
+      this->execute(instr);
+      this->on_executed<F>(instr);
+      if (ends_basic_block(instr.op)) { this->end_block(); }
+    }
+  });
+}
+}  // namespace vm
@@ -0,0 +1,246 @@
+#include <array>
+
+#include "instructions.hpp"
+#include "vm.hpp"
+
+// labels-as-values is a GNU extension, supported by gcc and clang.
+#if defined(__GNUC__) && !defined(LC3_NO_COMPUTED_GOTO)
+  #define LC3_COMPUTED_GOTO 1
+#else
+  #define LC3_COMPUTED_GOTO 0
+#endif
+
+namespace vm {
+#if LC3_COMPUTED_GOTO
+// Direct threaded code: every handler ends with its own indirect jump to the
+// next handler instead of going back to a shared switch. Each jump gets its
+// own branch predictor entry (e.g. "what usually follows an LDR") and there is
+// no bounds check on the op code.
+//
+// The slot after the 16 op codes is for UNDECODED entries, so a cache miss
+// costs no extra branch on the fast path.
+//
+// Misses decode superinstructions (see fuse() and loop_idiom()) unless the
+// run profiles or traces, which need to see every instruction on its own:
+// those loops send fused entries to the miss handler too, which decodes them
+// again. set_fusion(false) turns them off as well.
+template <Features F>
+auto Virtual_Machine::threaded_loop() -> void {  // NOLINT
+  #pragma GCC diagnostic push
+  #pragma GCC diagnostic ignored "-Wpedantic"
+
+  constexpr auto fusing = !F.profile && !F.trace;
+
+  static void *const dispatch_table[] = {
+    &&do_br,
+    &&do_add,
+    &&do_ld,
+    &&do_st,
+    &&do_jsr,
+    &&do_and,
+    &&do_ldr,
+    &&do_str,
+    &&do_rti,
+    &&do_not,
+    &&do_ldi,
+    &&do_sti,
+    &&do_jmp,
+    &&do_res,
+    &&do_lea,
+    &&do_trap,
+    &&do_undecoded,
+    fusing ? &&do_const : &&do_undecoded,
+    fusing ? &&do_add_br : &&do_undecoded,
+    fusing ? &&do_rmw : &&do_undecoded,
+    fusing ? &&do_lea_puts : &&do_undecoded,
+    fusing ? &&do_loop : &&do_undecoded,
+  };
+  static_assert(std::size(dispatch_table) == FUSED_END);
+
+  auto instr = Decoded_Instruction{};
+
+  // load the next instruction and jump straight to its handler. instr is a
+  // copy, a store may invalidate the cached entry while it executes.
+  #define DISPATCH()                                         \
+    do {                                                     \
+      instr = this->decoded_[this->register_[Register::PC]]; \
+      goto *dispatch_table[instr.op];                        \
+    } while (false)
+
+  // increment the PC, run the instruction and go to the next one.
+  #define HANDLER(label, execute)       \
+    label:                              \
+    this->register_[Register::PC]++;    \
+    this->on_fetch<F>(instr);           \
+    this->execute(instr);               \
+    this->on_executed<F>(instr);        \
+    DISPATCH()
+
+  // the same for an instruction that ends a basic block, where a pending
+  // interrupt is taken.
+  #define BRANCH(label, execute)        \
+    label:                              \
+    this->register_[Register::PC]++;    \
+    this->on_fetch<F>(instr);           \
+    this->execute(instr);               \
+    this->on_executed<F>(instr);        \
+    this->end_block();                  \
+    DISPATCH()
+
+  // a fused entry of length instructions.
+  #define FUSED(label, execute, length)                          \
+    label:                                                       \
+    if constexpr (F.count) { this->instructions_ += (length); } \
+    this->execute(instr);                                        \
+    this->check_budget<F>();                                     \
+    DISPATCH()
+
+  if (!this->running_) { return; }
+  DISPATCH();
+
+  BRANCH(do_br, op_br);
+  HANDLER(do_add, op_add);
+  HANDLER(do_ld, op_ld);
+  HANDLER(do_st, op_st);
+  BRANCH(do_jsr, op_jsr);
+  HANDLER(do_and, op_and);
+  HANDLER(do_ldr, op_ldr);
+  HANDLER(do_str, op_str);
+  HANDLER(do_not, op_not);
+  HANDLER(do_ldi, op_ldi);
+  HANDLER(do_sti, op_sti);
+  BRANCH(do_jmp, op_jmp);
+  HANDLER(do_lea, op_lea);
+  // a stop() in RTI (user mode) lands in do_undecoded.
+  BRANCH(do_rti, op_rti);
+
+  FUSED(do_const, fused_const, 2);
+
+do_lea_puts:
+  if constexpr (F.count) { this->instructions_ += 2; }
+  this->fused_lea_puts(instr);
+  this->check_budget<F>();
+  this->end_block();
+  DISPATCH();
+
+do_add_br:
+  if constexpr (F.count) { this->instructions_ += 2; }
+  this->fused_add_br(instr);
+  this->check_budget<F>();
+  this->end_block();
+  DISPATCH();
+
+do_rmw:
+  // a device could stop the run in between, so those run one at a time.
+  if (this->io_pages_[static_cast<tl::u16>(this->register_[instr.sr1] +
+                                           instr.imm) >>
+                      PAGE_BITS]) [[unlikely]] {
+    instr.op = Op_Code::LDR;
+    goto do_ldr;
+  }
+  if constexpr (F.count) { this->instructions_ += 3; }
+  this->fused_rmw(instr);
+  this->check_budget<F>();
+  DISPATCH();
+
+do_loop : {
+  // nothing ran when the loop starts next to a device or its own code, or
+  // changed since: then its first instruction goes on its own.
+  const auto ran = this->fused_loop();
+  if (ran == 0) [[unlikely]] {
+    instr = decode(this->memory_[this->register_[Register::PC]]);
+    goto *dispatch_table[instr.op];
+  }
+  if constexpr (F.count) { this->instructions_ += ran; }
+  this->check_budget<F>();
+  this->end_block();
+  DISPATCH();
+}
+
+do_trap:
+  // HALT stops the vm, so do GETC/IN at the end of the input.
+  this->register_[Register::PC]++;
+  this->on_fetch<F>(instr);
+  this->op_trap(instr);
+  this->on_executed<F>(instr);
+  if (!this->running_) { return; }
+  this->end_block();
+  DISPATCH();
+
+do_res:
+  // unused
+  if constexpr (F.count) { ++this->instructions_; }
+  this->abort();
+  return;
+
+do_undecoded : {
+  // also where a stop() in the middle of an instruction ends up.
+  if (!this->running_) { return; }
+  const auto pc = this->register_[Register::PC];
+  if (fusing && this->fusion_) {
+    const auto window  = this->code_window(pc);
+    this->decoded_[pc] = fuse(window[0], window[1], window[2]);
+    if (loop_idiom(window).kind != Loop_Kind::none) {
+      this->decoded_[pc].op = FUSED_LOOP;
+    }
+  } else {
+    this->decoded_[pc] = decode(this->memory_[pc]);
+  }
+  DISPATCH();
+}
+
+  #undef FUSED
+  #undef BRANCH
+  #undef HANDLER
+  #undef DISPATCH
+  #pragma GCC diagnostic pop
+}
+
+auto Virtual_Machine::run_threaded() -> void {
+  with_features(this->active_,
+                [this]<Features F>() { this->threaded_loop<F>(); });
+}
+#else
+// Portable fallback for compilers without labels-as-values: the same handler
+// table, but as functions called from a small trampoline loop. Standard C++
+// can't guarantee the handlers would tail call each other, so the loop keeps
+// the stack flat instead.
+auto Virtual_Machine::run_threaded() -> void {
+  using Handler = void (*)(Virtual_Machine &, const Decoded_Instruction &);
+
+  static constexpr auto bad_opcode = [](Virtual_Machine &self,
+                                        const Decoded_Instruction &) {
+    // unused
+    self.abort();
+  };
+
+  static constexpr auto handlers = std::array<Handler, UNDECODED>{
+    [](Virtual_Machine &self, const auto &instr) { self.op_br(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_add(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_ld(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_st(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_jsr(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_and(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_ldr(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_str(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_rti(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_not(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_ldi(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_sti(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_jmp(instr); },
+    bad_opcode,  // RES
+    [](Virtual_Machine &self, const auto &instr) { self.op_lea(instr); },
+    [](Virtual_Machine &self, const auto &instr) { self.op_trap(instr); },
+  };
+
+  with_features(this->active_, [this]<Features F>() {
+    while (this->running_) {
+      const auto instr = this->fetch<F>();
+      handlers[instr.op](*this, instr);
+      this->on_executed<F>(instr);
+      if (ends_basic_block(instr.op)) { this->end_block(); }
+    }
+  });
+}
+#endif
+}  // namespace vm
@@ -0,0 +1,54 @@
+#include "headless.hpp"
+
+#include <array>
+#include <cstdio>
+#include <fstream>
+
+namespace vm {
+auto read_whole_file(const std::string &path, std::string &bytes) -> bool {
+#ifdef _WIN32
+  std::FILE *in = nullptr;
+  fopen_s(&in, path.c_str(), "rb");
+#else
+  std::FILE *in = std::fopen(path.c_str(), "rb");
+#endif
+  if (!in) { return false; }
+
+  auto chunk = std::array<char, 4096>();
+  auto read  = tl::usize{};
+  while ((read = std::fread(chunk.data(), 1, chunk.size(), in)) > 0) {
+    bytes.append(chunk.data(), read);
+  }
+  std::fclose(in);  // NOLINT
+  return true;
+}
+
+auto read_schedule(const std::string &path, std::vector<tl::u64> &schedule)
+  -> bool {
+  auto in = std::ifstream(path);
+  if (!in) { return false; }
+
+  auto at = tl::u64{};
+  while (in >> at) {
+    if (!schedule.empty() && at < schedule.back()) { return false; }
+    schedule.push_back(at);
+  }
+  return in.eof();  // stopped at the end, not at something that isn't a number
+}
+
+auto make_headless(Virtual_Machine &vm, Scripted_Input &input) -> void {
+  vm.set_input(&input);
+  vm.set_stop_on_eof(true);
+  vm.set_instruction_clock(true);
+  vm.output().capture();
+}
+
+auto digest(std::string_view bytes) noexcept -> tl::u64 {
+  auto hash = tl::u64{0xcbf29ce484222325};
+  for (const auto byte : bytes) {
+    hash ^= static_cast<unsigned char>(byte);
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+}  // namespace vm
@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "input.hpp"
+#include "tl/numeric-aliases.hpp"
+#include "vm.hpp"
+
+namespace vm {
+/*
+ * Headless runs: keys come from a file, optionally released to KBSR on a
+ * schedule of instruction counts, and the output is kept in memory. Nothing
+ * depends on the terminal or the clock, so the same images, input and
+ * schedule give the same output and instruction count every time, on every
+ * engine.
+ */
+
+// the whole file in bytes, false if it can't be read.
+[[nodiscard]] auto read_whole_file(const std::string &path, std::string &bytes)
+  -> bool;
+
+// instruction counts separated by white space, one per key, never going
+// down. See Scripted_Input.
+[[nodiscard]] auto read_schedule(const std::string &path,
+                                 std::vector<tl::u64> &schedule) -> bool;
+
+// sets vm up for a reproducible run: keys from input, output captured (see
+// Output_Buffer::captured()), the timer on the instruction clock and the run
+// ends when the guest reads past the last key.
+auto make_headless(Virtual_Machine &vm, Scripted_Input &input) -> void;
+
+// FNV-1a, to compare the output of runs at a glance.
+[[nodiscard]] auto digest(std::string_view bytes) noexcept -> tl::u64;
+}  // namespace vm
@@ -0,0 +1,183 @@
+// Loop idioms: the copy, fill and search loops of loop_idiom(), run as one
+// host operation on memory_ by the threaded engine's FUSED_LOOP entries.
+//
+// Everything ends up as if the loop ran an instruction at a time: registers,
+// flags, PC, memory and the invalidated code. A range that reaches a device
+// page (or the end of memory, or the loop's own code for the writes) stops
+// short of it, with PC back at the loop, and the instructions take it from
+// there.
+#include <algorithm>
+#include <bit>
+
+#if defined(__x86_64__) || defined(_M_X64)
+  #include <immintrin.h>
+#elif defined(__aarch64__)
+  #include <arm_neon.h>
+#endif
+
+#include "instructions.hpp"
+#include "vm.hpp"
+
+namespace vm {
+namespace {
+// how many of the count words from first are plain memory, up to a device
+// page or the end of memory.
+[[nodiscard]] auto plain_words(const std::bitset<PAGES> &io_pages,
+                               tl::u16 first,
+                               tl::usize count) noexcept -> tl::usize {
+  const auto end = std::min(tl::usize{first} + count, tl::usize{LAS});
+  auto addr      = tl::usize{first};
+  while (addr < end && !io_pages[addr >> PAGE_BITS]) {
+    addr = std::min(((addr >> PAGE_BITS) + 1) << PAGE_BITS, end);
+  }
+  return addr - first;
+}
+
+// count cut down to the words from first that come before the loop at pc.
+[[nodiscard]] auto before_loop(tl::u16 first,
+                               tl::usize count,
+                               tl::u16 pc,
+                               tl::u8 length) noexcept -> tl::usize {
+  if (static_cast<tl::u16>(first - pc) < length) { return 0; }
+  return std::min(count, tl::usize{static_cast<tl::u16>(pc - first)});
+}
+
+// index of the first 0 in words, or count.
+[[nodiscard]] auto find_zero(const tl::u16 *words, tl::usize count) noexcept
+  -> tl::usize {
+  auto done = tl::usize{0};
+  // NOLINTBEGIN(*-reinterpret-cast, *-pointer-arithmetic)
+#if defined(__x86_64__) || defined(_M_X64)
+  const auto zero = _mm_setzero_si128();
+  for (; done + 8 <= count; done += 8) {
+    const auto words8 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(words + done));
+    const auto zeros = static_cast<unsigned>(
+      _mm_movemask_epi8(_mm_cmpeq_epi16(words8, zero)));
+    if (zeros != 0) { return done + std::countr_zero(zeros) / 2; }
+  }
+#elif defined(__aarch64__)
+  for (; done + 8 <= count; done += 8) {
+    if (vmaxvq_u16(vceqzq_u16(vld1q_u16(words + done))) != 0) { break; }
+  }
+#endif
+  while (done < count && words[done] != 0) { ++done; }
+  // NOLINTEND(*-reinterpret-cast, *-pointer-arithmetic)
+  return done;
+}
+
+// iterations of a loop that counts down to 0: BRp goes around again as long
+// as the counter is still positive, so one if it doesn't start out positive
+// (besides 0x8000, one less is 0x7fff).
+[[nodiscard]] auto iterations(tl::u16 counter) noexcept -> tl::usize {
+  return counter - 1U < 0x8000U ? counter : 1;
+}
+}  // namespace
+
+auto Virtual_Machine::fused_loop() -> tl::u64 {
+  const auto pc     = this->register_[Register::PC];
+  const auto window = this->code_window(pc);
+  const auto loop   = loop_idiom(window);
+  switch (loop.kind) {
+    case Loop_Kind::copy:
+      return this->loop_copy(loop, pc);
+    case Loop_Kind::fill:
+      return this->loop_fill(loop, pc);
+    case Loop_Kind::scan:
+      return this->loop_scan(loop, pc);
+    case Loop_Kind::none:
+      break;
+  }
+  // a store changed the loop after it was decoded.
+  this->decoded_[pc] = fuse(window[0], window[1], window[2]);
+  return 0;
+}
+
+auto Virtual_Machine::loop_copy(const Loop_Idiom &loop, tl::u16 pc)
+  -> tl::u64 {
+  auto &reg        = this->register_;
+  const auto total = iterations(reg[loop.counter]);
+  const auto from  = static_cast<tl::u16>(reg[loop.source] + loop.source_offset);
+  const auto to    = static_cast<tl::u16>(reg[loop.dest] + loop.dest_offset);
+  const auto count = before_loop(
+    to,
+    std::min(plain_words(this->io_pages_, from, total),
+             plain_words(this->io_pages_, to, total)),
+    pc,
+    loop.length);
+  if (count == 0) { return 0; }
+
+  auto *memory = this->memory_.data();
+  // NOLINTBEGIN(*-pointer-arithmetic)
+  if (to > from && to < from + count) {
+    // the copy reads what it wrote before, a word at a time like the loop.
+    for (auto i = tl::usize{0}; i < count; ++i) {
+      memory[to + i] = memory[from + i];
+    }
+  } else {
+    std::copy_n(memory + from, count, memory + to);
+  }
+  reg[loop.value] = memory[from + count - 1];
+  // NOLINTEND(*-pointer-arithmetic)
+  for (auto i = tl::usize{0}; i < count; ++i) {
+    this->invalidate(static_cast<tl::u16>(to + i));
+  }
+  this->effects_ += count;
+
+  reg[loop.source] += count;
+  reg[loop.dest] += count;
+  reg[loop.counter] -= count;
+  this->set_flags(reg[loop.counter]);
+  reg[Register::PC] = count == total ? pc + loop.length : pc;
+  return count * loop.length;
+}
+
+auto Virtual_Machine::loop_fill(const Loop_Idiom &loop, tl::u16 pc)
+  -> tl::u64 {
+  auto &reg        = this->register_;
+  const auto total = iterations(reg[loop.counter]);
+  const auto to    = static_cast<tl::u16>(reg[loop.dest] + loop.dest_offset);
+  const auto count = before_loop(
+    to, plain_words(this->io_pages_, to, total), pc, loop.length);
+  if (count == 0) { return 0; }
+
+  // NOLINTNEXTLINE(*-pointer-arithmetic)
+  std::fill_n(this->memory_.data() + to, count, reg[loop.value]);
+  for (auto i = tl::usize{0}; i < count; ++i) {
+    this->invalidate(static_cast<tl::u16>(to + i));
+  }
+  this->effects_ += count;
+
+  reg[loop.dest] += count;
+  reg[loop.counter] -= count;
+  this->set_flags(reg[loop.counter]);
+  reg[Register::PC] = count == total ? pc + loop.length : pc;
+  return count * loop.length;
+}
+
+auto Virtual_Machine::loop_scan(const Loop_Idiom &loop, tl::u16 pc)
+  -> tl::u64 {
+  auto &reg         = this->register_;
+  const auto from   = static_cast<tl::u16>(reg[loop.source] + loop.source_offset);
+  const auto plain  = plain_words(this->io_pages_, from, LAS);
+  const auto *words = this->memory_.data() + from;  // NOLINT
+  const auto count  = find_zero(words, plain);
+  const auto found  = count < plain;
+  if (count == 0 && !found) { return 0; }
+
+  reg[loop.source] += count;
+  if (loop.counter != NO_REGISTER) { reg[loop.counter] += count; }
+  if (found) {
+    // the LDR of the 0 and the BRz out.
+    reg[loop.value] = 0;
+    this->set_flags(0);
+    reg[Register::PC] = pc + loop.exit;
+    return count * loop.length + 2;
+  }
+  reg[loop.value] = words[count - 1];  // NOLINT(*-pointer-arithmetic)
+  this->set_flags(
+    reg[loop.counter != NO_REGISTER ? loop.counter : loop.source]);
+  reg[Register::PC] = pc;
+  return count * loop.length;
+}
+}  // namespace vm
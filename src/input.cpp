@@ -0,0 +1,177 @@
+#include "input.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+
+#ifdef _WIN32
+  #include <io.h>
+  #include <cstdio>  // std::getchar
+#else
+  #include <poll.h>
+  #include <unistd.h>
+
+  #include <cerrno>
+#endif
+
+namespace vm {
+namespace {
+// write end of the wake pipe of the running Console_Input, for the SIGINT
+// handler. There is only one console, so one is enough.
+std::atomic<int> console_wake_fd{-1};  // NOLINT
+}  // namespace
+
+Console_Input::Console_Input(int fd)
+  : fd_(fd) {
+#ifndef _WIN32
+  if (pipe(this->wake_) == 0) {
+    console_wake_fd.store(this->wake_[1]);
+  }
+#endif
+  this->reader_ = std::thread([this] { this->read_loop(); });
+}
+
+Console_Input::~Console_Input() {
+  this->stop();
+#ifndef _WIN32
+  for (const auto fd : this->wake_) {
+    if (fd >= 0) { close(fd); }
+  }
+#endif
+}
+
+auto Console_Input::key_ready(tl::u64 /*now*/) -> bool {
+  // at the end of the input there is "a key" as well: -1, like getchar().
+  return !this->keys_.empty() || this->eof_.load(std::memory_order_acquire);
+}
+
+auto Console_Input::get_key() -> int {
+  this->wait_key();
+
+  auto ch = char{};
+  if (this->keys_.try_pop(ch)) { return static_cast<unsigned char>(ch); }
+  return -1;  // the input ended
+}
+
+auto Console_Input::wait_key() -> void {
+  for (;;) {
+    const auto seen = this->events_.load(std::memory_order_acquire);
+    if (this->key_ready(0)) { return; }
+    this->events_.wait(seen);
+  }
+}
+
+auto Console_Input::stop() -> void {
+  if (!this->reader_.joinable()) { return; }
+
+#ifdef _WIN32
+  // getchar() can't be interrupted, the thread ends with the process.
+  this->reader_.detach();
+#else
+  console_wake_fd.store(-1);
+  const auto wake = char{1};
+  [[maybe_unused]] const auto written = write(this->wake_[1], &wake, 1);
+  this->reader_.join();
+#endif
+}
+
+auto Console_Input::read_loop() -> void {
+  const auto publish = [this] {
+    this->events_.fetch_add(1, std::memory_order_release);
+    this->events_.notify_all();
+  };
+
+#ifdef _WIN32
+  for (;;) {
+    const auto ch = std::getchar();
+    if (ch == EOF) { break; }
+    while (!this->keys_.try_push(static_cast<char>(ch))) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    publish();
+  }
+#else
+  auto buffer = std::array<char, 256>();
+  for (;;) {
+    auto fds = std::array<pollfd, 2>{
+      pollfd{this->fd_, POLLIN, 0},
+      pollfd{this->wake_[0], POLLIN, 0},
+    };
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) { continue; }
+      break;
+    }
+    if (fds[1].revents) { return; }  // stop(), not the end of the input
+
+    // the guest isn't reading, wait for it to make room.
+    const auto space = std::min(this->keys_.free_space(), buffer.size());
+    if (space == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      continue;
+    }
+
+    const auto n = read(this->fd_, buffer.data(), space);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) { continue; }
+    if (n <= 0) { break; }
+
+    for (auto i = 0; i < n; ++i) {
+      [[maybe_unused]] const auto pushed = this->keys_.try_push(buffer[i]);
+    }
+    publish();
+  }
+#endif
+
+  this->eof_.store(true, std::memory_order_release);
+  publish();
+}
+
+auto Fd_Input::key_ready(tl::u64 /*now*/) -> bool {
+  return this->next_ < this->size_ || this->eof_ || this->fill(0);
+}
+
+auto Fd_Input::get_key() -> int {
+  this->wait_key();
+  if (this->next_ < this->size_) {
+    return static_cast<unsigned char>(this->buffer_.at(this->next_++));
+  }
+  return -1;  // the input ended
+}
+
+auto Fd_Input::wait_key() -> void {
+  while (!this->key_ready(0)) { this->fill(-1); }
+}
+
+auto Fd_Input::fill(int timeout_ms) -> bool {
+  if (this->eof_) { return true; }
+#ifdef _WIN32
+  // no poll() on every kind of descriptor there, the read blocks.
+  static_cast<void>(timeout_ms);
+  const auto n = _read(this->fd_,
+                       this->buffer_.data(),
+                       static_cast<unsigned>(this->buffer_.size()));
+#else
+  auto fds = pollfd{this->fd_, POLLIN, 0};
+  if (poll(&fds, 1, timeout_ms) <= 0) { return false; }
+
+  const auto n = read(this->fd_, this->buffer_.data(), this->buffer_.size());
+  if (n < 0 && (errno == EINTR || errno == EAGAIN)) { return false; }
+#endif
+  if (n <= 0) {
+    this->eof_ = true;
+    return true;
+  }
+  this->next_ = 0;
+  this->size_ = static_cast<tl::usize>(n);
+  return true;
+}
+
+auto interrupt_console_input() noexcept -> void {
+#ifndef _WIN32
+  const auto fd = console_wake_fd.load();
+  if (fd >= 0) {
+    const auto wake = char{1};
+    [[maybe_unused]] const auto written = write(fd, &wake, 1);
+  }
+#endif
+}
+}  // namespace vm
@@ -0,0 +1,192 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ring_buffer.hpp"
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+// Where the vm gets its keys from (GETC/IN and the KBSR/KBDR registers).
+class Input_Source {
+ public:
+  Input_Source()                                         = default;
+  virtual ~Input_Source()                                = default;
+  Input_Source(const Input_Source &)                     = delete;
+  auto operator=(const Input_Source &) -> Input_Source & = delete;
+
+  // true if a key is waiting, or the input ended (get_key() won't block).
+  // now is the number of instructions the vm executed so far.
+  [[nodiscard]] virtual auto key_ready(tl::u64 now) -> bool = 0;
+
+  // the next key, waits for one if needed. -1 once the input ended.
+  [[nodiscard]] virtual auto get_key() -> int = 0;
+
+  // blocks until key_ready().
+  virtual auto wait_key() -> void = 0;
+
+  // false if wait_key() doesn't actually wait on anything (the vm then
+  // doesn't try to sleep through idle polling loops).
+  [[nodiscard]] virtual auto can_block() const noexcept -> bool = 0;
+
+  // true if no key can come while the vm runs, so waiting for one has to
+  // stop the run: every run() then parks like run_for() does, see
+  // Exit_Reason::waiting_for_input. wait_key() is never called.
+  [[nodiscard]] virtual auto parks() const noexcept -> bool { return false; }
+
+  // a file descriptor that turns readable when a key arrives (or the input
+  // ends), for hosts that wait on many inputs at once, see Scheduler. -1 if
+  // there is none.
+  [[nodiscard]] virtual auto ready_fd() const noexcept -> int { return -1; }
+};
+
+/*
+ * Keyboard input read by a dedicated thread.
+ *
+ * The thread blocks on the file descriptor and pushes every byte into a
+ * lock-free ring, so polling KBSR or reading a key is a couple of atomic
+ * loads instead of a select() and a getchar() syscall.
+ */
+class Console_Input final : public Input_Source {
+ public:
+  explicit Console_Input(int fd = 0);
+  ~Console_Input() override;
+  Console_Input(const Console_Input &)                     = delete;
+  auto operator=(const Console_Input &) -> Console_Input & = delete;
+
+  [[nodiscard]] auto key_ready(tl::u64 now) -> bool override;
+  [[nodiscard]] auto get_key() -> int override;
+  auto wait_key() -> void override;
+  [[nodiscard]] auto can_block() const noexcept -> bool override {
+    return true;
+  }
+
+  // stops and joins the reader thread, keys already read stay available.
+  auto stop() -> void;
+
+ private:
+  auto read_loop() -> void;
+
+  int fd_;
+  Spsc_Ring<char, 4096> keys_;
+  std::atomic<tl::u32> events_{0};  // bumped on every key and at the end
+  std::atomic<bool> eof_{false};
+  int wake_[2]{-1, -1};  // pipe to get the reader out of poll()
+  std::thread reader_;
+};
+
+/*
+ * Keys from memory, e.g. a whole file read up front, for runs that depend on
+ * neither the terminal nor the clock.
+ *
+ * Key i shows up in KBSR once the vm executed schedule[i] instructions, keys
+ * past the end of the schedule are there right away. GETC/IN never wait,
+ * they take the next key even before its time. Once the keys run out every
+ * key is -1.
+ */
+class Scripted_Input final : public Input_Source {
+ public:
+  explicit Scripted_Input(std::string bytes,
+                          std::vector<tl::u64> schedule = {})
+    : bytes_(std::move(bytes))
+    , schedule_(std::move(schedule)) {}
+
+  [[nodiscard]] auto key_ready(tl::u64 now) -> bool override {
+    return this->next_ >= this->schedule_.size() ||
+           this->schedule_[this->next_] <= now;
+  }
+  [[nodiscard]] auto get_key() -> int override {
+    if (this->next_ == this->bytes_.size()) { return -1; }
+    return static_cast<unsigned char>(this->bytes_[this->next_++]);
+  }
+  auto wait_key() -> void override {}
+  [[nodiscard]] auto can_block() const noexcept -> bool override {
+    return false;
+  }
+
+ private:
+  std::string bytes_;
+  std::vector<tl::u64> schedule_;
+  tl::usize next_{0};
+};
+
+/*
+ * Keys read straight from a file descriptor, e.g. a socket or a pipe, without
+ * a thread of its own.
+ *
+ * key_ready() reads what already arrived without blocking and ready_fd() is
+ * the descriptor itself, so one thread can wait on the inputs of many vms
+ * (see Scheduler) instead of one reader thread each like Console_Input. The
+ * descriptor is not owned.
+ */
+class Fd_Input final : public Input_Source {
+ public:
+  explicit Fd_Input(int fd)
+    : fd_(fd) {}
+
+  [[nodiscard]] auto key_ready(tl::u64 now) -> bool override;
+  [[nodiscard]] auto get_key() -> int override;
+  auto wait_key() -> void override;
+  [[nodiscard]] auto can_block() const noexcept -> bool override {
+    return true;
+  }
+  [[nodiscard]] auto ready_fd() const noexcept -> int override {
+    return this->fd_;
+  }
+
+ private:
+  // reads what there is, false if that is nothing and the input goes on.
+  auto fill(int timeout_ms) -> bool;
+
+  int fd_;
+  std::array<char, 256> buffer_{};
+  tl::usize next_{0};
+  tl::usize size_{0};
+  bool eof_{false};
+};
+
+/*
+ * Keys the host hands over as they come, e.g. from an event loop of its own.
+ *
+ * With nothing queued the guest waits: run() and run_for() stop with
+ * Exit_Reason::waiting_for_input, and the next one continues once more is
+ * pushed. Not thread safe, keys are pushed from the thread that runs the vm.
+ */
+class Queued_Input final : public Input_Source {
+ public:
+  auto push(std::string_view keys) -> void {
+    this->keys_.insert(end(this->keys_), begin(keys), end(keys));
+  }
+  // nothing comes after the keys queued so far.
+  auto close() noexcept -> void { this->closed_ = true; }
+
+  [[nodiscard]] auto key_ready(tl::u64 /*now*/) -> bool override {
+    return !this->keys_.empty() || this->closed_;
+  }
+  [[nodiscard]] auto get_key() -> int override {
+    if (this->keys_.empty()) { return -1; }
+    const auto key = static_cast<unsigned char>(this->keys_.front());
+    this->keys_.pop_front();
+    return key;
+  }
+  auto wait_key() -> void override {}
+  [[nodiscard]] auto can_block() const noexcept -> bool override {
+    return true;
+  }
+  // nothing can push while the vm runs.
+  [[nodiscard]] auto parks() const noexcept -> bool override { return true; }
+
+ private:
+  std::deque<char> keys_;
+  bool closed_{false};
+};
+
+// Stops the console reader from inside a signal handler, so it doesn't keep
+// reading the terminal while it is being restored. async-signal-safe.
+auto interrupt_console_input() noexcept -> void;
+}  // namespace vm
@@ -0,0 +1,543 @@
+#pragma once
+/*
+ * Semantics of every LC-3 instruction, shared by all execution engines.
+ *
+ * These are inline so each engine (see engine_*.cpp) can paste them straight
+ * into its dispatch loop. They only operate on already decoded instructions;
+ * fetching and dispatching is up to the engine.
+ */
+#include <utility>
+
+#include "decoder.hpp"
+#include "native.hpp"
+#include "opcodes.hpp"
+#include "vm.hpp"
+
+namespace vm {
+// calls loop.template operator()<F>() with F equal to features, so each
+// combination gets a loop of its own with the features that are off compiled
+// out. run() never turns profile or budget on without count.
+template <typename Loop>
+inline auto with_features(Features features, Loop &&loop) -> void {
+  const auto traced = [&loop,
+                       features]<bool Count, bool Profile, bool Budget>() {
+    if (features.trace) {
+      loop.template operator()<Features{Count, Profile, true, Budget}>();
+    } else {
+      loop.template operator()<Features{Count, Profile, false, Budget}>();
+    }
+  };
+  const auto counted = [&traced, features]<bool Profile>() {
+    if (features.budget) {
+      traced.template operator()<true, Profile, true>();
+    } else {
+      traced.template operator()<true, Profile, false>();
+    }
+  };
+  if (features.profile) {
+    counted.template operator()<true>();
+  } else if (features.count) {
+    counted.template operator()<false>();
+  } else {
+    traced.template operator()<false, false, false>();
+  }
+}
+
+// the instructions a basic block ends with, the run loops call end_block()
+// after them.
+[[nodiscard]] inline auto ends_basic_block(tl::u8 op) noexcept -> bool {
+  return op == Op_Code::BR || op == Op_Code::JMP || op == Op_Code::JSR ||
+         op == Op_Code::TRAP || op == Op_Code::RTI;
+}
+
+template <Features F>
+inline auto Virtual_Machine::fetch() -> Decoded_Instruction {
+  // load the instruction from the decoded cache, decoding it the first time
+  // the address is executed (or the first time after it was overwritten).
+  // Only the threaded engine runs fused entries.
+  const auto pc = this->register_[Register::PC];
+  auto &cached  = this->decoded_[pc];
+  if (cached.op >= UNDECODED) [[unlikely]] {
+    cached = decode(this->memory_[pc]);
+  }
+
+  this->register_[Register::PC]++;  // increment the memory in PC
+  this->on_fetch<F>(cached);
+
+  // return a copy, a store may invalidate the cached entry while the
+  // instruction is executing.
+  return cached;
+}
+
+template <Features F>
+inline auto Virtual_Machine::on_fetch(
+  [[maybe_unused]] const Decoded_Instruction &instr) -> void {
+  if constexpr (F.count) { ++this->instructions_; }
+  if constexpr (F.trace) { this->trace_begin(instr); }
+  if constexpr (F.profile) {
+    const auto pc = static_cast<tl::u16>(this->register_[Register::PC] - 1);
+    this->profiler_->instruction(pc, instr.op);
+    if (instr.op == Op_Code::TRAP) { this->profiler_->trap(instr.imm); }
+  }
+}
+
+template <Features F>
+inline auto Virtual_Machine::on_executed(
+  [[maybe_unused]] const Decoded_Instruction &instr) -> void {
+  if constexpr (F.profile || F.trace) {
+    // run() backs up over an instruction that stopped for a key, it is
+    // counted and traced once it runs again.
+    if (this->exit_ == Exit_Reason::waiting_for_input ||
+        this->exit_ == Exit_Reason::end_of_input) [[unlikely]] {
+      if constexpr (F.profile) {
+        const auto pc = static_cast<tl::u16>(this->register_[Register::PC] - 1);
+        this->profiler_->uncount(pc, instr.op, instr.imm);
+      }
+      return;
+    }
+  }
+  if constexpr (F.profile) {
+    if (instr.op == Op_Code::JSR) {
+      this->profiler_->call(this->register_[Register::PC],
+                            this->register_[Register::R7]);
+    } else if (instr.op == Op_Code::JMP || instr.op == Op_Code::RTI) {
+      this->profiler_->jump(this->register_[Register::PC]);
+    }
+  }
+  if constexpr (F.trace) { this->trace_end(instr); }
+  this->check_budget<F>();
+}
+
+template <Features F>
+inline auto Virtual_Machine::check_budget() noexcept -> void {
+  if constexpr (F.budget) {
+    // the instruction may have stopped the run already, for a better reason.
+    const auto spent = this->instructions_ >= this->deadline_;
+    if (spent && this->running_) [[unlikely]] {
+      this->stop(Exit_Reason::out_of_budget);
+    }
+  }
+}
+
+inline auto Virtual_Machine::trace_begin(
+  const Decoded_Instruction &instr) noexcept -> void {
+  // PC is already past the instruction. The address of LDI/STI comes from
+  // memory directly, even if the pointer sits in a device's page.
+  const auto pc      = this->register_[Register::PC];
+  auto &record       = this->trace_;
+  record.pc          = static_cast<tl::u16>(pc - 1);
+  record.instruction = this->memory_[record.pc];
+  switch (instr.op) {
+    case Op_Code::LD:
+    case Op_Code::ST:
+      record.address = static_cast<tl::u16>(pc + instr.imm);
+      break;
+    case Op_Code::LDI:
+    case Op_Code::STI:
+      record.address = this->memory_[static_cast<tl::u16>(pc + instr.imm)];
+      break;
+    case Op_Code::LDR:
+    case Op_Code::STR:
+      record.address =
+        static_cast<tl::u16>(this->register_[instr.sr1] + instr.imm);
+      break;
+    default:
+      break;
+  }
+}
+
+inline auto Virtual_Machine::trace_end(const Decoded_Instruction &instr)
+  -> void {
+  auto &record = this->trace_;
+  switch (instr.op) {
+    case Op_Code::LD:
+    case Op_Code::LDR:
+    case Op_Code::LDI:
+      record.flags  = trace_result | trace_load;
+      record.result = this->register_[instr.dr];
+      break;
+    case Op_Code::ST:
+    case Op_Code::STR:
+    case Op_Code::STI:
+      record.flags = trace_store;
+      record.value = this->register_[instr.dr];
+      break;
+    case Op_Code::ADD:
+    case Op_Code::AND:
+    case Op_Code::NOT:
+    case Op_Code::LEA:
+      record.flags  = trace_result;
+      record.result = this->register_[instr.dr];
+      break;
+    case Op_Code::JSR:
+      record.flags  = trace_result;
+      record.result = this->register_[Register::R7];
+      break;
+    case Op_Code::TRAP:
+      record.flags  = trace_result;
+      record.result = this->register_[Register::R0];
+      break;
+    default:
+      record.flags = 0;
+      break;
+  }
+  record.cond = static_cast<tl::u8>(this->condition());
+  this->tracer_->push(record);
+}
+
+inline auto Virtual_Machine::execute(const Decoded_Instruction &instr)
+  -> void {
+  switch (instr.op) {
+    case Op_Code::BR:
+      this->op_br(instr);
+      break;
+    case Op_Code::ADD:
+      this->op_add(instr);
+      break;
+    case Op_Code::LD:
+      this->op_ld(instr);
+      break;
+    case Op_Code::ST:
+      this->op_st(instr);
+      break;
+    case Op_Code::JSR:
+      this->op_jsr(instr);
+      break;
+    case Op_Code::AND:
+      this->op_and(instr);
+      break;
+    case Op_Code::LDR:
+      this->op_ldr(instr);
+      break;
+    case Op_Code::STR:
+      this->op_str(instr);
+      break;
+    case Op_Code::NOT:
+      this->op_not(instr);
+      break;
+    case Op_Code::LDI:
+      this->op_ldi(instr);
+      break;
+    case Op_Code::STI:
+      this->op_sti(instr);
+      break;
+    case Op_Code::JMP:
+      this->op_jmp(instr);
+      break;
+    case Op_Code::LEA:
+      this->op_lea(instr);
+      break;
+    case Op_Code::TRAP:
+      this->op_trap(instr);
+      break;
+    case Op_Code::RTI:
+      this->op_rti(instr);
+      break;
+    // NOLINTNEXTLINE(bugprone-branch-clone)
+    case Op_Code::RES:
+      // unused
+      this->abort();
+      break;
+    default:
+      // bad opcode
+      this->abort();
+      break;
+  }
+}
+
+inline auto Virtual_Machine::op_br(const Decoded_Instruction &instr) noexcept
+  -> void {
+  // dr holds the nzp bits
+  if (instr.dr & this->condition()) {
+    this->register_[Register::PC] += instr.imm;
+  }
+}
+
+inline auto Virtual_Machine::op_add(const Decoded_Instruction &instr) noexcept
+  -> void {
+  // 5th bit in the instructions: immediate mode or register mode
+  // 0 -> register mode
+  // 1 -> immediate mode (reads the value from the instructions)
+  if (instr.imm_mode) {  // immediate mode, imm5 is already extended
+    this->register_[instr.dr] = this->register_[instr.sr1] + instr.imm;
+  } else {  // register mode
+    this->register_[instr.dr] =
+      this->register_[instr.sr1] + this->register_[instr.sr2];
+  }
+
+  // set condition flags
+  this->set_flags(this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_ld(const Decoded_Instruction &instr) -> void {
+  // loads the content of an address
+  const auto mem_location = tl::u16(this->register_[Register::PC] + instr.imm);
+
+  this->register_[instr.dr] = this->read_memory(mem_location);
+  this->set_flags(this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_st(const Decoded_Instruction &instr) -> void {
+  // store register in memory
+  const auto dest = tl::u16(this->register_[Register::PC] + instr.imm);
+  this->write_memory(dest, this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_jsr(const Decoded_Instruction &instr) noexcept
+  -> void {
+  this->register_[Register::R7] = this->register_[Register::PC];
+
+  if (instr.imm_mode) {  // pc_offset11 mode, JSR
+    this->register_[Register::PC] += instr.imm;
+  } else {  // baseR mode, JSRR
+    this->register_[Register::PC] = this->register_[instr.sr1];
+  }
+}
+
+inline auto Virtual_Machine::op_and(const Decoded_Instruction &instr) noexcept
+  -> void {
+  if (instr.imm_mode) {  // immediate mode, imm5 is already extended
+    this->register_[instr.dr] = this->register_[instr.sr1] & instr.imm;
+  } else {  // register mode
+    this->register_[instr.dr] =
+      this->register_[instr.sr1] & this->register_[instr.sr2];
+  }
+
+  // set condition flags
+  this->set_flags(this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_ldr(const Decoded_Instruction &instr) -> void {
+  this->register_[instr.dr] = this->read_memory(
+    static_cast<tl::u16>(this->register_[instr.sr1] + instr.imm));
+  this->set_flags(this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_str(const Decoded_Instruction &instr) -> void {
+  const auto dest =
+    static_cast<tl::u16>(this->register_[instr.sr1] + instr.imm);
+  this->write_memory(dest, this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_not(const Decoded_Instruction &instr) noexcept
+  -> void {
+  this->register_[instr.dr] = ~this->register_[instr.sr1];
+  this->set_flags(this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_ldi(const Decoded_Instruction &instr) -> void {
+  // like LD but the content of the address is another
+  // address. Then it loads the content of the address
+  // of the address.
+  // [addr] -> [addr] -> content
+
+  // location of an address that stores the address of the value to load
+  // into DR.
+  const auto mem_location = tl::u16(this->register_[Register::PC] + instr.imm);
+
+  // We need to read_memory twice. See comment above.
+  this->register_[instr.dr] =
+    this->read_memory(this->read_memory(mem_location));
+
+  this->set_flags(this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_sti(const Decoded_Instruction &instr) -> void {
+  // stores an address of an address that contains an register.
+  const auto dest = tl::u16(this->register_[Register::PC] + instr.imm);
+  this->write_memory(this->read_memory(dest), this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_jmp(const Decoded_Instruction &instr) noexcept
+  -> void {
+  // handles RET too
+  this->register_[Register::PC] = this->register_[instr.sr1];
+}
+
+inline auto Virtual_Machine::op_lea(const Decoded_Instruction &instr) noexcept
+  -> void {
+  // the address itself is stored in the register.
+  // instead of loading the content of the address.
+  this->register_[instr.dr] = this->register_[Register::PC] + instr.imm;
+  this->set_flags(this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::op_trap(const Decoded_Instruction &instr) -> void {
+  this->register_[Register::R7] = this->register_[Register::PC];
+  ++this->effects_;
+  this->trap(instr.imm);
+}
+
+inline auto Virtual_Machine::trap(tl::u16 vector) -> void {
+  // with an OS, only the routines it loaded have a stand in.
+  if (this->os_ && (this->memory_[vector] != this->os_vectors_[vector] ||
+                    !native_trap(vector))) [[unlikely]] {
+    this->os_trap(vector);
+    return;
+  }
+  this->execute_trap(vector);
+}
+
+inline auto Virtual_Machine::op_rti(
+  [[maybe_unused]] const Decoded_Instruction &instr) -> void {
+  // a privilege mode violation, which not even an OS gets to handle here.
+  if (this->psr_ & PSR_USER) {
+    this->abort();
+    return;
+  }
+
+  // PC and PSR off the supervisor stack, then back to the user stack if
+  // that is where the interrupt came from.
+  auto &sp                        = this->register_[Register::R6];
+  this->register_[Register::PC]   = this->read_memory(sp++);
+  const auto psr                  = this->read_memory(sp++);
+  this->psr_                      = psr & (PSR_USER | PSR_PRIORITY);
+  this->register_[Register::COND] = psr & (NEG | ZRO | POS);
+  this->flags_                    = FLAGS_IN_REGISTER;
+  if (this->psr_ & PSR_USER) {
+    this->saved_ssp_ = std::exchange(sp, this->saved_usp_);
+  }
+  ++this->effects_;
+}
+
+// the k of the ADD in a fused entry.
+[[nodiscard]] inline auto fused_imm(const Decoded_Instruction &instr) noexcept
+  -> tl::u16 {
+  return static_cast<tl::u16>(static_cast<tl::i8>(instr.aux));
+}
+
+// fused entries, see Fused_Op. Each does what its instructions would one
+// after the other, PC included. The threaded engine counts them.
+inline auto Virtual_Machine::fused_const(
+  const Decoded_Instruction &instr) noexcept -> void {
+  this->register_[Register::PC] += 2;
+  this->register_[instr.dr] = instr.imm;
+  this->set_flags(instr.imm);
+}
+
+inline auto Virtual_Machine::fused_add_br(
+  const Decoded_Instruction &instr) noexcept -> void {
+  this->register_[Register::PC] += 2;
+  this->register_[instr.dr] = this->register_[instr.sr1] + fused_imm(instr);
+  this->set_flags(this->register_[instr.dr]);
+  if (instr.sr2 & this->condition()) {
+    this->register_[Register::PC] += instr.imm;
+  }
+}
+
+// the address is not in a device's page, the engine checks.
+inline auto Virtual_Machine::fused_rmw(const Decoded_Instruction &instr)
+  -> void {
+  this->register_[Register::PC] += 3;
+  const auto addr =
+    static_cast<tl::u16>(this->register_[instr.sr1] + instr.imm);
+  this->register_[instr.dr] = this->memory_[addr] + fused_imm(instr);
+  this->set_flags(this->register_[instr.dr]);
+  this->write_memory(addr, this->register_[instr.dr]);
+}
+
+inline auto Virtual_Machine::fused_lea_puts(const Decoded_Instruction &instr)
+  -> void {
+  ++this->register_[Register::PC];
+  this->op_lea(instr);
+  ++this->register_[Register::PC];
+  this->register_[Register::R7] = this->register_[Register::PC];
+  ++this->effects_;
+  this->trap(Trap::puts);
+}
+
+inline auto Virtual_Machine::set_flags(tl::u16 result) noexcept -> void {
+  this->flags_ = result;
+}
+
+inline auto Virtual_Machine::condition() const noexcept -> tl::u16 {
+  // without branches, BR has one of its own already: Z if 0, N if the
+  // left-most bit is set, P for 1 to 0x7fff. FLAGS_IN_REGISTER is none of
+  // them.
+  const auto result = this->flags_;
+  // NOLINTBEGIN(hicpp-signed-bitwise)
+  const auto lazy = static_cast<tl::u16>(
+    (result == 0 ? Condition_Flag::ZRO : 0) |
+    ((result >> 13) & Condition_Flag::NEG) |
+    (result - 1 < 0x7fff ? Condition_Flag::POS : 0));
+  // NOLINTEND(hicpp-signed-bitwise)
+  return result == FLAGS_IN_REGISTER ? this->register_[Register::COND] : lazy;
+}
+
+inline auto Virtual_Machine::sync_flags() noexcept -> void {
+  this->register_[Register::COND] = this->condition();
+  this->flags_                    = FLAGS_IN_REGISTER;
+}
+
+inline auto Virtual_Machine::read_memory(tl::u16 addr) -> tl::u16 {
+  // one check for every load, the devices are only looked up in their pages.
+  if (this->io_pages_[addr >> PAGE_BITS]) [[unlikely]] {
+    return this->read_io(addr);
+  }
+  return this->memory_[addr];
+}
+
+inline auto Virtual_Machine::write_memory(tl::u16 addr, tl::u16 content)
+  -> void {
+  if (this->io_pages_[addr >> PAGE_BITS]) [[unlikely]] {
+    this->write_io(addr, content);
+    return;
+  }
+  this->memory_[addr] = content;
+  ++this->effects_;
+
+  // self-modifying code: the next execution of addr must decode the new word.
+  this->invalidate(addr);
+}
+
+inline auto Virtual_Machine::invalidate(tl::u16 addr) noexcept -> void {
+  this->decoded_[addr].op = UNDECODED;
+  // and the fused entries addr could be part of.
+  for (auto back = 1; back < FUSED_LENGTH; ++back) {
+    auto &entry = this->decoded_[static_cast<tl::u16>(addr - back)];
+    if (entry.op > UNDECODED) { entry.op = UNDECODED; }
+  }
+  if (this->jit_) [[unlikely]] { this->jit_->invalidate(addr); }
+  if (this->native_) [[unlikely]] { this->native_->invalidate(addr); }
+}
+
+inline auto Virtual_Machine::code_window(tl::u16 pc) const noexcept
+  -> std::array<tl::u16, LOOP_LENGTH> {
+  auto words = std::array<tl::u16, LOOP_LENGTH>{};
+  for (auto i = 0; i < LOOP_LENGTH; ++i) {
+    words.at(i) = this->memory_[static_cast<tl::u16>(pc + i)];
+  }
+  return words;
+}
+
+inline auto Virtual_Machine::key_ready() -> bool {
+  return this->input_ && this->input_->key_ready(this->instructions_);
+}
+
+inline auto Virtual_Machine::get_key() -> int {
+  // run_for() doesn't wait, the instruction runs again once there is a key.
+  if (this->parking_ && this->input_ && this->input_->can_block() &&
+      !this->key_ready()) [[unlikely]] {
+    this->stop(Exit_Reason::waiting_for_input);
+    return -1;
+  }
+  const auto key = this->input_ ? this->input_->get_key() : -1;
+  if (key < 0 && this->stop_on_eof_) [[unlikely]] {
+    this->stop(Exit_Reason::end_of_input);
+  }
+  return key;
+}
+
+inline auto Virtual_Machine::end_block() -> void {
+  if (this->events_) [[unlikely]] { this->poll_events(); }
+}
+
+inline auto Virtual_Machine::stop(Exit_Reason reason) noexcept -> void {
+  this->running_ = false;
+  this->exit_    = reason;
+
+  // the threaded engine doesn't check running_ after every instruction, but
+  // it does on a decoded cache miss.
+  this->decoded_[this->register_[Register::PC]].op = UNDECODED;
+}
+}  // namespace vm
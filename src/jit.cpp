@@ -0,0 +1,802 @@
+#include "jit.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstring>  // std::memcpy
+
+#include "decoder.hpp"
+#include "instructions.hpp"
+#include "opcodes.hpp"
+#include "vm.hpp"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+  #define LC3_JIT_X64 1
+  #include <sys/mman.h>
+#else
+  #define LC3_JIT_X64 0
+#endif
+
+namespace vm {
+namespace {
+// longest block we compile, in LC-3 instructions.
+constexpr auto MAX_BLOCK = 64;
+
+// size of the executable buffer, it is flushed when full.
+constexpr auto CODE_SIZE = tl::usize{4} << 20;
+
+// set by read_helper() in its result when the vm stopped.
+constexpr auto STOPPED = tl::u32{1} << 16;
+
+// marks a block start that can't be compiled, so it isn't retried.
+constexpr auto NEVER = tl::u16{0xFFFF};
+
+[[nodiscard]] auto ends_block(tl::u8 op) noexcept -> bool {
+  return op == Op_Code::BR || op == Op_Code::JMP || op == Op_Code::JSR;
+}
+
+[[nodiscard]] auto compilable(tl::u8 op) noexcept -> bool {
+  return op != Op_Code::TRAP && op != Op_Code::RTI && op != Op_Code::RES;
+}
+
+// object and function pointers can't be cast into each other portably.
+template <typename T>
+[[nodiscard]] auto address_of(T fn) noexcept -> tl::u64 {
+  static_assert(sizeof(fn) == sizeof(tl::u64));
+  auto address = tl::u64{};
+  std::memcpy(&address, &fn, sizeof(address));
+  return address;
+}
+}  // namespace
+
+#if LC3_JIT_X64
+namespace {
+// x86-64 registers, by encoding.
+enum Host_Reg : tl::u8 {
+  rax = 0,
+  rcx,
+  rdx,
+  rbx,
+  rsp,
+  rbp,
+  rsi,
+  rdi,
+  r8,
+  r9,
+  r10,
+  r11,
+  r12,
+  r13,
+  r14,
+  r15,
+};
+
+// condition codes for jcc/cmovcc.
+enum Host_Cond : tl::u8 {
+  cc_b  = 0x2,
+  cc_ae = 0x3,
+  cc_e  = 0x4,
+  cc_ne = 0x5,
+  cc_be = 0x6,
+  cc_s  = 0x8,
+};
+
+// where each LC-3 register lives while a block runs. R0-R3 are caller saved
+// on the host, so they are spilled around helper calls.
+constexpr auto guest = std::array<tl::u8, 8>{r8, r9, r10, r11, r12, r13, r14, r15};
+
+// rbx: LC-3 register file (the vm's register_), rbp: LC-3 memory,
+// [rsp]: the Virtual_Machine, for helper calls.
+constexpr auto REGS = rbx;
+constexpr auto MEM  = rbp;
+
+// Just enough of an x86-64 assembler for the blocks below. All LC-3 values
+// are kept zero extended in 32 bit host registers.
+class Emitter {
+ public:
+  using Label = tl::usize;
+
+  [[nodiscard]] auto code() const noexcept -> const std::vector<tl::u8> & {
+    return this->code_;
+  }
+
+  // op r/m32, r32 (mov 0x89, add 0x01, and 0x21)
+  auto rr(tl::u8 opcode, tl::u8 dst, tl::u8 src) -> void {
+    this->rex(false, src, 0, dst);
+    this->byte(opcode);
+    this->modrm(3, src, dst);
+  }
+
+  auto mov(tl::u8 dst, tl::u8 src) -> void { this->rr(0x89, dst, src); }
+
+  // mov r64, r64
+  auto mov64(tl::u8 dst, tl::u8 src) -> void {
+    this->rex(true, src, 0, dst);
+    this->byte(0x89);
+    this->modrm(3, src, dst);
+  }
+  // mov r64, imm64
+  auto mov64_imm(tl::u8 dst, tl::u64 imm) -> void {
+    this->rex(true, 0, 0, dst);
+    this->byte(static_cast<tl::u8>(0xB8 + (dst & 7)));
+    for (auto i = 0; i < 8; ++i) {
+      this->byte(static_cast<tl::u8>(imm >> (8 * i)));
+    }
+  }
+
+  // cmp byte [base], imm8
+  auto cmp_mem8_imm(tl::u8 base, tl::u8 imm) -> void {
+    this->rex(false, 0, 0, base);
+    this->byte(0x80);
+    this->mem(7, base, 0);
+    this->byte(imm);
+  }
+
+  // add qword [base], imm32 (sign extended)
+  auto add_mem64_imm(tl::u8 base, tl::i32 imm) -> void {
+    this->rex(true, 0, 0, base);
+    this->byte(0x81);
+    this->mem(0, base, 0);
+    this->u32(static_cast<tl::u32>(imm));
+  }
+
+  auto add(tl::u8 dst, tl::u8 src) -> void { this->rr(0x01, dst, src); }
+  auto and_(tl::u8 dst, tl::u8 src) -> void { this->rr(0x21, dst, src); }
+
+  // op r/m32, imm32 (add /0, and /4, cmp /7)
+  auto ri(tl::u8 ext, tl::u8 dst, tl::u32 imm) -> void {
+    this->rex(false, 0, 0, dst);
+    this->byte(0x81);
+    this->modrm(3, ext, dst);
+    this->u32(imm);
+  }
+
+  auto add_imm(tl::u8 dst, tl::u32 imm) -> void { this->ri(0, dst, imm); }
+  auto and_imm(tl::u8 dst, tl::u32 imm) -> void { this->ri(4, dst, imm); }
+  auto cmp_imm(tl::u8 dst, tl::u32 imm) -> void { this->ri(7, dst, imm); }
+
+  auto not_(tl::u8 dst) -> void {
+    this->rex(false, 0, 0, dst);
+    this->byte(0xF7);
+    this->modrm(3, 2, dst);
+  }
+
+  auto mov_imm(tl::u8 dst, tl::u32 imm) -> void {
+    this->rex(false, 0, 0, dst);
+    this->byte(0xB8 + (dst & 7));
+    this->u32(imm);
+  }
+
+  // movzx r32, r16: truncates a result back to 16 bits.
+  auto movzx(tl::u8 dst, tl::u8 src) -> void {
+    this->rex(false, dst, 0, src);
+    this->byte(0x0F);
+    this->byte(0xB7);
+    this->modrm(3, dst, src);
+  }
+
+  // lea r32, [base + disp]
+  auto lea(tl::u8 dst, tl::u8 base, tl::i32 disp) -> void {
+    this->rex(false, dst, 0, base);
+    this->byte(0x8D);
+    this->mem(dst, base, disp);
+  }
+
+  // movzx r32, word [base + disp]
+  auto load16(tl::u8 dst, tl::u8 base, tl::i32 disp) -> void {
+    this->rex(false, dst, 0, base);
+    this->byte(0x0F);
+    this->byte(0xB7);
+    this->mem(dst, base, disp);
+  }
+
+  // movzx r32, word [base + index * 2]
+  auto load16_indexed(tl::u8 dst, tl::u8 base, tl::u8 index) -> void {
+    this->rex(false, dst, index, base);
+    this->byte(0x0F);
+    this->byte(0xB7);
+    this->modrm(2, dst, rsp);  // SIB follows
+    this->byte(static_cast<tl::u8>((1 << 6) | ((index & 7) << 3) | (base & 7)));
+    this->u32(0);
+  }
+
+  // mov word [base + disp], r16
+  auto store16(tl::u8 base, tl::i32 disp, tl::u8 src) -> void {
+    this->byte(0x66);
+    this->rex(false, src, 0, base);
+    this->byte(0x89);
+    this->mem(src, base, disp);
+  }
+
+  // mov word [base + disp], imm16
+  auto store16_imm(tl::u8 base, tl::i32 disp, tl::u16 imm) -> void {
+    this->byte(0x66);
+    this->rex(false, 0, 0, base);
+    this->byte(0xC7);
+    this->mem(0, base, disp);
+    this->byte(static_cast<tl::u8>(imm));
+    this->byte(static_cast<tl::u8>(imm >> 8));
+  }
+
+  // test r16, r16: sets SF from bit 15 and ZF.
+  auto test16(tl::u8 reg) -> void {
+    this->byte(0x66);
+    this->rr(0x85, reg, reg);
+  }
+
+  // test r32, r32
+  auto test(tl::u8 reg) -> void { this->rr(0x85, reg, reg); }
+
+  // test r32, imm32
+  auto test_imm(tl::u8 reg, tl::u32 imm) -> void {
+    this->rex(false, 0, 0, reg);
+    this->byte(0xF7);
+    this->modrm(3, 0, reg);
+    this->u32(imm);
+  }
+
+  // test cl, imm8
+  auto test_cl(tl::u8 imm) -> void {
+    this->byte(0xF6);
+    this->modrm(3, 0, rcx);
+    this->byte(imm);
+  }
+
+  auto cmov(Host_Cond cond, tl::u8 dst, tl::u8 src) -> void {
+    this->rex(false, dst, 0, src);
+    this->byte(0x0F);
+    this->byte(0x40 + cond);
+    this->modrm(3, dst, src);
+  }
+
+  auto push(tl::u8 reg) -> void {
+    this->rex(false, 0, 0, reg);
+    this->byte(0x50 + (reg & 7));
+  }
+
+  auto pop(tl::u8 reg) -> void {
+    this->rex(false, 0, 0, reg);
+    this->byte(0x58 + (reg & 7));
+  }
+
+  // mov rdi, [rsp]
+  auto load_vm_arg() -> void {
+    for (const auto b : {0x48, 0x8B, 0x3C, 0x24}) {
+      this->byte(static_cast<tl::u8>(b));
+    }
+  }
+
+  // mov rax, address; call rax
+  auto call(tl::u64 address) -> void {
+    this->byte(0x48);
+    this->byte(0xB8);
+    for (auto i = 0; i < 8; ++i) {
+      this->byte(static_cast<tl::u8>(address >> (8 * i)));
+    }
+    this->byte(0xFF);
+    this->byte(0xD0);
+  }
+
+  auto ret() -> void { this->byte(0xC3); }
+
+  [[nodiscard]] auto new_label() -> Label {
+    this->labels_.push_back(UNBOUND);
+    return this->labels_.size() - 1;
+  }
+
+  auto bind(Label label) -> void { this->labels_[label] = this->code_.size(); }
+
+  auto jmp(Label label) -> void {
+    this->byte(0xE9);
+    this->fixup(label);
+  }
+
+  auto jcc(Host_Cond cond, Label label) -> void {
+    this->byte(0x0F);
+    this->byte(0x80 + cond);
+    this->fixup(label);
+  }
+
+  // resolves every jump, must be called once after the last instruction.
+  auto finish() -> void {
+    for (const auto &[at, label] : this->fixups_) {
+      const auto rel = static_cast<tl::i32>(this->labels_[label] - (at + 4));
+      std::memcpy(&this->code_[at], &rel, sizeof(rel));
+    }
+  }
+
+ private:
+  static constexpr auto UNBOUND = ~tl::usize{0};
+
+  auto byte(tl::u8 b) -> void { this->code_.push_back(b); }
+
+  auto u32(tl::u32 v) -> void {
+    for (auto i = 0; i < 4; ++i) {
+      this->byte(static_cast<tl::u8>(v >> (8 * i)));
+    }
+  }
+
+  auto rex(bool w, tl::u8 reg, tl::u8 index, tl::u8 base) -> void {
+    const auto rex = static_cast<tl::u8>(0x40 | (w << 3) | ((reg >> 3) << 2) |
+                                         ((index >> 3) << 1) | (base >> 3));
+    if (rex != 0x40) { this->byte(rex); }
+  }
+
+  auto modrm(tl::u8 mod, tl::u8 reg, tl::u8 rm) -> void {
+    this->byte(static_cast<tl::u8>((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+  }
+
+  // [base + disp32]
+  auto mem(tl::u8 reg, tl::u8 base, tl::i32 disp) -> void {
+    this->modrm(2, reg, base);
+    if ((base & 7) == rsp) { this->byte(0x24); }  // rsp/r12 need a SIB
+    this->u32(static_cast<tl::u32>(disp));
+  }
+
+  auto fixup(Label label) -> void {
+    this->fixups_.emplace_back(this->code_.size(), label);
+    this->u32(0);
+  }
+
+  std::vector<tl::u8> code_;
+  std::vector<tl::usize> labels_;
+  std::vector<std::pair<tl::usize, Label>> fixups_;
+};
+}  // namespace
+
+auto Jit::read_helper(Virtual_Machine *vm, tl::u32 addr) -> tl::u32 {
+  const auto value = vm->read_memory(static_cast<tl::u16>(addr));
+  return vm->running_ ? value : (value | STOPPED);
+}
+
+auto Jit::write_helper(Virtual_Machine *vm, tl::u32 addr, tl::u32 value)
+  -> tl::u32 {
+  vm->write_memory(static_cast<tl::u16>(addr), static_cast<tl::u16>(value));
+  return vm->jit_->take_invalidated() || !vm->running_ ? 1 : 0;
+}
+
+namespace {
+// Translates one block, instruction by instruction.
+class Block_Compiler {
+ public:
+  Block_Compiler(tl::u16 start,
+                 const std::vector<Decoded_Instruction> &body,
+                 const std::bitset<PAGES> &io_pages,
+                 tl::u64 *instructions,
+                 const bool *events)
+    : start_(start)
+    , body_(body)
+    , io_pages_(io_pages)
+    , instructions_(address_of(instructions))
+    , events_(address_of(events)) {}
+
+  auto compile() -> std::vector<tl::u8> {
+    auto &a = this->a_;
+
+    // prologue: save what we use that the caller expects kept, the vm
+    // pointer goes last and keeps the stack 16 byte aligned for calls.
+    for (const auto reg : {rbx, rbp, r12, r13, r14, r15, rdi}) { a.push(reg); }
+    a.mov64(REGS, rsi);
+    a.mov64(MEM, rdx);
+    this->exit_ = a.new_label();
+    for (auto r = 0; r < 8; ++r) { a.load16(guest[r], REGS, r * 2); }
+
+    const auto loop = a.new_label();
+    a.bind(loop);
+
+    auto pc = this->start_;
+    for (const auto &instr : this->body_) {
+      ++pc;
+      ++this->current_;
+      this->instruction(instr, pc, loop);
+    }
+
+    // fell off the end (max length, or stopped before a TRAP).
+    if (!ends_block(this->body_.back().op)) { this->exit_to(pc); }
+
+    // epilogue, PC is already stored.
+    a.bind(this->exit_);
+    for (auto r = 0; r < 8; ++r) { a.store16(REGS, r * 2, guest[r]); }
+    for (const auto reg : {rdi, r15, r14, r13, r12, rbp, rbx}) { a.pop(reg); }
+    a.ret();
+
+    a.finish();
+    return a.code();
+  }
+
+ private:
+  // pc is the address after instr, like the interpreter's PC at that point.
+  auto instruction(const Decoded_Instruction &instr,
+                   tl::u16 pc,
+                   Emitter::Label loop) -> void {
+    auto &a         = this->a_;
+    const auto dst  = guest[instr.dr];
+    const auto src1 = guest[instr.sr1];
+    const auto addr = static_cast<tl::u16>(pc + instr.imm);
+
+    switch (instr.op) {
+      case Op_Code::ADD:
+        a.mov(rax, src1);
+        if (instr.imm_mode) {
+          a.add_imm(rax, instr.imm);
+        } else {
+          a.add(rax, guest[instr.sr2]);
+        }
+        a.movzx(dst, rax);
+        this->flags_ = instr.dr;
+        break;
+      case Op_Code::AND:
+        a.mov(rax, src1);
+        if (instr.imm_mode) {
+          a.and_imm(rax, instr.imm);
+        } else {
+          a.and_(rax, guest[instr.sr2]);
+        }
+        a.mov(dst, rax);
+        this->flags_ = instr.dr;
+        break;
+      case Op_Code::NOT:
+        a.mov(rax, src1);
+        a.not_(rax);
+        a.movzx(dst, rax);
+        this->flags_ = instr.dr;
+        break;
+      case Op_Code::LEA:
+        a.mov_imm(dst, addr);
+        this->flags_ = instr.dr;
+        break;
+      case Op_Code::LD:
+        this->read_at(addr, pc);
+        a.mov(dst, rax);
+        this->flags_ = instr.dr;
+        break;
+      case Op_Code::LDI:
+        this->read_at(addr, pc);
+        a.mov(rcx, rax);
+        this->read(rcx, pc);
+        a.mov(dst, rax);
+        this->flags_ = instr.dr;
+        break;
+      case Op_Code::LDR:
+        a.lea(rcx, src1, static_cast<tl::i16>(instr.imm));
+        a.movzx(rcx, rcx);
+        this->read(rcx, pc);
+        a.mov(dst, rax);
+        this->flags_ = instr.dr;
+        break;
+      case Op_Code::ST:
+        a.mov_imm(rcx, addr);
+        this->write(rcx, dst, pc);
+        break;
+      case Op_Code::STI:
+        this->read_at(addr, pc);
+        a.mov(rcx, rax);
+        this->write(rcx, dst, pc);
+        break;
+      case Op_Code::STR:
+        a.lea(rcx, src1, static_cast<tl::i16>(instr.imm));
+        a.movzx(rcx, rcx);
+        this->write(rcx, dst, pc);
+        break;
+      case Op_Code::BR: {
+        const auto target = static_cast<tl::u16>(pc + instr.imm);
+        // dr holds the nzp bits
+        if (instr.dr == 0) {  // never taken
+          this->exit_to(pc);
+          break;
+        }
+        this->cond_to_rcx();
+        const auto taken = a.new_label();
+        a.test_cl(instr.dr);
+        a.jcc(cc_ne, taken);
+        this->exit_to(pc);
+        a.bind(taken);
+        if (target == this->start_) {
+          // tight loop, stay in compiled code unless a device may
+          // interrupt.
+          const auto out = a.new_label();
+          a.mov64_imm(rax, this->events_);
+          a.cmp_mem8_imm(rax, 0);
+          a.jcc(cc_ne, out);
+          this->count(this->current_);
+          a.jmp(loop);
+          a.bind(out);
+          this->exit_to(target);
+        } else {
+          this->exit_to(target);
+        }
+        break;
+      }
+      case Op_Code::JMP:
+        this->store_flags();
+        a.mov(rax, src1);
+        this->exit_to_rax();
+        break;
+      case Op_Code::JSR:
+        // R7 is overwritten, the flags may come from it.
+        this->store_flags();
+        a.mov_imm(guest[Register::R7], pc);
+        if (instr.imm_mode) {
+          this->exit_to(static_cast<tl::u16>(pc + instr.imm));
+        } else {
+          a.mov(rax, src1);
+          this->exit_to_rax();
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  // eax = memory[address], the address is known while compiling.
+  auto read_at(tl::u16 address, tl::u16 pc) -> void {
+    auto &a = this->a_;
+    a.mov_imm(rcx, address);
+    if (this->io_pages_[address >> PAGE_BITS]) {
+      this->read_io(rcx, pc);
+    } else {
+      a.load16(rax, MEM, address * 2);
+    }
+  }
+
+  // eax = memory[addr], through read_memory() if addr is in a device page.
+  auto read(tl::u8 addr, tl::u16 pc) -> void {
+    auto &a         = this->a_;
+    const auto io   = a.new_label();
+    const auto done = a.new_label();
+
+    // one check per run of device pages, usually just the one at the top.
+    for (auto page = 0; page < PAGES; ++page) {
+      if (!this->io_pages_[page]) { continue; }
+      const auto first = page;
+      while (page + 1 < PAGES && this->io_pages_[page + 1]) { ++page; }
+
+      a.cmp_imm(addr, static_cast<tl::u32>(first << PAGE_BITS));
+      if (page == PAGES - 1) {
+        a.jcc(cc_ae, io);
+      } else {
+        const auto next = a.new_label();
+        a.jcc(cc_b, next);
+        a.cmp_imm(addr, static_cast<tl::u32>(((page + 1) << PAGE_BITS) - 1));
+        a.jcc(cc_be, io);
+        a.bind(next);
+      }
+    }
+
+    a.load16_indexed(rax, MEM, addr);
+    a.jmp(done);
+    a.bind(io);
+    this->read_io(addr, pc);
+    a.bind(done);
+  }
+
+  // eax = read_memory(addr). The register file is made complete around the
+  // call: the keyboard looks at it to tell when the guest is idle, and may
+  // advance counters in it.
+  auto read_io(tl::u8 addr, tl::u16 pc) -> void {
+    auto &a = this->a_;
+    a.mov(rsi, addr);
+    this->store_flags();
+    for (auto r = 4; r < 8; ++r) { a.store16(REGS, r * 2, guest[r]); }
+    a.store16_imm(REGS, Register::PC * 2, pc);
+    this->call_helper(address_of(&Jit::read_helper), rsi, rax);
+    for (auto r = 4; r < 8; ++r) { a.load16(guest[r], REGS, r * 2); }
+
+    // the run is over, leave without finishing the instruction.
+    const auto running = a.new_label();
+    a.test_imm(rax, STOPPED);
+    a.jcc(cc_e, running);
+    this->exit_to(pc);
+    a.bind(running);
+  }
+
+  // write_memory(rcx, value), leaving the block if it overwrote code.
+  auto write(tl::u8 addr, tl::u8 value, tl::u16 pc) -> void {
+    auto &a         = this->a_;
+    const auto done = a.new_label();
+    this->call_helper(address_of(&Jit::write_helper), addr, value);
+    a.test(rax);
+    a.jcc(cc_e, done);
+    this->exit_to(pc);
+    a.bind(done);
+  }
+
+  auto call_helper(tl::u64 fn, tl::u8 addr, tl::u8 value) -> void {
+    auto &a = this->a_;
+    // the instruction counter is exact while the helper runs, then goes
+    // back to counting at the block's exits.
+    this->count(this->current_);
+    a.mov(rsi, addr);
+    a.mov(rdx, value);
+    for (auto r = 0; r < 4; ++r) { a.store16(REGS, r * 2, guest[r]); }
+    a.load_vm_arg();
+    a.call(fn);
+    this->count(-this->current_);
+    for (auto r = 0; r < 4; ++r) { a.load16(guest[r], REGS, r * 2); }
+  }
+
+  // adds n to the vm's instruction counter, clobbers rdx.
+  auto count(tl::i32 n) -> void {
+    if (n == 0 || this->instructions_ == 0) { return; }
+    this->a_.mov64_imm(rdx, this->instructions_);
+    this->a_.add_mem64_imm(rdx, n);
+  }
+
+  // cl = COND
+  auto cond_to_rcx() -> void {
+    auto &a = this->a_;
+    if (this->flags_ < 0) {
+      a.load16(rcx, REGS, Register::COND * 2);
+      return;
+    }
+
+    // same as condition(): Z if 0, N if bit 15 is set, P otherwise.
+    a.test16(guest[this->flags_]);
+    a.mov_imm(rcx, Condition_Flag::POS);
+    a.mov_imm(rdx, Condition_Flag::NEG);
+    a.cmov(cc_s, rcx, rdx);
+    a.mov_imm(rdx, Condition_Flag::ZRO);
+    a.cmov(cc_e, rcx, rdx);
+    a.store16(REGS, Register::COND * 2, rcx);
+  }
+
+  // makes sure COND in the register file is up to date.
+  auto store_flags() -> void {
+    if (this->flags_ >= 0) { this->cond_to_rcx(); }
+  }
+
+  // the instruction being compiled is the last one that ran.
+  auto exit_to(tl::u16 pc) -> void {
+    this->count(this->current_);
+    this->store_flags();
+    this->a_.store16_imm(REGS, Register::PC * 2, pc);
+    this->a_.jmp(this->exit_);
+  }
+
+  auto exit_to_rax() -> void {
+    this->count(this->current_);
+    this->a_.store16(REGS, Register::PC * 2, rax);
+    this->a_.jmp(this->exit_);
+  }
+
+  Emitter a_;
+  Emitter::Label exit_{};
+  tl::u16 start_;
+  const std::vector<Decoded_Instruction> &body_;
+  const std::bitset<PAGES> &io_pages_;
+  // register that set the flags last in this block, -1 if COND in the
+  // register file is still current.
+  int flags_{-1};
+  // where the vm counts instructions, blocks add how many of theirs ran
+  // whenever they leave, loop or call out. 0 when counting is off.
+  tl::u64 instructions_;
+  // instructions of the block up to the one being compiled.
+  tl::i32 current_{0};
+  // the vm's events_, see Virtual_Machine::poll_events().
+  tl::u64 events_;
+};
+}  // namespace
+
+auto Jit::supported() noexcept -> bool { return true; }
+
+Jit::Jit(tl::u32 threshold)
+  : threshold_(std::min<tl::u32>(threshold, NEVER - 1))
+  , blocks_(LAS)
+  , block_end_(LAS)
+  , covered_(LAS)
+  , heat_(LAS) {
+  void *code = mmap(nullptr,
+                    CODE_SIZE,
+                    PROT_READ | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+  if (code != MAP_FAILED) {
+    this->code_      = static_cast<tl::u8 *>(code);
+    this->code_size_ = CODE_SIZE;
+  }
+}
+
+Jit::~Jit() {
+  if (this->code_) { munmap(this->code_, this->code_size_); }
+}
+
+auto Jit::compile(Virtual_Machine &vm, tl::u16 pc) -> bool {
+  // collect the block
+  auto body = std::vector<Decoded_Instruction>();
+  auto end  = pc;
+  for (auto addr = tl::u32{pc};
+       body.size() < MAX_BLOCK && !vm.io_pages_[addr >> PAGE_BITS];
+       ++addr) {
+    const auto instr = decode(vm.memory_[addr]);
+    if (!compilable(instr.op)) { break; }
+    body.push_back(instr);
+    end = static_cast<tl::u16>(addr);
+    if (ends_block(instr.op)) { break; }
+  }
+
+  if (body.empty() || !this->code_) {
+    this->heat_[pc] = NEVER;
+    return false;
+  }
+
+  const auto code =
+    Block_Compiler(pc,
+                   body,
+                   vm.io_pages_,
+                   vm.active_.count ? &vm.instructions_ : nullptr,
+                   &vm.events_)
+      .compile();
+  if (this->code_used_ + code.size() > this->code_size_) { this->flush(); }
+  if (code.size() > this->code_size_) {
+    this->heat_[pc] = NEVER;
+    return false;
+  }
+
+  // W^X: the buffer is only writable while a block is copied in.
+  auto *at = this->code_ + this->code_used_;
+  mprotect(this->code_, this->code_size_, PROT_READ | PROT_WRITE);
+  std::memcpy(at, code.data(), code.size());
+  mprotect(this->code_, this->code_size_, PROT_READ | PROT_EXEC);
+  this->code_used_ += (code.size() + 15) & ~tl::usize{15};
+
+  std::memcpy(&this->blocks_[pc], &at, sizeof(at));
+  this->block_end_[pc] = end;
+  for (auto addr = tl::u32{pc}; addr <= end; ++addr) { this->covered_[addr] = 1; }
+  return true;
+}
+#else
+auto Jit::supported() noexcept -> bool { return false; }
+
+Jit::Jit(tl::u32 threshold)
+  : threshold_(threshold)
+  , blocks_(LAS)
+  , block_end_(LAS)
+  , covered_(LAS)
+  , heat_(LAS) {}
+
+Jit::~Jit() = default;
+
+auto Jit::compile(Virtual_Machine &, tl::u16 pc) -> bool {
+  this->heat_[pc] = NEVER;
+  return false;
+}
+#endif
+
+auto Jit::hot(tl::u16 pc) noexcept -> bool {
+  auto &heat = this->heat_[pc];
+  if (heat == NEVER) { return false; }
+  return ++heat >= this->threshold_;
+}
+
+auto Jit::invalidate(tl::u16 addr) noexcept -> void {
+  // a block that couldn't be compiled may be compilable now.
+  if (this->heat_[addr] == NEVER) { this->heat_[addr] = 0; }
+
+  if (!this->covered_[addr]) { return; }
+  this->covered_[addr] = 0;
+
+  // a block covering addr starts at most MAX_BLOCK - 1 words before it.
+  const auto first = std::max(0, addr - (MAX_BLOCK - 1));
+  for (auto start = first; start <= addr; ++start) {
+    if (this->blocks_[start] && this->block_end_[start] >= addr) {
+      this->blocks_[start] = nullptr;
+      this->heat_[start]   = 0;
+      this->invalidated_   = true;
+    }
+  }
+}
+
+auto Jit::take_invalidated() noexcept -> bool {
+  const auto invalidated = this->invalidated_;
+  this->invalidated_     = false;
+  return invalidated;
+}
+
+auto Jit::flush() noexcept -> void {
+  std::ranges::fill(this->blocks_, nullptr);
+  std::ranges::fill(this->covered_, tl::u8{0});
+  std::ranges::fill(this->heat_, tl::u16{0});
+  this->code_used_ = 0;
+}
+}  // namespace vm
@@ -0,0 +1,89 @@
+#pragma once
+#include <vector>
+
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+class Virtual_Machine;
+
+// how many times a basic block has to be entered before it gets compiled.
+static constexpr auto JIT_THRESHOLD = 64;
+
+/*
+ * Basic block compiler from LC-3 to x86-64, used by Engine::jit.
+ *
+ * The engine interprets code until the block starting at some PC has been
+ * entered JIT_THRESHOLD times, then compiles it. A block runs up to (and
+ * including) the first BR, JMP or JSR. It stops right before a TRAP, RTI or
+ * RES so those always go through the interpreter.
+ *
+ * Compiled code keeps R0-R7 in r8-r15. Stores always call back into
+ * write_memory(), so the decoded cache and the compiled blocks are
+ * invalidated the same way as in the interpreter. Loads are inline unless they
+ * hit a page with devices, then they call read_memory() too. Which pages
+ * those are is baked into the code, attaching a device drops the Jit. Blocks
+ * also bump the vm's instruction counter directly, so a Jit only ever serves
+ * the vm it was created for. A block that loops back to its own start leaves
+ * between trips while a device may interrupt or output waits to be flushed,
+ * see Virtual_Machine::poll_events().
+ *
+ * Only x86-64 with mmap is supported; everywhere else supported() is false
+ * and the engine falls back to the threaded interpreter.
+ */
+class Jit {
+ public:
+  // compiled block: runs from the PC it was compiled for and stores the
+  // next PC (and every register it touched) back into registers.
+  using Block = void (*)(Virtual_Machine *vm,
+                         tl::u16 *registers,
+                         const tl::u16 *memory);
+
+  explicit Jit(tl::u32 threshold = JIT_THRESHOLD);
+  ~Jit();
+  Jit(const Jit &)                     = delete;
+  auto operator=(const Jit &) -> Jit & = delete;
+
+  [[nodiscard]] static auto supported() noexcept -> bool;
+
+  [[nodiscard]] auto lookup(tl::u16 pc) const noexcept -> Block {
+    return this->blocks_[pc];
+  }
+
+  // counts one more entry into the block at pc, true when it should be
+  // compiled.
+  [[nodiscard]] auto hot(tl::u16 pc) noexcept -> bool;
+
+  // compiles the block at pc, false if there is nothing worth compiling
+  // there (e.g. it starts with a TRAP).
+  auto compile(Virtual_Machine &vm, tl::u16 pc) -> bool;
+
+  // memory at addr was written, drop every block that covers it.
+  auto invalidate(tl::u16 addr) noexcept -> void;
+
+  // true (once) if the last invalidate() dropped a compiled block.
+  [[nodiscard]] auto take_invalidated() noexcept -> bool;
+
+  // called from compiled code: loads from device pages and every store.
+  // read_helper() sets bit 16 if the load stopped the vm (end of input).
+  // write_helper() returns non zero if the store overwrote compiled code or
+  // stopped the vm (MCR), so the running block has to stop.
+  static auto read_helper(Virtual_Machine *vm, tl::u32 addr) -> tl::u32;
+  static auto write_helper(Virtual_Machine *vm, tl::u32 addr, tl::u32 value)
+    -> tl::u32;
+
+ private:
+  auto flush() noexcept -> void;
+
+  tl::u32 threshold_;
+  std::vector<Block> blocks_;
+  std::vector<tl::u16> block_end_;  // last address covered by blocks_[pc]
+  std::vector<tl::u8> covered_;     // addresses that may be in some block
+  std::vector<tl::u16> heat_;
+  bool invalidated_{false};
+
+  // executable code buffer, filled front to back.
+  tl::u8 *code_{nullptr};
+  tl::usize code_size_{0};
+  tl::usize code_used_{0};
+};
+}  // namespace vm
@@ -0,0 +1,148 @@
+#include "lc3vm.h"
+
+#include <new>
+#include <span>
+#include <string_view>
+
+#include "input.hpp"
+#include "output.hpp"
+#include "vm.hpp"
+
+namespace {
+// output and diagnostics for a C callback.
+class Callback_Sink final : public vm::Output_Sink {
+ public:
+  Callback_Sink() = default;
+
+  auto set(lc3vm_write callback, void *user) noexcept -> void {
+    this->callback_ = callback;
+    this->user_     = user;
+  }
+  [[nodiscard]] auto is_set() const noexcept -> bool {
+    return this->callback_ != nullptr;
+  }
+
+  auto write(std::string_view bytes) -> void override {
+    if (this->callback_) {
+      this->callback_(this->user_, bytes.data(), bytes.size());
+    }
+  }
+
+ private:
+  lc3vm_write callback_{nullptr};
+  void *user_{nullptr};
+};
+
+[[nodiscard]] auto status(vm::Exit_Reason exit) noexcept -> lc3vm_status {
+  switch (exit) {
+    case vm::Exit_Reason::halted:
+      return LC3VM_HALTED;
+    case vm::Exit_Reason::bad_opcode:
+      return LC3VM_BAD_OPCODE;
+    case vm::Exit_Reason::end_of_input:
+      return LC3VM_END_OF_INPUT;
+    case vm::Exit_Reason::waiting_for_input:
+      return LC3VM_WAITING_FOR_INPUT;
+    case vm::Exit_Reason::out_of_budget:
+      return LC3VM_OUT_OF_BUDGET;
+  }
+  return LC3VM_ERROR;
+}
+
+// nothing C++ throws gets past the C interface.
+template <typename Run>
+[[nodiscard]] auto guarded(Run &&run) noexcept -> lc3vm_status {
+  try {
+    return status(run());
+  } catch (...) {
+    return LC3VM_ERROR;
+  }
+}
+}  // namespace
+
+// the sinks and the input go before the vm, which flushes into them when it
+// is destroyed.
+struct lc3vm {
+  Callback_Sink output;
+  Callback_Sink diagnostics;
+  vm::Queued_Input input;
+  vm::Virtual_Machine vm;
+};
+
+auto lc3vm_create() -> lc3vm * {
+  try {
+    auto *handle = new lc3vm();  // NOLINT(*-owning-memory)
+    handle->vm.output().set_fd(-1);
+    handle->vm.set_input(&handle->input);
+    handle->vm.set_stop_on_eof(true);
+    return handle;
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+auto lc3vm_destroy(lc3vm *vm) -> void {
+  delete vm;  // NOLINT(*-owning-memory)
+}
+
+auto lc3vm_set_output(lc3vm *vm, lc3vm_write write, void *user) -> void {
+  vm->output.set(write, user);
+  vm->vm.output().set_sink(vm->output.is_set() ? &vm->output : nullptr);
+}
+
+auto lc3vm_set_diagnostics(lc3vm *vm, lc3vm_write write, void *user)
+  -> void {
+  vm->diagnostics.set(write, user);
+  vm->vm.set_diagnostics(vm->diagnostics.is_set() ? &vm->diagnostics
+                                                  : nullptr);
+}
+
+auto lc3vm_load(lc3vm *vm, const void *bytes, size_t size) -> int {
+  try {
+    const auto data = std::span(static_cast<const std::byte *>(bytes), size);
+    return vm->vm.load(data) ? 1 : 0;
+  } catch (...) {
+    return 0;
+  }
+}
+
+auto lc3vm_load_file(lc3vm *vm, const char *path) -> int {
+  try {
+    return vm->vm.read_file(path) ? 1 : 0;
+  } catch (...) {
+    return 0;
+  }
+}
+
+auto lc3vm_use_os(lc3vm *vm) -> void { vm->vm.use_os(); }
+
+auto lc3vm_push_keys(lc3vm *vm, const char *keys, size_t count) -> void {
+  vm->input.push(std::string_view(keys, count));
+}
+
+auto lc3vm_close_input(lc3vm *vm) -> void { vm->input.close(); }
+
+auto lc3vm_run(lc3vm *vm) -> lc3vm_status {
+  return guarded([vm] { return vm->vm.run(); });
+}
+
+auto lc3vm_run_for(lc3vm *vm, uint64_t budget) -> lc3vm_status {
+  return guarded([vm, budget] { return vm->vm.run_for(budget); });
+}
+
+auto lc3vm_step(lc3vm *vm) -> lc3vm_status {
+  return guarded([vm] { return vm->vm.step(); });
+}
+
+auto lc3vm_instructions(const lc3vm *vm) -> uint64_t {
+  return vm->vm.instructions();
+}
+
+auto lc3vm_register(const lc3vm *vm, int reg) -> uint16_t {
+  if (reg < 0 || reg >= vm::REG_SIZE) { return 0; }
+  return vm->vm.registers().at(static_cast<tl::usize>(reg));
+}
+
+auto lc3vm_memory(const lc3vm *vm, uint16_t addr) -> uint16_t {
+  return vm->vm.memory()[addr];
+}
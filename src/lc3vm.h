@@ -0,0 +1,81 @@
+#pragma once
+/*
+ * C interface to the lc3vm library, for hosts in other languages or that
+ * want a stable ABI: an opaque handle, plain integers and callbacks. Every
+ * vm is independent of the others, a host can run as many as it likes on
+ * whatever threads it likes, as long as one vm is only used by one thread at
+ * a time.
+ *
+ *   lc3vm *vm = lc3vm_create();
+ *   lc3vm_set_output(vm, write_to_socket, session);
+ *   if (!lc3vm_load(vm, object, object_size)) { ... }
+ *   for (;;) {
+ *     lc3vm_status status = lc3vm_run_for(vm, 100000);
+ *     if (status == LC3VM_WAITING_FOR_INPUT) { wait, then lc3vm_push_keys }
+ *     else if (status != LC3VM_OUT_OF_BUDGET) { break; }
+ *   }
+ *   lc3vm_destroy(vm);
+ *
+ * The C++ interface is Virtual_Machine in vm.hpp.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lc3vm lc3vm;
+
+// why a run returned, see Exit_Reason.
+typedef enum lc3vm_status {
+  LC3VM_HALTED            = 0,
+  LC3VM_BAD_OPCODE        = 1,
+  LC3VM_END_OF_INPUT      = 2,
+  LC3VM_WAITING_FOR_INPUT = 3,
+  LC3VM_OUT_OF_BUDGET     = 4,
+  LC3VM_ERROR             = -1,  // the host's vm couldn't run, e.g. no memory
+} lc3vm_status;
+
+// called with what the guest printed, and with diagnostics.
+typedef void (*lc3vm_write)(void *user, const char *bytes, size_t count);
+
+// NULL if there isn't enough memory. The output is dropped until there is
+// an lc3vm_set_output(), there are no keys until lc3vm_push_keys().
+lc3vm *lc3vm_create(void);
+void lc3vm_destroy(lc3vm *vm);
+
+// write gets called with user whenever output is flushed, NULL drops it.
+void lc3vm_set_output(lc3vm *vm, lc3vm_write write, void *user);
+// where the vm says why something failed (stderr without it).
+void lc3vm_set_diagnostics(lc3vm *vm, lc3vm_write write, void *user);
+
+// an object file or preprocessed image from memory or a file, 0 if it isn't
+// one or doesn't fit.
+int lc3vm_load(lc3vm *vm, const void *bytes, size_t size);
+int lc3vm_load_file(lc3vm *vm, const char *path);
+// what is loaded so far is an operating system, TRAPs go through its vector
+// table from now on, see Virtual_Machine::use_os().
+void lc3vm_use_os(lc3vm *vm);
+
+// keys for the guest, in order. Once closed, reading past them stops the run
+// with LC3VM_END_OF_INPUT.
+void lc3vm_push_keys(lc3vm *vm, const char *keys, size_t count);
+void lc3vm_close_input(lc3vm *vm);
+
+// the whole program, a slice of about budget instructions or a single one.
+// A guest that waits for a key with none pushed stops all of them with
+// LC3VM_WAITING_FOR_INPUT. A run that stopped for input or budget continues
+// where it left off.
+lc3vm_status lc3vm_run(lc3vm *vm);
+lc3vm_status lc3vm_run_for(lc3vm *vm, uint64_t budget);
+lc3vm_status lc3vm_step(lc3vm *vm);
+
+uint64_t lc3vm_instructions(const lc3vm *vm);
+// R0 to R7, then PC and COND.
+uint16_t lc3vm_register(const lc3vm *vm, int reg);
+uint16_t lc3vm_memory(const lc3vm *vm, uint16_t addr);
+
+#ifdef __cplusplus
+}
+#endif
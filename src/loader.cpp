@@ -0,0 +1,309 @@
+#include "loader.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+  #include <immintrin.h>
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include "fmt/format.h"
+#include "memory.hpp"
+#include "utils.hpp"
+#include "vm.hpp"
+
+namespace vm {
+namespace {
+static_assert(sizeof(Image_Header) == 24, "no padding");
+
+constexpr auto IMAGE_SIZE = IMAGE_MEMORY_OFFSET + LAS * sizeof(tl::u16);
+
+// the bytes of a file, mapped where there is mmap(), read otherwise.
+class File_Bytes {
+ public:
+  explicit File_Bytes(const char *path);
+  ~File_Bytes();
+  File_Bytes(const File_Bytes &)                     = delete;
+  auto operator=(const File_Bytes &) -> File_Bytes & = delete;
+
+  [[nodiscard]] auto is_open() const noexcept -> bool {
+    return this->open_;
+  }
+  [[nodiscard]] auto bytes() const noexcept -> std::span<const std::byte> {
+    return this->bytes_;
+  }
+#ifndef _WIN32
+  [[nodiscard]] auto fd() const noexcept -> int { return this->fd_; }
+#endif
+
+ private:
+  bool open_{false};
+  std::span<const std::byte> bytes_;
+#ifdef _WIN32
+  std::vector<std::byte> read_;
+#else
+  int fd_{-1};
+  void *mapped_{nullptr};
+#endif
+};
+
+File_Bytes::File_Bytes(const char *path) {
+#ifdef _WIN32
+  std::FILE *in = nullptr;
+  fopen_s(&in, path, "rb");
+  if (!in) { return; }
+  auto chunk = std::array<std::byte, 4096>{};
+  auto read  = tl::usize{0};
+  while ((read = std::fread(chunk.data(), 1, chunk.size(), in)) > 0) {
+    this->read_.insert(end(this->read_), begin(chunk), begin(chunk) + read);
+  }
+  this->open_  = !std::ferror(in);
+  this->bytes_ = this->read_;
+  std::fclose(in);  // NOLINT
+#else
+  this->fd_ = ::open(path, O_RDONLY);  // NOLINT(*-vararg)
+  struct stat info {};
+  if (this->fd_ < 0 || fstat(this->fd_, &info) != 0) { return; }
+  const auto size = static_cast<tl::usize>(info.st_size);
+  // nothing to map in an empty file.
+  if (size > 0) {
+    this->mapped_ = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, this->fd_, 0);
+    if (this->mapped_ == MAP_FAILED) {  // NOLINT
+      this->mapped_ = nullptr;
+      return;
+    }
+    this->bytes_ =
+      std::span(static_cast<const std::byte *>(this->mapped_), size);
+  }
+  this->open_ = true;
+#endif
+}
+
+File_Bytes::~File_Bytes() {
+#ifndef _WIN32
+  if (this->mapped_) { munmap(this->mapped_, this->bytes_.size()); }
+  if (this->fd_ >= 0) { close(this->fd_); }
+#endif
+}
+
+// the words from offset on, which has to be even: files are mapped (or
+// read) at a page boundary, so that is where the words are.
+[[nodiscard]] auto words_at(std::span<const std::byte> bytes,
+                            tl::usize offset) -> const tl::u16 * {
+  // NOLINTNEXTLINE(*-reinterpret-cast)
+  return reinterpret_cast<const tl::u16 *>(bytes.subspan(offset).data());
+}
+
+[[nodiscard]] auto fits(tl::usize origin, tl::usize count) noexcept -> bool {
+  return origin + count <= LAS;
+}
+
+// the header of a preprocessed image, if the file is a good one. Otherwise
+// error says why not.
+[[nodiscard]] auto check_image(std::span<const std::byte> bytes,
+                               std::string_view file,
+                               std::string &error)
+  -> std::optional<Image_Header> {
+  auto header = Image_Header{};
+  std::memcpy(&header, bytes.data(), sizeof(header));
+  if (header.version != IMAGE_VERSION) {
+    error = fmt::format("image version {} instead of {}: {}",
+                        header.version,
+                        IMAGE_VERSION,
+                        file);
+    return std::nullopt;
+  }
+  if (bytes.size() != IMAGE_SIZE || !fits(header.origin, header.count)) {
+    error = fmt::format("image cut off or corrupt: {}", file);
+    return std::nullopt;
+  }
+  return header;
+}
+
+[[nodiscard]] auto is_image(std::span<const std::byte> bytes) -> bool {
+  return bytes.size() >= sizeof(Image_Header) &&
+         std::memcmp(bytes.data(), IMAGE_MAGIC.data(), IMAGE_MAGIC.size()) ==
+           0;
+}
+
+[[nodiscard]] auto swap16(tl::u16 x) noexcept -> tl::u16 {
+  return static_cast<tl::u16>((x << 8) | (x >> 8));  // NOLINT
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+// 16 words at a time, for the cpus that have it, see swap_bytes().
+__attribute__((target("avx2"))) auto swap_avx2(const tl::u16 *in,
+                                               tl::u16 *out,
+                                               tl::usize count) noexcept
+  -> tl::usize {
+  const auto order = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,  //
+                                      9, 8, 11, 10, 13, 12, 15, 14,
+                                      1, 0, 3, 2, 5, 4, 7, 6,
+                                      9, 8, 11, 10, 13, 12, 15, 14);
+  auto done = tl::usize{0};
+  for (; done + 16 <= count; done += 16) {
+    // NOLINTBEGIN(*-reinterpret-cast, *-pointer-arithmetic)
+    const auto words =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + done));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + done),
+                        _mm256_shuffle_epi8(words, order));
+    // NOLINTEND(*-reinterpret-cast, *-pointer-arithmetic)
+  }
+  return done;
+}
+#endif
+}  // namespace
+
+auto swap_bytes(const tl::u16 *in, tl::u16 *out, tl::usize count) noexcept
+  -> void {
+  auto done = tl::usize{0};
+  // NOLINTBEGIN(*-reinterpret-cast, *-pointer-arithmetic)
+#if defined(__GNUC__) && defined(__x86_64__)
+  static const auto avx2 = __builtin_cpu_supports("avx2") != 0;
+  if (avx2) { done = swap_avx2(in, out, count); }
+#endif
+#if defined(__x86_64__) || defined(_M_X64)
+  // every x86-64 has sse2: a shift each way.
+  for (; done + 8 <= count; done += 8) {
+    const auto words =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done));
+    _mm_storeu_si128(
+      reinterpret_cast<__m128i *>(out + done),
+      _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8)));
+  }
+#elif defined(__ARM_NEON)
+  for (; done + 8 <= count; done += 8) {
+    const auto words = vreinterpretq_u8_u16(vld1q_u16(in + done));
+    vst1q_u16(out + done, vreinterpretq_u16_u8(vrev16q_u8(words)));
+  }
+#endif
+  for (; done < count; ++done) { out[done] = swap16(in[done]); }
+  // NOLINTEND(*-reinterpret-cast, *-pointer-arithmetic)
+}
+
+auto write_image(const std::string &path,
+                 tl::u16 origin,
+                 std::span<const tl::u16> words) -> bool {
+  if (!fits(origin, words.size())) { return false; }
+  // like a snapshot, path may be mapped by the vm that wrote it.
+  auto file = Replacing_File(path);
+  auto *out = file.get();
+  if (!out) { return false; }
+
+  auto header   = Image_Header{};
+  header.origin = origin;
+  header.count  = static_cast<tl::u32>(words.size());
+  // seeking past the end leaves a hole that reads as zeros. Writing the
+  // last word of memory makes the file as long as the whole image.
+  const auto at = [out](tl::usize word) {
+    const auto offset = IMAGE_MEMORY_OFFSET + word * sizeof(tl::u16);
+    return std::fseek(out, static_cast<long>(offset), SEEK_SET) == 0;
+  };
+  const auto last = tl::u16{0};
+  auto written =
+    std::fwrite(&header, sizeof(header), 1, out) == 1 && at(origin) &&
+    std::fwrite(words.data(), sizeof(tl::u16), words.size(), out) ==
+      words.size();
+  if (fits(origin, words.size() + 1)) {
+    written = written && at(LAS - 1) &&
+              std::fwrite(&last, sizeof(last), 1, out) == 1;
+  }
+  return written && file.commit();
+}
+
+auto Virtual_Machine::read_file(const char *file) -> bool {
+  const auto in = File_Bytes(file);
+  if (!in.is_open()) {
+    this->diagnose("cannot open file.");
+    return false;
+  }
+#ifdef _WIN32
+  return this->load_bytes(in.bytes(), file, -1);
+#else
+  return this->load_bytes(in.bytes(), file, in.fd());
+#endif
+}
+
+auto Virtual_Machine::load(std::span<const std::byte> bytes,
+                           std::string_view name) -> bool {
+  // the words are read in place, a buffer from the host may be anywhere.
+  const auto at = reinterpret_cast<std::uintptr_t>(bytes.data());  // NOLINT
+  if (at % alignof(tl::u16) != 0) {
+    auto words = std::vector<tl::u16>((bytes.size() + 1) / sizeof(tl::u16));
+    std::memcpy(words.data(), bytes.data(), bytes.size());
+    return this->load_bytes(
+      std::as_bytes(std::span(words)).first(bytes.size()), name, -1);
+  }
+  return this->load_bytes(bytes, name, -1);
+}
+
+auto Virtual_Machine::load_bytes(std::span<const std::byte> bytes,
+                                 std::string_view name,
+                                 [[maybe_unused]] int fd) -> bool {
+  if (is_image(bytes)) {
+    auto error        = std::string();
+    const auto header = check_image(bytes, name, error);
+    if (!header) {
+      this->diagnose(error);
+      return false;
+    }
+#ifndef _WIN32
+    // nothing in memory to keep: the image becomes memory, page by page as
+    // the guest touches it.
+    const auto page     = static_cast<tl::usize>(sysconf(_SC_PAGESIZE));
+    const auto mappable = this->blank_ && IMAGE_MEMORY_OFFSET % page == 0;
+    const auto own      = fd >= 0 && mappable ? dup(fd) : -1;
+    if (own >= 0) {
+      this->load_image(*Memory_Image::from_file(
+        own, IMAGE_MEMORY_OFFSET, LAS * sizeof(tl::u16)));
+      return true;
+    }
+#endif
+    const auto *words = words_at(
+      bytes, IMAGE_MEMORY_OFFSET + header->origin * sizeof(tl::u16));
+    this->load_image(static_cast<tl::u16>(header->origin),
+                     std::span(words, header->count));
+    return true;
+  }
+
+  // an object file: the origin, then as many words as there are. A byte
+  // left over means it isn't one.
+  if (bytes.empty() || bytes.size() % sizeof(tl::u16) != 0) {
+    this->diagnose(fmt::format("not an object file: {}", name));
+    return false;
+  }
+  const auto *object = words_at(bytes, 0);
+  const auto origin  = swap16(object[0]);  // NOLINT(*-pointer-arithmetic)
+  const auto count   = bytes.size() / sizeof(tl::u16) - 1;
+  if (!fits(origin, count)) {
+    this->diagnose(
+      fmt::format("{} words from x{:04X} run past the end of memory: {}",
+                  count,
+                  origin,
+                  name));
+    return false;
+  }
+  // straight into memory, no buffer in between.
+  swap_bytes(object + 1,  // NOLINT(*-pointer-arithmetic)
+             this->memory_.data() + origin,
+             count);
+  this->blank_ = false;
+  this->forget_code();
+  return true;
+}
+}  // namespace vm
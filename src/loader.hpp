@@ -0,0 +1,50 @@
+#pragma once
+/*
+ * Program images, what Virtual_Machine::read_file() loads. Two formats:
+ *
+ *  - object files, what LC-3 assemblers write: the origin, then the words to
+ *    load from there on, all big-endian. They are byte swapped straight from
+ *    the mapped file into memory, see swap_bytes().
+ *
+ *  - preprocessed images, see write_image(): an Image_Header, zeros up to
+ *    IMAGE_MEMORY_OFFSET, then all of memory in host byte order. Only the
+ *    words from origin on are ever written, the rest of the file is a hole
+ *    that takes up no disk. A vm that has nothing in memory yet maps it as
+ *    its memory, without copying anything (see memory.hpp), any other one
+ *    copies the words in.
+ */
+#include <array>
+#include <span>
+#include <string>
+
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+static constexpr auto IMAGE_MAGIC =
+  std::array<char, 8>{'L', 'C', '3', 'I', 'M', 'G', '\n', '\0'};
+
+// like SNAPSHOT_VERSION: bumped with the layout, images from a host of the
+// other byte order don't match.
+static constexpr auto IMAGE_VERSION = tl::u32{1};
+
+static constexpr auto IMAGE_MEMORY_OFFSET = tl::usize{4096};
+
+struct Image_Header {
+  std::array<char, 8> magic = IMAGE_MAGIC;
+  tl::u32 version{IMAGE_VERSION};
+  tl::u32 origin{};  // the image is count words from origin on
+  tl::u32 count{};
+  tl::u32 reserved{};  // zero, no padding in the file
+};
+
+// count words from in to out, with their bytes swapped. in and out may be
+// the same, but not overlap otherwise.
+auto swap_bytes(const tl::u16 *in, tl::u16 *out, tl::usize count) noexcept
+  -> void;
+
+// words, loaded from origin on, as a preprocessed image. false if path can't
+// be written or the words run past the end of memory.
+[[nodiscard]] auto write_image(const std::string &path,
+                               tl::u16 origin,
+                               std::span<const tl::u16> words) -> bool;
+}  // namespace vm
@@ -0,0 +1,892 @@
+// Lockstep runs, see lockstep.hpp.
+//
+// The group keeps a mask of the lanes that are still in it (live_) and runs
+// one instruction per step for the ones at the lowest PC (while they are
+// all at the same PC, together_, that is all of them and there is nothing
+// to pick). The semantics are those of instructions.hpp and the built in
+// devices, one vector operation for what all the lanes do the same way and
+// a loop over the lanes for the rest: other addresses, devices and traps.
+#include "lockstep.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <bitset>
+#include <memory>
+#include <utility>
+
+#include "decoder.hpp"
+#include "fmt/format.h"
+#include "input.hpp"
+#include "opcodes.hpp"
+#include "output.hpp"
+
+// the step loop gets a copy for AVX-512 and one for AVX2, picked when the
+// program loads, where the compiler can do that.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+  defined(__linux__)
+  // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+  #define LOCKSTEP_CLONES                           \
+    __attribute__((target_clones("arch=x86-64-v4", \
+                                 "arch=x86-64-v3", \
+                                 "default")))
+#else
+  #define LOCKSTEP_CLONES
+#endif
+
+// the vector operations go into every copy, instead of being called in the
+// one without AVX.
+#if defined(__GNUC__)
+  // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+  #define LOCKSTEP_INLINE [[gnu::always_inline]] inline
+#else
+  // NOLINTNEXTLINE(cppcoreguidelines-macro-usage)
+  #define LOCKSTEP_INLINE inline
+#endif
+
+namespace vm {
+namespace {
+using Clock     = std::chrono::steady_clock;
+using Lane_Mask = tl::u32;  // a bit per lane
+static_assert(LOCKSTEP_LANES <= 32);
+
+// a word per lane, a row of memory is a cache line.
+struct alignas(64) Lanes : std::array<tl::u16, LOCKSTEP_LANES> {};
+
+constexpr auto ALL_ONES = tl::u16{0xFFFF};
+
+// steps the group runs before the lanes on their own get a turn, and
+// instructions those run per turn.
+constexpr auto GROUP_SLICE = tl::u64{1} << 16;
+constexpr auto ALONE_SLICE = tl::u64{1} << 16;
+
+// every WINDOW steps the group checks how many lanes a step ran on average.
+// Below MIN_LANES a vm per lane is faster: the lanes at the most common PC
+// stay, if there are at least MIN_LANES of them, the others leave.
+constexpr auto WINDOW    = tl::u64{1} << 14;
+constexpr auto MIN_LANES = tl::u64{4};
+
+// the page of the device registers, see devices.hpp.
+constexpr auto IO_PAGE = Mapped_Reg::key_status_reg >> PAGE_BITS;
+
+[[nodiscard]] LOCKSTEP_INLINE auto splat(tl::u16 value) noexcept -> Lanes {
+  auto out = Lanes();
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) { out[i] = value; }
+  return out;
+}
+
+// a where mask is set, b elsewhere.
+[[nodiscard]] LOCKSTEP_INLINE auto select(const Lanes &mask,
+                          const Lanes &a,
+                          const Lanes &b) noexcept -> Lanes {
+  auto out = Lanes();
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+    out[i] = static_cast<tl::u16>((a[i] & mask[i]) | (b[i] & ~mask[i]));
+  }
+  return out;
+}
+
+// all ones where a and b are equal.
+[[nodiscard]] LOCKSTEP_INLINE auto equal(const Lanes &a,
+                                         const Lanes &b) noexcept -> Lanes {
+  auto out = Lanes();
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+    out[i] = a[i] == b[i] ? ALL_ONES : 0;
+  }
+  return out;
+}
+
+[[nodiscard]] LOCKSTEP_INLINE auto both(const Lanes &a,
+                                        const Lanes &b) noexcept -> Lanes {
+  auto out = Lanes();
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+    out[i] = a[i] & b[i];
+  }
+  return out;
+}
+
+// true if any bit is set in any lane.
+[[nodiscard]] LOCKSTEP_INLINE auto any(const Lanes &a) noexcept -> bool {
+  auto bits = tl::u16{0};
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) { bits |= a[i]; }
+  return bits != 0;
+}
+
+// true if a and b differ in a lane of mask.
+[[nodiscard]] LOCKSTEP_INLINE auto differ(const Lanes &mask,
+                                          const Lanes &a,
+                                          const Lanes &b) noexcept -> bool {
+  auto bits = tl::u16{0};
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+    bits |= static_cast<tl::u16>((a[i] ^ b[i]) & mask[i]);
+  }
+  return bits != 0;
+}
+
+[[nodiscard]] LOCKSTEP_INLINE auto bits_of(const Lanes &mask) noexcept
+  -> Lane_Mask {
+  auto bits = Lane_Mask{0};
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+    bits |= Lane_Mask{mask[i] & 1U} << i;
+  }
+  return bits;
+}
+
+[[nodiscard]] LOCKSTEP_INLINE auto lanes_of(Lane_Mask bits) noexcept -> Lanes {
+  auto out = Lanes();
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+    out[i] = (bits >> i) & 1U ? ALL_ONES : 0;
+  }
+  return out;
+}
+
+// the lowest PC of the lanes in mask.
+[[nodiscard]] LOCKSTEP_INLINE auto lowest(const Lanes &mask,
+                                          const Lanes &pc) noexcept -> tl::u16 {
+  auto low = ALL_ONES;
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+    low = std::min(low, static_cast<tl::u16>(pc[i] | ~mask[i]));
+  }
+  return low;
+}
+
+// COND for every lane, see Virtual_Machine::set_flags().
+[[nodiscard]] LOCKSTEP_INLINE auto flags_of(const Lanes &values) noexcept
+  -> Lanes {
+  auto out = Lanes();
+  for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+    const auto value = values[i];
+    out[i]           = value == 0        ? Condition_Flag::ZRO
+                       : value >> 15 != 0 ? Condition_Flag::NEG
+                                          : Condition_Flag::POS;
+  }
+  return out;
+}
+
+// calls f(lane) for every lane in bits.
+template <typename F>
+LOCKSTEP_INLINE auto for_lanes(Lane_Mask bits, F &&f) -> void {
+  while (bits != 0) {
+    f(static_cast<tl::usize>(std::countr_zero(bits)));
+    bits &= bits - 1;
+  }
+}
+}  // namespace
+
+class Lockstep_Group {
+ public:
+  Lockstep_Group(const Memory_Image &image,
+                 std::vector<Lockstep_Job> &jobs,
+                 const std::function<void(Virtual_Machine &)> &setup,
+                 Lockstep_Stats &stats);
+
+  auto run() -> void;
+  [[nodiscard]] auto result(tl::usize lane) const -> const Lockstep_Result & {
+    return this->lanes_[lane]->result;
+  }
+
+ private:
+  struct Lane {
+    explicit Lane(Lockstep_Job &job)
+      : input(std::move(job.input))
+      , output(job.output_fd) {}
+
+    Scripted_Input input;
+    Output_Buffer output;
+    // the keyboard and the timer, see devices.hpp.
+    tl::u16 key_status{};
+    tl::u16 key_data{};
+    tl::u16 timer_interval{};
+    tl::u64 timer_next{};
+    bool timer_interrupts{false};
+    // while the lane runs on its own.
+    std::unique_ptr<Virtual_Machine> vm;
+    tl::u64 output_before{};  // what vms it came back from wrote
+    bool done{false};
+    Lockstep_Result result;
+  };
+
+  LOCKSTEP_CLONES auto run_steps(tl::u64 steps) -> void;
+  auto run_alone() -> void;
+
+  // one lane's view of memory and the built in devices, see read_memory()
+  // and write_memory().
+  [[nodiscard]] auto read(tl::usize lane, tl::u16 addr) -> tl::u16;
+  auto write(tl::usize lane, tl::u16 addr, tl::u16 value) -> void;
+  [[nodiscard]] auto read_device(tl::usize lane, tl::u16 addr) -> tl::u16;
+  auto write_device(tl::usize lane, tl::u16 addr, tl::u16 value) -> void;
+  // the same for every lane in mask, at their addresses.
+  [[nodiscard]] auto gather(Lane_Mask bits, const Lanes &addrs) -> Lanes;
+  auto scatter(Lane_Mask bits, const Lanes &addrs, const Lanes &values)
+    -> void;
+  // ...or all at the same address.
+  [[nodiscard]] LOCKSTEP_INLINE auto load(Lane_Mask bits, tl::u16 addr)
+    -> Lanes;
+  LOCKSTEP_INLINE auto store(const Lanes &mask,
+                             Lane_Mask bits,
+                             tl::u16 addr,
+                             const Lanes &values) -> void;
+  // reg of the lanes in mask and their flags.
+  LOCKSTEP_INLINE auto set(const Lanes &mask, tl::u8 reg, const Lanes &values)
+    -> void;
+  auto trap(tl::usize lane, tl::u16 vector) -> void;
+  [[nodiscard]] auto get_key(tl::usize lane) -> int;
+  auto stop(tl::usize lane, Exit_Reason reason) -> void;
+
+  [[nodiscard]] auto instructions(tl::usize lane) const noexcept -> tl::u64 {
+    return this->executed_[lane] + this->full_steps_;
+  }
+  [[nodiscard]] auto pc(tl::usize lane) const noexcept -> tl::u16 {
+    return this->together_ ? this->pc_together_ : this->pc_[lane];
+  }
+  auto set_live(Lane_Mask bits) -> void;
+  // lanes that ended in the step that just ran leave the group.
+  auto retire() -> void;
+  auto finish(tl::usize lane) -> void;
+  // the lanes not at the most common PC leave, or all of them if too few
+  // would be left.
+  auto split_up() -> void;
+  auto peel(tl::usize lane) -> void;
+  auto merge(tl::usize lane) -> void;
+
+  // per lane
+  std::array<Lanes, Register::PC> reg_{};
+  Lanes cond_{};  // COND, which starts out as 0 like in a vm
+  Lanes pc_{};    // unless together_
+  Lanes live_{};  // all ones for the lanes in the group
+  Lane_Mask live_bits_{0};
+  Lane_Mask stopped_{0};  // lanes that ended in the step that is running
+  Lane_Mask leaving_{0};  // and lanes that enabled interrupts in it
+  bool together_{true};
+  tl::u16 pc_together_{PC_START};
+  std::array<tl::u64, LOCKSTEP_LANES> executed_{};
+  tl::u64 full_steps_{0};  // steps all the lanes in the group took part in
+
+  // memory, a row of lanes per address, and the pages lanes wrote to.
+  std::unique_ptr<std::array<Lanes, LAS>> memory_;
+  std::bitset<PAGES> dirty_;
+  Cow_Array<tl::u16, LAS> image_;
+
+  // instructions decoded by address, as long as the word is still words_.
+  std::unique_ptr<std::array<Decoded_Instruction, LAS>> decoded_;
+  std::unique_ptr<std::array<tl::u16, LAS>> words_;
+
+  // how many lanes ran in the steps of this window.
+  tl::u64 window_steps_{0};
+  tl::u64 window_lanes_{0};
+
+  std::vector<std::unique_ptr<Lane>> lanes_;
+  tl::usize alone_{0};  // lanes running on their own
+  const Memory_Image &source_;
+  const std::function<void(Virtual_Machine &)> &setup_;
+  Clock::time_point start_;
+  Lockstep_Stats &stats_;
+};
+
+Lockstep_Group::Lockstep_Group(
+  const Memory_Image &image,
+  std::vector<Lockstep_Job> &jobs,
+  const std::function<void(Virtual_Machine &)> &setup,
+  Lockstep_Stats &stats)
+  : memory_(std::make_unique<std::array<Lanes, LAS>>())
+  , decoded_(std::make_unique<std::array<Decoded_Instruction, LAS>>())
+  , words_(std::make_unique<std::array<tl::u16, LAS>>())
+  , source_(image)
+  , setup_(setup)
+  , start_(Clock::now())
+  , stats_(stats) {
+  this->image_.map(image);
+  for (auto addr = tl::usize{0}; addr < LAS; ++addr) {
+    (*this->memory_)[addr] = splat(this->image_[addr]);
+  }
+
+  auto bits = Lane_Mask{0};
+  for (auto i = tl::usize{0}; i < jobs.size(); ++i) {
+    this->lanes_.push_back(std::make_unique<Lane>(jobs[i]));
+    this->lanes_.back()->output.write("Starting lc-3 virtual machine\n");
+    bits |= Lane_Mask{1} << i;
+  }
+  this->set_live(bits);
+}
+
+auto Lockstep_Group::run() -> void {
+  while (this->live_bits_ != 0 || this->alone_ != 0) {
+    if (this->live_bits_ != 0) { this->run_steps(GROUP_SLICE); }
+    if (this->alone_ != 0) { this->run_alone(); }
+  }
+}
+
+auto Lockstep_Group::run_steps(tl::u64 steps) -> void {
+  auto &memory = *this->memory_;
+  auto &reg    = this->reg_;
+  for (; steps > 0 && this->live_bits_ != 0; --steps) {
+    // the lanes that run this step, all at pc.
+    auto pc   = this->pc_together_;
+    auto mask = this->live_;
+    auto bits = this->live_bits_;
+    if (!this->together_) {
+      pc   = lowest(this->live_, this->pc_);
+      mask = both(this->live_, equal(this->pc_, splat(pc)));
+      bits = bits_of(mask);
+    }
+
+    // a lane may have written something else there.
+    const auto &row  = memory[pc];
+    const auto word  = row[static_cast<tl::usize>(std::countr_zero(bits))];
+    const auto words = splat(word);
+    if (differ(mask, row, words)) {
+      if (this->together_) {
+        this->pc_      = splat(pc);
+        this->together_ = false;
+      }
+      mask = both(mask, equal(row, words));
+      bits = bits_of(mask);
+    }
+
+    auto &instr = (*this->decoded_)[pc];
+    if (instr.op >= UNDECODED || (*this->words_)[pc] != word) {
+      instr                = decode(word);
+      (*this->words_)[pc] = word;
+    }
+
+    const auto full = bits == this->live_bits_;
+    if (full) {
+      ++this->full_steps_;
+    } else {
+      for_lanes(bits, [this](tl::usize lane) { ++this->executed_[lane]; });
+    }
+    const auto lanes = static_cast<tl::u64>(std::popcount(bits));
+    ++this->window_steps_;
+    this->window_lanes_ += lanes;
+    ++this->stats_.steps;
+    this->stats_.lockstep += lanes;
+
+    // where the lanes go next: all to target, or each to its own in targets
+    // if apart.
+    const auto next = static_cast<tl::u16>(pc + 1);
+    auto target     = next;
+    auto apart      = false;
+    auto targets    = Lanes();
+    switch (instr.op) {
+      case Op_Code::BR: {
+        const auto taken = equal(
+          equal(both(this->cond_, splat(instr.dr)), splat(0)), splat(0));
+        const auto to = static_cast<tl::u16>(next + instr.imm);
+        if (!differ(mask, taken, splat(ALL_ONES))) {
+          target = to;
+        } else if (any(both(mask, taken))) {
+          apart   = true;
+          targets = select(taken, splat(to), splat(next));
+        }
+        break;
+      }
+      case Op_Code::ADD: {
+        const auto &a = reg[instr.sr1];
+        const auto b  = instr.imm_mode ? splat(instr.imm) : reg[instr.sr2];
+        auto sum      = Lanes();
+        for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+          sum[i] = static_cast<tl::u16>(a[i] + b[i]);
+        }
+        this->set(mask, instr.dr, sum);
+        break;
+      }
+      case Op_Code::AND: {
+        const auto b = instr.imm_mode ? splat(instr.imm) : reg[instr.sr2];
+        this->set(mask, instr.dr, both(reg[instr.sr1], b));
+        break;
+      }
+      case Op_Code::NOT: {
+        auto inverse = Lanes();
+        for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+          inverse[i] = static_cast<tl::u16>(~reg[instr.sr1][i]);
+        }
+        this->set(mask, instr.dr, inverse);
+        break;
+      }
+      case Op_Code::LEA:
+        this->set(
+          mask, instr.dr, splat(static_cast<tl::u16>(next + instr.imm)));
+        break;
+      case Op_Code::LD:
+        this->set(mask,
+                  instr.dr,
+                  this->load(bits, static_cast<tl::u16>(next + instr.imm)));
+        break;
+      case Op_Code::LDI: {
+        const auto addrs =
+          this->load(bits, static_cast<tl::u16>(next + instr.imm));
+        this->set(mask, instr.dr, this->gather(bits, addrs));
+        break;
+      }
+      case Op_Code::LDR: {
+        auto addrs = Lanes();
+        for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+          addrs[i] = static_cast<tl::u16>(reg[instr.sr1][i] + instr.imm);
+        }
+        this->set(mask, instr.dr, this->gather(bits, addrs));
+        break;
+      }
+      case Op_Code::ST:
+        this->store(
+          mask, bits, static_cast<tl::u16>(next + instr.imm), reg[instr.dr]);
+        break;
+      case Op_Code::STI: {
+        const auto addrs =
+          this->load(bits, static_cast<tl::u16>(next + instr.imm));
+        this->scatter(bits, addrs, reg[instr.dr]);
+        break;
+      }
+      case Op_Code::STR: {
+        auto addrs = Lanes();
+        for (auto i = tl::usize{0}; i < LOCKSTEP_LANES; ++i) {
+          addrs[i] = static_cast<tl::u16>(reg[instr.sr1][i] + instr.imm);
+        }
+        this->scatter(bits, addrs, reg[instr.dr]);
+        break;
+      }
+      case Op_Code::JSR:
+      case Op_Code::JMP: {
+        if (instr.op == Op_Code::JSR) {
+          reg[Register::R7] = select(mask, splat(next), reg[Register::R7]);
+          if (instr.imm_mode) {
+            target = static_cast<tl::u16>(next + instr.imm);
+            break;
+          }
+        }
+        // JSRR R7 jumps to the R7 it just set, like op_jsr().
+        const auto &to = reg[instr.sr1];
+        target = to[static_cast<tl::usize>(std::countr_zero(bits))];
+        if (differ(mask, to, splat(target))) {
+          apart   = true;
+          targets = to;
+        }
+        break;
+      }
+      case Op_Code::TRAP:
+        reg[Register::R7] = select(mask, splat(next), reg[Register::R7]);
+        for_lanes(bits, [this, &instr](tl::usize lane) {
+          this->trap(lane, instr.imm);
+        });
+        break;
+      default:
+        // RES, and RTI: lanes are in user mode, see Virtual_Machine::op_rti().
+        for_lanes(bits, [this](tl::usize lane) {
+          this->lanes_[lane]->output.flush();
+          this->stop(lane, Exit_Reason::bad_opcode);
+        });
+        break;
+    }
+
+    if (full && !apart && this->together_) {
+      this->pc_together_ = target;
+    } else {
+      if (this->together_) {
+        this->pc_       = splat(pc);
+        this->together_ = false;
+      }
+      this->pc_ = select(mask, apart ? targets : splat(target), this->pc_);
+    }
+    if (this->stopped_ != 0) { this->retire(); }
+    if (this->leaving_ != 0) {
+      // only a vm takes interrupts.
+      const auto leaving = std::exchange(this->leaving_, 0) & this->live_bits_;
+      for_lanes(leaving, [this](tl::usize lane) { this->peel(lane); });
+    }
+
+    if (!this->together_ && this->live_bits_ != 0) {
+      const auto first =
+        this->pc_[static_cast<tl::usize>(std::countr_zero(this->live_bits_))];
+      if (!differ(this->live_, this->pc_, splat(first))) {
+        this->together_    = true;
+        this->pc_together_ = first;
+      }
+    }
+
+    if (this->window_steps_ == WINDOW) {
+      if (this->window_lanes_ < MIN_LANES * WINDOW) { this->split_up(); }
+      this->window_steps_ = 0;
+      this->window_lanes_ = 0;
+    }
+  }
+}
+
+auto Lockstep_Group::set(const Lanes &mask, tl::u8 reg, const Lanes &values)
+  -> void {
+  this->reg_[reg] = select(mask, values, this->reg_[reg]);
+  this->cond_     = select(mask, flags_of(values), this->cond_);
+}
+
+auto Lockstep_Group::load(Lane_Mask bits, tl::u16 addr) -> Lanes {
+  if (addr >> PAGE_BITS != IO_PAGE) [[likely]] {
+    return (*this->memory_)[addr];
+  }
+  auto values = Lanes();
+  for_lanes(bits, [this, &values, addr](tl::usize lane) {
+    values[lane] = this->read_device(lane, addr);
+  });
+  return values;
+}
+
+auto Lockstep_Group::store(const Lanes &mask,
+                           Lane_Mask bits,
+                           tl::u16 addr,
+                           const Lanes &values) -> void {
+  if (addr >> PAGE_BITS == IO_PAGE) [[unlikely]] {
+    for_lanes(bits, [this, &values, addr](tl::usize lane) {
+      this->write_device(lane, addr, values[lane]);
+    });
+    return;
+  }
+  auto &row = (*this->memory_)[addr];
+  row       = select(mask, values, row);
+  this->dirty_.set(addr >> PAGE_BITS);
+}
+
+auto Lockstep_Group::gather(Lane_Mask bits, const Lanes &addrs) -> Lanes {
+  auto values = Lanes();
+  for_lanes(bits, [this, &values, &addrs](tl::usize lane) {
+    values[lane] = this->read(lane, addrs[lane]);
+  });
+  return values;
+}
+
+auto Lockstep_Group::scatter(Lane_Mask bits,
+                             const Lanes &addrs,
+                             const Lanes &values) -> void {
+  for_lanes(bits, [this, &values, &addrs](tl::usize lane) {
+    this->write(lane, addrs[lane], values[lane]);
+  });
+}
+
+auto Lockstep_Group::read(tl::usize lane, tl::u16 addr) -> tl::u16 {
+  if (addr >> PAGE_BITS == IO_PAGE) [[unlikely]] {
+    return this->read_device(lane, addr);
+  }
+  return (*this->memory_)[addr][lane];
+}
+
+auto Lockstep_Group::write(tl::usize lane, tl::u16 addr, tl::u16 value)
+  -> void {
+  if (addr >> PAGE_BITS == IO_PAGE) [[unlikely]] {
+    this->write_device(lane, addr, value);
+    return;
+  }
+  (*this->memory_)[addr][lane] = value;
+  this->dirty_.set(addr >> PAGE_BITS);
+}
+
+// Keyboard, Display and Timer of devices.cpp, for one lane. The rest of
+// their page is plain memory.
+auto Lockstep_Group::read_device(tl::usize lane, tl::u16 addr) -> tl::u16 {
+  auto &state = *this->lanes_[lane];
+  if (addr <= Mapped_Reg::key_data_reg) {
+    if (addr == Mapped_Reg::key_data_reg) {
+      state.key_status &= ~DEVICE_READY;
+      return state.key_data;
+    }
+    if (addr != Mapped_Reg::key_status_reg) { return 0; }
+    if (state.input.key_ready(this->instructions(lane))) {
+      // NOLINTNEXTLINE(hicpp-signed-bitwise)
+      state.key_status = (1 << 15);
+      state.key_data   = static_cast<tl::u16>(this->get_key(lane));
+    } else {
+      state.key_status = 0;
+    }
+    return state.key_status;
+  }
+  if (addr >= Mapped_Reg::display_status_reg &&
+      addr <= Mapped_Reg::display_data_reg) {
+    // NOLINTNEXTLINE(hicpp-signed-bitwise)
+    return addr == Mapped_Reg::display_status_reg ? (1 << 15) : 0;
+  }
+  if (addr >= Mapped_Reg::timer_status_reg &&
+      addr <= Mapped_Reg::timer_interval_reg) {
+    if (addr == Mapped_Reg::timer_interval_reg) { return state.timer_interval; }
+    if (addr != Mapped_Reg::timer_status_reg || state.timer_interval == 0) {
+      return 0;
+    }
+    const auto now = this->instructions(lane) / INSTRUCTIONS_PER_MS;
+    if (now < state.timer_next) { return 0; }
+    state.timer_next = now + state.timer_interval;
+    // NOLINTNEXTLINE(hicpp-signed-bitwise)
+    return (1 << 15);
+  }
+  return (*this->memory_)[addr][lane];
+}
+
+auto Lockstep_Group::write_device(tl::usize lane, tl::u16 addr, tl::u16 value)
+  -> void {
+  auto &state = *this->lanes_[lane];
+  if (addr <= Mapped_Reg::key_data_reg) {
+    if (addr == Mapped_Reg::key_status_reg) {
+      state.key_status = static_cast<tl::u16>(
+        (state.key_status & DEVICE_READY) | (value & INTERRUPT_ENABLE));
+      if (value & INTERRUPT_ENABLE) { this->leaving_ |= Lane_Mask{1} << lane; }
+    } else if (addr == Mapped_Reg::key_data_reg) {
+      state.key_data = value;
+    }
+  } else if (addr >= Mapped_Reg::display_status_reg &&
+             addr <= Mapped_Reg::display_data_reg) {
+    if (addr == Mapped_Reg::display_data_reg) {
+      // NOLINTNEXTLINE(hicpp-signed-bitwise)
+      state.output.put(static_cast<char>(value & 0xFF));
+      state.output.maybe_flush();
+    }
+  } else if (addr >= Mapped_Reg::timer_status_reg &&
+             addr <= Mapped_Reg::timer_interval_reg) {
+    if (addr == Mapped_Reg::timer_interval_reg) {
+      state.timer_interval = value;
+      state.timer_next =
+        this->instructions(lane) / INSTRUCTIONS_PER_MS + value;
+    } else if (addr == Mapped_Reg::timer_status_reg) {
+      state.timer_interrupts = (value & INTERRUPT_ENABLE) != 0;
+      if (state.timer_interrupts) { this->leaving_ |= Lane_Mask{1} << lane; }
+    }
+  } else {
+    (*this->memory_)[addr][lane] = value;
+    this->dirty_.set(IO_PAGE);
+  }
+}
+
+// Virtual_Machine::execute_trap(), for one lane.
+auto Lockstep_Group::trap(tl::usize lane, tl::u16 vector) -> void {
+  auto &memory = *this->memory_;
+  auto &output = this->lanes_[lane]->output;
+  auto &r0     = this->reg_[Register::R0][lane];
+  switch (vector) {
+    case Trap::getc:
+      r0 = static_cast<tl::u16>(this->get_key(lane));
+      break;
+    case Trap::out:
+      // NOLINTNEXTLINE(hicpp-signed-bitwise)
+      output.put(static_cast<char>(r0 & 0x7F));
+      output.maybe_flush();
+      break;
+    case Trap::puts:
+      for (auto addr = r0; memory[addr][lane] != 0; ++addr) {
+        output.put(static_cast<char>(this->read(lane, addr)));
+      }
+      output.maybe_flush();
+      break;
+    case Trap::in: {
+      output.write("Enter a character: ");
+      const auto ch = this->get_key(lane);
+      if (ch < 0) { break; }  // stopped, like in a vm
+      output.write(fmt::format("\n{}", ch));
+      output.maybe_flush();
+      r0 = static_cast<tl::u16>(ch);
+      break;
+    }
+    case Trap::putsp:
+      for (auto addr = r0; memory[addr][lane] != 0; ++addr) {
+        const auto value = memory[addr][lane];
+        // NOLINTNEXTLINE(hicpp-signed-bitwise)
+        output.put(static_cast<char>(value & 0xFF));
+        // NOLINTNEXTLINE(hicpp-signed-bitwise)
+        if (value >> 8) { output.put(static_cast<char>(value >> 8)); }
+      }
+      output.maybe_flush();
+      break;
+    case Trap::halt:
+      output.write("vm halted, bye!\n");
+      this->stop(lane, Exit_Reason::halted);
+      break;
+    default:
+      break;
+  }
+}
+
+auto Lockstep_Group::get_key(tl::usize lane) -> int {
+  const auto key = this->lanes_[lane]->input.get_key();
+  if (key < 0) { this->stop(lane, Exit_Reason::end_of_input); }
+  return key;
+}
+
+auto Lockstep_Group::stop(tl::usize lane, Exit_Reason reason) -> void {
+  // the rest of the instruction still runs, like in a vm.
+  this->lanes_[lane]->result.exit = reason;
+  this->stopped_ |= Lane_Mask{1} << lane;
+}
+
+auto Lockstep_Group::set_live(Lane_Mask bits) -> void {
+  this->live_bits_ = bits;
+  this->live_      = lanes_of(bits);
+}
+
+auto Lockstep_Group::retire() -> void {
+  const auto stopped = std::exchange(this->stopped_, 0);
+  for_lanes(stopped, [this](tl::usize lane) {
+    auto &state               = *this->lanes_[lane];
+    state.result.instructions = this->instructions(lane);
+    // like run(), the read past the end of the input didn't finish.
+    if (state.result.exit == Exit_Reason::end_of_input) {
+      --state.result.instructions;
+    }
+    this->finish(lane);
+  });
+  this->set_live(this->live_bits_ & ~stopped);
+}
+
+auto Lockstep_Group::finish(tl::usize lane) -> void {
+  auto &state = *this->lanes_[lane];
+  state.output.flush();
+  state.result.output_bytes = state.output.total_bytes() + state.output_before;
+  state.result.time         =
+    std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                          this->start_);
+  state.done = true;
+}
+
+auto Lockstep_Group::split_up() -> void {
+  // the most common PC, the lowest if there are several.
+  auto best  = this->pc_together_;
+  auto count = std::popcount(this->live_bits_);
+  if (!this->together_) {
+    count = 0;
+    for_lanes(this->live_bits_, [this, &best, &count](tl::usize lane) {
+      const auto pc   = this->pc_[lane];
+      const auto same = std::popcount(
+        bits_of(both(this->live_, equal(this->pc_, splat(pc)))));
+      if (same > count || (same == count && pc < best)) {
+        best  = pc;
+        count = same;
+      }
+    });
+  }
+
+  const auto keep = static_cast<tl::u64>(count) >= MIN_LANES;
+  for_lanes(this->live_bits_, [this, best, keep](tl::usize lane) {
+    if (!keep || this->pc(lane) != best) { this->peel(lane); }
+  });
+}
+
+// the lane goes on in a vm of its own, from exactly where it is.
+auto Lockstep_Group::peel(tl::usize lane) -> void {
+  auto &state = *this->lanes_[lane];
+  state.output.flush();
+
+  auto vm = std::make_unique<Virtual_Machine>();
+  this->setup_(*vm);
+  vm->load_image(this->source_);
+  for (auto page = tl::usize{0}; page < PAGES; ++page) {
+    if (!this->dirty_[page]) { continue; }
+    for (auto addr = page << PAGE_BITS; addr < (page + 1) << PAGE_BITS;
+         ++addr) {
+      const auto word = (*this->memory_)[addr][lane];
+      if (word != this->image_[addr]) { vm->memory_[addr] = word; }
+    }
+  }
+  for (auto r = tl::usize{0}; r < Register::PC; ++r) {
+    vm->register_[r] = this->reg_[r][lane];
+  }
+  vm->register_[Register::PC]   = this->pc(lane);
+  vm->register_[Register::COND] = this->cond_[lane];
+  vm->flags_                    = Virtual_Machine::FLAGS_IN_REGISTER;
+  vm->instructions_             = this->instructions(lane);
+  vm->resume_                   = true;
+  vm->keyboard_.status_         = state.key_status;
+  vm->keyboard_.data_           = state.key_data;
+  vm->timer_.interval_          = state.timer_interval;
+  vm->timer_.next_              = state.timer_next;
+  vm->timer_.interrupts_        = state.timer_interrupts;
+  vm->update_events();
+  vm->set_input(&state.input);
+  vm->set_stop_on_eof(true);
+  vm->set_instruction_clock(true);
+  vm->output().set_fd(state.output.fd());
+
+  state.vm = std::move(vm);
+  ++this->alone_;
+  ++this->stats_.peeled;
+  this->set_live(this->live_bits_ & ~(Lane_Mask{1} << lane));
+}
+
+auto Lockstep_Group::run_alone() -> void {
+  for (auto lane = tl::usize{0}; lane < this->lanes_.size(); ++lane) {
+    auto &state = *this->lanes_[lane];
+    if (!state.vm) { continue; }
+
+    auto &vm          = *state.vm;
+    const auto before = vm.instructions();
+    const auto exit   = vm.run_for(ALONE_SLICE);
+    this->stats_.alone += vm.instructions() - before;
+    if (exit != Exit_Reason::out_of_budget) {
+      state.result.exit         = exit;
+      state.result.instructions = vm.instructions();
+      state.output_before += vm.output().total_bytes();
+      state.vm.reset();
+      --this->alone_;
+      this->finish(lane);
+      continue;
+    }
+
+    // back in the group if it is where some of the lanes are, with
+    // interrupts off and out of any handler.
+    const auto plain = !vm.interrupts_enabled() && vm.psr_ == PSR_USER &&
+                       vm.saved_ssp_ == SUPERVISOR_STACK;
+    if (!plain) { continue; }
+    const auto pc = vm.registers()[Register::PC];
+    const auto at = this->together_
+                      ? (pc == this->pc_together_ ? this->live_bits_ : 0)
+                      : bits_of(both(this->live_, equal(this->pc_, splat(pc))));
+    if (at != 0) { this->merge(lane); }
+  }
+}
+
+auto Lockstep_Group::merge(tl::usize lane) -> void {
+  auto &state    = *this->lanes_[lane];
+  auto &vm       = *state.vm;
+  const auto mem = vm.memory();
+  for (auto addr = tl::usize{0}; addr < LAS; ++addr) {
+    auto &word = (*this->memory_)[addr][lane];
+    if (word != mem[addr]) {
+      word = mem[addr];
+      this->dirty_.set(addr >> PAGE_BITS);
+    }
+  }
+  const auto registers = vm.registers();
+  for (auto r = tl::usize{0}; r < Register::PC; ++r) {
+    this->reg_[r][lane] = registers[r];
+  }
+  this->cond_[lane]      = registers[Register::COND];
+  this->executed_[lane]  = vm.instructions() - this->full_steps_;
+  state.key_status       = vm.keyboard_.status_;
+  state.key_data         = vm.keyboard_.data_;
+  state.timer_interval   = vm.timer_.interval_;
+  state.timer_next       = vm.timer_.next_;
+  state.timer_interrupts = vm.timer_.interrupts_;
+  if (!this->together_) { this->pc_[lane] = registers[Register::PC]; }
+
+  state.output_before += vm.output().total_bytes();
+  state.vm.reset();
+  --this->alone_;
+  ++this->stats_.merged;
+  this->set_live(this->live_bits_ | Lane_Mask{1} << lane);
+}
+
+auto run_lockstep(const Memory_Image &image,
+                  std::vector<Lockstep_Job> jobs,
+                  const std::function<void(Virtual_Machine &)> &setup,
+                  Lockstep_Stats *stats) -> std::vector<Lockstep_Result> {
+  auto results = std::vector<Lockstep_Result>();
+  auto counts  = Lockstep_Stats();
+  for (auto first = tl::usize{0}; first < jobs.size();
+       first += LOCKSTEP_LANES) {
+    const auto last =
+      std::min(first + tl::usize{LOCKSTEP_LANES}, jobs.size());
+    auto group_jobs = std::vector<Lockstep_Job>(
+      std::make_move_iterator(begin(jobs) + static_cast<std::ptrdiff_t>(first)),
+      std::make_move_iterator(begin(jobs) + static_cast<std::ptrdiff_t>(last)));
+
+    // on the heap, its memory alone is 4 MB.
+    auto group =
+      std::make_unique<Lockstep_Group>(image, group_jobs, setup, counts);
+    group->run();
+    for (auto lane = tl::usize{0}; lane < group_jobs.size(); ++lane) {
+      results.push_back(group->result(lane));
+    }
+  }
+  if (stats) { *stats = counts; }
+  return results;
+}
+}  // namespace vm
@@ -0,0 +1,59 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "memory.hpp"
+#include "tl/numeric-aliases.hpp"
+#include "vm.hpp"
+
+namespace vm {
+/*
+ * Lockstep runs: up to LOCKSTEP_LANES vms that start from the same image
+ * and only differ in their input, run side by side like the lanes of a
+ * vector unit.
+ *
+ * Registers are vectors with a lane per vm and memory is interleaved, every
+ * address is a row with one word per lane, so an instruction runs for all
+ * the lanes that are at the same PC at once. Lanes whose PCs differ wait
+ * while the ones with the lowest PC go first, which brings them back
+ * together after a branch most of the time. Lanes that stay apart for long
+ * leave for a Virtual_Machine of their own, and come back if they turn up
+ * at the PC of the other lanes again. So do lanes that enable interrupts,
+ * until they turn them off again.
+ *
+ * Every lane ends up exactly like a run of its own in batch mode (see
+ * batch.hpp): the same output, exit reason and instruction count.
+ */
+static constexpr auto LOCKSTEP_LANES = 32;
+
+struct Lockstep_Job {
+  std::string input;  // all of its keys, the lane ends after the last one
+  int output_fd{-1};  // -1 drops the output, it is only counted
+};
+
+struct Lockstep_Result {
+  Exit_Reason exit{Exit_Reason::halted};
+  tl::u64 instructions{};
+  tl::u64 output_bytes{};
+  std::chrono::microseconds time{};  // until the lane ended
+};
+
+// how the lanes of a run_lockstep() spent their instructions.
+struct Lockstep_Stats {
+  tl::u64 steps{};     // instructions run for several lanes at once
+  tl::u64 lockstep{};  // instructions of all the lanes in those
+  tl::u64 alone{};     // instructions lanes ran in a vm of their own
+  tl::u64 peeled{};    // times a lane left for a vm of its own
+  tl::u64 merged{};    // times one came back
+};
+
+// runs every job from image at PC_START until it halts, hits a bad op code
+// or reads past its input. setup() configures the vms lanes leave for.
+[[nodiscard]] auto run_lockstep(
+  const Memory_Image &image,
+  std::vector<Lockstep_Job> jobs,
+  const std::function<void(Virtual_Machine &)> &setup,
+  Lockstep_Stats *stats = nullptr) -> std::vector<Lockstep_Result>;
+}  // namespace vm
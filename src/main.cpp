@@ -1,32 +1,441 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
 #include <csignal>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "batch.hpp"
 #include "fmt/format.h"
-#include "utils.hpp"
+#include "headless.hpp"
+#include "tl/numeric-aliases.hpp"
+#include "input.hpp"
+#include "loader.hpp"
+#include "native.hpp"
+#include "snapshot.hpp"
+#include "terminal.hpp"
+#include "trace.hpp"
 #include "vm.hpp"
 
+namespace {
+constexpr auto usage =
+  "Error! Usage: vm.exe [options] [image-file] ...\n"
+  "       vm.exe [options] --batch=MANIFEST\n"
+  "options:\n"
+  "  --engine=switch|threaded|jit|native\n"
+  "                                instruction dispatch (default: threaded,\n"
+  "                                native in a vm built with a program, that\n"
+  "                                runs it without image-file)\n"
+  "  --jit-threshold=N             block entries before compiling (jit)\n"
+  "  --output-buffer=BYTES         flush console output at this size\n"
+  "  --output-flush-ms=MS          or when it is this old\n"
+  "  --stats                       print run counters to stderr at exit\n"
+  "  --batch=MANIFEST              run every job in MANIFEST, see batch.hpp\n"
+  "  --jobs=N                      batch worker threads (default: 1 per core)\n"
+  "  --report=FILE                 batch report file (default: stdout)\n"
+  "  --lanes=N                     batch jobs with the same images run N at\n"
+  "                                a time in lockstep (at most 32)\n"
+  "  --headless                    reproducible run without the terminal:\n"
+  "  --input=FILE                    keys from FILE\n"
+  "  --schedule=FILE                 instruction counts when keys show up\n"
+  "  --output=FILE                   output to FILE (default: stdout)\n"
+  "  --profile[=FILE]              hot spots to stderr at exit, and the call\n"
+  "                                stacks to FILE for flame graphs\n"
+  "  --trace=FILE                  record every instruction to FILE, see\n"
+  "                                lc3_trace to read it\n"
+  "  --os=FILE                     load FILE first as the operating system:\n"
+  "                                TRAPs go through its vector table (not\n"
+  "                                with --batch)\n"
+  "  --restore=FILE                start from a snapshot, images are loaded\n"
+  "                                on top of it\n"
+  "  --snapshot=FILE               save the vm to FILE when the run stops.\n"
+  "                                Headless without --input, that is at the\n"
+  "                                first key the guest asks for\n"
+  "  --write-image=FILE            save the loaded images as one image that\n"
+  "                                loads without byte swapping, and exit\n";
+
+struct Options {
+  vm::Engine engine{vm::Engine::threaded};
+  tl::u32 jit_threshold{vm::JIT_THRESHOLD};
+  std::optional<tl::u32> output_buffer;
+  std::optional<tl::u32> output_flush_ms;
+  bool stats{false};
+  std::string batch;
+  tl::u32 jobs{0};
+  tl::u32 lanes{0};
+  std::string report;
+  bool headless{false};
+  std::string input;
+  std::string schedule;
+  std::string output;
+  bool profile{false};
+  std::string folded;
+  std::string trace;
+  std::string os;
+  std::string restore;
+  std::string snapshot;
+  std::string image;
+};
+
+[[nodiscard]] auto parse_number(std::string_view text, tl::u32 &value) -> bool {
+  const auto *end      = text.data() + text.size();
+  const auto [ptr, ec] = std::from_chars(text.data(), end, value);
+  return ec == std::errc() && ptr == end;
+}
+
+[[nodiscard]] auto parse_number(std::string_view text,
+                                std::optional<tl::u32> &value) -> bool {
+  auto number = tl::u32{};
+  if (!parse_number(text, number)) { return false; }
+  value = number;
+  return true;
+}
+
+// returns false if the option is unknown or has a bad value.
+[[nodiscard]] auto parse_option(std::string_view option, Options &options)
+  -> bool {
+  const auto value = option.substr(option.find('=') + 1);
+  if (option == "--engine=switch") {
+    options.engine = vm::Engine::switch_loop;
+  } else if (option == "--engine=threaded") {
+    options.engine = vm::Engine::threaded;
+  } else if (option == "--engine=jit") {
+    options.engine = vm::Engine::jit;
+  } else if (option == "--engine=native") {
+    options.engine = vm::Engine::native;
+  } else if (option.starts_with("--jit-threshold=")) {
+    return parse_number(value, options.jit_threshold);
+  } else if (option.starts_with("--output-buffer=")) {
+    return parse_number(value, options.output_buffer);
+  } else if (option.starts_with("--output-flush-ms=")) {
+    return parse_number(value, options.output_flush_ms);
+  } else if (option == "--stats") {
+    options.stats = true;
+  } else if (option.starts_with("--batch=")) {
+    options.batch = value;
+  } else if (option.starts_with("--jobs=")) {
+    return parse_number(value, options.jobs);
+  } else if (option.starts_with("--lanes=")) {
+    return parse_number(value, options.lanes);
+  } else if (option.starts_with("--report=")) {
+    options.report = value;
+  } else if (option == "--headless") {
+    options.headless = true;
+  } else if (option.starts_with("--input=")) {
+    options.input = value;
+  } else if (option.starts_with("--schedule=")) {
+    options.schedule = value;
+  } else if (option.starts_with("--output=")) {
+    options.output = value;
+  } else if (option == "--profile") {
+    options.profile = true;
+  } else if (option.starts_with("--profile=")) {
+    options.profile = true;
+    options.folded  = value;
+  } else if (option.starts_with("--trace=")) {
+    options.trace = value;
+  } else if (option.starts_with("--os=")) {
+    options.os = value;
+  } else if (option.starts_with("--restore=")) {
+    options.restore = value;
+  } else if (option.starts_with("--snapshot=")) {
+    options.snapshot = value;
+  } else if (option.starts_with("--write-image=")) {
+    options.image = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+auto configure(const Options &options, vm::Virtual_Machine &vm) -> void {
+  vm.set_engine(options.engine);
+  vm.set_jit_threshold(options.jit_threshold);
+  if (options.output_buffer) {
+    vm.output().set_flush_threshold(*options.output_buffer);
+  }
+  if (options.output_flush_ms) {
+    vm.output().set_flush_interval(
+      std::chrono::milliseconds(*options.output_flush_ms));
+  }
+}
+
+// with --stats, the run counters go to stderr.
+auto report_stats(const Options &options, const vm::Virtual_Machine &vm)
+  -> void {
+  if (!options.stats) { return; }
+  fmt::print(stderr, "instructions: {}\n", vm.instructions());
+  fmt::print(stderr, "idle wakeups: {}\n", vm.stats().idle_wakeups);
+  fmt::print(stderr, "interrupts: {}\n", vm.stats().interrupts);
+  fmt::print(stderr, "os traps: {}\n", vm.stats().os_traps);
+}
+
+// with --profile, the hot spots go to stderr and the call stacks to FILE.
+auto report_profile(const Options &options, vm::Virtual_Machine &vm) -> void {
+  auto *profiler = vm.profiler();
+  if (!profiler) { return; }
+
+  profiler->write_report(stderr, vm.memory());
+  if (options.folded.empty()) { return; }
+#ifdef _WIN32
+  std::FILE *out = nullptr;
+  fopen_s(&out, options.folded.c_str(), "w");
+#else
+  auto *out = std::fopen(options.folded.c_str(), "w");
+#endif
+  if (!out) {
+    fmt::print(stderr, "cannot open profile: {}\n", options.folded);
+    return;
+  }
+  profiler->write_folded(out);
+  std::fclose(out);  // NOLINT
+}
+
+// writes out the rest of the trace, false if that (or anything before it)
+// failed.
+[[nodiscard]] auto close_trace(const Options &options,
+                               vm::Trace_Writer *tracer) -> bool {
+  if (!tracer) { return true; }
+  if (!tracer->close()) {
+    fmt::print(stderr, "cannot write trace: {}\n", options.trace);
+    return false;
+  }
+  if (options.stats) {
+    fmt::print(stderr, "trace records: {}\n", tracer->records());
+  }
+  return true;
+}
+
+// with --snapshot, false if it can't be written.
+[[nodiscard]] auto save_snapshot(const Options &options,
+                                 const vm::Virtual_Machine &vm) -> bool {
+  if (options.snapshot.empty() || vm.save_snapshot(options.snapshot)) {
+    return true;
+  }
+  fmt::print(stderr, "cannot write snapshot: {}\n", options.snapshot);
+  return false;
+}
+
+// memory from the first word that isn't zero to the last, as an image.
+[[nodiscard]] auto write_image(const Options &options,
+                               const vm::Virtual_Machine &vm) -> int {
+  const auto memory = vm.memory();
+  const auto used   = [](tl::u16 word) { return word != 0; };
+  const auto first  = std::ranges::find_if(memory, used);
+  const auto last   = std::ranges::find_if(rbegin(memory), rend(memory), used);
+  // nothing at all but zeros makes an empty image.
+  const auto words  = first == end(memory) ? std::span<const tl::u16>()
+                                           : std::span(first, last.base());
+  const auto origin = static_cast<tl::u16>(first - begin(memory));
+  if (!vm::write_image(options.image, origin, words)) {
+    fmt::print(stderr, "cannot write image: {}\n", options.image);
+    return -1;
+  }
+  return 0;
+}
+
+[[nodiscard]] auto run_batch(const Options &options) -> int {
+  const auto jobs = vm::read_manifest(options.batch.c_str());
+  if (!jobs) { return -1; }
+
+  auto report = stdout;
+  if (!options.report.empty()) {
+#ifdef _WIN32
+    fopen_s(&report, options.report.c_str(), "w");
+#else
+    report = std::fopen(options.report.c_str(), "w");
+#endif
+    if (!report) {
+      fmt::print(stderr, "cannot open report: {}\n", options.report);
+      return -1;
+    }
+  }
+
+  auto pool        = vm::Work_Stealing_Pool(options.jobs);
+  const auto start = std::chrono::steady_clock::now();
+  const auto results =
+    vm::run_batch(
+      *jobs,
+      pool,
+      [&options](vm::Virtual_Machine &vm) { configure(options, vm); },
+      options.lanes);
+  const auto wall = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start);
+
+  vm::write_report(report, *jobs, results, pool.workers(), wall);
+  if (report != stdout) { std::fclose(report); }  // NOLINT
+  return 0;
+}
+
+// how the last run stopped, for the summary line.
+[[nodiscard]] auto exit_name(vm::Exit_Reason reason) noexcept -> const char * {
+  switch (reason) {
+    case vm::Exit_Reason::halted:
+      return "halted";
+    case vm::Exit_Reason::bad_opcode:
+      return "bad opcode";
+    case vm::Exit_Reason::end_of_input:
+      return "end of input";
+    case vm::Exit_Reason::waiting_for_input:
+      return "waiting for input";
+    case vm::Exit_Reason::out_of_budget:
+      return "out of budget";
+  }
+  return "stopped";
+}
+
+[[nodiscard]] auto run_headless(const Options &options,
+                                vm::Virtual_Machine &vm) -> int {
+  auto bytes = std::string();
+  if (!options.input.empty() && !vm::read_whole_file(options.input, bytes)) {
+    fmt::print(stderr, "cannot read input: {}\n", options.input);
+    return -1;
+  }
+  auto schedule = std::vector<tl::u64>();
+  if (!options.schedule.empty() &&
+      !vm::read_schedule(options.schedule, schedule)) {
+    fmt::print(stderr, "bad schedule: {}\n", options.schedule);
+    return -1;
+  }
+
+  auto input = vm::Scripted_Input(std::move(bytes), std::move(schedule));
+  vm::make_headless(vm, input);
+  vm.set_features({.count   = true,
+                   .profile = options.profile,
+                   .trace   = !options.trace.empty()});
+  const auto exit = vm.run();
+  vm.output().flush();
+
+  const auto &output = vm.output().captured();
+  auto *out          = stdout;
+  if (!options.output.empty()) {
+#ifdef _WIN32
+    fopen_s(&out, options.output.c_str(), "wb");
+#else
+    out = std::fopen(options.output.c_str(), "wb");
+#endif
+    if (!out) {
+      fmt::print(stderr, "cannot open output: {}\n", options.output);
+      return -1;
+    }
+  }
+  std::fwrite(output.data(), 1, output.size(), out);
+  if (out != stdout) { std::fclose(out); }  // NOLINT
+
+  fmt::print(stderr,
+             "{} after {} instructions, {} bytes of output, digest {:016x}\n",
+             exit_name(exit),
+             vm.instructions(),
+             output.size(),
+             vm::digest(output));
+  report_stats(options, vm);
+  report_profile(options, vm);
+  return save_snapshot(options, vm) ? 0 : -1;
+}
+}  // namespace
+
 auto main(int argc, const char* argv[]) -> int {
-  // image-file must be passed as argument.
-  if (argc < 2) {
-    fmt::print(stderr, "{}\n", "Error! Usage: vm.exe [image-file] ...");
+  auto options = Options();
+  auto images  = std::vector<const char *>();
+  // built with a translated program (see native.hpp), that is what runs.
+  const auto *program = vm::native_program();
+  if (program) { options.engine = vm::Engine::native; }
+
+  // options can go anywhere in between the image-files.
+  for (auto i = 1; i < argc; ++i) {
+    const auto arg = std::string_view(argv[i]);
+    if (!arg.starts_with("--")) {
+      images.push_back(argv[i]);
+    } else if (!parse_option(arg, options)) {
+      fmt::print(stderr, "Unknown option: {}\n{}", arg, usage);
+      return -1;
+    }
+  }
+
+  if (!options.batch.empty() && !options.os.empty()) {
+    fmt::print(stderr, "--os doesn't go with --batch\n");
+    return -1;
+  }
+  if (!options.batch.empty()) { return run_batch(options); }
+
+  // image-file must be passed as argument, unless there is a snapshot or a
+  // program built in.
+  const auto nothing_given = images.empty() && options.restore.empty();
+  if (nothing_given && !program) {
+    fmt::print(stderr, "{}", usage);
     return -1;
   }
 
   auto vm = vm::Virtual_Machine();
+  configure(options, vm);
+  if (!options.restore.empty()) {
+    const auto snapshot = vm::Snapshot::open(options.restore);
+    if (!snapshot) { return -1; }
+    vm.restore(*snapshot);
+  }
+  if (!options.os.empty()) {
+    if (!vm.read_file(options.os.c_str())) {
+      fmt::print(stderr, "{} {}\n", "Failed to load os:", options.os);
+      return -1;
+    }
+    vm.use_os();
+  }
+  if (nothing_given && program) {
+    vm.load_image(program->origin, program->image);
+  }
+  for (const auto *image : images) {
+    if (!vm.read_file(image)) {
+      fmt::print(stderr, "{} {}\n", "Failed to load image:", image);
+      return -1;
+    }
+  }
+  if (!options.image.empty()) { return write_image(options, vm); }
 
-  // load the image-file
-  for (auto i = 1; i < argc; ++i) {
-    if (!vm.read_file(argv[i])) {
-      fmt::print(stderr, "{} {}\n", "Failed to load image:", argv[i]);
+  // every instruction goes to the trace from the first one on.
+  auto tracer = std::unique_ptr<vm::Trace_Writer>();
+  if (!options.trace.empty()) {
+    tracer = vm::Trace_Writer::open(options.trace);
+    if (!tracer) {
+      fmt::print(stderr, "cannot open trace: {}\n", options.trace);
       return -1;
     }
+    vm.set_tracer(tracer.get());
+  }
+
+  if (options.headless) {
+    const auto status = run_headless(options, vm);
+    return close_trace(options, tracer.get()) ? status : -1;
   }
 
+  // nothing needs the instruction count unless it gets printed.
+  vm.set_features({.count   = options.stats,
+                   .profile = options.profile,
+                   .trace   = !options.trace.empty()});
+
   signal(SIGINT, handle_interrupt);
   disable_input_buffering();
 
-  vm.run();
+  // keys are read on their own thread from now on.
+  auto input = vm::Console_Input();
+  vm.set_input(&input);
+
+  const auto exit = vm.run();
 
+  input.stop();
   restore_input_buffering();
 
-  return 0;
+  if (exit == vm::Exit_Reason::bad_opcode) {
+    fmt::print(stderr, "{}\n", "BAD OPCODE. Aborting");
+  }
+  report_stats(options, vm);
+  report_profile(options, vm);
+
+  const auto saved = save_snapshot(options, vm);
+  return close_trace(options, tracer.get()) && saved ? 0 : -1;
 }
@@ -0,0 +1,117 @@
+#include "memory.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+namespace vm {
+#ifndef _WIN32
+namespace {
+// a file only in memory, gone with the last mapping of it. -1 if there is
+// none to be had, nothing here touches the file system.
+[[nodiscard]] auto anonymous_file() noexcept -> int {
+  #ifdef __linux__
+  const auto fd = memfd_create("lc3vm-image", MFD_CLOEXEC);
+  if (fd >= 0) { return fd; }
+  #endif
+  static auto count = std::atomic<tl::u32>{0};
+  const auto name   = "/lc3vm-" + std::to_string(getpid()) + "-" +
+                    std::to_string(count.fetch_add(1));
+  const auto shared =
+    shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);  // NOLINT
+  if (shared >= 0) { shm_unlink(name.c_str()); }
+  return shared;
+}
+}  // namespace
+#endif
+
+auto Memory_Image::create(std::span<const std::byte> bytes)
+  -> std::shared_ptr<const Memory_Image> {
+  auto image   = std::shared_ptr<Memory_Image>(new Memory_Image());
+  image->size_ = bytes.size();
+#ifndef _WIN32
+  image->fd_ = anonymous_file();
+  if (image->fd_ >= 0 &&
+      ftruncate(image->fd_, static_cast<off_t>(bytes.size())) == 0 &&
+      pwrite(image->fd_, bytes.data(), bytes.size(), 0) ==
+        static_cast<ssize_t>(bytes.size())) {
+    return image;
+  }
+  if (image->fd_ >= 0) { close(image->fd_); }
+  image->fd_ = -1;
+#endif
+  // every array that maps it gets a copy of its own.
+  image->bytes_.assign(begin(bytes), end(bytes));
+  return image;
+}
+
+#ifndef _WIN32
+auto Memory_Image::from_file(int fd, tl::usize offset, tl::usize size)
+  -> std::shared_ptr<const Memory_Image> {
+  auto image     = std::shared_ptr<Memory_Image>(new Memory_Image());
+  image->fd_     = fd;
+  image->offset_ = offset;
+  image->size_   = size;
+  return image;
+}
+#endif
+
+Memory_Image::~Memory_Image() {
+#ifndef _WIN32
+  // mappings of the file keep it around by themselves.
+  if (this->fd_ >= 0) { close(this->fd_); }
+#endif
+}
+
+auto map_block(void *block, tl::usize size, const Memory_Image *image)
+  -> void * {
+  if (image && image->size_ < size) {
+    throw std::invalid_argument("memory image too small");
+  }
+
+#ifdef _WIN32
+  auto *bytes = static_cast<std::byte *>(block);
+  if (!bytes) { bytes = new std::byte[size]{}; }  // NOLINT
+  if (image) { std::ranges::copy_n(begin(image->bytes_), size, bytes); }
+  return bytes;
+#else
+  const auto *file = image && image->fd_ >= 0 ? image : nullptr;
+  const auto flags = (block ? MAP_FIXED : 0) |  // NOLINT(hicpp-signed-bitwise)
+                     (file ? MAP_PRIVATE : MAP_PRIVATE | MAP_ANONYMOUS);
+  void *mapped     = mmap(block,
+                      size,
+                      PROT_READ | PROT_WRITE,  // NOLINT(hicpp-signed-bitwise)
+                      flags,
+                      file ? file->fd_ : -1,
+                      file ? static_cast<off_t>(file->offset_) : 0);
+  if (mapped == MAP_FAILED) {  // NOLINT
+    if (!block) { throw std::bad_alloc(); }
+    throw std::system_error(errno, std::generic_category());
+  }
+  if (image && !file) {
+    std::ranges::copy_n(
+      begin(image->bytes_), size, static_cast<std::byte *>(mapped));
+  }
+  return mapped;
+#endif
+}
+
+auto unmap_block(void *block, tl::usize size) noexcept -> void {
+#ifdef _WIN32
+  static_cast<void>(size);
+  delete[] static_cast<std::byte *>(block);  // NOLINT
+#else
+  munmap(block, size);
+#endif
+}
+}  // namespace vm
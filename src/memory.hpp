@@ -0,0 +1,103 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+/*
+ * Contents for a Cow_Array that any number of them can share, see
+ * Cow_Array::map(). Never changes once it is made.
+ *
+ * It is a file (a snapshot, or one only in memory) the arrays map
+ * privately, so the OS keeps one copy of every page for all of them. Where
+ * there is no such file to be had (or no mmap()), every array copies it.
+ */
+class Memory_Image {
+ public:
+  [[nodiscard]] static auto create(std::span<const std::byte> bytes)
+    -> std::shared_ptr<const Memory_Image>;
+#ifndef _WIN32
+  // size bytes at offset in the file fd, which the image owns from then on.
+  // offset has to be a multiple of the page size.
+  [[nodiscard]] static auto from_file(int fd,
+                                      tl::usize offset,
+                                      tl::usize size)
+    -> std::shared_ptr<const Memory_Image>;
+#endif
+
+  ~Memory_Image();
+  Memory_Image(const Memory_Image &)                     = delete;
+  auto operator=(const Memory_Image &) -> Memory_Image & = delete;
+
+  [[nodiscard]] auto size() const noexcept -> tl::usize { return this->size_; }
+
+ private:
+  Memory_Image() = default;
+
+  int fd_{-1};
+  tl::usize offset_{0};
+  tl::usize size_{0};
+  std::vector<std::byte> bytes_;  // where there is no file for it
+
+  friend auto map_block(void *block, tl::usize size, const Memory_Image *image)
+    -> void *;
+};
+
+// size bytes mapped privately from image, or zeros for nullptr. At block
+// if that isn't nullptr, replacing what was mapped there. Throws if it
+// can't.
+[[nodiscard]] auto map_block(void *block,
+                             tl::usize size,
+                             const Memory_Image *image) -> void *;
+auto unmap_block(void *block, tl::usize size) noexcept -> void;
+
+/*
+ * A fixed number of Ts in one block, so the engines (and the jit's code) can
+ * index it directly: one load more than an array of its own, for the
+ * pointer.
+ *
+ * The block is a private mapping, of nothing to begin with (the OS hands out
+ * zero pages on first touch) or of a Memory_Image. Pages are shared until
+ * the array writes to one, which gets it a copy of its own. Without mmap()
+ * it is just an array.
+ */
+template <typename T, tl::usize Size>
+class Cow_Array {
+  static_assert(std::is_trivially_copyable_v<T>);
+  static constexpr auto BYTES = Size * sizeof(T);
+
+ public:
+  Cow_Array()
+    : data_(static_cast<T *>(map_block(nullptr, BYTES, nullptr))) {}
+  ~Cow_Array() { unmap_block(this->data_, BYTES); }
+  Cow_Array(const Cow_Array &)                     = delete;
+  auto operator=(const Cow_Array &) -> Cow_Array & = delete;
+
+  [[nodiscard]] auto operator[](tl::usize i) noexcept -> T & {
+    return this->data_[i];  // NOLINT(*-pointer-arithmetic)
+  }
+  [[nodiscard]] auto operator[](tl::usize i) const noexcept -> const T & {
+    return this->data_[i];  // NOLINT(*-pointer-arithmetic)
+  }
+  [[nodiscard]] auto data() noexcept -> T * { return this->data_; }
+  [[nodiscard]] auto data() const noexcept -> const T * { return this->data_; }
+  [[nodiscard]] auto span() noexcept -> std::span<T, Size> {
+    return std::span<T, Size>(this->data_, Size);
+  }
+  [[nodiscard]] auto span() const noexcept -> std::span<const T, Size> {
+    return std::span<const T, Size>(this->data_, Size);
+  }
+
+  // everything becomes image, which has to have BYTES. data() stays put.
+  auto map(const Memory_Image &image) -> void {
+    static_cast<void>(map_block(this->data_, BYTES, &image));
+  }
+
+ private:
+  T *data_;
+};
+}  // namespace vm
@@ -0,0 +1,73 @@
+#include "native.hpp"
+
+#include <algorithm>
+
+#include "instructions.hpp"
+
+namespace vm {
+namespace {
+const Native_Program *registered = nullptr;  // NOLINT(*-non-const-global-*)
+}  // namespace
+
+auto register_native_program(const Native_Program &program) -> bool {
+  registered = &program;
+  return true;
+}
+
+auto native_program() noexcept -> const Native_Program * { return registered; }
+
+auto Native_Frame::load_io(tl::u16 addr, tl::u16 pc) -> tl::u16 {
+  this->registers[Register::PC] = pc;  // NOLINT(*-pointer-arithmetic)
+  const auto value = this->vm->read_memory(addr);
+  this->stopped    = !this->vm->running_;
+  return value;
+}
+
+auto Native_Frame::store(tl::u16 addr, tl::u16 value) -> bool {
+  this->vm->write_memory(addr, value);
+  return this->vm->native_->take_invalidated() || !this->vm->running_;
+}
+
+auto Native_Frame::trap(tl::u16 vector) -> tl::u16 {
+  auto instr = Decoded_Instruction{};
+  instr.op   = Op_Code::TRAP;
+  instr.imm  = vector;
+  this->vm->op_trap(instr);
+  return this->registers[Register::PC];  // NOLINT(*-pointer-arithmetic)
+}
+
+Native_Code::Native_Code(const Native_Program &program,
+                         std::span<const tl::u16> memory)
+  : program_(program)
+  , blocks_(LAS)
+  , covered_(LAS) {
+  const auto words = program.image;
+  const auto in_memory =
+    memory.subspan(program.origin, std::min(words.size(),
+                                            memory.size() - program.origin));
+  for (const auto &block : program.blocks) {
+    // the words the block was translated from, as they are now.
+    const auto from = tl::usize{block.start} - program.origin;
+    const auto size = tl::usize{block.end} - block.start + 1;
+    if (from + size > in_memory.size() ||
+        !std::ranges::equal(words.subspan(from, size),
+                            in_memory.subspan(from, size))) {
+      continue;
+    }
+    this->blocks_[block.start] = block.run;
+    std::fill_n(begin(this->covered_) + block.start, size, tl::u8{1});
+  }
+}
+
+auto Native_Code::drop_blocks(tl::u16 addr) noexcept -> void {
+  this->covered_[addr] = 0;
+
+  for (const auto &block : this->program_.blocks) {
+    if (block.start <= addr && addr <= block.end &&
+        this->blocks_[block.start] == block.run) {
+      this->blocks_[block.start] = nullptr;
+      this->invalidated_         = true;
+    }
+  }
+}
+}  // namespace vm
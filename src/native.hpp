@@ -0,0 +1,117 @@
+#pragma once
+/*
+ * Programs translated ahead of time, what Engine::native runs.
+ *
+ * lc3_recompile (tools/lc3_recompile.cpp) turns an object file into C++: the
+ * image itself, and a function for every basic block it can reach from
+ * PC_START. Built together with main.cpp (see add_lc3_native() in
+ * CMakeLists.txt) that is a vm that runs the program natively, with every
+ * option of the vm.
+ *
+ * Blocks work on the vm's registers and memory, loads from device pages,
+ * stores and traps go through the vm like they do for the interpreter. A
+ * block is only used while memory still holds the words it was translated
+ * from: blocks that don't match when the engine starts (another image, a
+ * snapshot) and blocks that get written to are dropped, and the code there is
+ * interpreted. So is anything the translator couldn't reach, the targets of
+ * JMP, JSRR and RET are only known at run time.
+ */
+#include <bitset>
+#include <span>
+#include <vector>
+
+#include "opcodes.hpp"
+#include "tl/numeric-aliases.hpp"
+#include "vm.hpp"
+
+namespace vm {
+// what a block sees of the vm.
+struct Native_Frame {
+  tl::u16 *registers;  // R0-R7, PC, COND
+  const tl::u16 *memory;
+  const std::bitset<PAGES> *io_pages;
+  tl::u64 *instructions;  // the vm's counter, or one nobody reads
+  Virtual_Machine *vm;
+  bool stopped{false};  // a load stopped the run (end of input)
+
+  [[nodiscard]] auto io(tl::u16 addr) const noexcept -> bool {
+    return (*this->io_pages)[addr >> PAGE_BITS];
+  }
+  // a load from a device page. The registers (COND too) have to be up to
+  // date for the keyboard's idle watch, pc is past the instruction that
+  // loads, where the interpreter would be.
+  auto load_io(tl::u16 addr, tl::u16 pc) -> tl::u16;
+  // true if the store overwrote translated code or stopped the run (MCR),
+  // the block has to return.
+  [[nodiscard]] auto store(tl::u16 addr, tl::u16 value) -> bool;
+  // the registers have to be up to date, PC past the TRAP. Returns the next
+  // PC: that one, or an OS's routine.
+  [[nodiscard]] auto trap(tl::u16 vector) -> tl::u16;
+  // a device may interrupt or output waits, a block that loops has to
+  // return between trips so the engine can see to it.
+  [[nodiscard]] auto events() const noexcept -> bool {
+    return this->vm->events_;
+  }
+};
+
+// runs from the address it was translated for, returns the next PC.
+using Native_Block = auto (*)(Native_Frame &frame) -> tl::u16;
+
+struct Native_Block_Entry {
+  tl::u16 start;
+  tl::u16 end;  // last address the block covers
+  Native_Block run;
+};
+
+struct Native_Program {
+  tl::u16 origin;
+  std::span<const tl::u16> image;
+  std::span<const Native_Block_Entry> blocks;
+};
+
+// COND after an instruction that left value in its destination register.
+[[nodiscard]] constexpr auto native_cond(tl::u16 value) noexcept -> tl::u16 {
+  if (value == 0) { return Condition_Flag::ZRO; }
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  return value >> 15 ? Condition_Flag::NEG : Condition_Flag::POS;
+}
+
+// the translated code calls it once, while it is initialized. The program
+// has to outlive every vm.
+auto register_native_program(const Native_Program &program) -> bool;
+// the program built into this executable, nullptr if there is none.
+[[nodiscard]] auto native_program() noexcept -> const Native_Program *;
+
+// the blocks of a program a vm can run, see Engine::native. Like a Jit, it
+// only serves the vm it was made for.
+class Native_Code {
+ public:
+  // program's blocks that match memory.
+  Native_Code(const Native_Program &program, std::span<const tl::u16> memory);
+
+  [[nodiscard]] auto lookup(tl::u16 pc) const noexcept -> Native_Block {
+    return this->blocks_[pc];
+  }
+
+  // memory at addr was written, drop every block that covers it. Inline for
+  // the stores that don't, which is nearly all of them.
+  auto invalidate(tl::u16 addr) noexcept -> void {
+    if (this->covered_[addr]) [[unlikely]] { this->drop_blocks(addr); }
+  }
+
+  // true (once) if the last invalidate() dropped a block.
+  [[nodiscard]] auto take_invalidated() noexcept -> bool {
+    const auto invalidated = this->invalidated_;
+    this->invalidated_     = false;
+    return invalidated;
+  }
+
+ private:
+  auto drop_blocks(tl::u16 addr) noexcept -> void;
+
+  const Native_Program &program_;
+  std::vector<Native_Block> blocks_;
+  std::vector<tl::u8> covered_;  // addresses that may be in some block
+  bool invalidated_{false};
+};
+}  // namespace vm
@@ -53,9 +53,22 @@ enum Trap {
   halt  = 0x25,  // halt the program
 };
 
+// interrupt vectors, the handler of vector v starts at the address in
+// memory[INTERRUPT_TABLE + v].
+enum Interrupt {
+  keyboard_interrupt = 0x80,  // a key is in KBDR
+  timer_interrupt    = 0x81,  // the timer's interval elapsed
+};
+
+// device registers, see devices.hpp.
 enum Mapped_Reg {
-  key_status_reg = 0xFE00,  // keyboard status, if a key is pressed
-  key_data_reg   = 0xFE02,  // keyboard data, the pressed key
+  key_status_reg      = 0xFE00,  // keyboard status, if a key is pressed
+  key_data_reg        = 0xFE02,  // keyboard data, the pressed key
+  display_status_reg  = 0xFE04,  // display status, if it can take a character
+  display_data_reg    = 0xFE06,  // display data, the character to write
+  timer_status_reg    = 0xFE08,  // timer status, if the interval elapsed
+  timer_interval_reg  = 0xFE0A,  // timer interval in ms, 0 stops it
+  machine_control_reg = 0xFFFE,  // machine control, clearing bit 15 halts
 };
 
 enum Mask {
@@ -0,0 +1,91 @@
+#include "output.hpp"
+
+#ifdef _WIN32
+  #include <io.h>  // _write
+#else
+  #include <unistd.h>  // write
+
+  #include <cerrno>
+#endif
+
+namespace vm {
+Output_Buffer::Output_Buffer(int fd)
+  : fd_(fd) {
+  this->buffer_.reserve(OUTPUT_FLUSH_BYTES);
+}
+
+Output_Buffer::~Output_Buffer() { this->flush(); }
+
+auto Output_Buffer::maybe_flush() -> void {
+  const auto size = this->buffer_.size();
+  if (size >= this->flush_bytes_) {
+    this->flush();
+    return;
+  }
+  if (size - this->clock_bytes_ < OUTPUT_CLOCK_BYTES) { return; }
+  this->clock_bytes_ = size;
+  if (this->overdue()) { this->flush(); }
+}
+
+auto Output_Buffer::poll() -> void {
+  if (this->buffer_.empty() || ++this->clock_polls_ < OUTPUT_CLOCK_POLLS) {
+    return;
+  }
+  this->clock_polls_ = 0;
+  if (this->overdue()) { this->flush(); }
+}
+
+auto Output_Buffer::overdue() -> bool {
+  // the age counts from the first look: put() doesn't read the clock.
+  const auto now = Clock::now();
+  if (this->oldest_ == Clock::time_point()) {
+    this->oldest_ = now;
+    return this->flush_interval_.count() <= 0;
+  }
+  return now - this->oldest_ >= this->flush_interval_;
+}
+
+auto Output_Buffer::set_fd(int fd) -> void {
+  this->flush();
+  this->fd_ = fd;
+}
+
+auto Output_Buffer::set_sink(Output_Sink *sink) -> void {
+  this->flush();
+  this->sink_ = sink;
+}
+
+auto Output_Buffer::capture() -> void {
+  this->flush();
+  this->capturing_ = true;
+}
+
+auto Output_Buffer::flush() -> void {
+  const auto *data = this->buffer_.data();
+  auto left        = this->buffer_.size();
+  this->flushed_ += left;
+
+  if (this->capturing_) {
+    this->captured_.append(this->buffer_);
+    left = 0;
+  } else if (this->sink_ && left > 0) {
+    this->sink_->write(this->buffer_);
+    left = 0;
+  }
+
+  while (left > 0 && this->fd_ >= 0) {
+#ifdef _WIN32
+    const auto written = _write(this->fd_, data, static_cast<unsigned>(left));
+#else
+    const auto written = ::write(this->fd_, data, left);
+    if (written < 0 && errno == EINTR) { continue; }
+#endif
+    // nowhere to write it, drop it rather than spin.
+    if (written <= 0) { break; }
+    data += written;
+    left -= static_cast<tl::usize>(written);
+  }
+
+  this->buffer_.clear();
+}
+}  // namespace vm
@@ -0,0 +1,123 @@
+#pragma once
+#include <chrono>
+#include <string>
+#include <string_view>
+
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+// defaults for when buffered console output is written out.
+static constexpr auto OUTPUT_FLUSH_BYTES    = tl::usize{4096};
+static constexpr auto OUTPUT_FLUSH_INTERVAL = std::chrono::milliseconds(15);
+// how often the age of the output is looked at: the clock costs more than
+// buffering a byte, or than a short block of guest code.
+static constexpr auto OUTPUT_CLOCK_BYTES = tl::usize{64};
+static constexpr auto OUTPUT_CLOCK_POLLS = tl::u32{256};
+
+// Where a host wants output to go instead of a file descriptor, e.g. a
+// socket of its own or a string, see Output_Buffer::set_sink().
+class Output_Sink {
+ public:
+  Output_Sink()                                        = default;
+  virtual ~Output_Sink()                               = default;
+  Output_Sink(const Output_Sink &)                     = delete;
+  auto operator=(const Output_Sink &) -> Output_Sink & = delete;
+
+  virtual auto write(std::string_view bytes) -> void = 0;
+};
+
+/*
+ * Collects everything the guest writes to the console (OUT, PUTS, PUTSP...)
+ * and writes it to a file descriptor in large chunks, instead of one stdio
+ * call per character.
+ *
+ * The vm flushes it whenever the guest may be waiting on the user: before
+ * reading a key (GETC/IN, KBSR polls) and on HALT. Output that isn't followed
+ * by any of those is written once it reaches the size threshold, or once the
+ * oldest buffered byte is older than the interval: the vm calls poll() in
+ * between blocks of guest code while anything is pending, see set_watch().
+ */
+class Output_Buffer {
+  using Clock = std::chrono::steady_clock;
+
+ public:
+  explicit Output_Buffer(int fd = 1);
+  ~Output_Buffer();
+  Output_Buffer(const Output_Buffer &)                     = delete;
+  auto operator=(const Output_Buffer &) -> Output_Buffer & = delete;
+
+  auto put(char ch) -> void {
+    if (this->buffer_.empty()) { this->start_pending(); }
+    this->buffer_.push_back(ch);
+  }
+
+  auto write(std::string_view text) -> void {
+    if (this->buffer_.empty()) { this->start_pending(); }
+    this->buffer_.append(text);
+  }
+
+  // call after a batch of put()/write(), flushes if a threshold was crossed.
+  // The interval is only looked at every OUTPUT_CLOCK_BYTES bytes.
+  auto maybe_flush() -> void;
+  // flushes if the interval is over, for output that nothing else flushes.
+  // Only every OUTPUT_CLOCK_POLLS calls read the clock.
+  auto poll() -> void;
+  [[nodiscard]] auto pending() const noexcept -> bool {
+    return !this->buffer_.empty();
+  }
+  // *flag is set whenever output becomes pending, not owned. The owner
+  // clears it once pending() is false again.
+  auto set_watch(bool *flag) noexcept -> void { this->watch_ = flag; }
+
+  // writes out everything buffered so far.
+  auto flush() -> void;
+
+  // where flush() writes to from now on, -1 drops the output.
+  auto set_fd(int fd) -> void;
+  [[nodiscard]] auto fd() const noexcept -> int { return this->fd_; }
+  // or sink instead of the fd, not owned. nullptr goes back to the fd.
+  auto set_sink(Output_Sink *sink) -> void;
+
+  // keep everything flushed from now on in memory instead, see captured().
+  auto capture() -> void;
+  [[nodiscard]] auto captured() const noexcept -> const std::string & {
+    return this->captured_;
+  }
+
+  // everything the guest wrote so far, flushed or not.
+  [[nodiscard]] auto total_bytes() const noexcept -> tl::u64 {
+    return this->flushed_ + this->buffer_.size();
+  }
+
+  auto set_flush_threshold(tl::usize bytes) noexcept -> void {
+    this->flush_bytes_ = bytes;
+  }
+  auto set_flush_interval(std::chrono::milliseconds interval) noexcept -> void {
+    this->flush_interval_ = interval;
+  }
+
+ private:
+  auto start_pending() noexcept -> void {
+    this->oldest_ = Clock::time_point();  // the next look at the clock
+    this->clock_bytes_ = 0;
+    this->clock_polls_ = 0;
+    if (this->watch_) { *this->watch_ = true; }
+  }
+  // true once the oldest byte is older than the interval.
+  [[nodiscard]] auto overdue() -> bool;
+
+  int fd_;
+  Output_Sink *sink_{nullptr};
+  std::string buffer_;
+  tl::u64 flushed_{0};
+  bool capturing_{false};
+  std::string captured_;
+  // when the first look at the clock saw output pending, zero until then.
+  Clock::time_point oldest_{};
+  tl::usize clock_bytes_{0};  // buffer size at the last look
+  tl::u32 clock_polls_{0};
+  bool *watch_{nullptr};
+  tl::usize flush_bytes_{OUTPUT_FLUSH_BYTES};
+  std::chrono::milliseconds flush_interval_{OUTPUT_FLUSH_INTERVAL};
+};
+}  // namespace vm
@@ -0,0 +1,222 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <numeric>
+#include <string>
+#include <utility>
+
+#include "decoder.hpp"
+#include "fmt/format.h"
+#include "vm.hpp"
+
+namespace vm {
+namespace {
+// how many of the hottest addresses and subroutines the report lists.
+constexpr auto REPORT_TOP = tl::usize{20};
+
+[[nodiscard]] auto percent(tl::u64 part, tl::u64 total) -> double {
+  return total ? 100.0 * static_cast<double>(part) / static_cast<double>(total)
+               : 0.0;
+}
+
+// indices of the non zero counts, biggest first, at most top of them.
+template <typename Counts>
+[[nodiscard]] auto hottest(const Counts &counts, tl::usize top)
+  -> std::vector<tl::usize> {
+  auto order = std::vector<tl::usize>(counts.size());
+  std::iota(begin(order), end(order), 0);
+  std::erase_if(order, [&counts](auto i) { return counts[i] == 0; });
+  top = std::min(top, order.size());
+  std::partial_sort(begin(order),
+                    begin(order) + static_cast<std::ptrdiff_t>(top),
+                    end(order),
+                    [&counts](auto a, auto b) { return counts[a] > counts[b]; });
+  order.resize(top);
+  return order;
+}
+}  // namespace
+
+Profiler::Profiler()
+  : pcs_(LAS) {
+  // the root is wherever run() starts.
+  this->nodes_.push_back({PC_START, 0});
+}
+
+auto Profiler::trap(tl::u16 vector) -> void {
+  ++this->traps_[vector & 0xFF];  // NOLINT(hicpp-signed-bitwise)
+
+  // move the TRAP from the caller to a leaf of its own.
+  --this->nodes_[this->current_].self;
+  ++this->nodes_[this->child(this->current_, TRAP_KEY + vector)].self;
+}
+
+auto Profiler::uncount(tl::u16 pc, tl::u8 op, tl::u16 vector) -> void {
+  --this->ops_[op];
+  --this->pcs_[pc];
+  --this->total_;
+  if (op == Op_Code::TRAP) {
+    --this->traps_[vector & 0xFF];  // NOLINT(hicpp-signed-bitwise)
+    --this->nodes_[this->child(this->current_, TRAP_KEY + vector)].self;
+  } else {
+    --this->nodes_[this->current_].self;
+  }
+}
+
+auto Profiler::call(tl::u16 entry, tl::u16 return_to) -> void {
+  auto &subroutine = this->subroutines_[entry];
+  ++subroutine.calls;
+
+  // a call to a subroutine already on the stack (recursion, or a JSR that
+  // never returns) goes back to its frame, so the stack and the tree only
+  // grow with subroutines they haven't seen yet.
+  const auto found = std::ranges::find(this->frames_, entry, &Frame::entry);
+  if (found != this->frames_.end()) {
+    this->current_ = this->child(found->caller, entry);
+    return;
+  }
+
+  this->frames_.push_back({entry, return_to, this->current_, this->total_});
+  this->current_ = this->child(this->current_, entry);
+  ++subroutine.active;
+}
+
+auto Profiler::jump(tl::u16 target) -> void {
+  // a return to any frame on the stack unwinds everything above it too.
+  const auto found = std::ranges::find(this->frames_.rbegin(),
+                                       this->frames_.rend(),
+                                       target,
+                                       &Frame::return_to);
+  if (found == this->frames_.rend()) { return; }
+
+  const auto depth = this->frames_.size() -
+                     static_cast<tl::usize>(found - this->frames_.rbegin()) -
+                     1;
+  this->current_ = this->frames_[depth].caller;
+  while (this->frames_.size() > depth) {
+    this->leave(this->frames_.back());
+    this->frames_.pop_back();
+  }
+}
+
+auto Profiler::child(tl::u32 parent, tl::u32 key) -> tl::u32 {
+  const auto id = (tl::u64{parent} << 32) | key;  // NOLINT
+  const auto [it, added] =
+    this->children_.try_emplace(id, static_cast<tl::u32>(this->nodes_.size()));
+  if (added) { this->nodes_.push_back({key, parent}); }
+  return it->second;
+}
+
+auto Profiler::leave(const Frame &frame) -> void {
+  // a recursive subroutine only counts from its outermost call.
+  auto &subroutine = this->subroutines_[frame.entry];
+  if (--subroutine.active == 0) {
+    subroutine.inclusive += this->total_ - frame.start;
+  }
+}
+
+auto Profiler::write_report(std::FILE *out, std::span<const tl::u16> memory)
+  -> void {
+  // whatever never returned ends here.
+  while (!this->frames_.empty()) {
+    this->leave(this->frames_.back());
+    this->frames_.pop_back();
+  }
+  this->current_ = 0;
+
+  const auto total = this->total_;
+  fmt::print(out, "profile: {} instructions\n", total);
+
+  fmt::print(out, "\nop codes:\n");
+  for (const auto op : hottest(this->ops_, this->ops_.size())) {
+    fmt::print(out,
+               "  {:<6} {:>14} {:>6.2f}%\n",
+               OP_NAMES[op],
+               this->ops_[op],
+               percent(this->ops_[op], total));
+  }
+
+  if (const auto traps = hottest(this->traps_, this->traps_.size());
+      !traps.empty()) {
+    fmt::print(out, "\ntraps:\n");
+    for (const auto vector : traps) {
+      fmt::print(out, "  x{:02X}    {:>14}\n", vector, this->traps_[vector]);
+    }
+  }
+
+  fmt::print(out, "\nhottest addresses:\n");
+  for (const auto pc : hottest(this->pcs_, REPORT_TOP)) {
+    fmt::print(out,
+               "  x{:04X}  {:<6} {:>14} {:>6.2f}%\n",
+               pc,
+               OP_NAMES[decode(memory[pc]).op],
+               this->pcs_[pc],
+               percent(this->pcs_[pc], total));
+  }
+
+  // self instructions per subroutine, over every node it has in the tree.
+  auto self = std::unordered_map<tl::u16, tl::u64>();
+  for (const auto &node : this->nodes_) {
+    if (node.key < TRAP_KEY) { self[static_cast<tl::u16>(node.key)] += node.self; }
+  }
+
+  auto entries = std::vector<tl::u16>();
+  for (const auto &[entry, subroutine] : this->subroutines_) {
+    entries.push_back(entry);
+  }
+  std::ranges::sort(entries, [this](auto a, auto b) {
+    return this->subroutines_[a].inclusive > this->subroutines_[b].inclusive;
+  });
+  entries.resize(std::min(entries.size(), REPORT_TOP));
+
+  if (entries.empty()) { return; }
+  fmt::print(out,
+             "\nsubroutines:\n  {:<6} {:>10} {:>14} {:>14} {:>7}\n",
+             "entry",
+             "calls",
+             "self",
+             "inclusive",
+             "");
+  for (const auto entry : entries) {
+    const auto &subroutine = this->subroutines_[entry];
+    fmt::print(out,
+               "  x{:04X}  {:>10} {:>14} {:>14} {:>6.2f}%\n",
+               entry,
+               subroutine.calls,
+               self[entry],
+               subroutine.inclusive,
+               percent(subroutine.inclusive, total));
+  }
+}
+
+auto Profiler::write_folded(std::FILE *out) const -> void {
+  // nodes only ever come after their parent.
+  auto children = std::vector<std::vector<tl::u32>>(this->nodes_.size());
+  for (auto node = tl::u32{1}; node < this->nodes_.size(); ++node) {
+    children[this->nodes_[node].parent].push_back(node);
+  }
+
+  // depth first, each node's path is its parent's with its own name added.
+  auto path  = std::string();
+  auto stack = std::vector<std::pair<tl::u32, tl::usize>>{{0, 0}};
+  while (!stack.empty()) {
+    const auto [node, prefix] = stack.back();
+    stack.pop_back();
+
+    const auto &entry = this->nodes_[node];
+    path.resize(prefix);
+    if (node != 0) { path += ';'; }
+    if (entry.key >= TRAP_KEY) {
+      fmt::format_to(
+        std::back_inserter(path), "trap_x{:02X}", entry.key - TRAP_KEY);
+    } else {
+      fmt::format_to(std::back_inserter(path), "x{:04X}", entry.key);
+    }
+    if (entry.self != 0) { fmt::print(out, "{} {}\n", path, entry.self); }
+
+    for (const auto child : children[node]) {
+      stack.emplace_back(child, path.size());
+    }
+  }
+}
+}  // namespace vm
@@ -0,0 +1,92 @@
+#pragma once
+#include <array>
+#include <cstdio>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+/*
+ * Counts where a guest spends its instructions: per op code, per TRAP vector,
+ * per address and per subroutine.
+ *
+ * Subroutines are tracked through a call tree: JSR/JSRR enter a child of the
+ * current node, a JMP to the return address of a frame on the stack (RET,
+ * usually) leaves it again, along with anything called since that never
+ * returned. A call to a subroutine that is already on the stack goes back to
+ * its frame instead, so recursion (or a JSR that never returns) folds into
+ * one node. Every instruction counts for the node it ran in, a TRAP for a
+ * leaf of its own below it. The tree is what write_folded() writes out.
+ *
+ * The vm only feeds one while Features::profile is on, see vm.hpp.
+ */
+class Profiler {
+ public:
+  Profiler();
+
+  // the instruction at pc is about to run.
+  auto instruction(tl::u16 pc, tl::u8 op) noexcept -> void {
+    ++this->ops_[op];
+    ++this->pcs_[pc];
+    ++this->nodes_[this->current_].self;
+    ++this->total_;
+  }
+
+  // the TRAP that was just counted by instruction() was to vector.
+  auto trap(tl::u16 vector) -> void;
+  // takes back the instruction() (and trap(), with vector) at pc, which
+  // didn't run after all.
+  auto uncount(tl::u16 pc, tl::u8 op, tl::u16 vector) -> void;
+  // JSR/JSRR to entry, which returns to return_to.
+  auto call(tl::u16 entry, tl::u16 return_to) -> void;
+  // JMP/RET to target.
+  auto jump(tl::u16 target) -> void;
+
+  // hot spots, sorted: op codes, traps, addresses and subroutines. memory
+  // is only read to name the instructions at the hottest addresses.
+  auto write_report(std::FILE *out, std::span<const tl::u16> memory) -> void;
+  // one line per call stack, "x3000;x3120;trap_x21 42", which is what
+  // flamegraph.pl and friends read.
+  auto write_folded(std::FILE *out) const -> void;
+
+ private:
+  // a call tree node is for a subroutine entry address, or a TRAP vector
+  // past the addresses.
+  static constexpr auto TRAP_KEY = tl::u32{1} << 16;
+
+  struct Node {
+    tl::u32 key;
+    tl::u32 parent;
+    tl::u64 self{0};  // instructions run in here, not in a callee
+  };
+
+  struct Frame {
+    tl::u16 entry;
+    tl::u16 return_to;
+    tl::u32 caller;  // node to go back to
+    tl::u64 start;   // total_ at the call
+  };
+
+  struct Subroutine {
+    tl::u64 calls{0};
+    tl::u64 inclusive{0};  // instructions from the call to the return
+    tl::u32 active{0};     // frames on the stack, to count recursion once
+  };
+
+  [[nodiscard]] auto child(tl::u32 parent, tl::u32 key) -> tl::u32;
+  auto leave(const Frame &frame) -> void;
+
+  std::array<tl::u64, 16> ops_{};
+  std::array<tl::u64, 256> traps_{};
+  std::vector<tl::u64> pcs_;
+  tl::u64 total_{0};
+
+  std::vector<Node> nodes_;
+  std::unordered_map<tl::u64, tl::u32> children_;  // (parent, key) -> node
+  tl::u32 current_{0};
+  std::vector<Frame> frames_;
+  std::unordered_map<tl::u16, Subroutine> subroutines_;
+};
+}  // namespace vm
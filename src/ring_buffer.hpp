@@ -0,0 +1,64 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <bit>
+
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+/*
+ * Lock-free ring buffer for exactly one producer thread and one consumer
+ * thread.
+ *
+ * head_ is only written by the consumer and tail_ only by the producer, each
+ * on its own cache line. Each side also keeps the last index it saw of the
+ * other one, and only reloads it when the ring looks full (or empty), so a
+ * busy ring doesn't bounce both cache lines on every push. Capacity must be
+ * a power of two, indices run freely and are masked on access.
+ */
+template <typename T, tl::usize Capacity>
+class Spsc_Ring {
+  static_assert(std::has_single_bit(Capacity), "capacity must be 2^n");
+
+ public:
+  [[nodiscard]] auto try_push(const T &value) noexcept -> bool {
+    const auto tail = this->tail_.load(std::memory_order_relaxed);
+    if (tail - this->cached_head_ == Capacity) {
+      this->cached_head_ = this->head_.load(std::memory_order_acquire);
+      if (tail - this->cached_head_ == Capacity) { return false; }  // full
+    }
+    this->data_[tail & (Capacity - 1)] = value;
+    this->tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  [[nodiscard]] auto try_pop(T &value) noexcept -> bool {
+    const auto head = this->head_.load(std::memory_order_relaxed);
+    if (head == this->cached_tail_) {
+      this->cached_tail_ = this->tail_.load(std::memory_order_acquire);
+      if (head == this->cached_tail_) { return false; }  // empty
+    }
+    value = this->data_[head & (Capacity - 1)];
+    this->head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // room left, as seen from the producer.
+  [[nodiscard]] auto free_space() const noexcept -> tl::usize {
+    return Capacity - (this->tail_.load(std::memory_order_relaxed) -
+                       this->head_.load(std::memory_order_acquire));
+  }
+
+  [[nodiscard]] auto empty() const noexcept -> bool {
+    return this->head_.load(std::memory_order_relaxed) ==
+           this->tail_.load(std::memory_order_acquire);
+  }
+
+ private:
+  alignas(64) std::atomic<tl::usize> head_{0};
+  tl::usize cached_tail_{0};  // consumer's copy of tail_
+  alignas(64) std::atomic<tl::usize> tail_{0};
+  tl::usize cached_head_{0};  // producer's copy of head_
+  alignas(64) std::array<T, Capacity> data_{};
+};
+}  // namespace vm
@@ -0,0 +1,155 @@
+#include "scheduler.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <system_error>
+#include <thread>
+#include <utility>
+
+#ifndef _WIN32
+  #include <poll.h>
+
+  #include <cerrno>
+#endif
+
+#include "fmt/format.h"
+#include "input.hpp"
+
+namespace vm {
+namespace {
+// every parked session gets its turn, after a nap if block is set.
+template <typename Session>
+auto wake_all(std::vector<Session *> &parked,
+              std::deque<Session *> &ready,
+              bool block) -> void {
+  if (block) { std::this_thread::sleep_for(PARKED_NAP); }
+  ready.insert(end(ready), begin(parked), end(parked));
+  parked.clear();
+}
+
+// moves the parked sessions that may have a key by now to ready. Waits for
+// one if block is set and there is something to wait on. The errno of
+// poll() if it failed, then they all got their turn.
+template <typename Session>
+auto wake(std::vector<Session *> &parked,
+          std::deque<Session *> &ready,
+          bool block) -> int {
+#ifdef _WIN32
+  // no poll() on every kind of descriptor.
+  wake_all(parked, ready, block);
+  return 0;
+#else
+  auto fds = std::vector<pollfd>();
+  fds.reserve(parked.size());
+  for (const auto *session : parked) {
+    const auto *input = session->vm->input();
+    const auto fd     = input ? input->ready_fd() : -1;
+    fds.push_back(pollfd{fd, POLLIN, 0});  // poll() skips -1
+  }
+  // nothing to wait on: the ones without a descriptor go round again.
+  const auto waits = std::ranges::any_of(
+    fds, [](const pollfd &entry) { return entry.fd >= 0; });
+  const auto timeout = block && waits ? -1 : 0;
+  if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+    const auto error = errno;
+    wake_all(parked, ready, block);
+    return error;
+  }
+
+  auto still = tl::usize{0};
+  for (auto i = tl::usize{0}; i < parked.size(); ++i) {
+    if (fds[i].fd < 0 || fds[i].revents != 0) {
+      ready.push_back(parked[i]);
+    } else {
+      parked[still++] = parked[i];
+    }
+  }
+  parked.resize(still);
+  return 0;
+#endif
+}
+}  // namespace
+
+Scheduler::Scheduler(unsigned threads, tl::u64 slice)
+  : threads_(threads ? threads
+                     : std::max(1U, std::thread::hardware_concurrency()))
+  , slice_(slice) {}
+
+auto Scheduler::add(Virtual_Machine &vm, Done on_done) -> void {
+  this->sessions_.push_back(Session{&vm, std::move(on_done)});
+}
+
+auto Scheduler::set_diagnostics(Output_Sink *sink) noexcept -> void {
+  this->diagnostics_ = sink;
+}
+
+auto Scheduler::diagnose(std::string_view message) const -> void {
+  const auto lock = std::scoped_lock(this->diagnostics_lock_);
+  if (this->diagnostics_) {
+    this->diagnostics_->write(fmt::format("{}\n", message));
+  } else {
+    fmt::print(stderr, "{}\n", message);
+  }
+}
+
+auto Scheduler::run() -> void {
+  // contiguous shares, the calling thread runs the first.
+  const auto count   = this->sessions_.size();
+  const auto threads = std::min<tl::usize>(this->threads_, count);
+  const auto share   = [this, count, threads](tl::usize t) {
+    const auto first = count * t / threads;
+    const auto last  = count * (t + 1) / threads;
+    return std::span(this->sessions_).subspan(first, last - first);
+  };
+
+  {
+    auto loops = std::vector<std::jthread>();
+    loops.reserve(threads);
+    for (auto t = tl::usize{1}; t < threads; ++t) {
+      loops.emplace_back([this, sessions = share(t)] {
+        this->event_loop(sessions);
+      });
+    }
+    if (threads > 0) { this->event_loop(share(0)); }
+  }
+  this->sessions_.clear();
+}
+
+auto Scheduler::event_loop(std::span<Session> sessions) const -> void {
+  auto ready    = std::deque<Session *>();
+  auto parked   = std::vector<Session *>();
+  auto reported = false;
+  for (auto &session : sessions) { ready.push_back(&session); }
+
+  while (!ready.empty() || !parked.empty()) {
+    // sleeps only when every session waits for input.
+    const auto error =
+      parked.empty() ? 0 : wake(parked, ready, ready.empty());
+    if (error != 0 && !std::exchange(reported, true)) {
+      this->diagnose(fmt::format(
+        "scheduler: can't wait for input ({}), napping instead",
+        std::generic_category().message(error)));
+    }
+
+    // a round: every vm that was ready when it started gets one slice.
+    for (auto turns = ready.size(); turns > 0; --turns) {
+      auto *session = ready.front();
+      ready.pop_front();
+      switch (const auto exit = session->vm->run_for(this->slice_)) {
+        case Exit_Reason::out_of_budget:
+          ready.push_back(session);
+          break;
+        case Exit_Reason::waiting_for_input:
+          parked.push_back(session);
+          break;
+        case Exit_Reason::halted:
+        case Exit_Reason::bad_opcode:
+        case Exit_Reason::end_of_input:
+          if (session->on_done) { session->on_done(*session->vm, exit); }
+          break;
+      }
+    }
+  }
+}
+}  // namespace vm
@@ -0,0 +1,71 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "tl/numeric-aliases.hpp"
+#include "vm.hpp"
+
+namespace vm {
+// instructions a session runs before the next one gets its turn.
+static constexpr auto SLICE = tl::u64{100'000};
+
+// how long a thread naps when every session of it waits for a key and it
+// can't poll() their inputs, before they all get their turn again.
+static constexpr auto PARKED_NAP = std::chrono::milliseconds(10);
+
+/*
+ * Runs many vms on a few threads, a time slice at a time, see run_for().
+ *
+ * Every thread has an event loop over its share of the sessions and gives
+ * them their slices round robin. A session that waits for a key is parked
+ * until the ready_fd() of its input turns readable, so a mostly idle
+ * interactive session costs a poll() entry instead of a blocked thread. One
+ * whose input has no descriptor simply gets its turn again. Where poll()
+ * isn't there or fails (e.g. more sessions than the process may have
+ * descriptors), parked sessions get their turns after a PARKED_NAP instead.
+ *
+ * A session is done once it halts, hits a bad op code or reads past the end
+ * of its input (see set_stop_on_eof()), then on_done is called from the
+ * thread it ran on. The vms and their inputs and outputs belong to the
+ * caller, each is only touched by one thread until run() returns.
+ */
+class Scheduler {
+ public:
+  using Done = std::function<void(Virtual_Machine &, Exit_Reason)>;
+
+  // 0 threads means one per core.
+  explicit Scheduler(unsigned threads = 0, tl::u64 slice = SLICE);
+
+  [[nodiscard]] auto threads() const noexcept -> unsigned {
+    return this->threads_;
+  }
+
+  // sessions are added before run().
+  auto add(Virtual_Machine &vm, Done on_done = {}) -> void;
+  // where the scheduler says what went wrong (a failed poll()), not owned.
+  // stderr without one. Written to from the threads of run().
+  auto set_diagnostics(Output_Sink *sink) noexcept -> void;
+
+  // returns once every session is done.
+  auto run() -> void;
+
+ private:
+  struct Session {
+    Virtual_Machine *vm;
+    Done on_done;
+  };
+
+  auto event_loop(std::span<Session> sessions) const -> void;
+  auto diagnose(std::string_view message) const -> void;
+
+  unsigned threads_;
+  tl::u64 slice_;
+  std::vector<Session> sessions_;
+  Output_Sink *diagnostics_{nullptr};
+  mutable std::mutex diagnostics_lock_;
+};
+}  // namespace vm
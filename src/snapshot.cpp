@@ -0,0 +1,156 @@
+#include "snapshot.hpp"
+
+#include <cstdio>
+#include <tuple>
+#include <vector>
+
+#ifndef _WIN32
+  #include <unistd.h>
+#endif
+
+#include "fmt/format.h"
+#include "instructions.hpp"
+#include "utils.hpp"
+#include "vm.hpp"
+
+namespace vm {
+namespace {
+static_assert(sizeof(Snapshot_Header) == 576, "no padding");
+static_assert(std::tuple_size_v<decltype(Snapshot_Header::registers)> ==
+              REG_SIZE);
+static_assert(std::tuple_size_v<decltype(Snapshot_Header::os_vectors)> ==
+              TRAP_TABLE_SIZE);
+
+constexpr auto SNAPSHOT_SIZE = SNAPSHOT_MEMORY_OFFSET + LAS * sizeof(tl::u16);
+
+[[nodiscard]] auto check_header(const Snapshot_Header &header,
+                                const std::string &path) -> bool {
+  if (header.magic != SNAPSHOT_MAGIC) {
+    fmt::print(stderr, "not a snapshot: {}\n", path);
+    return false;
+  }
+  if (header.version != SNAPSHOT_VERSION) {
+    fmt::print(stderr,
+               "snapshot version {} instead of {}: {}\n",
+               header.version,
+               SNAPSHOT_VERSION,
+               path);
+    return false;
+  }
+  return true;
+}
+
+// the memory part of the snapshot in, nullptr if it is too short.
+[[nodiscard]] auto read_memory(std::FILE *in)
+  -> std::shared_ptr<const Memory_Image> {
+  if (std::fseek(in, 0, SEEK_END) != 0) { return nullptr; }
+  const auto size = std::ftell(in);
+  if (size < 0 || static_cast<tl::usize>(size) < SNAPSHOT_SIZE) {
+    return nullptr;
+  }
+#ifndef _WIN32
+  const auto page = static_cast<tl::usize>(sysconf(_SC_PAGESIZE));
+  if (SNAPSHOT_MEMORY_OFFSET % page == 0) {
+    const auto fd = dup(fileno(in));
+    return fd < 0 ? nullptr
+                  : Memory_Image::from_file(
+                      fd, SNAPSHOT_MEMORY_OFFSET, LAS * sizeof(tl::u16));
+  }
+#endif
+  // pages too big to map it.
+  auto words = std::vector<tl::u16>(LAS);
+  if (std::fseek(in, SNAPSHOT_MEMORY_OFFSET, SEEK_SET) != 0 ||
+      std::fread(words.data(), sizeof(tl::u16), LAS, in) != LAS) {
+    return nullptr;
+  }
+  return Memory_Image::create(std::as_bytes(std::span(words)));
+}
+}  // namespace
+
+auto Snapshot::open(const std::string &path) -> std::unique_ptr<Snapshot> {
+#ifdef _WIN32
+  std::FILE *in = nullptr;
+  fopen_s(&in, path.c_str(), "rb");
+#else
+  auto *in = std::fopen(path.c_str(), "rb");
+#endif
+  if (!in) {
+    fmt::print(stderr, "cannot open snapshot: {}\n", path);
+    return nullptr;
+  }
+
+  auto snapshot = std::unique_ptr<Snapshot>(new Snapshot());
+  auto &header  = snapshot->header_;
+  if (std::fread(&header, sizeof(header), 1, in) == 1 &&
+      check_header(header, path)) {
+    snapshot->memory_ = read_memory(in);
+    if (!snapshot->memory_) {
+      fmt::print(stderr, "snapshot cut off: {}\n", path);
+    }
+  } else if (std::ferror(in) || std::feof(in)) {
+    fmt::print(stderr, "not a snapshot: {}\n", path);
+  }
+  std::fclose(in);  // NOLINT
+  return snapshot->memory_ ? std::move(snapshot) : nullptr;
+}
+
+auto Virtual_Machine::save_snapshot(const std::string &path) const -> bool {
+  auto header           = Snapshot_Header{};
+  header.flags          = this->resume_ ? tl::u32{snapshot_resume} : 0;
+  if (this->keyboard_.status_ & INTERRUPT_ENABLE) {
+    header.flags |= snapshot_keyboard_interrupts;
+  }
+  if (this->timer_.interrupts_) { header.flags |= snapshot_timer_interrupts; }
+  if (this->between_) { header.flags |= snapshot_between_blocks; }
+  if (this->os_) { header.flags |= snapshot_os; }
+  if (this->prompted_) { header.flags |= snapshot_prompted; }
+  header.instructions   = this->instructions_;
+  header.registers      = this->register_;
+  header.timer_interval = this->timer_.interval_;
+  header.timer_next     = this->timer_.next_;
+  header.psr            = this->psr_;
+  header.saved_usp      = this->saved_usp_;
+  header.saved_ssp      = this->saved_ssp_;
+  header.os_vectors     = this->os_vectors_;
+  // only worked out when needed, see condition().
+  header.registers[Register::COND] = this->condition();
+
+  // never into path itself: this vm may run from a mapping of it.
+  auto file = Replacing_File(path);
+  auto *out = file.get();
+  if (!out) { return false; }
+
+  const auto padding =
+    std::array<char, SNAPSHOT_MEMORY_OFFSET - sizeof(Snapshot_Header)>{};
+  const auto written =
+    std::fwrite(&header, sizeof(header), 1, out) == 1 &&
+    std::fwrite(padding.data(), 1, padding.size(), out) == padding.size() &&
+    std::fwrite(this->memory_.data(), sizeof(tl::u16), LAS, out) == LAS;
+  return written && file.commit();
+}
+
+auto Virtual_Machine::restore(const Snapshot &snapshot) -> void {
+  const auto &header = snapshot.header();
+  this->load_image(snapshot.memory());
+  this->register_        = header.registers;
+  this->flags_           = FLAGS_IN_REGISTER;
+  this->instructions_    = header.instructions;
+  this->resume_          = (header.flags & snapshot_resume) != 0;
+  this->between_         = (header.flags & snapshot_between_blocks) != 0;
+  this->prompted_        = (header.flags & snapshot_prompted) != 0;
+  this->timer_.interval_ = header.timer_interval;
+  this->timer_.next_     = header.timer_next;
+  this->psr_             = header.psr;
+  this->saved_usp_       = header.saved_usp;
+  this->saved_ssp_       = header.saved_ssp;
+  this->keyboard_.status_ = (header.flags & snapshot_keyboard_interrupts) != 0
+                              ? INTERRUPT_ENABLE
+                              : tl::u16{0};
+  this->timer_.interrupts_ = (header.flags & snapshot_timer_interrupts) != 0;
+  this->update_events();
+  if (header.flags & snapshot_os) {
+    this->use_os();
+    this->os_vectors_ = header.os_vectors;
+  }
+}
+}  // namespace vm
@@ -0,0 +1,91 @@
+#pragma once
+/*
+ * Snapshots: the state of a Virtual_Machine in a file, so sessions can start
+ * from a guest that already went through its initialization instead of
+ * running it every time.
+ *
+ * Virtual_Machine::save_snapshot() writes one, Snapshot::open() reads one
+ * and Virtual_Machine::restore() puts a vm back to it. Restoring maps the
+ * snapshot's memory straight from the file, the vm only gets copies of the
+ * pages it writes to (see memory.hpp). An open Snapshot is never written
+ * to, so any number of vms, on any threads, can be restored from the same
+ * one, and they share its pages.
+ *
+ * File format, in host byte order: a Snapshot_Header, zeros up to
+ * SNAPSHOT_MEMORY_OFFSET, then all of memory. Memory starts on a page of its
+ * own, so it can be mapped.
+ */
+#include <array>
+#include <memory>
+#include <string>
+
+#include "memory.hpp"
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+static constexpr auto SNAPSHOT_MAGIC =
+  std::array<char, 8>{'L', 'C', '3', 'S', 'N', 'A', 'P', '\n'};
+
+// bumped whenever the layout changes, older snapshots are rejected rather
+// than converted. A snapshot from a host of the other byte order doesn't
+// match either.
+static constexpr auto SNAPSHOT_VERSION = tl::u32{3};
+
+static constexpr auto SNAPSHOT_MEMORY_OFFSET = tl::usize{4096};
+
+enum Snapshot_Flag : tl::u32 {
+  // the run stopped waiting for input, run() resumes it at the saved PC.
+  snapshot_resume = 1 << 0,
+  // the guest enabled the interrupts of the keyboard, of the timer.
+  snapshot_keyboard_interrupts = 1 << 1,
+  snapshot_timer_interrupts    = 1 << 2,
+  // it stopped in between two basic blocks, see stop_between().
+  snapshot_between_blocks = 1 << 3,
+  // an OS was loaded, its vector table is in Snapshot_Header::os_vectors.
+  snapshot_os = 1 << 4,
+  // it stopped in an IN that already printed its prompt.
+  snapshot_prompted = 1 << 5,
+};
+
+struct Snapshot_Header {
+  std::array<char, 8> magic = SNAPSHOT_MAGIC;
+  tl::u32 version{SNAPSHOT_VERSION};
+  tl::u32 flags{};
+  tl::u64 instructions{};
+  std::array<tl::u16, 10> registers{};  // R0-R7, PC, COND
+  tl::u16 timer_interval{};             // see Timer
+  tl::u16 reserved{};                   // zero, no padding in the file
+  tl::u64 timer_next{};
+  // the PSR without COND and the R6 of the other mode, see vm.hpp.
+  tl::u16 psr{};
+  tl::u16 saved_usp{};
+  tl::u16 saved_ssp{};
+  tl::u16 reserved2{};  // zero
+  // the trap vector table as the OS loaded it, see Virtual_Machine::use_os().
+  std::array<tl::u16, 256> os_vectors{};
+};
+
+class Snapshot {
+ public:
+  // nullptr if path can't be read or isn't a snapshot of this version, says
+  // why on stderr.
+  [[nodiscard]] static auto open(const std::string &path)
+    -> std::unique_ptr<Snapshot>;
+
+  Snapshot(const Snapshot &)                     = delete;
+  auto operator=(const Snapshot &) -> Snapshot & = delete;
+
+  [[nodiscard]] auto header() const noexcept -> const Snapshot_Header & {
+    return this->header_;
+  }
+  [[nodiscard]] auto memory() const noexcept -> const Memory_Image & {
+    return *this->memory_;
+  }
+
+ private:
+  Snapshot() = default;
+
+  Snapshot_Header header_;
+  std::shared_ptr<const Memory_Image> memory_;
+};
+}  // namespace vm
@@ -0,0 +1,62 @@
+#include "terminal.hpp"
+
+#ifdef _WIN32
+  #include <windows.h>
+#endif
+
+#ifdef linux
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/termios.h>
+  #include <sys/time.h>
+  #include <sys/types.h>
+  #include <unistd.h>
+#endif
+
+#include <cstdlib>
+
+#include "fmt/format.h"
+#include "input.hpp"
+
+// Input buffering windows
+#ifdef _WIN32
+HANDLE hStdin = INVALID_HANDLE_VALUE;  // NOLINT
+DWORD fdwMode;                         // NOLINT
+DWORD fdwOldMode;                      // NOLINT
+
+auto disable_input_buffering() -> void {
+  hStdin = GetStdHandle(STD_INPUT_HANDLE);
+  GetConsoleMode(hStdin, &fdwOldMode);  // save old mode
+
+  // no input echo and return when one or more characters are available
+  fdwMode = fdwOldMode ^ ENABLE_ECHO_INPUT ^ ENABLE_LINE_INPUT;  // NOLINT
+
+  SetConsoleMode(hStdin, fdwMode);  // set new mode
+  FlushConsoleInputBuffer(hStdin);  // clear buffer
+}
+
+auto restore_input_buffering() -> void { SetConsoleMode(hStdin, fdwOldMode); }
+#endif
+
+// Input buffering linux
+#ifdef linux
+struct termios original_tio;
+
+auto disable_input_buffering() -> void {
+  tcgetattr(STDIN_FILENO, &original_tio);
+  struct termios new_tio = original_tio;
+  new_tio.c_lflag &= ~ICANON & ~ECHO;
+  tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+auto restore_input_buffering() -> void {
+  tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+#endif
+
+auto handle_interrupt([[maybe_unused]] int signal) -> void {
+  vm::interrupt_console_input();
+  restore_input_buffering();
+  fmt::print("\n");
+  std::exit(-2);  // NOLINT
+}
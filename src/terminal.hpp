@@ -0,0 +1,9 @@
+#pragma once
+// The terminal of the vm executable: raw keys while the guest runs, back to
+// normal when it stops or on SIGINT. Process wide, so not in the library.
+
+auto disable_input_buffering() -> void;
+
+auto restore_input_buffering() -> void;
+
+auto handle_interrupt(int signal) -> void;
@@ -0,0 +1,237 @@
+#include "trace.hpp"
+
+#include <algorithm>
+
+#include "opcodes.hpp"
+
+namespace vm {
+namespace {
+// the header byte: Trace_Flag bits, COND, and which fields are spelled out.
+constexpr auto COND_SHIFT = 3;
+constexpr auto NEW_PC     = tl::u8{1} << 6;
+constexpr auto NEW_INSTR  = tl::u8{1} << 7;
+
+// encoded bytes the writer collects before each fwrite(), and the most a
+// single record can take: header, pc, instruction and three varints.
+constexpr auto WRITE_CHUNK = tl::usize{1} << 16;
+constexpr auto MAX_RECORD  = tl::usize{1 + 2 + 2 + 3 * 3};
+
+// 16 bit differences as small unsigned numbers: 0, -1, 1, -2...
+[[nodiscard]] auto zigzag(tl::u16 delta) noexcept -> tl::u16 {
+  const auto value = static_cast<tl::i16>(delta);
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  return static_cast<tl::u16>((value << 1) ^ (value >> 15));
+}
+
+[[nodiscard]] auto unzigzag(tl::u16 value) noexcept -> tl::u16 {
+  // NOLINTNEXTLINE(hicpp-signed-bitwise)
+  return static_cast<tl::u16>((value >> 1) ^ -(value & 1));
+}
+
+// these write at out and move it past what they wrote.
+auto put_varint(tl::u8 *&out, tl::u16 value) noexcept -> void {
+  while (value >= 0x80) {
+    // NOLINTNEXTLINE(hicpp-signed-bitwise)
+    *out++ = static_cast<tl::u8>(value | 0x80);
+    value >>= 7;  // NOLINT(hicpp-signed-bitwise)
+  }
+  *out++ = static_cast<tl::u8>(value);
+}
+
+auto put_u16(tl::u8 *&out, tl::u16 value) noexcept -> void {
+  *out++ = static_cast<tl::u8>(value);
+  *out++ = static_cast<tl::u8>(value >> 8);  // NOLINT
+}
+}  // namespace
+
+auto destination_register(tl::u16 instruction) noexcept -> tl::u16 {
+  switch (instruction >> 12) {  // NOLINT(hicpp-signed-bitwise)
+    case Op_Code::JSR:
+      return Register::R7;
+    case Op_Code::TRAP:
+      return Register::R0;
+    default:
+      return (instruction >> 9) & Mask::Three_Bits;  // NOLINT
+  }
+}
+
+auto Trace_Writer::open(const std::string &path)
+  -> std::unique_ptr<Trace_Writer> {
+#ifdef _WIN32
+  std::FILE *out = nullptr;
+  fopen_s(&out, path.c_str(), "wb");
+#else
+  auto *out = std::fopen(path.c_str(), "wb");
+#endif
+  if (!out) { return nullptr; }
+  return std::unique_ptr<Trace_Writer>(new Trace_Writer(out));
+}
+
+Trace_Writer::Trace_Writer(std::FILE *out)
+  : out_(out)
+  , buffer_(WRITE_CHUNK + MAX_RECORD) {
+  std::ranges::copy(TRACE_MAGIC, this->buffer_.data());
+  this->used_ = TRACE_MAGIC.size();
+  this->writer_ = std::thread([this] { this->write_loop(); });
+}
+
+Trace_Writer::~Trace_Writer() { this->close(); }
+
+auto Trace_Writer::close() -> bool {
+  if (this->writer_.joinable()) {
+    this->done_.store(true, std::memory_order_release);
+    this->wakeups_.fetch_add(1, std::memory_order_release);
+    this->wakeups_.notify_one();
+    this->writer_.join();
+  }
+  if (this->out_) {
+    this->failed_ = std::fclose(this->out_) != 0 || this->failed_;  // NOLINT
+    this->out_    = nullptr;
+  }
+  return !this->failed_;
+}
+
+auto Trace_Writer::wait_for_room() -> void {
+  // the writer sleeps until the ring fills up, so the vm doesn't pay for a
+  // wakeup per record. Then the vm sleeps until it made room.
+  const auto seen = this->drains_.load(std::memory_order_acquire);
+  this->wakeups_.fetch_add(1, std::memory_order_release);
+  this->wakeups_.notify_one();
+  if (this->ring_.free_space() == 0) { this->drains_.wait(seen); }
+}
+
+auto Trace_Writer::write_loop() -> void {
+  auto record  = Trace_Record{};
+  auto records = tl::u64{0};
+  for (;;) {
+    // everything pushed before done_ was set gets drained below.
+    const auto seen = this->wakeups_.load(std::memory_order_acquire);
+    const auto done = this->done_.load(std::memory_order_acquire);
+
+    auto drained = false;
+    while (this->ring_.try_pop(record)) {
+      this->encode(record);
+      ++records;
+      drained = true;
+      if (this->used_ >= WRITE_CHUNK) { this->write_out(); }
+    }
+    this->records_.store(records, std::memory_order_relaxed);
+    this->drains_.fetch_add(1, std::memory_order_release);
+    this->drains_.notify_one();
+
+    if (done) { break; }
+    if (!drained) { this->wakeups_.wait(seen); }
+  }
+  this->write_out();
+}
+
+auto Trace_Writer::write_out() -> void {
+  if (this->used_ == 0) { return; }
+  const auto written =
+    std::fwrite(this->buffer_.data(), 1, this->used_, this->out_);
+  this->failed_ = this->failed_ || written != this->used_;
+  this->used_   = 0;
+}
+
+auto Trace_Writer::encode(const Trace_Record &record) -> void {
+  auto &codec  = this->codec_;
+  auto *header = this->buffer_.data() + this->used_;
+  auto *out    = header + 1;
+
+  *header = static_cast<tl::u8>(
+    record.flags | (record.cond << COND_SHIFT));  // NOLINT
+  const auto new_pc = record.pc != static_cast<tl::u16>(codec.pc + 1);
+  const auto new_instr = codec.instructions[record.pc] != record.instruction;
+  if (new_pc) { *header |= NEW_PC; }
+  if (new_instr) { *header |= NEW_INSTR; }
+
+  if (new_pc) { put_u16(out, record.pc); }
+  if (new_instr) {
+    put_u16(out, record.instruction);
+    codec.instructions[record.pc] = record.instruction;
+  }
+  codec.pc = record.pc;
+
+  if (record.flags & trace_result) {
+    auto &last = codec.registers[destination_register(record.instruction)];
+    put_varint(out, zigzag(static_cast<tl::u16>(record.result - last)));
+    last = record.result;
+  }
+  if (record.flags & (trace_load | trace_store)) {
+    put_varint(out,
+               zigzag(static_cast<tl::u16>(record.address - codec.address)));
+    // a load's value is its result.
+    if (!(record.flags & trace_load)) { put_varint(out, record.value); }
+    codec.address = record.address;
+  }
+  this->used_ = static_cast<tl::usize>(out - this->buffer_.data());
+}
+
+Trace_Reader::Trace_Reader(std::FILE *in)
+  : in_(in) {
+  auto magic = std::string(TRACE_MAGIC.size(), '\0');
+  this->valid_ = std::fread(magic.data(), 1, magic.size(), in) ==
+                   magic.size() &&
+                 magic == TRACE_MAGIC;
+}
+
+auto Trace_Reader::next(Trace_Record &record) -> bool {
+  auto &codec       = this->codec_;
+  const auto header = std::fgetc(this->in_);
+  if (header == EOF) { return false; }
+
+  record       = Trace_Record{};
+  record.flags = static_cast<tl::u8>(header & Mask::Three_Bits);  // NOLINT
+  record.cond  = static_cast<tl::u8>((header >> COND_SHIFT) &  // NOLINT
+                                    Mask::Three_Bits);
+
+  record.pc = static_cast<tl::u16>(codec.pc + 1);
+  if ((header & NEW_PC) && !this->read_u16(record.pc)) { return false; }
+  codec.pc = record.pc;
+
+  if (header & NEW_INSTR) {
+    if (!this->read_u16(record.instruction)) { return false; }
+    codec.instructions[record.pc] = record.instruction;
+  } else {
+    record.instruction = static_cast<tl::u16>(codec.instructions[record.pc]);
+  }
+
+  auto delta = tl::u16{};
+  if (record.flags & trace_result) {
+    if (!this->read_varint(delta)) { return false; }
+    auto &last    = codec.registers[destination_register(record.instruction)];
+    last          = static_cast<tl::u16>(last + unzigzag(delta));
+    record.result = last;
+  }
+  if (record.flags & (trace_load | trace_store)) {
+    if (!this->read_varint(delta)) { return false; }
+    if (record.flags & trace_load) {
+      record.value = record.result;
+    } else if (!this->read_varint(record.value)) {
+      return false;
+    }
+    codec.address  = static_cast<tl::u16>(codec.address + unzigzag(delta));
+    record.address = codec.address;
+  }
+  return true;
+}
+
+auto Trace_Reader::read_u16(tl::u16 &value) -> bool {
+  const auto low  = std::fgetc(this->in_);
+  const auto high = std::fgetc(this->in_);
+  if (low == EOF || high == EOF) { return false; }
+  value = static_cast<tl::u16>(low | (high << 8));  // NOLINT
+  return true;
+}
+
+auto Trace_Reader::read_varint(tl::u16 &value) -> bool {
+  value = 0;
+  for (auto shift = 0; shift < 16; shift += 7) {
+    const auto byte = std::fgetc(this->in_);
+    if (byte == EOF) { return false; }
+    value = static_cast<tl::u16>(value | ((byte & 0x7F) << shift));  // NOLINT
+    if (!(byte & 0x80)) { return true; }  // NOLINT
+  }
+  return false;
+}
+}  // namespace vm
@@ -0,0 +1,136 @@
+#pragma once
+/*
+ * Instruction traces: one Trace_Record per executed instruction.
+ *
+ * While Features::trace is on, the run loop fills in a record for every
+ * instruction and pushes it into a Trace_Writer's lock-free ring. The
+ * writer's own thread compresses the records and streams them to a file,
+ * so the vm never formats or writes anything itself. Trace_Reader reads
+ * such a file back, see tools/lc3_trace.cpp.
+ *
+ * File format: TRACE_MAGIC, then one encoded record after the other. An
+ * encoded record starts with a byte of Trace_Flag bits and COND, followed by
+ * only the fields that can't be predicted from the records before it:
+ *  - pc (2 bytes) unless it is the previous pc + 1,
+ *  - the instruction (2 bytes) unless it is the same as the last time pc ran,
+ *  - the result, the change to the destination register as a varint,
+ *  - the address, the change from the last load/store address as a varint,
+ *  - the value stored, as a varint (a load's value is its result).
+ */
+#include <atomic>
+#include <array>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "ring_buffer.hpp"
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+// which of the optional fields a Trace_Record has.
+enum Trace_Flag : tl::u8 {
+  trace_result = 1 << 0,  // wrote the register destination_register() says
+  trace_load   = 1 << 1,  // read value from address, into the result
+  trace_store  = 1 << 2,  // wrote value to address
+};
+
+struct Trace_Record {
+  tl::u16 pc{};
+  tl::u16 instruction{};  // the raw word at pc
+  tl::u16 result{};       // the destination register afterwards
+  tl::u16 address{};
+  tl::u16 value{};
+  tl::u8 cond{};  // COND afterwards
+  tl::u8 flags{};
+};
+
+// the register instruction leaves its result in, for trace_result.
+[[nodiscard]] auto destination_register(tl::u16 instruction) noexcept
+  -> tl::u16;
+
+static constexpr auto TRACE_MAGIC = std::string_view("LC3TRACE1\n");
+
+// records in flight between the vm and the writer thread.
+static constexpr auto TRACE_RING = tl::usize{1} << 14;
+
+// the delta and varint state shared by the encoder and the decoder.
+struct Trace_Codec {
+  tl::u16 pc{};
+  tl::u16 address{};
+  std::array<tl::u16, 8> registers{};
+  // the last instruction seen at each pc, NO_INSTRUCTION before the first.
+  static constexpr auto NO_INSTRUCTION = tl::u32{1} << 16;
+  std::vector<tl::u32> instructions =
+    std::vector<tl::u32>(tl::usize{1} << 16, NO_INSTRUCTION);
+};
+
+class Trace_Writer {
+ public:
+  // nullptr if path can't be opened for writing.
+  [[nodiscard]] static auto open(const std::string &path)
+    -> std::unique_ptr<Trace_Writer>;
+
+  ~Trace_Writer();
+  Trace_Writer(const Trace_Writer &)                     = delete;
+  auto operator=(const Trace_Writer &) -> Trace_Writer & = delete;
+
+  // from the vm thread. Waits for the writer if the ring is full, a trace
+  // never drops records.
+  auto push(const Trace_Record &record) -> void {
+    while (!this->ring_.try_push(record)) [[unlikely]] {
+      this->wait_for_room();
+    }
+  }
+
+  // writes out everything pushed so far, stops the thread and closes the
+  // file. false if anything failed to write.
+  auto close() -> bool;
+
+  // records written so far (all of them once close() returned).
+  [[nodiscard]] auto records() const noexcept -> tl::u64 {
+    return this->records_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  explicit Trace_Writer(std::FILE *out);
+  auto wait_for_room() -> void;
+  auto write_loop() -> void;
+  auto encode(const Trace_Record &record) -> void;
+  auto write_out() -> void;
+
+  std::FILE *out_;
+  Spsc_Ring<Trace_Record, TRACE_RING> ring_;
+  std::atomic<bool> done_{false};
+  std::atomic<tl::u32> wakeups_{0};  // bumped when the ring fills, by close()
+  std::atomic<tl::u32> drains_{0};   // bumped after the writer emptied the ring
+  std::atomic<tl::u64> records_{0};
+  bool failed_{false};
+  Trace_Codec codec_;
+  std::vector<tl::u8> buffer_;
+  tl::usize used_{0};  // bytes of buffer_ encoded, not written yet
+  std::thread writer_;
+};
+
+class Trace_Reader {
+ public:
+  // reads from in (not owned), false from valid() unless it starts with
+  // TRACE_MAGIC.
+  explicit Trace_Reader(std::FILE *in);
+
+  [[nodiscard]] auto valid() const noexcept -> bool { return this->valid_; }
+
+  // false at the end of the trace, or if it is cut off.
+  [[nodiscard]] auto next(Trace_Record &record) -> bool;
+
+ private:
+  [[nodiscard]] auto read_u16(tl::u16 &value) -> bool;
+  [[nodiscard]] auto read_varint(tl::u16 &value) -> bool;
+
+  std::FILE *in_;
+  bool valid_{false};
+  Trace_Codec codec_;
+};
+}  // namespace vm
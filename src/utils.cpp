@@ -1,81 +1,16 @@
 #include "utils.hpp"
 
-#ifdef _WIN32
-  #include <conio.h>  // _kbhit
-  #include <windows.h>
-#endif
-
-#ifdef linux
-  #include <fcntl.h>
-  #include <sys/mman.h>
-  #include <sys/termios.h>
-  #include <sys/time.h>
-  #include <sys/types.h>
-  #include <unistd.h>
-#endif
+#include <filesystem>
+#include <system_error>
+#include <utility>
 
-#include <cstdint>
-#include <cstdlib>
-
-#include "fmt/format.h"
-
-// Input buffering windows
 #ifdef _WIN32
-HANDLE hStdin = INVALID_HANDLE_VALUE;  // NOLINT
-DWORD fdwMode;                         // NOLINT
-DWORD fdwOldMode;                      // NOLINT
-
-auto check_key() -> uint16_t {
-  return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
-}
-
-auto disable_input_buffering() -> void {
-  hStdin = GetStdHandle(STD_INPUT_HANDLE);
-  GetConsoleMode(hStdin, &fdwOldMode);  // save old mode
-
-  // no input echo and return when one or more characters are available
-  fdwMode = fdwOldMode ^ ENABLE_ECHO_INPUT ^ ENABLE_LINE_INPUT;  // NOLINT
-
-  SetConsoleMode(hStdin, fdwMode);  // set new mode
-  FlushConsoleInputBuffer(hStdin);  // clear buffer
-}
-
-auto restore_input_buffering() -> void { SetConsoleMode(hStdin, fdwOldMode); }
-#endif
-
-// Input buffering linux
-#ifdef linux
-auto check_key() -> uint16_t {
-  fd_set readfds;
-  FD_ZERO(&readfds);
-  FD_SET(STDIN_FILENO, &readfds);
-
-  struct timeval timeout;
-  timeout.tv_sec  = 0;
-  timeout.tv_usec = 0;
-  return select(1, &readfds, NULL, NULL, &timeout) != 0;
-}
-
-struct termios original_tio;
-
-auto disable_input_buffering() -> void {
-  tcgetattr(STDIN_FILENO, &original_tio);
-  struct termios new_tio = original_tio;
-  new_tio.c_lflag &= ~ICANON & ~ECHO;
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
-}
-
-auto restore_input_buffering() -> void {
-  tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
-}
+  #include <io.h>
+#else
+  #include <sys/stat.h>
+  #include <unistd.h>
 #endif
 
-auto handle_interrupt([[maybe_unused]] int signal) -> void {
-  restore_input_buffering();
-  fmt::print("\n");
-  std::exit(-2);  // NOLINT
-}
-
 namespace vm {
 [[nodiscard]] auto sign_extend(tl::u16 x, tl::u16 bit_count) noexcept
   -> tl::u16 {
@@ -87,9 +22,46 @@ namespace vm {
   return x;
 }
 
-[[nodiscard]] auto destination(const std::bitset<16> &instr) noexcept
-  -> tl::u16 {
-  // NOLINTNEXTLINE(hicpp-signed-bitwise)
-  return static_cast<tl::u16>((instr >> 9).to_ulong() & 0x7);
+Replacing_File::Replacing_File(std::string path)
+  : path_(std::move(path)) {
+#ifdef _WIN32
+  this->temporary_ = this->path_ + ".partial";
+  fopen_s(&this->file_, this->temporary_.c_str(), "wb");
+#else
+  // unique, so vms saving to the same path don't write into each other.
+  auto name = this->path_ + ".XXXXXX";
+  const auto fd = mkstemp(name.data());
+  if (fd < 0) { return; }
+  // mkstemp() makes it private, fopen() would not have.
+  fchmod(fd, 0644);  // NOLINT
+  this->temporary_ = name;
+  this->file_      = fdopen(fd, "wb");
+  if (!this->file_) { close(fd); }
+#endif
+}
+
+Replacing_File::~Replacing_File() {
+  if (this->file_) { std::fclose(this->file_); }  // NOLINT
+  if (!this->temporary_.empty()) { std::remove(this->temporary_.c_str()); }
+}
+
+auto Replacing_File::commit() -> bool {
+  if (!this->file_) { return false; }
+  auto *file  = std::exchange(this->file_, nullptr);
+  auto synced = std::fflush(file) == 0;
+#ifdef _WIN32
+  synced = synced && _commit(_fileno(file)) == 0;
+#else
+  synced = synced && fsync(fileno(file)) == 0;
+#endif
+  synced = std::fclose(file) == 0 && synced;  // NOLINT
+  if (!synced) { return false; }
+
+  // std::filesystem replaces an existing path on every platform.
+  auto error = std::error_code();
+  std::filesystem::rename(this->temporary_, this->path_, error);
+  if (error) { return false; }
+  this->temporary_.clear();
+  return true;
 }
 }  // namespace vm
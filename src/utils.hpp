@@ -1,20 +1,35 @@
 #pragma once
-#include <bitset>
 #include <cstdint>
-
-auto check_key() -> uint16_t;
-
-auto disable_input_buffering() -> void;
-
-auto restore_input_buffering() -> void;
-
-auto handle_interrupt(int signal) -> void;
+#include <cstdio>
+#include <string>
 
 namespace vm {
 #include "tl/numeric-aliases.hpp"
 
 [[nodiscard]] auto sign_extend(tl::u16 x, tl::u16 bit_count) noexcept
   -> tl::u16;
-[[nodiscard]] auto destination(const std::bitset<16> &instr) noexcept
-  -> tl::u16;
+
+// a file that replaces path once it is complete: it is written next to path
+// and renamed over it by commit(). Snapshots and images are mapped by the
+// vms that run from them, writing into path itself would change (or cut)
+// their memory under them.
+class Replacing_File {
+ public:
+  explicit Replacing_File(std::string path);
+  // removes the unfinished file unless commit() renamed it.
+  ~Replacing_File();
+  Replacing_File(const Replacing_File &)                     = delete;
+  auto operator=(const Replacing_File &) -> Replacing_File & = delete;
+
+  // nullptr if the file couldn't be created.
+  [[nodiscard]] auto get() const noexcept -> std::FILE * { return this->file_; }
+  // closes the file, syncs it to disk and renames it over path. false if any
+  // of that failed, path is untouched then.
+  [[nodiscard]] auto commit() -> bool;
+
+ private:
+  std::string path_;
+  std::string temporary_;
+  std::FILE *file_{nullptr};
+};
 }  // namespace vm
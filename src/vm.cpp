@@ -1,424 +1,579 @@
 #include "vm.hpp"
 
 #include <algorithm>
-#include <bitset>
-#include <cstdio>  // std::getchar, std::FILE
-#include <ranges>
+#include <thread>
+#include <utility>
 
+#include "decoder.hpp"
 #include "fmt/format.h"
-#include "utils.hpp"
+#include "instructions.hpp"
+#include "native.hpp"
 
 namespace vm {
+namespace {
+// LAS undecoded entries, what every decoded cache starts out as.
+[[nodiscard]] auto undecoded() -> const Memory_Image & {
+  static const auto image = [] {
+    const auto entries = std::vector<Decoded_Instruction>(LAS);
+    return Memory_Image::create(std::as_bytes(std::span(entries)));
+  }();
+  return *image;
+}
+}  // namespace
+
+Virtual_Machine::Virtual_Machine() {
+  this->decoded_.map(undecoded());
+  this->output_.set_watch(&this->events_);
+
+  this->attach(this->keyboard_,
+               Mapped_Reg::key_status_reg,
+               Mapped_Reg::key_data_reg);
+  this->attach(this->display_,
+               Mapped_Reg::display_status_reg,
+               Mapped_Reg::display_data_reg);
+  this->attach(
+    this->timer_, Mapped_Reg::timer_status_reg, Mapped_Reg::timer_interval_reg);
+}
 
-auto Virtual_Machine::run() -> void {  // NOLINT
-  this->register_[Register::PC] = PC_START;
+Virtual_Machine::~Virtual_Machine() = default;
+
+auto Virtual_Machine::run() -> Exit_Reason {
+  const auto resume  = this->resume_;
+  const auto between = std::exchange(this->between_, false);
+  // waiting on an input nothing can push to would never end.
+  const auto parking = this->parking_;
+  this->parking_     = parking || (this->input_ && this->input_->parks());
+  if (!resume) {
+    this->register_[Register::PC] = PC_START;
+    this->prompted_               = false;
+  }
 
   this->running_ = true;
+  this->exit_    = Exit_Reason::halted;
+  this->blank_   = false;
+
+  // the instruction clock and the profiler count instructions too.
+  auto active   = this->features_;
+  active.budget = this->deadline_ != NO_DEADLINE;
+  active.count  = active.count || active.profile || active.budget ||
+                 this->timer_.on_instruction_clock();
+  active.trace = active.trace && this->tracer_;
+  // compiled blocks only bump the counter if it was on when they were
+  // compiled.
+  if (active.count != this->active_.count) { this->jit_.reset(); }
+  this->active_ = active;
+
+  if (!resume) { this->output_.write("Starting lc-3 virtual machine\n"); }
+  if (resume && between) { this->end_block(); }
+
+  switch (this->engine_) {
+    case Engine::switch_loop:
+      this->run_switch();
+      break;
+    case Engine::threaded:
+      this->run_threaded();
+      break;
+    case Engine::jit:
+      this->run_jit();
+      break;
+    case Engine::native:
+      this->run_native();
+      break;
+  }
 
-  fmt::print("{}\n", "Starting lc-3 virtual machine");
+  // the instruction that asked for a key didn't finish. It only read, so it
+  // can simply run again once there is input (IN without its prompt).
+  const auto waiting = this->exit_ == Exit_Reason::end_of_input ||
+                       this->exit_ == Exit_Reason::waiting_for_input;
+  this->resume_ = waiting || this->exit_ == Exit_Reason::out_of_budget;
+  if (waiting) {
+    --this->register_[Register::PC];
+    if (active.count) { --this->instructions_; }
+  }
 
-  while (this->running_) {
-    // load the instruction from memory
-    const auto instruction =
-      std::bitset<16>(this->read_memory(this->register_[Register::PC]));
+  this->output_.flush();
+  this->parking_ = parking;
+  return this->exit_;
+}
 
-    this->register_[Register::PC]++;  // increment the memory in PC
+auto Virtual_Machine::run_for(tl::u64 budget) -> Exit_Reason {
+  // just short of NO_DEADLINE, which would mean no budget at all.
+  const auto left = NO_DEADLINE - 1 - this->instructions_;
+  this->deadline_ = this->instructions_ + std::min(budget, left);
+  this->parking_  = true;
+  const auto exit = this->run();
+  this->deadline_ = NO_DEADLINE;
+  this->parking_  = false;
+  return exit;
+}
 
-    // Instruction set is 16 bit. the first 4 bits store the opcode.
-    // To get the opcodes we right-shift by 12.
-    const auto op = instruction >> 12;
+auto Virtual_Machine::step() -> Exit_Reason {
+  const auto engine = std::exchange(this->engine_, Engine::switch_loop);
+  const auto exit   = this->run_for(1);
+  this->engine_     = engine;
+  return exit;
+}
 
-    switch (op.to_ulong()) {
-      case Op_Code::BR: {
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto condition = (instruction >> 9).to_ulong() & 0x7;
-        if (condition & this->register_[Register::COND]) {
-          this->register_[Register::PC] += sign_extend(
-            // NOLINTNEXTLINE(hicpp-signed-bitwise)
-            (static_cast<tl::u16>(instruction.to_ulong()) & 0x1FF),
-            9);
-        }
-        break;
-      }
-      case Op_Code::ADD: {
-        // 5th bit in the instructions: immediate mode or register mode
-        // 0 -> register mode
-        // 1 -> immediate mode (reads the value from the instructions)
-
-        // we do this because the registers are only 3 bits (INDEX)
-        // 0b111
-        const auto dr = destination(instruction);
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto sr1 = (instruction >> 6).to_ulong() & 0x7;
+auto Virtual_Machine::set_engine(Engine engine) noexcept -> void {
+  this->engine_ = engine;
+}
 
-        if (instruction.test(5)) {  // immediate mode
-          // bit [4:0] & 0b11111
-          // NOLINTNEXTLINE(hicpp-signed-bitwise)
-          const auto imm5 = instruction.to_ulong() & 0x1F;
-          this->register_[dr] =
-            this->register_[sr1] +
-            sign_extend(static_cast<tl::u16>(imm5), 5);  // imm5 is 5bits.
+auto Virtual_Machine::set_jit_threshold(tl::u32 threshold) noexcept -> void {
+  this->jit_threshold_ = threshold;
+}
 
-        } else {  // register mode
+auto Virtual_Machine::set_fusion(bool fusion) -> void {
+  if (fusion == this->fusion_) { return; }
+  this->fusion_ = fusion;
+  this->decoded_.map(undecoded());
+}
 
-          // NOLINTNEXTLINE(hicpp-signed-bitwise)
-          const auto sr2      = instruction.to_ulong() & 0x7;
-          this->register_[dr] = this->register_[sr1] + this->register_[sr2];
-        }
+auto Virtual_Machine::output() noexcept -> Output_Buffer & {
+  return this->output_;
+}
 
-        // set condition flags
-        this->update_flags(static_cast<tl::u16>(dr));
-        break;
-      }
-      case Op_Code::LD: {
-        // loads the content of an address
-        const auto dr = destination(instruction);
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto pc_offset9 = instruction.to_ulong() & 0x1FF;
-        const auto sext_pc_offset9 =
-          sign_extend(static_cast<tl::u16>(pc_offset9), 9);
-        const auto mem_location =
-          tl::u16(this->register_[Register::PC] + sext_pc_offset9);
+auto Virtual_Machine::registers() const noexcept
+  -> std::array<tl::u16, REG_SIZE> {
+  auto registers            = this->register_;
+  registers[Register::COND] = this->condition();
+  return registers;
+}
 
-        this->register_[dr] = this->read_memory(mem_location);
-        this->update_flags(static_cast<tl::u16>(dr));
+auto Virtual_Machine::set_diagnostics(Output_Sink *sink) noexcept -> void {
+  this->diagnostics_ = sink;
+}
 
-        break;
-      }
-      case Op_Code::ST: {
-        // store register in memory
-        const auto sr = destination(instruction);
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto pc_offset9 = instruction.to_ulong() & 0x1FF;
-        const auto sext_pc_offset9 =
-          sign_extend(static_cast<tl::u16>(pc_offset9), 9);
+auto Virtual_Machine::diagnose(std::string_view message) const -> void {
+  if (this->diagnostics_) {
+    this->diagnostics_->write(fmt::format("{}\n", message));
+  } else {
+    fmt::print(stderr, "{}\n", message);
+  }
+}
 
-        const auto dest =
-          tl::u16(this->register_[Register::PC] + sext_pc_offset9);
-        this->write_memory(dest, this->register_[sr]);
-        break;
-      }
-      case Op_Code::JSR: {
-        this->register_[Register::R7] = this->register_[Register::PC];
-
-        if (instruction.test(11)) {  // pc_offset11 mode, JSR
-
-          // NOLINTNEXTLINE(hicpp-signed-bitwise)
-          const auto pc_offset11 = instruction.to_ulong() & 0x7FF;
-          const auto sext_pc_offset11 =
-            sign_extend(static_cast<tl::u16>(pc_offset11), 11);
-          this->register_[Register::PC] += sext_pc_offset11;
-        } else {  // baseR mode, JSRR
-
-          // NOLINTNEXTLINE(hicpp-signed-bitwise)
-          const auto base_register = (instruction >> 6).to_ulong() & 0x7;
-          this->register_[Register::PC] =
-            this->register_[static_cast<tl::u16>(base_register)];
-        }
-        break;
-      }
-      case Op_Code::AND: {
-        const auto dr = destination(instruction);
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto sr1 = (instruction >> 6).to_ulong() & 0x7;
+auto Virtual_Machine::set_input(Input_Source *input) noexcept -> void {
+  this->input_ = input;
+}
 
-        if (instruction.test(5)) {  // immediate mode
-          // bit [4:0] & 0b11111
-          // NOLINTNEXTLINE(hicpp-signed-bitwise)
-          const auto imm5 = instruction.to_ulong() & 0x1F;
-          this->register_[dr] =
-            this->register_[sr1] &
-            sign_extend(static_cast<tl::u16>(imm5), 5);  // imm5 is 5bits.
+auto Virtual_Machine::set_stop_on_eof(bool stop) noexcept -> void {
+  this->stop_on_eof_ = stop;
+}
 
-        } else {  // register mode
+auto Virtual_Machine::set_instruction_clock(bool enabled) noexcept -> void {
+  this->timer_.use_instruction_clock(enabled ? &this->instructions_ : nullptr);
+}
 
-          // NOLINTNEXTLINE(hicpp-signed-bitwise)
-          const auto sr2      = instruction.to_ulong() & 0x7;
-          this->register_[dr] = this->register_[sr1] & this->register_[sr2];
-        }
+auto Virtual_Machine::set_features(Features features) -> void {
+  this->features_ = features;
+  if (features.profile && !this->profiler_) {
+    this->profiler_ = std::make_unique<Profiler>();
+  }
+}
 
-        // set condition flags
-        this->update_flags(static_cast<tl::u16>(dr));
+auto Virtual_Machine::set_tracer(Trace_Writer *tracer) noexcept -> void {
+  this->tracer_ = tracer;
+}
 
-        break;
-      }
-      case Op_Code::LDR: {
-        const auto dr = destination(instruction);
+auto Virtual_Machine::stats() const noexcept -> const Run_Stats & {
+  return this->stats_;
+}
 
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto base_register = (instruction >> 6).to_ulong() & 0x7;
+auto Virtual_Machine::attach(Device &device, tl::u16 first, tl::u16 last)
+  -> void {
+  for (auto addr = tl::u32{first}; addr <= last; ++addr) {
+    const auto page = addr >> PAGE_BITS;
+    auto &devices   = this->devices_[page];
+    if (!devices) { devices = std::make_unique<Page_Devices>(); }
+    (*devices)[addr & (PAGE_SIZE - 1)] = &device;
+    this->io_pages_.set(page);
+  }
 
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto offset6      = instruction.to_ulong() & 0x3F;
-        const auto sext_offset6 = sign_extend(static_cast<tl::u16>(offset6), 6);
-        this->register_[dr]     = this->read_memory(
-          static_cast<tl::u16>(this->register_[base_register] + sext_offset6));
-        this->update_flags(dr);
-        break;
-      }
-      case Op_Code::STR: {
-        const auto sr = destination(instruction);
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto base_register = (instruction >> 6).to_ulong() & 0x7;
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto offset6      = instruction.to_ulong() & 0x3F;
-        const auto sext_offset6 = sign_extend(static_cast<tl::u16>(offset6), 6);
+  // compiled code only checks for devices in the pages that had them.
+  this->jit_.reset();
+}
 
-        const auto dest =
-          static_cast<tl::u16>(this->register_[base_register] + sext_offset6);
-        this->write_memory(dest, this->register_[sr]);
-        break;
-      }
-      case Op_Code::NOT: {
-        const auto dr = destination(instruction);
+auto Virtual_Machine::device_at(tl::u16 addr) const noexcept -> Device * {
+  const auto &devices = this->devices_[addr >> PAGE_BITS];
+  return devices ? (*devices)[addr & (PAGE_SIZE - 1)] : nullptr;
+}
 
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto sr = (instruction >> 6).to_ulong() & 0x7;
+auto Virtual_Machine::read_io(tl::u16 addr) -> tl::u16 {
+  auto *device = this->device_at(addr);
+  if (!device) { return this->memory_[addr]; }
 
-        this->register_[dr] = ~this->register_[(static_cast<tl::u16>(sr))];
-        this->update_flags(dr);
-        break;
-      }
-      case Op_Code::LDI: {
-        // like LD but the content of the address is another
-        // address. Then it loads the content of the address
-        // of the address.
-        // [addr] -> [addr] -> content
-        const auto dr = destination(instruction);
+  // other devices may answer differently every time (the timer does), so
+  // idle detection can't assume a polling loop sees the same thing. The
+  // keyboard takes care of that itself.
+  if (device != &this->keyboard_) { ++this->effects_; }
+  return device->read(addr);
+}
 
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto pc_offset9 = instruction.to_ulong() & 0x1FF;
-        const auto sext_pc_offset9 =
-          sign_extend(static_cast<tl::u16>(pc_offset9), 9);
+auto Virtual_Machine::write_io(tl::u16 addr, tl::u16 content) -> void {
+  ++this->effects_;
+  if (auto *device = this->device_at(addr)) {
+    device->write(addr, content);
+    return;
+  }
+  this->memory_[addr] = content;
+  this->invalidate(addr);
+}
 
-        // location of an address that stores the address of the value to load
-        // into DR.
-        const auto mem_location =
-          tl::u16(this->register_[Register::PC] + sext_pc_offset9);
+// Called when a keyboard poll found no key. The guest is idle if it keeps
+// polling from the same place without storing or printing anything, and
+//  - either its registers didn't change since the last poll: it will do the
+//    same thing over and over until KBSR changes,
+//  - or it is a small loop that only counts while it waits (2048 does that to
+//    seed its random numbers), see counting_loop().
+// Then block until there is a key instead of burning the host CPU. A counting
+// loop gets its counters advanced by the trips it would have made meanwhile.
+// The guest still sees this poll fail, like it would have.
+auto Virtual_Machine::wait_if_idle() -> void {
+  using Clock = std::chrono::steady_clock;
+
+  // nothing to wait on, or waiting would make the run depend on the clock.
+  if (!this->input_ || !this->input_->can_block()) { return; }
+
+  // COND takes part in comparing the registers.
+  this->sync_flags();
+  const auto now = Clock::now();
+  const auto pc  = this->register_[Register::PC];
+  auto &idle     = this->idle_;
+  if (pc != idle.pc || this->effects_ != idle.effects) {
+    idle = Idle_Watch{pc, this->effects_, this->register_, 0, now};
+    return;
+  }
 
-        // We need to read_memory twice. See comment above.
-        this->register_[dr] =
-          this->read_memory(this->read_memory(mem_location));
+  const auto same = this->register_ == idle.registers;
+  idle.registers  = this->register_;
+  if (++idle.polls < IDLE_POLLS) { return; }
 
-        this->update_flags(static_cast<tl::u16>(dr));
-        break;
-      }
-      case Op_Code::STI: {
-        // stores an address of an address that contains an register.
-        const auto sr = destination(instruction);
+  auto step = Registers{};
+  if (!same && !this->counting_loop(step)) { return; }
 
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto pc_offset9 = instruction.to_ulong() & 0x1FF;
-        const auto sext_pc_offset9 =
-          sign_extend(static_cast<tl::u16>(pc_offset9), 9);
+  // run_for() gets the poll again once there is a key, counters untouched.
+  if (this->parking_) {
+    this->stop(Exit_Reason::waiting_for_input);
+    return;
+  }
 
-        const auto dest =
-          tl::u16(this->register_[Register::PC] + sext_pc_offset9);
-        this->write_memory(this->read_memory(dest), this->register_[sr]);
-        break;
-      }
-      case Op_Code::JMP: {
-        // handles RET too
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto base_register = (instruction >> 6).to_ulong() & 0x7;
-        this->register_[Register::PC] =
-          this->register_[static_cast<tl::u16>(base_register)];
-        break;
-      }
-      case Op_Code::LEA: {
-        // the address itself is stored in the register.
-        // instead of loading the content of the address.
-        const auto dr = destination(instruction);
+  const auto trip = (now - idle.since) / idle.polls;
+  this->input_->wait_key();
+  ++this->stats_.idle_wakeups;
 
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        const auto pc_offset9 = instruction.to_ulong() & 0x1FF;
-        const auto sext_pc_offset9 =
-          sign_extend(static_cast<tl::u16>(pc_offset9), 9);
+  const auto woken = Clock::now();
+  if (!same && trip.count() > 0) {
+    // only the low 16 bits of the trip count matter for 16 bit registers.
+    const auto trips = static_cast<tl::u16>((woken - now) / trip);
+    for (auto r = 0; r < Register::PC; ++r) {
+      this->register_[r] += static_cast<tl::u16>(step[r] * trips);
+    }
+  }
+  idle = Idle_Watch{pc, this->effects_, this->register_, 0, woken};
+}
 
-        this->register_[dr] = this->register_[Register::PC] + sext_pc_offset9;
-        this->update_flags(dr);
-        break;
-      }
-      case Op_Code::TRAP: {
-        this->register_[Register::R7] = this->register_[Register::PC];
+// true if the poll that is running is the load in a loop like
+//
+//   LOOP ADD R1, R1, #1   ; any number of ADD Rn, Rn, #imm
+//        LDI R0, KBSR
+//        BRzp LOOP
+//
+// nothing in there can leave the loop but the poll, so sleeping is safe.
+// step gets what one trip adds to each register.
+auto Virtual_Machine::counting_loop(Registers &step) const -> bool {
+  const auto pc   = this->register_[Register::PC];
+  const auto poll = decode(this->memory_[static_cast<tl::u16>(pc - 1)]);
+  const auto br   = decode(this->memory_[pc]);
+
+  // a zero from KBSR has to take the branch back.
+  if (br.op != Op_Code::BR || !(br.dr & Condition_Flag::ZRO)) { return false; }
+  if (poll.op != Op_Code::LD && poll.op != Op_Code::LDI &&
+      poll.op != Op_Code::LDR) {
+    return false;
+  }
 
-        // NOLINTNEXTLINE(hicpp-signed-bitwise)
-        switch (instruction.to_ulong() & 0xFF) {
-          case Trap::getc: {
-            // Read a single character from the keyboard. The character is not
-            // echoed onto the console. Its ASCII code is copied into R0. The
-            // high eight bits of R0 are cleared.
-            const auto ch                 = std::getchar();
-            this->register_[Register::R0] = static_cast<tl::u16>(ch);
-            break;
-          }
-          case Trap::out: {
-            // Write a character in R0[7:0] to the console display.
-            const auto content = this->register_[Register::R0];
-
-            // NOLINTNEXTLINE(hicpp-signed-bitwise)
-            const auto ch = content & 0x7F;
-            fmt::print("{}", static_cast<char>(ch));
-            break;
-          }
-          case Trap::puts: {
-            // Write a string of ASCII characters to the console display. The
-            // characters are contained in consecutive memory locations, one
-            // character per memory location, starting with the address
-            // specified in R0. Writing terminates with the occurrence of x0000
-            // in a memory location.
-            auto start_addr = this->register_[Register::R0];
-
-            // increment the address until we find an address with nothing in it
-            while (this->memory_[start_addr]) {
-              const auto ch = static_cast<char>(this->read_memory(start_addr));
-              fmt::print("{}", ch);
-              ++start_addr;
-            }
-            break;
-          }
-          case Trap::in: {
-            // Print a prompt on the screen and read a single character from the
-            // keyboard. The character is echoed onto the console monitor, and
-            // its ASCII code is copied into R0. The high eight bits of R0 are
-            // cleared.
-            fmt::print("Enter a character: ");
-            const auto ch = std::getchar();
-            fmt::print("\n{}", ch);
-            this->register_[Register::R0] = static_cast<tl::u16>(ch);
-            break;
-          }
-          case Trap::putsp: {
-            // Write a string of ASCII characters to the console. The characters
-            // are contained in consecutive memory locations, two characters per
-            // memory location, starting with the address specified in R0. The
-            // ASCII code contained in bits [7:0] of a memory location is
-            // written to the console first. Then the ASCII code contained in
-            // bits [15:8] of that memory location is written to the console. (A
-            // character string consisting of an odd number of characters to be
-            // written will have x00 in bits [15:8] of the memory location
-            // containing the last character to be written.) Writing terminates
-            // with the occurrence of x0000 in a memory location.
-
-            auto start_addr = this->register_[Register::R0];
-
-            while (this->memory_[start_addr]) {
-              const auto value = this->memory_[start_addr];
-
-              // NOLINTNEXTLINE(hicpp-signed-bitwise)
-              const auto first_ch = value & 0xFF;
-              fmt::print("{}", static_cast<char>(first_ch));
-
-              // NOLINTNEXTLINE(hicpp-signed-bitwise)
-              const auto second_ch = value >> 8;
-
-              if (second_ch) { fmt::print("{}", static_cast<char>(second_ch)); }
-              ++start_addr;
-            }
-
-            break;
-          }
-          case Trap::halt: {
-            fmt::print("{}\n", "vm halted, bye!");
-            this->running_ = false;
-            break;
-          }
-        }
-        break;
-      }
-      // NOLINTNEXTLINE(bugprone-branch-clone)
-      case Op_Code::RES:
-        // unused
-        this->abort();
-        break;
-      case Op_Code::RTI:
-        // unused
-        this->abort();
-        break;
-      default:
-        // bad opcode
-        this->abort();
-        break;
+  const auto head   = static_cast<tl::u16>(pc + 1 + br.imm);
+  const auto length = static_cast<tl::u16>(pc - 1 - head);
+  if (length > IDLE_LOOP_LENGTH) { return false; }
+
+  for (auto addr = head; addr != static_cast<tl::u16>(pc - 1); ++addr) {
+    const auto instr = decode(this->memory_[addr]);
+    if (instr.op != Op_Code::ADD || !instr.imm_mode || instr.dr != instr.sr1 ||
+        instr.dr == poll.dr ||
+        (poll.op == Op_Code::LDR && instr.dr == poll.sr1)) {
+      return false;
     }
+    step[instr.dr] += instr.imm;
   }
+  return true;
 }
 
-auto Virtual_Machine::read_memory(tl::u16 addr) -> tl::u16 {
-  // check if the memory is a mapped register
-  if (this->memory_[addr] == Mapped_Reg::key_status_reg) {
-    if (check_key()) {
-      // NOLINTNEXTLINE(hicpp-signed-bitwise)
-      this->memory_[Mapped_Reg::key_status_reg] = (1 << 15);
-      this->memory_[Mapped_Reg::key_data_reg] =
-        static_cast<tl::u16>(std::getchar());
-    } else {
-      this->memory_[Mapped_Reg::key_status_reg] = 0;
+auto Virtual_Machine::update_events() noexcept -> void {
+  this->events_ = this->interrupts_enabled() || this->output_.pending();
+}
+
+auto Virtual_Machine::interrupts_enabled() const noexcept -> bool {
+  return (this->keyboard_.status_ & INTERRUPT_ENABLE) != 0 ||
+         this->timer_.interrupts_;
+}
+
+auto Virtual_Machine::poll_events() -> void {
+  // output the guest went quiet after, nothing else would flush it.
+  this->output_.poll();
+  this->update_events();
+
+  // the budget may have run out right before, or the input while the
+  // keyboard was polled.
+  if (!this->running_ || this->take_interrupt() || !this->running_) { return; }
+
+  // BRnzp #-1 at PC: nothing but an interrupt gets the guest out of there.
+  constexpr auto wait_loop = tl::u16{0x0FFF};
+  if (this->memory_[this->register_[Register::PC]] != wait_loop) { return; }
+  this->wait_for_event();
+  if (this->running_) { this->take_interrupt(); }
+}
+
+auto Virtual_Machine::take_interrupt() -> bool {
+  const auto level = (this->psr_ & PSR_PRIORITY) >> 8;
+  if (this->timer_.interrupts_ && TIMER_PRIORITY > level &&
+      this->timer_.due()) {
+    this->interrupt(Interrupt::timer_interrupt, TIMER_PRIORITY);
+    return true;
+  }
+  if ((this->keyboard_.status_ & INTERRUPT_ENABLE) &&
+      KEYBOARD_PRIORITY > level) {
+    if (this->keyboard_.latch()) {
+      this->interrupt(Interrupt::keyboard_interrupt, KEYBOARD_PRIORITY);
+      return true;
     }
+    // the end of the input, we are in between two instructions.
+    if (!this->running_) { this->stop_between(this->exit_); }
   }
-  return this->memory_[addr];
+  return false;
 }
 
-auto Virtual_Machine::write_memory(tl::u16 addr, tl::u16 content) -> void {
-  this->memory_[addr] = content;
+auto Virtual_Machine::interrupt(tl::u16 vector, tl::u16 priority) -> void {
+  this->enter_supervisor(
+    this->read_memory(static_cast<tl::u16>(INTERRUPT_TABLE + vector)),
+    static_cast<tl::u16>(priority << 8));
+  ++this->stats_.interrupts;
 }
 
-auto Virtual_Machine::read_file(const char *file) -> bool {
-#ifdef _WIN32
-  std::FILE *in = nullptr;
-  fopen_s(&in, file, "rb");
-#else
-  std::FILE *in = std::fopen(file, "rb");
-#endif
+auto Virtual_Machine::enter_supervisor(tl::u16 handler, tl::u16 psr) -> void {
+  const auto saved = static_cast<tl::u16>(this->psr_ | this->condition());
+  const auto from  = this->register_[Register::PC];
 
-  auto read{false};
+  // the supervisor stack, unless the guest is on it already.
+  auto &sp = this->register_[Register::R6];
+  if (this->psr_ & PSR_USER) {
+    this->saved_usp_ = std::exchange(sp, this->saved_ssp_);
+  }
+  this->write_memory(--sp, saved);
+  this->write_memory(--sp, from);
 
-  if (in) {
-    // convert to little-endian, since the instructions are big-endian.
-    constexpr auto swap16 = [](tl::u16 x) {
-      // NOLINTNEXTLINE(hicpp-signed-bitwise)
-      return static_cast<tl::u16>((x << 8) | (x >> 8));
-    };
+  this->psr_                    = psr;
+  this->register_[Register::PC] = handler;
+  if (this->active_.profile) { this->profiler_->call(handler, from); }
+}
 
-    // first value in the file is the starting memory.
-    auto origin = tl::u16{};
-    fread(&origin, sizeof(origin), 1, in);
-    origin = swap16(origin);
+auto Virtual_Machine::wait_for_event() -> void {
+  using Clock = std::chrono::steady_clock;
+
+  const auto level = (this->psr_ & PSR_PRIORITY) >> 8;
+  const auto keys =
+    (this->keyboard_.status_ & INTERRUPT_ENABLE) && KEYBOARD_PRIORITY > level;
+  const auto timer = this->timer_.interrupts_ && this->timer_.interval_ != 0 &&
+                     TIMER_PRIORITY > level;
+  const auto blocking = this->input_ && this->input_->can_block();
+
+  if (timer && this->timer_.on_instruction_clock()) {
+    // a key on a schedule may come before the timer, keep spinning for it.
+    if (keys && !blocking) { return; }
+    // every trip is one instruction, so the spinning would end right there.
+    const auto tick = this->timer_.next_ * INSTRUCTIONS_PER_MS;
+    this->instructions_ =
+      std::max(this->instructions_, std::min(tick, this->deadline_));
+    if (this->instructions_ >= this->deadline_) {
+      this->between_ = true;
+      this->stop(Exit_Reason::out_of_budget);
+    }
+    return;
+  }
 
-    // std::numeric_limits<tl::u16>::max() - origin
-    const auto max_read = 52648;
+  // run_for() doesn't block, the scheduler wakes the vm once there is a key.
+  if (this->parking_) {
+    if (keys && !timer && blocking && !this->key_ready()) {
+      this->stop_between(Exit_Reason::waiting_for_input);
+    }
+    return;
+  }
 
-    auto temp_buffer = std::array<tl::u16, max_read>();
-    fread(temp_buffer.data(), sizeof(tl::u16), max_read, in);
+  // the guest is idle, show what it printed before it sleeps.
+  this->output_.flush();
+  if (keys && !timer && blocking) {
+    this->input_->wait_key();
+    ++this->stats_.idle_wakeups;
+    return;
+  }
 
-    auto rng = temp_buffer | std::views::transform(swap16);
+  if (timer) {
+    // in short naps if a key could come first, see Timer::now().
+    const auto tick =
+      Clock::time_point(std::chrono::milliseconds(this->timer_.next_));
+    const auto nap = Clock::now() + std::chrono::milliseconds(1);
+    std::this_thread::sleep_until(keys ? std::min(tick, nap) : tick);
+    ++this->stats_.idle_wakeups;
+    this->timer_.polls_ = 0;  // look right away
+  }
+}
 
-    std::ranges::copy_n(
-      begin(rng), temp_buffer.size(), begin(this->memory_) + origin);
+auto Virtual_Machine::stop_between(Exit_Reason reason) noexcept -> void {
+  // run() backs up over the instruction that wanted a key, here that is
+  // none: step over first, it nets out.
+  ++this->register_[Register::PC];
+  if (this->active_.count) { ++this->instructions_; }
+  this->between_ = true;
+  this->stop(reason);
+}
 
-    read = true;
-    std::fclose(in);  // NOLINT
-  } else {
-    fmt::print(stderr, "{}\n", "cannot open file.");
+auto Virtual_Machine::os_trap(tl::u16 vector) -> void {
+  // at the guest's priority, only the mode changes.
+  this->enter_supervisor(this->read_memory(vector), this->psr_ & PSR_PRIORITY);
+  ++this->stats_.os_traps;
+}
+
+auto Virtual_Machine::execute_trap(tl::u16 vector) -> void {  // NOLINT
+  switch (vector) {
+    case Trap::getc: {
+      // Read a single character from the keyboard. The character is not
+      // echoed onto the console. Its ASCII code is copied into R0. The
+      // high eight bits of R0 are cleared.
+      this->output_.flush();  // the guest is waiting on the user
+      const auto ch                 = this->get_key();
+      this->register_[Register::R0] = static_cast<tl::u16>(ch);
+      break;
+    }
+    case Trap::out: {
+      // Write a character in R0[7:0] to the console display.
+      const auto content = this->register_[Register::R0];
+
+      // NOLINTNEXTLINE(hicpp-signed-bitwise)
+      const auto ch = content & 0x7F;
+      this->output_.put(static_cast<char>(ch));
+      this->output_.maybe_flush();
+      break;
+    }
+    case Trap::puts: {
+      // Write a string of ASCII characters to the console display. The
+      // characters are contained in consecutive memory locations, one
+      // character per memory location, starting with the address
+      // specified in R0. Writing terminates with the occurrence of x0000
+      // in a memory location.
+      auto start_addr = this->register_[Register::R0];
+
+      // increment the address until we find an address with nothing in it
+      while (this->memory_[start_addr]) {
+        const auto ch = static_cast<char>(this->read_memory(start_addr));
+        this->output_.put(ch);
+        ++start_addr;
+      }
+      this->output_.maybe_flush();
+      break;
+    }
+    case Trap::in: {
+      // Print a prompt on the screen and read a single character from the
+      // keyboard. The character is echoed onto the console monitor, and
+      // its ASCII code is copied into R0. The high eight bits of R0 are
+      // cleared.
+      if (!std::exchange(this->prompted_, false)) {
+        this->output_.write("Enter a character: ");
+      }
+      this->output_.flush();
+      const auto ch = this->get_key();
+      // it runs again once there is a key, the prompt is out already.
+      if (this->exit_ == Exit_Reason::waiting_for_input ||
+          this->exit_ == Exit_Reason::end_of_input) {
+        this->prompted_ = true;
+        break;
+      }
+      this->output_.write(fmt::format("\n{}", ch));
+      this->output_.maybe_flush();
+      this->register_[Register::R0] = static_cast<tl::u16>(ch);
+      break;
+    }
+    case Trap::putsp: {
+      // Write a string of ASCII characters to the console. The characters
+      // are contained in consecutive memory locations, two characters per
+      // memory location, starting with the address specified in R0. The
+      // ASCII code contained in bits [7:0] of a memory location is
+      // written to the console first. Then the ASCII code contained in
+      // bits [15:8] of that memory location is written to the console. (A
+      // character string consisting of an odd number of characters to be
+      // written will have x00 in bits [15:8] of the memory location
+      // containing the last character to be written.) Writing terminates
+      // with the occurrence of x0000 in a memory location.
+
+      auto start_addr = this->register_[Register::R0];
+
+      while (this->memory_[start_addr]) {
+        const auto value = this->memory_[start_addr];
+
+        // NOLINTNEXTLINE(hicpp-signed-bitwise)
+        const auto first_ch = value & 0xFF;
+        this->output_.put(static_cast<char>(first_ch));
+
+        // NOLINTNEXTLINE(hicpp-signed-bitwise)
+        const auto second_ch = value >> 8;
+
+        if (second_ch) { this->output_.put(static_cast<char>(second_ch)); }
+        ++start_addr;
+      }
+      this->output_.maybe_flush();
+
+      break;
+    }
+    case Trap::halt: {
+      this->output_.write("vm halted, bye!\n");
+      this->output_.flush();
+      this->stop(Exit_Reason::halted);
+      break;
+    }
   }
+}
+
+auto Virtual_Machine::use_os() -> void {
+  this->os_ = true;
+  std::ranges::copy_n(
+    this->memory_.data(), TRAP_TABLE_SIZE, this->os_vectors_.begin());
+  this->attach(this->machine_control_,
+               Mapped_Reg::machine_control_reg,
+               Mapped_Reg::machine_control_reg);
+}
 
-  return read;
+auto Virtual_Machine::load_image(tl::u16 origin,
+                                 std::span<const tl::u16> words) -> void {
+  // whatever doesn't fit below the end of memory is dropped.
+  const auto count = std::min(words.size(), LAS - tl::usize{origin});
+  std::ranges::copy_n(begin(words), count, this->memory_.data() + origin);
+  this->blank_ = false;
+  this->forget_code();
 }
 
-auto Virtual_Machine::update_flags(tl::u16 r) noexcept -> void {
-  if (this->register_[r] == 0) {
-    this->register_[Register::COND] = Condition_Flag::ZRO;
+auto Virtual_Machine::load_image(const Memory_Image &image) -> void {
+  this->memory_.map(image);
+  this->blank_ = false;
+  this->forget_code();
+}
 
-    // NOLINTNEXTLINE(hicpp-signed-bitwise)
-  } else if (this->register_[r] >> 15) {
-    // 1 in the left-most bit indicates negative
-    this->register_[Register::COND] = Condition_Flag::NEG;
-  } else {
-    this->register_[Register::COND] = Condition_Flag::POS;
-  }
+auto Virtual_Machine::forget_code() -> void {
+  // anything decoded or compiled before memory was loaded is stale now.
+  this->decoded_.map(undecoded());
+  this->jit_.reset();
+  this->native_.reset();
 }
 
-auto Virtual_Machine::abort() noexcept -> void {
-  fmt::print(stderr, "{}\n", "BAD OPCODE. Aborting");
-  this->running_ = false;
+auto Virtual_Machine::abort() -> void {
+  // run() returns Exit_Reason::bad_opcode, the caller reports it.
+  this->output_.flush();
+  this->stop(Exit_Reason::bad_opcode);
 }
 }  // namespace vm
@@ -1,17 +1,79 @@
 #pragma once
 #include <array>
+#include <bitset>
+#include <chrono>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
 
+#include "decoder.hpp"
+#include "devices.hpp"
+#include "input.hpp"
+#include "jit.hpp"
+#include "memory.hpp"
+#include "output.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
 #include "opcodes.hpp"
 #include "tl/numeric-aliases.hpp"
 
 namespace vm {
+class Lockstep_Group;
+class Snapshot;
+class Native_Code;
+struct Native_Frame;
+
 // Location address space.
 static constexpr auto LAS      = 65536;
 static constexpr auto REG_SIZE = 10;
 
+// memory is split in pages for memory mapped I/O: a page is either plain
+// memory or has devices attached to some of its addresses.
+static constexpr auto PAGE_BITS = 9;
+static constexpr auto PAGE_SIZE = 1 << PAGE_BITS;
+static constexpr auto PAGES     = LAS >> PAGE_BITS;
+
 // the starting memory is 0x3000 12888
 static constexpr auto PC_START = 0x3000;
 
+// the processor status register: bit 15 is set in user mode, bits 10-8 hold
+// the priority level and bits 2-0 are COND. Programs start in user mode at
+// priority 0, an interrupt switches to supervisor mode and to the supervisor
+// stack, RTI switches back.
+static constexpr auto PSR_USER         = tl::u16{1} << 15;
+static constexpr auto PSR_PRIORITY     = tl::u16{0x0700};
+static constexpr auto SUPERVISOR_STACK = 0x3000;  // R6 on the first interrupt
+
+// where the interrupt vector table is, and the priority levels the devices
+// interrupt at, see Interrupt. A device only interrupts a guest running at a
+// lower level.
+static constexpr auto INTERRUPT_TABLE   = 0x0100;
+static constexpr auto KEYBOARD_PRIORITY = 4;
+static constexpr auto TIMER_PRIORITY    = 5;
+
+// the trap vector table at x0000: with an OS, TRAP x runs the routine at
+// memory[x] in supervisor mode, see use_os(). The routine returns with RTI.
+static constexpr auto TRAP_TABLE_SIZE = 0x0100;
+
+// the traps the vm has a routine of its own for, see execute_trap(). With an
+// OS they run instead of its routines, as long as the table still points at
+// those.
+[[nodiscard]] constexpr auto native_trap(tl::u16 vector) noexcept -> bool {
+  switch (vector) {
+    case Trap::getc:
+    case Trap::out:
+    case Trap::puts:
+    case Trap::in:
+    case Trap::putsp:
+    case Trap::halt:
+      return true;
+    default:
+      return false;
+  }
+}
+
 /*
  * LC-3 Arch:
  *
@@ -36,27 +98,350 @@ static constexpr auto PC_START = 0x3000;
  *
  */
 
+// How run() dispatches instructions. Both engines share the instruction
+// semantics in instructions.hpp, switch_loop is the reference one.
+enum class Engine {
+  switch_loop,  // one switch on the op code per instruction
+  threaded,     // direct threaded code, see engine_threaded.cpp
+  jit,          // compiles hot basic blocks to native code, see jit.hpp
+  native,       // runs a program translated ahead of time, see native.hpp
+};
+
+// what the run loops do besides running the guest. run() has a loop built
+// for every combination it can pick (see with_features() in
+// instructions.hpp) and picks one per run, so whatever is off costs nothing
+// per instruction.
+struct Features {
+  bool count{true};     // keep instructions() up to date
+  bool profile{false};  // feed a Profiler, see profiler()
+  bool trace{false};    // record every instruction, see set_tracer()
+  bool budget{false};   // stop once a run_for() ran its instructions
+};
+
+// why run() returned.
+enum class Exit_Reason {
+  halted,        // HALT trap
+  bad_opcode,    // RES, RTI in user mode or an unknown op code
+  end_of_input,  // read past the end of the input, see set_stop_on_eof().
+                 // The next run() resumes the guest, see run()
+  // run_for() (or run() on an input that parks), the next run() or run_for()
+  // resumes the guest from them:
+  waiting_for_input,  // it wants a key that isn't there yet
+  out_of_budget,      // it ran the instructions it was given
+};
+
+// how many polls of the keyboard in a row have to come from the same place
+// before the guest counts as idle, see Virtual_Machine::wait_if_idle().
+static constexpr auto IDLE_POLLS = 4;
+
+// longest polling loop (in instructions before the poll) that may count
+// something while it waits and still be put to sleep.
+static constexpr auto IDLE_LOOP_LENGTH = 8;
+
+// counters about a run, for the host.
+struct Run_Stats {
+  // times the vm slept in a keyboard polling loop until a key arrived, or in
+  // a loop waiting for an interrupt.
+  tl::u64 idle_wakeups{};
+  // interrupts the guest took.
+  tl::u64 interrupts{};
+  // TRAPs that ran a routine of the OS, not one of the vm's.
+  tl::u64 os_traps{};
+};
+
 class Virtual_Machine {
-  using Registers       = std::array<tl::u16, REG_SIZE>;
-  using Memory_Location = std::array<tl::u16, LAS>;
+  using Registers     = std::array<tl::u16, REG_SIZE>;
+  using Memory        = Cow_Array<tl::u16, LAS>;
+  using Decoded_Cache = Cow_Array<Decoded_Instruction, LAS>;
 
  public:
-  auto run() -> void;
+  Virtual_Machine();
+  ~Virtual_Machine();
+
+  // starts the program at PC_START, unless the last run stopped for input
+  // (or the vm was restored from a snapshot of such a run): then it picks up
+  // where that left off, with the instruction that wanted a key. With an
+  // input that parks (see Input_Source::parks()) it stops for a key the way
+  // run_for() does.
+  auto run() -> Exit_Reason;
+  // run() for a time slice of about budget instructions (fused entries in
+  // the threaded engine finish first), which never blocks: instead of
+  // waiting for a key it stops with Exit_Reason::waiting_for_input. The jit
+  // and native engines run threaded meanwhile, their blocks can't stop in
+  // the middle of a loop. For hosts that run many vms in turn on a few
+  // threads, see scheduler.hpp.
+  auto run_for(tl::u64 budget) -> Exit_Reason;
+  // one instruction, on the switch engine: the others may run several at
+  // once.
+  auto step() -> Exit_Reason;
+  auto set_engine(Engine engine) noexcept -> void;
+  auto set_jit_threshold(tl::u32 threshold) noexcept -> void;
+  // superinstructions and loop idioms in the threaded engine (see fuse() and
+  // loop_idiom()), on by default. Switching drops what was decoded.
+  auto set_fusion(bool fusion) -> void;
+  [[nodiscard]] auto output() noexcept -> Output_Buffer &;
+  // where the vm says what went wrong (why a file didn't load...), not
+  // owned. stderr without one.
+  auto set_diagnostics(Output_Sink *sink) noexcept -> void;
+  // where keys come from, not owned. Without one the keyboard is never
+  // ready and GETC/IN read -1.
+  auto set_input(Input_Source *input) noexcept -> void;
+  [[nodiscard]] auto input() const noexcept -> Input_Source * {
+    return this->input_;
+  }
+  // stop the run when the guest reads past the end of the input, instead of
+  // handing it -1 (EOF) keys forever. For scripted, non interactive input.
+  auto set_stop_on_eof(bool stop) noexcept -> void;
+  [[nodiscard]] auto stats() const noexcept -> const Run_Stats &;
+  // instructions executed so far, over every run().
+  [[nodiscard]] auto instructions() const noexcept -> tl::u64 {
+    return this->instructions_;
+  }
+  // devices that measure time (the timer) count instructions instead of
+  // reading the clock, see INSTRUCTIONS_PER_MS. For reproducible runs.
+  auto set_instruction_clock(bool enabled) noexcept -> void;
+  // maps device to the addresses first to last, not owned. The keyboard,
+  // display and timer are attached from the start.
+  auto attach(Device &device, tl::u16 first, tl::u16 last) -> void;
+  // an object file or a preprocessed image, see loader.hpp. false if it
+  // can't be read or doesn't fit in memory, says why on stderr.
   [[nodiscard]] auto read_file(const char *file) -> bool;
-  [[nodiscard]] auto memory_size() const -> tl::usize {
-    return this->memory_.size();
+  // the same from bytes the host already has, without touching the file
+  // system. name only shows up in the diagnostics.
+  [[nodiscard]] auto load(std::span<const std::byte> bytes,
+                          std::string_view name = "buffer") -> bool;
+  // what is loaded so far is an operating system: TRAPs go through its
+  // vector table from now on, and it halts through MCR. Where the table
+  // still points at the routine the OS put there, the vm runs its own (see
+  // native_trap()), so the guest only pays for the routines it replaced.
+  auto use_os() -> void;
+  [[nodiscard]] auto uses_os() const noexcept -> bool { return this->os_; }
+  // copies words to memory from origin on, what read_file() does with a
+  // preprocessed image that can't be mapped.
+  auto load_image(tl::u16 origin, std::span<const tl::u16> words) -> void;
+  // all of memory becomes image, sharing its pages with every other vm that
+  // loaded it until it writes to them, see memory.hpp.
+  auto load_image(const Memory_Image &image) -> void;
+  // R0 to R7, PC and COND.
+  [[nodiscard]] auto registers() const noexcept
+    -> std::array<tl::u16, REG_SIZE>;
+  [[nodiscard]] auto memory_size() const -> tl::usize { return LAS; }
+  [[nodiscard]] auto memory() const noexcept -> std::span<const tl::u16> {
+    return this->memory_.span();
+  }
+  // memory, registers (the PSR too), the instruction count, the timer,
+  // which devices interrupt and the OS, see snapshot.hpp. false if path
+  // can't be written.
+  [[nodiscard]] auto save_snapshot(const std::string &path) const -> bool;
+  // back to where the snapshot was saved. Devices attached on top of the
+  // built in ones keep their state, the keyboard drops any key it held (a
+  // resumed run polls it again anyway).
+  auto restore(const Snapshot &snapshot) -> void;
+  // the instruction clock and profiling need the instruction counter, so
+  // they keep it on regardless.
+  auto set_features(Features features) -> void;
+  [[nodiscard]] auto features() const noexcept -> Features {
+    return this->features_;
+  }
+  // where Features::trace sends its records, not owned. Tracing stays off
+  // without one.
+  auto set_tracer(Trace_Writer *tracer) noexcept -> void;
+  // what the guest ran so far, nullptr unless profiling was turned on.
+  [[nodiscard]] auto profiler() noexcept -> Profiler * {
+    return this->profiler_.get();
   }
 
  private:
   // method
-  auto update_flags(tl::u16 r) noexcept -> void;
+  auto run_switch() -> void;
+  auto run_threaded() -> void;
+  auto run_jit() -> void;
+  auto run_native() -> void;
+  template <Features F>
+  auto threaded_loop() -> void;
+  template <Features F>
+  auto jit_loop() -> void;
+  template <Features F>
+  auto native_loop() -> void;
+  template <Features F>
+  [[nodiscard]] auto fetch() -> Decoded_Instruction;
+  // instr was fetched and PC incremented, it is about to run.
+  template <Features F>
+  auto on_fetch(const Decoded_Instruction &instr) -> void;
+  // instr just ran.
+  template <Features F>
+  auto on_executed(const Decoded_Instruction &instr) -> void;
+  // stops the run at the end of the budget of run_for().
+  template <Features F>
+  auto check_budget() noexcept -> void;
+  // the trace record of an instruction: what has to be read before it runs,
+  // then the rest once it ran.
+  auto trace_begin(const Decoded_Instruction &instr) noexcept -> void;
+  auto trace_end(const Decoded_Instruction &instr) -> void;
+  auto execute(const Decoded_Instruction &instr) -> void;
+  // TRAP once PC and R7 are set: the vm's routine, or the OS's.
+  auto trap(tl::u16 vector) -> void;
+  auto execute_trap(tl::u16 vector) -> void;
+  auto os_trap(tl::u16 vector) -> void;
+
+  // instruction semantics, see instructions.hpp
+  auto op_br(const Decoded_Instruction &instr) noexcept -> void;
+  auto op_add(const Decoded_Instruction &instr) noexcept -> void;
+  auto op_ld(const Decoded_Instruction &instr) -> void;
+  auto op_st(const Decoded_Instruction &instr) -> void;
+  auto op_jsr(const Decoded_Instruction &instr) noexcept -> void;
+  auto op_and(const Decoded_Instruction &instr) noexcept -> void;
+  auto op_ldr(const Decoded_Instruction &instr) -> void;
+  auto op_str(const Decoded_Instruction &instr) -> void;
+  auto op_not(const Decoded_Instruction &instr) noexcept -> void;
+  auto op_ldi(const Decoded_Instruction &instr) -> void;
+  auto op_sti(const Decoded_Instruction &instr) -> void;
+  auto op_jmp(const Decoded_Instruction &instr) noexcept -> void;
+  auto op_lea(const Decoded_Instruction &instr) noexcept -> void;
+  auto op_trap(const Decoded_Instruction &instr) -> void;
+  auto op_rti(const Decoded_Instruction &instr) -> void;
+  auto fused_const(const Decoded_Instruction &instr) noexcept -> void;
+  auto fused_add_br(const Decoded_Instruction &instr) noexcept -> void;
+  auto fused_rmw(const Decoded_Instruction &instr) -> void;
+  auto fused_lea_puts(const Decoded_Instruction &instr) -> void;
+  // FUSED_LOOP, see idioms.cpp: runs the loop at PC, all of it or as much as
+  // stays in plain memory, and returns how many instructions that was. 0 if
+  // not even one iteration could run, then the first instruction has to.
+  [[nodiscard]] auto fused_loop() -> tl::u64;
+  [[nodiscard]] auto loop_copy(const Loop_Idiom &loop, tl::u16 pc) -> tl::u64;
+  [[nodiscard]] auto loop_fill(const Loop_Idiom &loop, tl::u16 pc) -> tl::u64;
+  [[nodiscard]] auto loop_scan(const Loop_Idiom &loop, tl::u16 pc) -> tl::u64;
+  [[nodiscard]] auto code_window(tl::u16 pc) const noexcept
+    -> std::array<tl::u16, LOOP_LENGTH>;
+
+  // COND is only worked out when something reads it: the instructions that
+  // set the flags just keep their result, condition() makes N, Z or P of it
+  // for BR, the trace, snapshots and the idle watch.
+  auto set_flags(tl::u16 result) noexcept -> void;
+  [[nodiscard]] auto condition() const noexcept -> tl::u16;
+  // COND in register_ up to date, for code that works on it there (the jit).
+  auto sync_flags() noexcept -> void;
   [[nodiscard]] auto read_memory(tl::u16 addr) -> tl::u16;
   auto write_memory(tl::u16 addr, tl::u16 content) -> void;
-  auto abort() noexcept -> void;
+  [[nodiscard]] auto read_io(tl::u16 addr) -> tl::u16;
+  auto write_io(tl::u16 addr, tl::u16 content) -> void;
+  [[nodiscard]] auto device_at(tl::u16 addr) const noexcept -> Device *;
+  auto invalidate(tl::u16 addr) noexcept -> void;
+  auto forget_code() -> void;
+  // fd is the file bytes were mapped from, or -1.
+  [[nodiscard]] auto load_bytes(std::span<const std::byte> bytes,
+                                std::string_view name,
+                                int fd) -> bool;
+  auto diagnose(std::string_view message) const -> void;
+  [[nodiscard]] auto key_ready() -> bool;
+  [[nodiscard]] auto get_key() -> int;
+  auto wait_if_idle() -> void;
+
+  // interrupts. Devices only raise them while the guest enabled them, then
+  // events_ is set and every basic block ends with a poll_events(): it takes
+  // the interrupt of the highest priority that is pending, if that is above
+  // the guest's. Output waiting to be flushed sets events_ too, so it goes
+  // out on time while the guest computes. Without events_ the run loops
+  // never look at devices.
+  auto end_block() -> void;
+  auto poll_events() -> void;
+  // true if it took one.
+  auto take_interrupt() -> bool;
+  auto interrupt(tl::u16 vector, tl::u16 priority) -> void;
+  // pushes PSR and PC on the supervisor stack, then runs handler in
+  // supervisor mode with psr. What interrupts and OS traps do.
+  auto enter_supervisor(tl::u16 handler, tl::u16 psr) -> void;
+  // the guest spins in a BRnzp to itself until an interrupt comes, skip or
+  // sleep through that.
+  auto wait_for_event() -> void;
+  auto update_events() noexcept -> void;
+  [[nodiscard]] auto interrupts_enabled() const noexcept -> bool;
+  // stops the run between two basic blocks, which run() then doesn't back
+  // up over. The next run() polls first, as this one would have.
+  auto stop_between(Exit_Reason reason) noexcept -> void;
+  auto abort() -> void;
+  auto stop(Exit_Reason reason) noexcept -> void;
 
   // data
-  Memory_Location memory_{};
+  // both start out shared with other vms, see memory.hpp: memory_ with
+  // whatever image it was loaded from, decoded_ with all the other decoded
+  // caches, as long as nothing is decoded in a page.
+  Memory memory_;
+  Decoded_Cache decoded_;  // an entry per address in memory_
+  bool blank_{true};       // nothing loaded or run yet, memory_ is all zeros
   Registers register_{};
+  // the result that set the flags last, or FLAGS_IN_REGISTER when COND in
+  // register_ is current, see condition().
+  static constexpr auto FLAGS_IN_REGISTER = tl::u32{1} << 16;
+  tl::u32 flags_{FLAGS_IN_REGISTER};
+  // the PSR without COND, and the R6 of the mode the guest isn't in.
+  tl::u16 psr_{PSR_USER};
+  tl::u16 saved_usp_{0};
+  tl::u16 saved_ssp_{SUPERVISOR_STACK};
+  bool events_{false};  // poll_events() has something to do
+  // the OS's trap vector table as it was loaded, see use_os().
+  bool os_{false};
+  std::array<tl::u16, TRAP_TABLE_SIZE> os_vectors_{};
+  tl::u64 instructions_{0};
+  Features features_;
+  Features active_;  // features_ plus what the run needs, see run()
+  std::unique_ptr<Profiler> profiler_;
+  Trace_Writer *tracer_{nullptr};
+  Trace_Record trace_;  // of the instruction that is running
   bool running_{false};
+  bool resume_{false};  // the next run() continues at PC, see run()
+  bool between_{false};  // and polls for events first, see stop_between()
+  bool prompted_{false};  // and that is an IN that already printed its prompt
+  // instructions() at which a run_for() stops, and whether a missing key
+  // stops it too instead of blocking.
+  static constexpr auto NO_DEADLINE = ~tl::u64{0};
+  tl::u64 deadline_{NO_DEADLINE};
+  bool parking_{false};
+  Exit_Reason exit_{Exit_Reason::halted};
+  Output_Buffer output_;
+  Output_Sink *diagnostics_{nullptr};
+  Input_Source *input_{nullptr};
+  bool stop_on_eof_{false};
+  Run_Stats stats_;
+
+  // idle detection, see wait_if_idle(). effects_ counts everything besides
+  // the registers that could change what the guest does next or what the
+  // outside world sees: stores, traps and keys.
+  struct Idle_Watch {
+    tl::u16 pc{};
+    tl::u64 effects{};
+    Registers registers{};  // at the last poll
+    tl::u32 polls{};        // in a row from the same pc, without effects
+    std::chrono::steady_clock::time_point since;
+  };
+  [[nodiscard]] auto counting_loop(Registers &step) const -> bool;
+  tl::u64 effects_{0};
+  Idle_Watch idle_;
+
+  // memory mapped I/O: which pages have devices, and the device of every
+  // address in those pages (nullptr for plain memory).
+  using Page_Devices = std::array<Device *, PAGE_SIZE>;
+  std::bitset<PAGES> io_pages_;
+  std::array<std::unique_ptr<Page_Devices>, PAGES> devices_;
+  Keyboard keyboard_{*this};
+  Display display_{this->output_};
+  Timer timer_{*this};
+  Machine_Control machine_control_{*this};  // attached with an OS
+  Engine engine_{Engine::threaded};
+  bool fusion_{true};
+
+  // only created when the jit engine runs.
+  std::unique_ptr<Jit> jit_;
+  tl::u32 jit_threshold_{JIT_THRESHOLD};
+
+  // only created when the native engine runs.
+  std::unique_ptr<Native_Code> native_;
+
+  friend class Jit;
+  friend struct Native_Frame;
+  friend class Keyboard;
+  friend class Timer;
+  friend class Machine_Control;
+  friend class Lockstep_Group;  // hands lanes over to vms and back
 };
 }  // namespace vm
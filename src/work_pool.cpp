@@ -0,0 +1,58 @@
+#include "work_pool.hpp"
+
+#include <algorithm>
+#include <thread>
+
+namespace vm {
+Work_Stealing_Pool::Work_Stealing_Pool(unsigned workers)
+  : workers_(workers ? workers
+                     : std::max(1U, std::thread::hardware_concurrency()))
+  , queues_(this->workers_) {}
+
+auto Work_Stealing_Pool::run(tl::usize count,
+                             const std::function<void(tl::usize)> &task)
+  -> void {
+  // contiguous shares, so neighbouring tasks (often alike) stay together.
+  for (auto w = 0U; w < this->workers_; ++w) {
+    const auto first = count * w / this->workers_;
+    const auto last  = count * (w + 1) / this->workers_;
+    for (auto i = first; i < last; ++i) {
+      this->queues_[w].tasks.push_back(i);
+    }
+  }
+
+  const auto work = [this, &task](unsigned worker) {
+    auto i = tl::usize{};
+    while (this->next(worker, i)) { task(i); }
+  };
+
+  // the calling thread is worker 0.
+  auto threads = std::vector<std::jthread>();
+  threads.reserve(this->workers_ - 1);
+  for (auto w = 1U; w < this->workers_; ++w) { threads.emplace_back(work, w); }
+  work(0);
+}
+
+auto Work_Stealing_Pool::next(unsigned worker, tl::usize &task) -> bool {
+  {
+    auto &own  = this->queues_[worker];
+    auto guard = std::scoped_lock(own.lock);
+    if (!own.tasks.empty()) {
+      task = own.tasks.back();
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+
+  for (auto offset = 1U; offset < this->workers_; ++offset) {
+    auto &victim = this->queues_[(worker + offset) % this->workers_];
+    auto guard   = std::scoped_lock(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = victim.tasks.front();
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace vm
@@ -0,0 +1,43 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "tl/numeric-aliases.hpp"
+
+namespace vm {
+/*
+ * Runs a batch of independent tasks on a fixed number of worker threads.
+ *
+ * Every worker gets its own deque with an even share of the tasks. It takes
+ * tasks from the back of its own deque and, once that is empty, steals from
+ * the front of the others, so a few long tasks on one worker don't leave the
+ * rest idle. Tasks don't create more tasks, a worker is done when every deque
+ * is empty.
+ */
+class Work_Stealing_Pool {
+ public:
+  // 0 workers means one per core.
+  explicit Work_Stealing_Pool(unsigned workers = 0);
+
+  [[nodiscard]] auto workers() const noexcept -> unsigned {
+    return this->workers_;
+  }
+
+  // runs task(i) for every i in [0, count), returns once all of them did.
+  auto run(tl::usize count, const std::function<void(tl::usize)> &task)
+    -> void;
+
+ private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<tl::usize> tasks;
+  };
+
+  [[nodiscard]] auto next(unsigned worker, tl::usize &task) -> bool;
+
+  unsigned workers_;
+  std::vector<Queue> queues_;
+};
+}  // namespace vm
@@ -0,0 +1,156 @@
+# runs IMAGE headless with the keys in INPUT on every engine, on NATIVE (the
+# vm with IMAGE built in, see add_lc3_native()), from a snapshot half way
+# through and in lockstep lanes of a batch, and fails unless they all run
+# the same instructions and print the same output.
+#
+#   cmake -DVM=vm -DNATIVE=vm_2048 -DIMAGE=2048.obj -DINPUT=2048.keys
+#         -DWORK_DIR=dir [-DINSTRUCTIONS=n -DDIGEST=hex] [-DOS=os.obj]
+#         -P engines.cmake
+#
+# With INSTRUCTIONS and DIGEST the switch engine has to match them as well.
+# With OS they all run IMAGE once more with --os=OS, and have to agree on
+# that too (the lanes of a batch can't have an OS).
+
+foreach(var VM NATIVE IMAGE INPUT WORK_DIR)
+  if(NOT DEFINED ${var})
+    message(FATAL_ERROR "${var} is not set")
+  endif()
+endforeach()
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+# run_headless(name input command...): runs command headless with input and
+# sets ${name}_summary to "<instructions> <digest>", ${name}_output to the
+# file its output went to.
+function(run_headless name input)
+  set(output ${WORK_DIR}/${name}.txt)
+  execute_process(
+    COMMAND ${ARGN} --headless --input=${input} --output=${output}
+    RESULT_VARIABLE result
+    ERROR_VARIABLE  errors
+    OUTPUT_QUIET
+  )
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${name}: exited with ${result}\n${errors}")
+  endif()
+  string(REGEX MATCH
+    "after ([0-9]+) instructions, [0-9]+ bytes of output, digest ([0-9a-f]+)"
+    summary "${errors}")
+  if(NOT summary)
+    message(FATAL_ERROR "${name}: no summary line\n${errors}")
+  endif()
+  set(${name}_summary "${CMAKE_MATCH_1} ${CMAKE_MATCH_2}" PARENT_SCOPE)
+  set(${name}_output ${output} PARENT_SCOPE)
+  message(STATUS
+    "${name}: ${CMAKE_MATCH_1} instructions, digest ${CMAKE_MATCH_2}")
+endfunction()
+
+# same_output(name expected actual): fails unless both files are the same.
+function(same_output name expected actual)
+  file(SHA256 ${expected} expected_hash)
+  file(SHA256 ${actual} actual_hash)
+  if(NOT expected_hash STREQUAL actual_hash)
+    message(FATAL_ERROR "${name}: output differs from ${expected}")
+  endif()
+endfunction()
+
+run_headless(switch ${INPUT} ${VM} --engine=switch ${IMAGE})
+if(DEFINED INSTRUCTIONS AND
+   NOT switch_summary STREQUAL "${INSTRUCTIONS} ${DIGEST}")
+  message(FATAL_ERROR
+    "switch: expected ${INSTRUCTIONS} instructions, digest ${DIGEST}")
+endif()
+
+foreach(engine threaded jit native)
+  run_headless(${engine} ${INPUT} ${VM} --engine=${engine} ${IMAGE})
+  if(NOT ${engine}_summary STREQUAL switch_summary)
+    message(FATAL_ERROR
+      "${engine}: ${${engine}_summary}, switch: ${switch_summary}")
+  endif()
+  same_output(${engine} ${switch_output} ${${engine}_output})
+endforeach()
+
+run_headless(built_in ${INPUT} ${NATIVE})
+if(NOT built_in_summary STREQUAL switch_summary)
+  message(FATAL_ERROR
+    "built in: ${built_in_summary}, switch: ${switch_summary}")
+endif()
+same_output(built_in ${switch_output} ${built_in_output})
+
+# lanes of one batch, one of them with only the first half of the keys so
+# it leaves the others half way through.
+file(SIZE ${INPUT} size)
+math(EXPR half "${size} / 2")
+file(READ ${INPUT} keys LIMIT ${half})
+file(WRITE ${WORK_DIR}/half.keys "${keys}")
+set(snapshot ${WORK_DIR}/half.snapshot)
+run_headless(half ${WORK_DIR}/half.keys
+             ${VM} --engine=switch --snapshot=${snapshot} ${IMAGE})
+
+# the half run's snapshot, restored with the rest of the keys, has to end
+# up where the run with all of them did: the same instructions, and the two
+# outputs one after the other the same as its output.
+file(READ ${INPUT} rest OFFSET ${half})
+file(WRITE ${WORK_DIR}/rest.keys "${rest}")
+foreach(engine switch threaded jit native)
+  run_headless(restored_${engine} ${WORK_DIR}/rest.keys
+               ${VM} --engine=${engine} --restore=${snapshot})
+  string(REGEX REPLACE " .*" "" restored ${restored_${engine}_summary})
+  string(REGEX REPLACE " .*" "" uninterrupted ${switch_summary})
+  if(NOT restored STREQUAL uninterrupted)
+    message(FATAL_ERROR
+      "restored on ${engine}: ${restored} instructions, "
+      "uninterrupted: ${uninterrupted}")
+  endif()
+  file(READ ${half_output} before)
+  file(READ ${restored_${engine}_output} after)
+  file(WRITE ${WORK_DIR}/round_trip_${engine}.txt "${before}${after}")
+  same_output(restored_${engine}
+              ${switch_output} ${WORK_DIR}/round_trip_${engine}.txt)
+endforeach()
+
+set(manifest ${WORK_DIR}/lanes.manifest)
+file(WRITE ${manifest}
+  "${IMAGE} < ${INPUT} > ${WORK_DIR}/lane0.txt\n"
+  "${IMAGE} < ${WORK_DIR}/half.keys > ${WORK_DIR}/lane1.txt\n"
+  "${IMAGE} < ${INPUT} > ${WORK_DIR}/lane2.txt\n"
+  "${IMAGE} < ${INPUT} > ${WORK_DIR}/lane3.txt\n"
+)
+execute_process(
+  COMMAND ${VM} --batch=${manifest} --lanes=4 --jobs=1
+  RESULT_VARIABLE result
+  OUTPUT_VARIABLE report
+  ERROR_VARIABLE  errors
+)
+if(NOT result EQUAL 0)
+  message(FATAL_ERROR "lanes: exited with ${result}\n${report}${errors}")
+endif()
+same_output(lane0 ${switch_output} ${WORK_DIR}/lane0.txt)
+same_output(lane1 ${half_output} ${WORK_DIR}/lane1.txt)
+same_output(lane2 ${switch_output} ${WORK_DIR}/lane2.txt)
+same_output(lane3 ${switch_output} ${WORK_DIR}/lane3.txt)
+
+if(NOT DEFINED OS)
+  return()
+endif()
+
+run_headless(os_switch ${INPUT} ${VM} --engine=switch --os=${OS} ${IMAGE})
+foreach(engine threaded jit native)
+  run_headless(os_${engine} ${INPUT}
+               ${VM} --engine=${engine} --os=${OS} ${IMAGE})
+  if(NOT os_${engine}_summary STREQUAL os_switch_summary)
+    message(FATAL_ERROR
+      "${engine} with an OS: ${os_${engine}_summary}, "
+      "switch: ${os_switch_summary}")
+  endif()
+  same_output(os_${engine} ${os_switch_output} ${os_${engine}_output})
+endforeach()
+
+run_headless(os_built_in ${INPUT} ${NATIVE} --os=${OS})
+if(NOT os_built_in_summary STREQUAL os_switch_summary)
+  message(FATAL_ERROR
+    "built in with an OS: ${os_built_in_summary}, "
+    "switch: ${os_switch_summary}")
+endif()
+same_output(os_built_in ${os_switch_output} ${os_built_in_output})
@@ -0,0 +1,80 @@
+; Keyboard and timer interrupts, for tests/engines.cmake: the keyboard's
+; handler echoes a key and then keeps busy long enough for the timer's to
+; interrupt it, which prints a dot per tick (a millisecond, that is a
+; thousand instructions headless). Both end in RTI. In between the guest
+; waits in BRnzp #-1 until a q makes the keyboard's handler return past it.
+;
+; With an OS that has a TRAP x26 (tests/os.asm) it calls that before it
+; halts, still with the timer on. Assembled with lc3as into interrupts.obj.
+
+        .ORIG x3000
+        LEA R0, KEY_ISR
+        STI R0, KEY_VECTOR
+        LEA R0, TICK_ISR
+        STI R0, TICK_VECTOR
+        AND R0, R0, #0
+        ADD R0, R0, #1
+        STI R0, TMI             ; tick every millisecond
+        LD R0, ENABLE
+        STI R0, TMR
+        STI R0, KBSR
+        AND R0, R0, #0          ; some COND, or the wait loop falls through
+WAIT    BRnzp WAIT
+
+DONE    LDI R0, OS_TRAP
+        BRz OFF
+        TRAP x26
+OFF     AND R0, R0, #0
+        STI R0, TMR
+        STI R0, TMI
+        LEA R0, BYE
+        PUTS
+        HALT
+
+; R6 is the supervisor stack: the saved PC on top, then the PSR.
+KEY_ISR ADD R6, R6, #-3
+        STR R0, R6, #0
+        STR R1, R6, #1
+        STR R7, R6, #2
+        LDI R0, KBDR
+        OUT
+        LD R1, MINUS_Q
+        ADD R1, R0, R1
+        BRnp BUSY
+        LEA R1, DONE
+        STR R1, R6, #3          ; returns to DONE instead of WAIT
+        AND R1, R1, #0
+        STI R1, KBSR            ; no more keys, there is no end to wait for
+BUSY    LD R1, DELAY
+SPIN    ADD R1, R1, #-1
+        BRp SPIN
+        LDR R0, R6, #0
+        LDR R1, R6, #1
+        LDR R7, R6, #2
+        ADD R6, R6, #3
+        RTI
+
+TICK_ISR
+        ADD R6, R6, #-2
+        STR R0, R6, #0
+        STR R7, R6, #1
+        LD R0, DOT
+        OUT
+        LDR R0, R6, #0
+        LDR R7, R6, #1
+        ADD R6, R6, #2
+        RTI
+
+KEY_VECTOR  .FILL x0180
+TICK_VECTOR .FILL x0181
+KBSR        .FILL xFE00
+KBDR        .FILL xFE02
+TMR         .FILL xFE08
+TMI         .FILL xFE0A
+ENABLE      .FILL x4000         ; interrupt enable
+OS_TRAP     .FILL x0026
+MINUS_Q     .FILL #-113
+DELAY       .FILL #700          ; 1400 instructions, more than a tick
+DOT         .FILL x002E
+BYE         .STRINGZ "\nbye\n"
+        .END
@@ -0,0 +1,76 @@
+; A small operating system for tests/engines.cmake: the trap vector table
+; with routines for OUT, PUTS and HALT, which the vm runs natively as long
+; as the table points at them, and TRAP x26, which only the guest has. That
+; one prints through the display registers itself and takes long enough for
+; a timer tick to interrupt it. Assembled with lc3as into os.obj.
+
+        .ORIG x0020
+        .FILL x0000             ; GETC, IN and PUTSP aren't used
+        .FILL OUT_R
+        .FILL PUTS_R
+        .FILL x0000
+        .FILL x0000
+        .FILL HALT_R
+        .FILL HELLO_R
+
+OUT_R   ST R1, SAVE_R1
+OUT_W   LDI R1, DSR
+        BRzp OUT_W
+        STI R0, DDR
+        LD R1, SAVE_R1
+        RTI
+
+PUTS_R  ST R0, SAVE_R0
+        ST R1, SAVE_R1
+        ST R2, SAVE_R2
+        ADD R2, R0, #0
+PUTS_C  LDR R0, R2, #0
+        BRz PUTS_E
+PUTS_W  LDI R1, DSR
+        BRzp PUTS_W
+        STI R0, DDR
+        ADD R2, R2, #1
+        BRnzp PUTS_C
+PUTS_E  LD R0, SAVE_R0
+        LD R1, SAVE_R1
+        LD R2, SAVE_R2
+        RTI
+
+HALT_R  LDI R0, MCR
+        LD R1, RUNNING
+        NOT R1, R1
+        AND R0, R0, R1
+        STI R0, MCR
+        BRnzp HALT_R
+
+HELLO_R ADD R6, R6, #-3
+        STR R0, R6, #0
+        STR R1, R6, #1
+        STR R2, R6, #2
+        LEA R2, HELLO
+HELLO_C LDR R0, R2, #0
+        BRz HELLO_D
+HELLO_W LDI R1, DSR
+        BRzp HELLO_W
+        STI R0, DDR
+        ADD R2, R2, #1
+        BRnzp HELLO_C
+HELLO_D LD R1, DELAY
+HELLO_S ADD R1, R1, #-1
+        BRp HELLO_S
+        LDR R0, R6, #0
+        LDR R1, R6, #1
+        LDR R2, R6, #2
+        ADD R6, R6, #3
+        RTI
+
+DSR     .FILL xFE04
+DDR     .FILL xFE06
+MCR     .FILL xFFFE
+RUNNING .FILL x8000
+DELAY   .FILL #700
+SAVE_R0 .FILL x0000
+SAVE_R1 .FILL x0000
+SAVE_R2 .FILL x0000
+HELLO   .STRINGZ "\nhello from the os"
+        .END
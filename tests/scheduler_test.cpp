@@ -0,0 +1,160 @@
+// Scheduler with sessions reading pipes through Fd_Input: they park while
+// their pipe is empty, wake up when keys arrive and are done once it is
+// closed. Then again with RLIMIT_NOFILE below the number of sessions, so
+// poll() fails and the parked sessions have to get their turns anyway.
+#include <array>
+#include <chrono>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "fmt/format.h"
+#include "input.hpp"
+#include "scheduler.hpp"
+#include "tl/numeric-aliases.hpp"
+#include "vm.hpp"
+
+namespace {
+// GETC; OUT; AND R1, R1, #0; BRz back to the GETC.
+constexpr auto echo = std::array<tl::u16, 4>{0xF020, 0xF021, 0x5260, 0x05FC};
+
+constexpr auto KEYS = std::array<std::string_view, 3>{"ab", "cd", "ef"};
+
+// the keys come this long after each other, the sessions wait in between.
+constexpr auto KEY_DELAY = std::chrono::milliseconds(50);
+
+class Captured final : public vm::Output_Sink {
+ public:
+  auto write(std::string_view bytes) -> void override { this->text += bytes; }
+
+  std::string text;
+};
+
+struct Session {
+  std::array<int, 2> pipe{-1, -1};
+  std::unique_ptr<vm::Fd_Input> input;
+  std::unique_ptr<vm::Virtual_Machine> vm;
+  vm::Exit_Reason exit{vm::Exit_Reason::halted};
+  bool done{false};
+};
+
+// runs count sessions on threads, with the open file limit lowered to
+// limit (0: as it is) while the scheduler runs. false if any of them went
+// wrong, says why on stderr.
+[[nodiscard]] auto run_sessions(tl::usize count,
+                                unsigned threads,
+                                rlim_t limit,
+                                std::string &diagnostics) -> bool {
+  auto sessions = std::vector<Session>(count);
+  for (auto &session : sessions) {
+    if (::pipe(session.pipe.data()) != 0) {
+      fmt::print(stderr, "pipe() failed\n");
+      return false;
+    }
+    session.input = std::make_unique<vm::Fd_Input>(session.pipe[0]);
+    session.vm    = std::make_unique<vm::Virtual_Machine>();
+    session.vm->set_input(session.input.get());
+    session.vm->set_stop_on_eof(true);
+    session.vm->output().capture();
+    session.vm->load_image(vm::PC_START, echo);
+  }
+
+  auto captured  = Captured();
+  auto scheduler = vm::Scheduler(threads);
+  scheduler.set_diagnostics(&captured);
+  for (auto &session : sessions) {
+    scheduler.add(*session.vm, [&session](vm::Virtual_Machine &, auto exit) {
+      session.exit = exit;
+      session.done = true;
+    });
+  }
+
+  auto old_limit = rlimit{};
+  getrlimit(RLIMIT_NOFILE, &old_limit);
+  if (limit != 0) {
+    auto lowered     = old_limit;
+    lowered.rlim_cur = limit;
+    setrlimit(RLIMIT_NOFILE, &lowered);
+  }
+
+  const auto wall = std::chrono::steady_clock::now();
+  const auto cpu  = std::clock();
+  {
+    auto writer = std::jthread([&sessions] {
+      for (const auto keys : KEYS) {
+        std::this_thread::sleep_for(KEY_DELAY);
+        for (const auto &session : sessions) {
+          [[maybe_unused]] const auto written =
+            ::write(session.pipe[1], keys.data(), keys.size());
+        }
+      }
+      std::this_thread::sleep_for(KEY_DELAY);
+      for (const auto &session : sessions) { ::close(session.pipe[1]); }
+    });
+    scheduler.run();
+  }
+  const auto cpu_ms =
+    1000.0 * static_cast<double>(std::clock() - cpu) / CLOCKS_PER_SEC;
+  const auto wall_ms = std::chrono::duration<double, std::milli>(
+                         std::chrono::steady_clock::now() - wall)
+                         .count();
+  setrlimit(RLIMIT_NOFILE, &old_limit);
+
+  auto expected = std::string("Starting lc-3 virtual machine\n");
+  for (const auto keys : KEYS) { expected += keys; }
+
+  auto ok = true;
+  for (auto i = tl::usize{0}; i < count; ++i) {
+    const auto &session = sessions[i];
+    ::close(session.pipe[0]);
+    if (!session.done || session.exit != vm::Exit_Reason::end_of_input) {
+      fmt::print(stderr, "session {}: not done at the end of its input\n", i);
+      ok = false;
+    } else if (session.vm->output().captured() != expected) {
+      fmt::print(stderr,
+                 "session {}: wrote \"{}\"\n",
+                 i,
+                 session.vm->output().captured());
+      ok = false;
+    }
+  }
+  // waiting for keys is most of the run, it mustn't spin through it.
+  if (cpu_ms > wall_ms / 2) {
+    fmt::print(
+      stderr, "{:.0f} ms of cpu in {:.0f} ms waiting\n", cpu_ms, wall_ms);
+    ok = false;
+  }
+  diagnostics = std::move(captured.text);
+  return ok;
+}
+}  // namespace
+
+auto main() -> int {
+  auto ok          = true;
+  auto diagnostics = std::string();
+
+  for (const auto threads : {1U, 2U}) {
+    if (!run_sessions(8, threads, 0, diagnostics) || !diagnostics.empty()) {
+      fmt::print(stderr, "parked sessions on {} threads failed\n", threads);
+      fmt::print(stderr, "{}", diagnostics);
+      ok = false;
+    }
+  }
+
+  // more parked sessions than descriptors: poll() fails with EINVAL.
+  if (!run_sessions(16, 1, 8, diagnostics)) {
+    fmt::print(stderr, "parked sessions without poll() failed\n");
+    ok = false;
+  }
+  if (diagnostics.find("scheduler:") == std::string::npos) {
+    fmt::print(stderr, "the failed poll() wasn't reported\n");
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
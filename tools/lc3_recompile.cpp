@@ -0,0 +1,508 @@
+/*
+ * lc3_recompile: translates an object file to C++ ahead of time, for
+ * Engine::native (see native.hpp). The output is the image and a function
+ * for every basic block reachable from PC_START through branches, calls and
+ * the returns of calls and traps:
+ *
+ *   auto block_x3002(vm::Native_Frame &f) -> tl::u16 {
+ *     auto *const R = f.registers;
+ *     auto *const I = f.instructions;
+ *     auto r1 = R[1];
+ *     auto c = R[vm::COND];
+ *     // x3002
+ *     r1 = static_cast<tl::u16>(r1 + 0xFFFF);
+ *     c = vm::native_cond(r1);
+ *     // x3003
+ *     if (c & 1) { *I += 2; R[1] = r1; R[vm::COND] = c; return 0x3002; }
+ *     ...
+ *
+ * The registers a block uses live in locals, so the compiler can keep them
+ * in host registers. They go back to the vm wherever something can look at
+ * them: at the exits, before traps and before loads from devices (the
+ * keyboard's idle watch). The instruction counter is only added to before
+ * loads, stores and traps, and at the exits.
+ *
+ * Built with src/main.cpp (see add_lc3_native() in CMakeLists.txt) it is a
+ * vm that runs the program natively, and anything else interpreted.
+ *
+ * usage: lc3_recompile OBJECT-FILE OUTPUT-FILE
+ */
+#include <algorithm>
+#include <bitset>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "decoder.hpp"
+#include "fmt/format.h"
+#include "headless.hpp"
+#include "loader.hpp"
+#include "opcodes.hpp"
+#include "tl/numeric-aliases.hpp"
+#include "vm.hpp"
+
+namespace {
+// longest straight line a block translates before it goes on to the next.
+constexpr auto MAX_BLOCK = tl::usize{512};
+
+using Used_Registers = std::bitset<8>;  // R0-R7
+
+struct Object {
+  tl::u16 origin{};
+  std::vector<tl::u16> words;
+
+  // translated code stays below the device registers.
+  [[nodiscard]] auto has(tl::u32 addr) const noexcept -> bool {
+    return addr >= this->origin && addr < this->origin + this->words.size() &&
+           addr < vm::Mapped_Reg::key_status_reg;
+  }
+  [[nodiscard]] auto at(tl::u16 addr) const -> tl::u16 {
+    return this->words[addr - this->origin];
+  }
+};
+
+struct Block {
+  tl::u16 end{};  // last address translated
+  std::string code;
+  std::vector<tl::u16> next;  // blocks it can go on to
+};
+
+// RTI and RES are left to the interpreter.
+[[nodiscard]] auto translatable(const vm::Decoded_Instruction &instr) -> bool {
+  return instr.op != vm::Op_Code::RTI && instr.op != vm::Op_Code::RES;
+}
+
+[[nodiscard]] auto ends_block(tl::u8 op) noexcept -> bool {
+  return op == vm::Op_Code::BR || op == vm::Op_Code::JMP ||
+         op == vm::Op_Code::JSR || op == vm::Op_Code::TRAP;
+}
+
+[[nodiscard]] auto hex(tl::u32 value) -> std::string {
+  return fmt::format("0x{:04X}", value);
+}
+
+[[nodiscard]] auto reg(tl::u8 r) -> std::string {
+  return fmt::format("r{}", r);
+}
+
+// the registers instr works on.
+[[nodiscard]] auto registers_of(const vm::Decoded_Instruction &instr)
+  -> Used_Registers {
+  auto used = Used_Registers();
+  switch (instr.op) {
+    case vm::Op_Code::ADD:
+    case vm::Op_Code::AND:
+      used.set(instr.dr).set(instr.sr1);
+      if (!instr.imm_mode) { used.set(instr.sr2); }
+      break;
+    case vm::Op_Code::NOT:
+    case vm::Op_Code::LDR:
+    case vm::Op_Code::STR:
+      used.set(instr.dr).set(instr.sr1);
+      break;
+    case vm::Op_Code::LD:
+    case vm::Op_Code::LDI:
+    case vm::Op_Code::LEA:
+    case vm::Op_Code::ST:
+    case vm::Op_Code::STI:
+      used.set(instr.dr);
+      break;
+    case vm::Op_Code::JMP:
+      used.set(instr.sr1);
+      break;
+    case vm::Op_Code::JSR:
+      used.set(vm::Register::R7);
+      if (!instr.imm_mode) { used.set(instr.sr1); }
+      break;
+    default:
+      break;
+  }
+  return used;
+}
+
+// the C++ of one block, an instruction at a time.
+class Block_Writer {
+ public:
+  Block_Writer(tl::u16 start, Used_Registers used)
+    : start_(start)
+    , used_(used) {}
+
+  auto translate(const vm::Decoded_Instruction &instr, tl::u16 addr) -> void;
+  // the block, up to right before next.
+  [[nodiscard]] auto finish(tl::u16 next) -> Block;
+
+ private:
+  // leaves the block for pc.
+  [[nodiscard]] auto exit_to(const std::string &pc) const -> std::string;
+  // goes on at pc, which may be the start of the block itself: a loop
+  // doesn't have to leave it. Nothing can have dropped the block by then, a
+  // store that does leaves right away.
+  [[nodiscard]] auto jump_to(tl::u16 pc) -> std::string;
+  // the last exit, nothing after it runs.
+  auto leave(const std::string &pc) -> void;
+  auto branch_to(tl::u16 pc) -> void { this->block_.next.push_back(pc); }
+  // the instructions not counted yet go to the counter.
+  [[nodiscard]] auto count() -> std::string;
+  // the locals back to the vm, and from it.
+  [[nodiscard]] auto store_registers() const -> std::string;
+  [[nodiscard]] auto load_registers() const -> std::string;
+  // value = memory[addr] for the instruction before pc.
+  [[nodiscard]] auto load(const std::string &value,
+                          const std::string &addr,
+                          tl::u16 pc) const -> std::string;
+
+  tl::u16 start_;
+  Used_Registers used_;
+  tl::u32 pending_{0};  // instructions not counted yet
+  bool ended_{false};
+  bool loops_{false};  // jumps back to start_
+  Block block_;
+};
+
+auto Block_Writer::finish(tl::u16 next) -> Block {
+  if (!this->ended_) {
+    // the interpreter, or the next block, takes over there.
+    this->leave(hex(next));
+    this->branch_to(next);
+  }
+  auto entry = std::string("  auto *const R = f.registers;\n"
+                           "  auto *const I = f.instructions;\n");
+  for (auto r = 0; r < 8; ++r) {
+    if (this->used_[r]) { entry += fmt::format("  auto r{0} = R[{0}];\n", r); }
+  }
+  entry += "  auto c = R[vm::COND];\n";
+  if (this->loops_) { entry += "start:\n"; }
+  this->block_.code = entry + this->block_.code;
+  this->block_.end  = static_cast<tl::u16>(next - 1);
+  return std::move(this->block_);
+}
+
+auto Block_Writer::exit_to(const std::string &pc) const -> std::string {
+  const auto counted =
+    this->pending_ ? fmt::format("*I += {}; ", this->pending_) : "";
+  return fmt::format(
+    "{{ {}{} return {}; }}", counted, this->store_registers(), pc);
+}
+
+auto Block_Writer::jump_to(tl::u16 pc) -> std::string {
+  if (pc != this->start_) { return this->exit_to(hex(pc)); }
+  this->loops_ = true;
+  const auto counted =
+    this->pending_ ? fmt::format("*I += {}; ", this->pending_) : "";
+  // out to the engine between trips while interrupts are on.
+  return fmt::format("{{ {}if (f.events()) [[unlikely]] {{ {} return {}; }} "
+                     "goto start; }}",
+                     counted,
+                     this->store_registers(),
+                     hex(pc));
+}
+
+auto Block_Writer::leave(const std::string &pc) -> void {
+  this->block_.code += fmt::format("  {}\n", this->exit_to(pc));
+  this->ended_ = true;
+}
+
+auto Block_Writer::count() -> std::string {
+  if (this->pending_ == 0) { return {}; }
+  auto code      = fmt::format("  *I += {};\n", this->pending_);
+  this->pending_ = 0;
+  return code;
+}
+
+auto Block_Writer::store_registers() const -> std::string {
+  auto code = std::string();
+  for (auto r = 0; r < 8; ++r) {
+    if (this->used_[r]) { code += fmt::format("R[{0}] = r{0}; ", r); }
+  }
+  return code + "R[vm::COND] = c;";
+}
+
+auto Block_Writer::load_registers() const -> std::string {
+  auto code = std::string();
+  for (auto r = 0; r < 8; ++r) {
+    if (this->used_[r]) { code += fmt::format(" r{0} = R[{0}];", r); }
+  }
+  return code;
+}
+
+auto Block_Writer::load(const std::string &value,
+                        const std::string &addr,
+                        tl::u16 pc) const -> std::string {
+  // the idle watch may move the registers on while it waits for a key.
+  return fmt::format("  if (f.io({1})) [[unlikely]] {{\n"
+                     "    {3}\n"
+                     "    const auto loaded = f.load_io({1}, {2});\n"
+                     "   {4}\n"
+                     "    {0} = loaded;\n"
+                     "  }} else {{\n"
+                     "    {0} = f.memory[{1}];\n"
+                     "  }}\n",
+                     value,
+                     addr,
+                     hex(pc),
+                     this->store_registers(),
+                     this->load_registers());
+}
+
+auto Block_Writer::translate(const vm::Decoded_Instruction &instr,
+                             tl::u16 addr) -> void {
+  const auto next   = static_cast<tl::u16>(addr + 1);
+  const auto jump   = static_cast<tl::u16>(next + instr.imm);
+  const auto target = hex(jump);
+  const auto dr     = reg(instr.dr);
+  const auto sr1    = reg(instr.sr1);
+  const auto flags  = fmt::format("  c = vm::native_cond({});\n", dr);
+  const auto offset =
+    fmt::format("static_cast<tl::u16>({} + {})", sr1, hex(instr.imm));
+
+  auto &code = this->block_.code;
+  code += fmt::format("  // x{:04X}\n", addr);
+  ++this->pending_;
+
+  // loads from devices can stop the run (end of input), after the
+  // instruction wrote its register like it does in the interpreter.
+  const auto emit_load = [&](const std::string &at) {
+    code += this->count() + this->load(dr, at, next) + flags;
+    code += fmt::format("  if (f.stopped) {}\n", this->exit_to(hex(next)));
+  };
+  // a store that overwrote a block (maybe this one) leaves it.
+  const auto emit_store = [&](const std::string &at) {
+    code += this->count();
+    code += fmt::format(
+      "  if (f.store({}, {})) {}\n", at, dr, this->exit_to(hex(next)));
+  };
+
+  switch (instr.op) {
+    case vm::Op_Code::ADD:
+    case vm::Op_Code::AND: {
+      const auto operand = instr.imm_mode ? hex(instr.imm) : reg(instr.sr2);
+      code += fmt::format("  {} = static_cast<tl::u16>({} {} {});\n",
+                          dr,
+                          sr1,
+                          instr.op == vm::Op_Code::ADD ? '+' : '&',
+                          operand);
+      code += flags;
+      break;
+    }
+    case vm::Op_Code::NOT:
+      code += fmt::format("  {} = static_cast<tl::u16>(~{});\n", dr, sr1);
+      code += flags;
+      break;
+    case vm::Op_Code::LEA:
+      code += fmt::format("  {} = {};\n", dr, target);
+      code += flags;
+      break;
+    case vm::Op_Code::LD:
+      emit_load(target);
+      break;
+    case vm::Op_Code::LDI:
+      // the pointer goes through dr, the second load overwrites it.
+      code += this->count() + this->load(dr, target, next);
+      emit_load(dr);
+      break;
+    case vm::Op_Code::LDR:
+      emit_load(offset);
+      break;
+    case vm::Op_Code::ST:
+      emit_store(target);
+      break;
+    case vm::Op_Code::STI:
+      // the store still happens if loading the pointer stopped the run.
+      code += this->count() + "  {\n  auto pointer = tl::u16{};\n";
+      code += this->load("pointer", target, next);
+      code += fmt::format("  if (f.store(pointer, {}) || f.stopped) {}\n  }}\n",
+                          dr,
+                          this->exit_to(hex(next)));
+      break;
+    case vm::Op_Code::STR:
+      emit_store(offset);
+      break;
+    case vm::Op_Code::BR:
+      if (instr.dr == (vm::NEG | vm::ZRO | vm::POS)) {
+        code += fmt::format("  {}\n", this->jump_to(jump));
+        this->ended_ = true;
+        this->branch_to(jump);
+      } else if (instr.dr != 0) {
+        code +=
+          fmt::format("  if (c & {}) {}\n", instr.dr, this->jump_to(jump));
+        this->branch_to(jump);
+      }
+      // otherwise finish() goes on to next.
+      break;
+    case vm::Op_Code::JMP:
+      this->leave(sr1);
+      break;
+    case vm::Op_Code::JSR:
+      // R7 first, JSRR R7 jumps to the return address.
+      code += fmt::format("  r7 = {};\n", hex(next));
+      if (instr.imm_mode) {
+        this->leave(target);
+        this->branch_to(jump);
+      } else {
+        this->leave(sr1);
+      }
+      this->branch_to(next);
+      break;
+    case vm::Op_Code::TRAP:
+      // the trap may change R0 and R7, nothing writes the locals back after
+      // it. With an OS it may go to the OS's routine instead.
+      code += this->count();
+      code += fmt::format("  {} R[vm::PC] = {};\n"
+                          "  return f.trap({});\n",
+                          this->store_registers(),
+                          hex(next),
+                          hex(instr.imm));
+      this->ended_ = true;
+      if (instr.imm != vm::Trap::halt) { this->branch_to(next); }
+      break;
+    default:
+      break;
+  }
+}
+
+// the block at start, nothing if its first instruction can't be translated.
+[[nodiscard]] auto translate_block(const Object &object, tl::u16 start)
+  -> std::optional<Block> {
+  // the instructions first, the block needs all their registers up front.
+  auto instructions = std::vector<vm::Decoded_Instruction>();
+  auto used         = Used_Registers();
+  auto addr         = start;
+  while (object.has(addr) && instructions.size() < MAX_BLOCK) {
+    const auto instr = vm::decode(object.at(addr));
+    if (!translatable(instr)) { break; }
+    instructions.push_back(instr);
+    used |= registers_of(instr);
+    ++addr;
+    if (ends_block(instr.op)) { break; }
+  }
+  if (instructions.empty()) { return std::nullopt; }
+
+  auto writer = Block_Writer(start, used);
+  for (auto i = tl::usize{0}; i < instructions.size(); ++i) {
+    writer.translate(instructions[i], static_cast<tl::u16>(start + i));
+  }
+  return writer.finish(addr);
+}
+
+[[nodiscard]] auto read_object(const char *path, Object &object) -> bool {
+  auto bytes = std::string();
+  if (!vm::read_whole_file(path, bytes)) {
+    fmt::print(stderr, "cannot read object file: {}\n", path);
+    return false;
+  }
+  if (bytes.empty() || bytes.size() % sizeof(tl::u16) != 0) {
+    fmt::print(stderr, "not an object file: {}\n", path);
+    return false;
+  }
+  // the origin, then the words.
+  std::memcpy(&object.origin, bytes.data(), sizeof(object.origin));
+  vm::swap_bytes(&object.origin, &object.origin, 1);
+  object.words.resize(bytes.size() / sizeof(tl::u16) - 1);
+  std::memcpy(object.words.data(),
+              bytes.data() + sizeof(tl::u16),
+              object.words.size() * sizeof(tl::u16));
+  vm::swap_bytes(object.words.data(), object.words.data(), object.words.size());
+  if (object.origin + object.words.size() > vm::LAS) {
+    fmt::print(stderr, "object file runs past the end of memory: {}\n", path);
+    return false;
+  }
+  return true;
+}
+
+[[nodiscard]] auto write_program(const char *path,
+                                 const char *source,
+                                 const Object &object,
+                                 const std::map<tl::u16, Block> &blocks)
+  -> bool {
+  auto out = fmt::format(
+    "// generated by lc3_recompile from {}, do not edit.\n"
+    "#include <array>\n\n"
+    "#include \"native.hpp\"\n\n"
+    "namespace {{\n"
+    "// NOLINTBEGIN\n"
+    "constexpr auto image = std::array<tl::u16, {}>{{\n",
+    source,
+    object.words.size());
+  for (auto i = tl::usize{0}; i < object.words.size(); ++i) {
+    out += fmt::format("{}0x{:04X},{}",
+                       i % 8 == 0 ? "  " : "",
+                       object.words[i],
+                       i % 8 == 7 ? "\n" : " ");
+  }
+  out += "};\n";
+
+  for (const auto &[start, block] : blocks) {
+    out += fmt::format(
+      "\nauto block_x{:04X}(vm::Native_Frame &f) -> tl::u16 {{\n{}}}\n",
+      start,
+      block.code);
+  }
+
+  out += fmt::format(
+    "\nconstexpr auto blocks = std::array<vm::Native_Block_Entry, {}>{{{{\n",
+    blocks.size());
+  for (const auto &[start, block] : blocks) {
+    out += fmt::format(
+      "  {{0x{:04X}, 0x{:04X}, &block_x{:04X}}},\n", start, block.end, start);
+  }
+  out += fmt::format(
+    "}}}};\n\n"
+    "constexpr auto program = vm::Native_Program{{0x{:04X}, image, blocks}};\n"
+    "[[maybe_unused]] const auto registered =\n"
+    "  vm::register_native_program(program);\n"
+    "// NOLINTEND\n"
+    "}}  // namespace\n",
+    object.origin);
+
+#ifdef _WIN32
+  std::FILE *file = nullptr;
+  fopen_s(&file, path, "wb");
+#else
+  auto *file = std::fopen(path, "wb");
+#endif
+  if (!file) { return false; }
+  const auto written =
+    std::fwrite(out.data(), 1, out.size(), file) == out.size();
+  return std::fclose(file) == 0 && written;  // NOLINT
+}
+}  // namespace
+
+auto main(int argc, const char *argv[]) -> int {
+  if (argc != 3) {
+    fmt::print(stderr, "{}\n", "usage: lc3_recompile OBJECT-FILE OUTPUT-FILE");
+    return -1;
+  }
+
+  auto object = Object{};
+  if (!read_object(argv[1], object)) { return -1; }
+
+  // every block reachable from where run() starts.
+  auto blocks = std::map<tl::u16, Block>();
+  auto work   = std::vector<tl::u16>{vm::PC_START};
+  while (!work.empty()) {
+    const auto start = work.back();
+    work.pop_back();
+    if (!object.has(start) || blocks.contains(start)) { continue; }
+    auto block = translate_block(object, start);
+    if (!block) { continue; }
+    std::ranges::copy(block->next, std::back_inserter(work));
+    blocks.emplace(start, std::move(*block));
+  }
+  if (blocks.empty()) {
+    fmt::print(stderr,
+               "nothing to translate from x{:04X}: {}\n",
+               vm::PC_START,
+               argv[1]);
+  }
+
+  if (!write_program(argv[2], argv[1], object, blocks)) {
+    fmt::print(stderr, "cannot write: {}\n", argv[2]);
+    return -1;
+  }
+  return 0;
+}
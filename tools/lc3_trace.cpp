@@ -0,0 +1,127 @@
+/*
+ * lc3_trace: prints a trace written by vm --trace=FILE as text, one line per
+ * instruction:
+ *
+ *   x3002  x1261  ADD R1, R1, #1      R1=x0005  P
+ *   x3003  x6440  LDR R2, R1, #0      R2=x0041  [x0005]  P
+ *
+ * usage: lc3_trace TRACE-FILE
+ */
+#include <cstdio>
+#include <string>
+
+#include "decoder.hpp"
+#include "fmt/format.h"
+#include "opcodes.hpp"
+#include "tl/numeric-aliases.hpp"
+#include "trace.hpp"
+
+namespace {
+[[nodiscard]] auto cond_name(tl::u8 cond) -> const char * {
+  switch (cond) {
+    case vm::Condition_Flag::POS:
+      return "P";
+    case vm::Condition_Flag::ZRO:
+      return "Z";
+    case vm::Condition_Flag::NEG:
+      return "N";
+    default:
+      return "-";
+  }
+}
+
+// the instruction at pc in assembly, targets as absolute addresses.
+[[nodiscard]] auto disassemble(tl::u16 pc, tl::u16 word) -> std::string {
+  const auto instr  = vm::decode(word);
+  const auto name   = vm::OP_NAMES[instr.op];
+  const auto target = static_cast<tl::u16>(pc + 1 + instr.imm);
+  const auto imm    = static_cast<tl::i16>(instr.imm);
+  switch (instr.op) {
+    case vm::Op_Code::BR:
+      return fmt::format("BR{}{}{} x{:04X}",
+                         instr.dr & vm::Condition_Flag::NEG ? "n" : "",
+                         instr.dr & vm::Condition_Flag::ZRO ? "z" : "",
+                         instr.dr & vm::Condition_Flag::POS ? "p" : "",
+                         target);
+    case vm::Op_Code::ADD:
+    case vm::Op_Code::AND:
+      if (instr.imm_mode) {
+        return fmt::format("{} R{}, R{}, #{}", name, instr.dr, instr.sr1, imm);
+      }
+      return fmt::format(
+        "{} R{}, R{}, R{}", name, instr.dr, instr.sr1, instr.sr2);
+    case vm::Op_Code::LD:
+    case vm::Op_Code::ST:
+    case vm::Op_Code::LDI:
+    case vm::Op_Code::STI:
+    case vm::Op_Code::LEA:
+      return fmt::format("{} R{}, x{:04X}", name, instr.dr, target);
+    case vm::Op_Code::LDR:
+    case vm::Op_Code::STR:
+      return fmt::format("{} R{}, R{}, #{}", name, instr.dr, instr.sr1, imm);
+    case vm::Op_Code::NOT:
+      return fmt::format("NOT R{}, R{}", instr.dr, instr.sr1);
+    case vm::Op_Code::JSR:
+      if (instr.imm_mode) { return fmt::format("JSR x{:04X}", target); }
+      return fmt::format("JSRR R{}", instr.sr1);
+    case vm::Op_Code::JMP:
+      if (instr.sr1 == vm::Register::R7) { return "RET"; }
+      return fmt::format("JMP R{}", instr.sr1);
+    case vm::Op_Code::TRAP:
+      return fmt::format("TRAP x{:02X}", instr.imm);
+    default:
+      return name;
+  }
+}
+}  // namespace
+
+auto main(int argc, const char *argv[]) -> int {
+  if (argc != 2) {
+    fmt::print(stderr, "usage: lc3_trace TRACE-FILE\n");
+    return -1;
+  }
+
+#ifdef _WIN32
+  std::FILE *in = nullptr;
+  fopen_s(&in, argv[1], "rb");
+#else
+  auto *in = std::fopen(argv[1], "rb");
+#endif
+  if (!in) {
+    fmt::print(stderr, "cannot open trace: {}\n", argv[1]);
+    return -1;
+  }
+
+  auto reader = vm::Trace_Reader(in);
+  if (!reader.valid()) {
+    fmt::print(stderr, "not a trace: {}\n", argv[1]);
+    std::fclose(in);  // NOLINT
+    return -1;
+  }
+
+  auto record  = vm::Trace_Record{};
+  auto records = tl::u64{0};
+  while (reader.next(record)) {
+    auto line = fmt::format("x{:04X}  x{:04X}  {:<20}",
+                            record.pc,
+                            record.instruction,
+                            disassemble(record.pc, record.instruction));
+    if (record.flags & vm::trace_result) {
+      line += fmt::format(" R{}=x{:04X}",
+                          vm::destination_register(record.instruction),
+                          record.result);
+    }
+    if (record.flags & vm::trace_load) {
+      line += fmt::format("  [x{:04X}]", record.address);
+    }
+    if (record.flags & vm::trace_store) {
+      line += fmt::format("  [x{:04X}]<-x{:04X}", record.address, record.value);
+    }
+    fmt::print("{}  {}\n", line, cond_name(record.cond));
+    ++records;
+  }
+
+  std::fclose(in);  // NOLINT
+  fmt::print(stderr, "{} records\n", records);
+  return 0;
+}